@@ -2,6 +2,7 @@
 
 #include "chat-auto-parser.h"
 #include "ggml.h"
+#include "log.h"
 #include "peg-parser.h"
 
 #include "nlohmann/json.hpp"
@@ -225,6 +226,60 @@ tagged_peg_parser build_tagged_peg_parser(
     return { builder.build() };
 }
 
+common_chat_peg_parse_session::common_chat_peg_parse_session(const common_chat_parser_params & params)
+    : params_(params) {
+    if (params_.parser.empty()) {
+        LOG_DBG("No parser definition detected, assuming pure content parser.");
+        params_.parser = build_chat_peg_parser([](common_chat_peg_builder & p) { return p.content(p.rest()) + p.end(); });
+    }
+    ctx_.flags = COMMON_PEG_PARSE_FLAG_LENIENT;
+    if (params_.debug) {
+        ctx_.flags |= COMMON_PEG_PARSE_FLAG_DEBUG;
+    }
+    ctx_.cache = &cache_;
+    reset();
+}
+
+void common_chat_peg_parse_session::reset() {
+    ctx_.input = params_.generation_prompt;
+    ctx_.ast.clear();
+    cache_.clear();
+    msg_ = common_chat_msg();
+    diffs_.clear();
+}
+
+const common_chat_msg & common_chat_peg_parse_session::append(const std::string & text, bool is_partial) {
+    const char * data = ctx_.input.data();
+    ctx_.input += text;
+    if (ctx_.input.data() != data) {
+        ctx_.ast.rebind(ctx_.input);
+    }
+    cache_.collect(ctx_.ast, ctx_.input.size());
+
+    ctx_.examined = 0;
+    auto result = params_.parser.parse(ctx_);
+
+    // Same handling of the result as common_chat_peg_parse()
+    if (result.fail() && !(is_partial && result.end > 0)) {
+        LOG_WRN("%s: unparsed %s output: %s\n", __func__, common_chat_format_name(params_.format), ctx_.input.substr(result.end).c_str());
+        throw std::runtime_error(std::string("The model produced output that does not match the expected ") + common_chat_format_name(params_.format) + " format");
+    }
+
+    common_chat_msg msg;
+    msg.role = "assistant";
+    std::unique_ptr<common_chat_peg_mapper> mapper;
+    if (params_.format == COMMON_CHAT_FORMAT_PEG_GEMMA4) {
+        mapper = std::make_unique<common_chat_peg_gemma4_mapper>(msg);
+    } else {
+        mapper = std::make_unique<common_chat_peg_mapper>(msg);
+    }
+    mapper->from_ast(ctx_.ast, result);
+
+    diffs_ = common_chat_msg_diff::compute_diffs(msg_, msg);
+    msg_   = std::move(msg);
+    return msg_;
+}
+
 common_peg_parser common_chat_peg_builder::tag_with_safe_content(const std::string &       tag_name,
                                                                  const std::string &       marker,
                                                                  const common_peg_parser & p) {
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <optional>
+#include <string_view>
 #include <vector>
 
 class common_chat_peg_mapper {
@@ -169,6 +170,41 @@ inline common_peg_arena build_chat_peg_parser(
   return builder.build();
 }
 
+// Parses a model's output as it streams in. The parser is loaded once and the
+// memoized parse state is kept between calls, so the parse itself costs about
+// as much as the text appended since the previous one. Mapping the AST to a
+// message and diffing it against the previous one still walk the whole
+// output. Results match common_chat_parse() on the whole output.
+class common_chat_peg_parse_session {
+  public:
+    common_chat_peg_parse_session(const common_chat_parser_params & params);
+    common_chat_peg_parse_session(const common_chat_peg_parse_session &) = delete;
+    common_chat_peg_parse_session & operator=(const common_chat_peg_parse_session &) = delete;
+
+    // Parse the output so far after appending `text` to it
+    const common_chat_msg & append(const std::string & text, bool is_partial);
+
+    // Start over with an empty output
+    void reset();
+
+    const common_chat_msg & msg() const { return msg_; }
+
+    // Content, reasoning and tool call changes made by the last append()
+    const std::vector<common_chat_msg_diff> & diffs() const { return diffs_; }
+
+    size_t size() const { return ctx_.input.size() - params_.generation_prompt.size(); }
+
+    // The output parsed so far
+    std::string_view output() const { return std::string_view(ctx_.input).substr(params_.generation_prompt.size()); }
+
+  private:
+    common_chat_parser_params         params_;
+    common_peg_parse_context          ctx_;
+    common_peg_parse_cache            cache_;
+    common_chat_msg                   msg_;
+    std::vector<common_chat_msg_diff> diffs_;
+};
+
 class tag_based_peg_mapper {
   public:
     std::map<std::string, std::string> tags;
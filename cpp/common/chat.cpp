@@ -2727,14 +2727,14 @@ std::optional<common_chat_params> common_chat_try_specialized_template(
     return std::nullopt;
 }
 
-static common_chat_params common_chat_templates_apply_jinja(const struct common_chat_templates *        tmpls,
-                                                            const struct common_chat_templates_inputs & inputs) {
-    autoparser::generation_params params;
+// Template and render parameters for the given inputs, shared by apply and render
+static const common_chat_template & common_chat_templates_prepare_jinja(const struct common_chat_templates *        tmpls,
+                                                                        const struct common_chat_templates_inputs & inputs,
+                                                                        autoparser::generation_params &             params) {
     params.tools = common_chat_tools_to_json_oaicompat(inputs.tools);
     const auto & tmpl =
         params.tools.is_array() && tmpls->template_tool_use ? *tmpls->template_tool_use : *tmpls->template_default;
     const auto & src             = tmpl.source();
-    const auto & caps            = tmpl.original_caps();
     std::vector<common_chat_msg>        trimmed_messages;
     const std::vector<common_chat_msg> * messages_to_render = &inputs.messages;
     if (src.find("You have access to the following functions in JSONSchema format") != std::string::npos) {
@@ -2805,6 +2805,15 @@ static common_chat_params common_chat_templates_apply_jinja(const struct common_
     }
 
     params.parallel_tool_calls = inputs.parallel_tool_calls;
+    return tmpl;
+}
+
+static common_chat_params common_chat_templates_apply_jinja(const struct common_chat_templates *        tmpls,
+                                                            const struct common_chat_templates_inputs & inputs) {
+    autoparser::generation_params params;
+    const auto & tmpl = common_chat_templates_prepare_jinja(tmpls, inputs, params);
+    const auto & src  = tmpl.source();
+    const auto & caps = tmpl.original_caps();
 
     if (params.tools.is_array()) {
         if (params.tool_choice != COMMON_CHAT_TOOL_CHOICE_NONE && !params.grammar.empty()) {
@@ -2940,6 +2949,17 @@ common_chat_params common_chat_templates_apply(const struct common_chat_template
                               common_chat_templates_apply_legacy(tmpls, inputs);
 }
 
+std::string common_chat_templates_render(const struct common_chat_templates *        tmpls,
+                                         const struct common_chat_templates_inputs & inputs) {
+    LM_GGML_ASSERT(tmpls != nullptr);
+    if (!inputs.use_jinja) {
+        return common_chat_templates_apply_legacy(tmpls, inputs).prompt;
+    }
+    autoparser::generation_params params;
+    const auto & tmpl = common_chat_templates_prepare_jinja(tmpls, inputs, params);
+    return common_chat_template_direct_apply_impl(tmpl, params);
+}
+
 common_chat_msg common_chat_parse(const std::string &               input,
                                   bool                              is_partial,
                                   const common_chat_parser_params & params) {
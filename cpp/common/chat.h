@@ -327,6 +327,11 @@ std::string common_chat_templates_source(const struct common_chat_templates * tm
 struct common_chat_params common_chat_templates_apply(const struct common_chat_templates *        tmpls,
                                                       const struct common_chat_templates_inputs & inputs);
 
+// Only the prompt: the messages rendered as given, without building a parser or
+// grammar. Specialized formats that rewrite messages may render differently.
+std::string common_chat_templates_render(const struct common_chat_templates *        tmpls,
+                                         const struct common_chat_templates_inputs & inputs);
+
 // Format single message, while taking into account the position of that message in chat history
 std::string common_chat_format_single(const struct common_chat_templates * tmpls,
                                       const std::vector<common_chat_msg> & past_msg,
@@ -332,6 +332,86 @@ void common_peg_ast_arena::visit(const common_peg_parse_result & result, const c
     }
 }
 
+void common_peg_ast_arena::rebind(std::string_view input) {
+    for (auto & node : nodes_) {
+        if (node.text.data() != nullptr) {
+            node.text = input.substr(node.start, node.text.size());
+        }
+    }
+}
+
+std::vector<common_peg_ast_id> common_peg_ast_arena::compact(const std::vector<common_peg_ast_id> & roots) {
+    std::vector<bool> live(nodes_.size(), false);
+    std::vector<common_peg_ast_id> stack(roots.begin(), roots.end());
+    while (!stack.empty()) {
+        auto id = stack.back();
+        stack.pop_back();
+        if (id >= nodes_.size() || live[id]) {
+            continue;
+        }
+        live[id] = true;
+        stack.insert(stack.end(), nodes_[id].children.begin(), nodes_[id].children.end());
+    }
+
+    std::vector<common_peg_ast_id> remap(nodes_.size(), COMMON_PEG_INVALID_AST_ID);
+    size_t n_live = 0;
+    for (size_t id = 0; id < nodes_.size(); id++) {
+        if (live[id]) {
+            remap[id] = n_live;
+            if (n_live != id) {
+                nodes_[n_live] = std::move(nodes_[id]);
+            }
+            n_live++;
+        }
+    }
+    nodes_.resize(n_live);
+
+    for (auto & node : nodes_) {
+        node.id = remap[node.id];
+        for (auto & child : node.children) {
+            child = remap[child];
+        }
+    }
+    return remap;
+}
+
+void common_peg_parse_cache::collect(common_peg_ast_arena & ast, size_t input_size) {
+    if (ast.size() < 2 * n_live_nodes + 256) {
+        return;
+    }
+
+    // Entries that looked at the end of an earlier input are only kept for their checkpoint
+    std::vector<common_peg_ast_id> roots;
+    for (auto it = entries.begin(); it != entries.end();) {
+        auto & e = it->second;
+        if (!e.valid(input_size)) {
+            if (e.checkpoint == nullptr) {
+                it = entries.erase(it);
+                continue;
+            }
+            e.result.nodes.clear();
+        }
+        roots.insert(roots.end(), e.result.nodes.begin(), e.result.nodes.end());
+        if (e.checkpoint) {
+            roots.insert(roots.end(), e.checkpoint->nodes.begin(), e.checkpoint->nodes.end());
+        }
+        ++it;
+    }
+
+    const auto remap = ast.compact(roots);
+    for (auto & [k, e] : entries) {
+        for (auto & id : e.result.nodes) {
+            id = remap[id];
+        }
+        if (e.checkpoint) {
+            for (auto & id : e.checkpoint->nodes) {
+                id = remap[id];
+            }
+        }
+    }
+    n_live_nodes = ast.size();
+}
+
 struct parser_executor;
 
 common_peg_parser_id common_peg_arena::add_parser(common_peg_parser_variant parser) {
@@ -356,9 +436,65 @@ struct parser_executor {
     const common_peg_arena & arena;
     common_peg_parse_context & ctx;
     size_t start_pos;
+    common_peg_parse_cache::entry * memo;
+
+    parser_executor(const common_peg_arena & arena, common_peg_parse_context & ctx, size_t start,
+                    common_peg_parse_cache::entry * memo = nullptr)
+        : arena(arena), ctx(ctx), start_pos(start), memo(memo) {}
+
+    // Record that the result depends on the byte at pos, or on where the
+    // input ends when pos is past it
+    void examine(size_t pos) const {
+        ctx.examined = std::max(ctx.examined, std::min(pos, ctx.input.size()) + 1);
+    }
+
+    void examine_codepoint(size_t pos, const utf8_parse_result & result) const {
+        if (result.status == utf8_parse_result::SUCCESS) {
+            examine(pos + result.bytes_consumed - 1);
+        } else if (result.status == utf8_parse_result::INCOMPLETE) {
+            examine(ctx.input.size());
+        } else {
+            examine(std::min(pos + 3, ctx.input.size() - 1));
+        }
+    }
+
+    bool at_end(size_t pos) const {
+        if (pos >= ctx.input.size()) {
+            examine(pos);
+            return true;
+        }
+        return false;
+    }
+
+    // Checkpoint left by the previous computation of this result, if any
+    const common_peg_parse_checkpoint * resume_point() const {
+        if (memo == nullptr || memo->checkpoint == nullptr) {
+            return nullptr;
+        }
+        ctx.examined = std::max(ctx.examined, memo->checkpoint->examined);
+        return memo->checkpoint.get();
+    }
 
-    parser_executor(const common_peg_arena & arena, common_peg_parse_context & ctx, size_t start)
-        : arena(arena), ctx(ctx), start_pos(start) {}
+    common_peg_parse_checkpoint * checkpoint() const {
+        if (memo == nullptr) {
+            return nullptr;
+        }
+        if (memo->checkpoint == nullptr) {
+            memo->checkpoint = std::make_unique<common_peg_parse_checkpoint>();
+        }
+        memo->checkpoint->n_input = ctx.input.size();
+        return memo->checkpoint.get();
+    }
+
+    // A scan reached the end of the input at pos; everything before it was
+    // examined and stays the same when more input is appended
+    void save_scan(size_t pos, int count = 0) const {
+        if (auto * cp = checkpoint()) {
+            cp->pos      = pos;
+            cp->count    = count;
+            cp->examined = ctx.input.size();
+        }
+    }
 
     std::string debug_indent() const { return std::string(ctx.parse_depth * 2, ' '); }
 
@@ -398,6 +534,7 @@ struct parser_executor {
     }
 
     common_peg_parse_result operator()(const common_peg_end_parser & /* p */) const {
+        examine(start_pos);
         return common_peg_parse_result(
             start_pos >= ctx.input.size() ? COMMON_PEG_PARSE_RESULT_SUCCESS : COMMON_PEG_PARSE_RESULT_FAIL,
             start_pos
@@ -407,6 +544,7 @@ struct parser_executor {
     common_peg_parse_result operator()(const common_peg_literal_parser & p) {
         auto pos = start_pos;
         for (auto i = 0u; i < p.literal.size(); ++i) {
+            examine(pos);
             if (pos >= ctx.input.size()) {
                 if (!ctx.is_lenient()) {
                     return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_FAIL, start_pos);
@@ -519,10 +657,29 @@ struct parser_executor {
         auto pos = start_pos;
         int match_count = 0;
         std::vector<common_peg_ast_id> nodes;
+        std::vector<common_peg_parse_checkpoint::step> steps;
+
+        // Iterations that only examined input from before the last append are unchanged
+        if (auto * cp = memo && memo->checkpoint ? memo->checkpoint.get() : nullptr) {
+            size_t n_stable = 0;
+            while (n_stable < cp->steps.size() && cp->steps[n_stable].examined <= cp->n_input) {
+                n_stable++;
+            }
+            if (n_stable > 0) {
+                const auto last = cp->steps[n_stable - 1];
+                pos         = last.end;
+                match_count = (int) n_stable;
+                ctx.examined = std::max(ctx.examined, last.examined);
+                steps = std::move(cp->steps);
+                steps.resize(n_stable);
+                nodes = std::move(cp->nodes);
+                nodes.resize(last.n_nodes);
+            }
+        }
 
         // Try to match up to max_count times (or unlimited if max_count is -1)
         while (p.max_count == -1 || match_count < p.max_count) {
-            if (pos >= ctx.input.size()) {
+            if (at_end(pos)) {
                 if (ctx.is_debug()) {
                     fprintf(stderr, "%sREPEAT: at end of input, count=%d\n", debug_indent().c_str(), match_count);
                 }
@@ -552,10 +709,14 @@ struct parser_executor {
 
                 pos = result.end;
                 match_count++;
+                if (memo) {
+                    steps.push_back({ pos, ctx.examined, nodes.size() });
+                }
                 continue;
             }
 
             if (result.need_more_input()) {
+                save_iterations(steps, nodes);
                 if (!result.nodes.empty()) {
                     nodes.insert(nodes.end(), result.nodes.begin(), result.nodes.end());
                 }
@@ -574,11 +735,12 @@ struct parser_executor {
             }
             break;
         }
+        save_iterations(steps, nodes);
 
         // Check if we got enough matches
         if (p.min_count > 0 && match_count < p.min_count) {
             ctx.parse_depth--;
-            if (pos >= ctx.input.size() && ctx.is_lenient()) {
+            if (at_end(pos) && ctx.is_lenient()) {
                 if (ctx.is_debug()) {
                     fprintf(stderr, "%sREPEAT -> NEED_MORE (not enough matches: %d < %d)\n", debug_indent().c_str(),
                             match_count, p.min_count);
@@ -600,6 +762,16 @@ struct parser_executor {
         return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos, std::move(nodes));
     }
 
+    // Keep the iterations of a repetition that ran into the end of the input
+    void save_iterations(std::vector<common_peg_parse_checkpoint::step> & steps, const std::vector<common_peg_ast_id> & nodes) const {
+        if (memo == nullptr || ctx.examined <= ctx.input.size()) {
+            return;
+        }
+        auto * cp  = checkpoint();
+        cp->steps  = std::move(steps);
+        cp->nodes  = nodes;
+    }
+
     common_peg_parse_result operator()(const common_peg_and_parser & p) {
         auto result = arena.parse(p.child, ctx, start_pos);
         // Pass result but don't consume input
@@ -626,6 +798,7 @@ struct parser_executor {
     common_peg_parse_result operator()(const common_peg_any_parser & /* p */) const {
         // Parse a single UTF-8 codepoint (not just a single byte)
         auto result = common_parse_utf8_codepoint(ctx.input, start_pos);
+        examine_codepoint(start_pos, result);
 
         if (result.status == utf8_parse_result::INCOMPLETE) {
             if (!ctx.is_lenient()) {
@@ -649,6 +822,7 @@ struct parser_executor {
                 break;
             }
         }
+        examine(pos);
 
         return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos);
     }
@@ -656,12 +830,18 @@ struct parser_executor {
     common_peg_parse_result operator()(const common_peg_chars_parser & p) const {
         auto pos = start_pos;
         int match_count = 0;
+        if (const auto * cp = resume_point()) {
+            pos         = cp->pos;
+            match_count = cp->count;
+        }
 
         // Try to match up to max_count times (or unlimited if max_count is -1)
         while (p.max_count == -1 || match_count < p.max_count) {
             auto result = common_parse_utf8_codepoint(ctx.input, pos);
+            examine_codepoint(pos, result);
 
             if (result.status == utf8_parse_result::INCOMPLETE) {
+                save_scan(pos, match_count);
                 if (match_count >= p.min_count) {
                     // We have enough matches, succeed with what we have
                     return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos);
@@ -708,7 +888,7 @@ struct parser_executor {
 
         // Check if we got enough matches
         if (match_count < p.min_count) {
-            if (pos >= ctx.input.size() && ctx.is_lenient()) {
+            if (at_end(pos) && ctx.is_lenient()) {
                 return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_NEED_MORE_INPUT, start_pos, pos);
             }
             return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_FAIL, start_pos, pos);
@@ -756,6 +936,9 @@ struct parser_executor {
 
     common_peg_parse_result operator()(const common_peg_string_parser & p) {
         auto pos = start_pos;
+        if (const auto * cp = resume_point()) {
+            pos = cp->pos;
+        }
 
         // Parse string content (without quotes)
         while (pos < ctx.input.size()) {
@@ -763,18 +946,26 @@ struct parser_executor {
 
             if (c == p.delimiter) {
                 // Found closing delimiter - success (don't consume it)
+                examine(pos);
                 return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos);
             }
 
             if (c == '\\') {
+                const size_t escape_pos = pos;
                 auto result = handle_escape_sequence(ctx, start_pos, pos, p.delimiter);
                 if (!result.success()) {
+                    examine(pos);
+                    if (pos >= ctx.input.size()) {
+                        save_scan(escape_pos);
+                    }
                     return result;
                 }
             } else {
                 auto utf8_result = common_parse_utf8_codepoint(ctx.input, pos);
+                examine_codepoint(pos, utf8_result);
 
                 if (utf8_result.status == utf8_parse_result::INCOMPLETE) {
+                    save_scan(pos);
                     if (!ctx.is_lenient()) {
                         return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_FAIL, start_pos);
                     }
@@ -790,6 +981,8 @@ struct parser_executor {
         }
 
         // Reached end without finding closing quote
+        examine(pos);
+        save_scan(pos);
         if (!ctx.is_lenient()) {
             return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_FAIL, start_pos, pos);
         }
@@ -798,15 +991,24 @@ struct parser_executor {
 
     common_peg_parse_result operator()(const common_peg_until_parser & p) const {
         trie matcher(p.delimiters);
+        size_t max_delimiter = 0;
+        for (const auto & delimiter : p.delimiters) {
+            max_delimiter = std::max(max_delimiter, delimiter.size());
+        }
 
         // Scan input and check for delimiters
         size_t pos = start_pos;
-        size_t last_valid_pos = start_pos;
+        if (const auto * cp = resume_point()) {
+            pos = cp->pos;
+        }
+        size_t last_valid_pos = pos;
 
         while (pos < ctx.input.size()) {
             auto utf8_result = common_parse_utf8_codepoint(ctx.input, pos);
+            examine_codepoint(pos, utf8_result);
 
             if (utf8_result.status == utf8_parse_result::INCOMPLETE) {
+                save_scan(pos);
                 // Incomplete UTF-8 sequence
                 if (!ctx.is_lenient()) {
                     // Input is complete but UTF-8 is incomplete = malformed
@@ -826,17 +1028,22 @@ struct parser_executor {
 
             if (match == trie::COMPLETE_MATCH) {
                 // Found a complete delimiter, return everything before it
+                examine(std::min(pos + max_delimiter, ctx.input.size()) - 1);
                 return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos);
             }
 
             if (match == trie::PARTIAL_MATCH) {
                 // Found a partial match extending to end of input, return everything before it
+                examine(ctx.input.size());
+                save_scan(pos);
                 return common_peg_parse_result(COMMON_PEG_PARSE_RESULT_SUCCESS, start_pos, pos);
             }
 
             pos += utf8_result.bytes_consumed;
             last_valid_pos = pos;
         }
+        examine(pos);
+        save_scan(pos);
 
         if (last_valid_pos == ctx.input.size() && ctx.is_lenient()) {
             // Reached the end of a partial stream, there might still be more input that we need to consume.
@@ -934,11 +1141,44 @@ common_peg_parse_result common_peg_arena::parse(common_peg_parse_context & ctx,
     return parse(root_, ctx, start);
 }
 
+// Results worth keeping between calls: the ones that scan or combine others
+static bool is_memoized(const common_peg_parser_variant & parser) {
+    return std::visit([](const auto & p) -> bool {
+        using T = std::decay_t<decltype(p)>;
+        return std::is_same_v<T, common_peg_sequence_parser> || std::is_same_v<T, common_peg_choice_parser> ||
+               std::is_same_v<T, common_peg_repetition_parser> || std::is_same_v<T, common_peg_and_parser> ||
+               std::is_same_v<T, common_peg_not_parser> || std::is_same_v<T, common_peg_chars_parser> ||
+               std::is_same_v<T, common_peg_string_parser> || std::is_same_v<T, common_peg_until_parser> ||
+               std::is_same_v<T, common_peg_rule_parser> || std::is_same_v<T, common_peg_tag_parser>;
+    }, parser);
+}
+
 common_peg_parse_result common_peg_arena::parse(common_peg_parser_id id, common_peg_parse_context & ctx, size_t start) const {
     // Execute parser
     const auto & parser = parsers_.at(id);
-    parser_executor exec(*this, ctx, start);
-    return std::visit(exec, parser);
+    if (ctx.cache == nullptr || !is_memoized(parser)) {
+        parser_executor exec(*this, ctx, start);
+        return std::visit(exec, parser);
+    }
+
+    auto & entry = ctx.cache->get(id, start);
+    if (entry.valid(ctx.input.size())) {
+        ctx.examined = std::max(ctx.examined, entry.examined);
+        return entry.result;
+    }
+
+    const size_t outer_examined = ctx.examined;
+    ctx.examined = 0;
+    parser_executor exec(*this, ctx, start, &entry);
+    entry.result   = std::visit(exec, parser);
+    entry.examined = ctx.examined;
+    entry.n_input  = ctx.input.size();
+    if (entry.examined <= entry.n_input) {
+        // Final: nothing to resume
+        entry.checkpoint.reset();
+    }
+    ctx.examined = std::max(outer_examined, entry.examined);
+    return entry.result;
 }
 
 common_peg_parser_id common_peg_arena::resolve_ref(common_peg_parser_id id) {
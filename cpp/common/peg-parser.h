@@ -113,6 +113,13 @@ class common_peg_ast_arena {
 
     void clear() { nodes_.clear(); }
 
+    // Point node text at the input again after it was reallocated
+    void rebind(std::string_view input);
+
+    // Drop the nodes not reachable from roots and renumber the rest in order.
+    // Returns the old -> new id map (COMMON_PEG_INVALID_AST_ID for dropped nodes).
+    std::vector<common_peg_ast_id> compact(const std::vector<common_peg_ast_id> & roots);
+
     void visit(common_peg_ast_id id, const common_peg_ast_visitor & visitor) const;
     void visit(const common_peg_parse_result & result, const common_peg_ast_visitor & visitor) const;
 
@@ -164,6 +171,67 @@ inline common_peg_parse_flags operator~(common_peg_parse_flags a) {
     return static_cast<common_peg_parse_flags>(~int(a));
 }
 
+// Where a scan that ran into the end of the input picks up once more input
+// arrives: terminals keep a position, repetitions their completed iterations.
+struct common_peg_parse_checkpoint {
+    struct step {
+        size_t end;        // Where the iteration ended
+        size_t examined;   // Input examined by the repetition up to here
+        size_t n_nodes;    // AST nodes collected up to here
+    };
+
+    size_t pos      = 0;   // Resume position
+    size_t examined = 0;   // Input examined before pos
+    int    count    = 0;   // Matches before pos
+    size_t n_input  = 0;   // Input size when saved
+
+    std::vector<step>              steps;
+    std::vector<common_peg_ast_id> nodes;
+};
+
+// Memoized parse results for input that only grows, as in streaming. A result
+// stays valid while everything it examined lies before the end of the input
+// it was computed on; one that looked at the end is recomputed after an
+// append, resuming from its checkpoint when it has one.
+struct common_peg_parse_cache {
+    struct entry {
+        common_peg_parse_result result;
+        size_t examined = 0;                       // One past the furthest byte examined
+        size_t n_input  = std::string::npos;       // Input size when computed
+        std::unique_ptr<common_peg_parse_checkpoint> checkpoint;
+
+        bool valid(size_t input_size) const {
+            return n_input != std::string::npos && (examined <= n_input || n_input == input_size);
+        }
+    };
+
+    entry & get(common_peg_parser_id id, size_t start) { return entries[{ id, start }]; }
+
+    // Drop stale entries and unreachable AST nodes once they outnumber the live ones
+    void collect(common_peg_ast_arena & ast, size_t input_size);
+
+    void clear() {
+        entries.clear();
+        n_live_nodes = 0;
+    }
+
+    size_t size() const { return entries.size(); }
+
+  private:
+    struct key {
+        common_peg_parser_id id;
+        size_t               start;
+        bool operator==(const key & other) const { return id == other.id && start == other.start; }
+    };
+
+    struct key_hash {
+        size_t operator()(const key & k) const { return std::hash<size_t>()(k.id) ^ (k.start * 0x9e3779b97f4a7c15ull); }
+    };
+
+    std::unordered_map<key, entry, key_hash> entries;
+    size_t n_live_nodes = 0;
+};
+
 struct common_peg_parse_context {
     std::string input;
     common_peg_parse_flags flags;
@@ -171,6 +239,10 @@ struct common_peg_parse_context {
 
     int parse_depth;
 
+    // Set to keep results across calls on a growing input
+    common_peg_parse_cache * cache = nullptr;
+    size_t examined = 0;  // One past the furthest byte the current parse examined
+
     common_peg_parse_context(common_peg_parse_flags flags = COMMON_PEG_PARSE_FLAG_NONE)
         : flags(flags), parse_depth(0) {}
 
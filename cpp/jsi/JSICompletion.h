@@ -2,7 +2,9 @@
 
 #include "JSIHelpers.h"
 #include "JSINativeHeaders.h"
+#include <algorithm>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace rnllama_jsi {
@@ -44,6 +46,56 @@ namespace rnllama_jsi {
         }
     }
 
+    // JS strings of the token ids in a result, each created once. The ids
+    // are formatted through the context's token_strings, so a candidate is
+    // detokenized once per model rather than once per streamed token.
+    class TokenStringCache {
+    public:
+        TokenStringCache(jsi::Runtime& runtime, rnllama::llama_rn_context* ctx) : runtime_(runtime), ctx_(ctx) {}
+
+        // Resolve the ids a result will ask for in one go
+        void add(const rnllama::completion_token_output& token) {
+            pending_.push_back(token.tok);
+            for (const auto& prob : token.probs) {
+                pending_.push_back(prob.tok);
+            }
+        }
+
+        jsi::Value get(llama_token tok) {
+            auto it = strings_.find(tok);
+            if (it == strings_.end()) {
+                pending_.push_back(tok);
+                resolvePending();
+                it = strings_.find(tok);
+            }
+            return jsi::Value(runtime_, it->second);
+        }
+
+    private:
+        void resolvePending() {
+            std::sort(pending_.begin(), pending_.end());
+            pending_.erase(std::unique(pending_.begin(), pending_.end()), pending_.end());
+            pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+                [this](llama_token tok) { return strings_.count(tok) > 0; }), pending_.end());
+
+            std::vector<std::string> resolved;
+            if (ctx_ != nullptr && ctx_->ctx != nullptr) {
+                ctx_->token_strings.resolve(ctx_->ctx, pending_.data(), pending_.size(), resolved);
+            }
+            resolved.resize(pending_.size());
+            for (size_t i = 0; i < pending_.size(); i++) {
+                const std::string& tokStr = resolved[i].empty() ? std::string("<UNKNOWN>") : resolved[i];
+                strings_.emplace(pending_[i], jsi::String::createFromUtf8(runtime_, tokStr));
+            }
+            pending_.clear();
+        }
+
+        jsi::Runtime& runtime_;
+        rnllama::llama_rn_context* ctx_;
+        std::vector<llama_token> pending_;
+        std::unordered_map<llama_token, jsi::String> strings_;
+    };
+
     inline jsi::Array createCompletionProbabilities(
         jsi::Runtime& runtime,
         rnllama::llama_rn_context* ctx,
@@ -54,6 +106,10 @@ namespace rnllama_jsi {
             return jsi::Array(runtime, 0);
         }
 
+        TokenStringCache strings(runtime, ctx);
+        for (const auto& prob : probs_vec) {
+            strings.add(prob);
+        }
         jsi::Array out(runtime, probs_vec.size());
         for (size_t i = 0; i < probs_vec.size(); ++i) {
             const auto &prob = probs_vec[i];
@@ -61,18 +117,13 @@ namespace rnllama_jsi {
             jsi::Array probsForToken(runtime, prob.probs.size());
             for (size_t j = 0; j < prob.probs.size(); ++j) {
                 jsi::Object p(runtime);
-                std::string tokStr = rnllama::tokens_to_output_formatted_string(ctx->ctx, prob.probs[j].tok);
-                if (tokStr.empty()) tokStr = "<UNKNOWN>";
-                p.setProperty(runtime, "tok_str", jsi::String::createFromUtf8(runtime, tokStr));
+                p.setProperty(runtime, "tok_str", strings.get(prob.probs[j].tok));
                 p.setProperty(runtime, "prob", (double)prob.probs[j].prob);
                 probsForToken.setValueAtIndex(runtime, j, p);
             }
 
-            std::string tokStr = rnllama::tokens_to_output_formatted_string(ctx->ctx, prob.tok);
-            if (tokStr.empty()) tokStr = "<UNKNOWN>";
-
             jsi::Object completionProb(runtime);
-            completionProb.setProperty(runtime, "content", jsi::String::createFromUtf8(runtime, tokStr));
+            completionProb.setProperty(runtime, "content", strings.get(prob.tok));
             completionProb.setProperty(runtime, "probs", probsForToken);
 
             out.setValueAtIndex(runtime, i, completionProb);
@@ -80,37 +131,63 @@ namespace rnllama_jsi {
         return out;
     }
 
-    inline jsi::Object createTokenProb(jsi::Runtime& runtime, rnllama::llama_rn_context* ctx, const rnllama::completion_token_output::token_prob& p) {
-        jsi::Object res(runtime);
-        std::string tokStr = (ctx != nullptr && ctx->ctx != nullptr)
-            ? rnllama::tokens_to_output_formatted_string(ctx->ctx, p.tok)
-            : "";
-        if (tokStr.empty()) tokStr = "<UNKNOWN>";
-        res.setProperty(runtime, "tok_str", jsi::String::createFromUtf8(runtime, tokStr));
-        res.setProperty(runtime, "prob", (double)p.prob);
-        return res;
+    // Token ids and their top-n candidates in one native buffer, exposed as
+    // `tokens` (Int32), `prob_tokens` (Int32) and `probs` (Float32) views.
+    // Candidates are n_probs per token, -1 / 0 where a token has fewer.
+    inline void setTokenArrays(
+        jsi::Runtime& runtime,
+        jsi::Object& res,
+        const rnllama::completion_token_output* tokens,
+        size_t n_tokens
+    ) {
+        size_t n_probs = 0;
+        for (size_t i = 0; i < n_tokens; i++) {
+            n_probs = std::max(n_probs, tokens[i].probs.size());
+        }
+        const size_t n_cand = n_tokens * n_probs;
+
+        std::vector<uint8_t> data((n_tokens + 2 * n_cand) * sizeof(int32_t));
+        int32_t* ids = reinterpret_cast<int32_t*>(data.data());
+        int32_t* cand_ids = ids + n_tokens;
+        float* cand_probs = reinterpret_cast<float*>(cand_ids + n_cand);
+        for (size_t i = 0; i < n_tokens; i++) {
+            const auto& token = tokens[i];
+            ids[i] = token.tok;
+            for (size_t j = 0; j < n_probs; j++) {
+                const bool has = j < token.probs.size();
+                cand_ids[i * n_probs + j] = has ? token.probs[j].tok : -1;
+                cand_probs[i * n_probs + j] = has ? token.probs[j].prob : 0.0f;
+            }
+        }
+
+        jsi::ArrayBuffer buffer = createArrayBuffer(runtime, std::move(data));
+        res.setProperty(runtime, "n_tokens", (double) n_tokens);
+        res.setProperty(runtime, "tokens", createTypedArrayView(runtime, buffer, "Int32Array", 0, n_tokens));
+        if (n_probs > 0) {
+            res.setProperty(runtime, "n_probs", (double) n_probs);
+            res.setProperty(runtime, "prob_tokens",
+                createTypedArrayView(runtime, buffer, "Int32Array", n_tokens * 4, n_cand));
+            res.setProperty(runtime, "probs",
+                createTypedArrayView(runtime, buffer, "Float32Array", (n_tokens + n_cand) * 4, n_cand));
+        }
     }
 
     inline jsi::Object createTokenResult(jsi::Runtime& runtime, rnllama::llama_rn_context* ctx, const rnllama::completion_token_output& token) {
         jsi::Object res(runtime);
         res.setProperty(runtime, "token", jsi::String::createFromUtf8(runtime, token.text));
 
-        if (!token.probs.empty()) {
-            jsi::Array probs(runtime, token.probs.size());
+        if (token.probs.size() > 0) {
+            setTokenArrays(runtime, res, &token, 1);
+
+            TokenStringCache strings(runtime, ctx);
+            strings.add(token);
+            jsi::Array probs = jsi::Array(runtime, token.probs.size());
             for (size_t i = 0; i < token.probs.size(); i++) {
                 jsi::Object prob(runtime);
-                prob.setProperty(runtime, "tok", (int)token.probs[i].tok);
+                prob.setProperty(runtime, "tok_str", strings.get(token.probs[i].tok));
                 prob.setProperty(runtime, "prob", (double)token.probs[i].prob);
                 probs.setValueAtIndex(runtime, i, prob);
             }
-            res.setProperty(runtime, "probs", probs);
-        }
-
-        if (token.probs.size() > 0) {
-            jsi::Array probs = jsi::Array(runtime, token.probs.size());
-            for (size_t i = 0; i < token.probs.size(); i++) {
-                probs.setValueAtIndex(runtime, i, createTokenProb(runtime, ctx, token.probs[i]));
-            }
             
             jsi::Object completionProb(runtime);
             completionProb.setProperty(runtime, "content", jsi::String::createFromUtf8(runtime, token.text));
@@ -130,6 +207,18 @@ namespace rnllama_jsi {
         return res;
     }
 
+    // A frame of streamed tokens: their text concatenated, plus the token
+    // ids and candidates as typed arrays (see setTokenArrays)
+    inline jsi::Object createTokenFrameResult(jsi::Runtime& runtime, const rnllama::llama_rn_token_frame& frame) {
+        jsi::Object res(runtime);
+        res.setProperty(runtime, "token", jsi::String::createFromUtf8(runtime, frame.text));
+        setTokenArrays(runtime, res, frame.tokens.data(), frame.tokens.size());
+        if (frame.request_id != -1) {
+            res.setProperty(runtime, "requestId", (int) frame.request_id);
+        }
+        return res;
+    }
+
     inline jsi::Object createCompletionResult(jsi::Runtime& runtime, rnllama::llama_rn_context* ctx) {
         if (ctx == nullptr) {
             throw std::runtime_error("RNLLAMA_NULL_CONTEXT");
@@ -258,6 +347,8 @@ namespace rnllama_jsi {
         timingsObj.setProperty(runtime, "predicted_ms", (double)timings.predicted_ms);
         timingsObj.setProperty(runtime, "predicted_per_token_ms", (double)timings.predicted_per_token_ms);
         timingsObj.setProperty(runtime, "predicted_per_second", (double)timings.predicted_per_second);
+        timingsObj.setProperty(runtime, "draft_n", (double)timings.draft_n);
+        timingsObj.setProperty(runtime, "draft_n_accepted", (double)timings.draft_n_accepted);
         res.setProperty(runtime, "timings", timingsObj);
 
         return res;
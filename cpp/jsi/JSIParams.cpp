@@ -446,6 +446,7 @@ namespace rnllama_jsi {
         auto& sparams = ctx->params.sampling;
         sparams.seed = getPropertyAsInt(runtime, params, "seed", -1);
         ctx->params.n_predict = getPropertyAsInt(runtime, params, "n_predict", ctx->params.n_predict);
+        ctx->params.n_keep = getPropertyAsInt(runtime, params, "n_keep", 0);
         ctx->params.sampling.ignore_eos = getPropertyAsBool(runtime, params, "ignore_eos", ctx->params.sampling.ignore_eos);
         applySpeculativeOptions(runtime, params, ctx->params);
 
@@ -10,11 +10,7 @@ namespace rnllama_jsi {
     inline jsi::Object createTokenizeResult(jsi::Runtime& runtime, const rnllama::llama_rn_tokenize_result& result) {
         jsi::Object res(runtime);
         
-        jsi::Array tokens = jsi::Array(runtime, result.tokens.size());
-        for (size_t i = 0; i < result.tokens.size(); ++i) {
-            tokens.setValueAtIndex(runtime, i, (double)result.tokens[i]);
-        }
-        res.setProperty(runtime, "tokens", tokens);
+        res.setProperty(runtime, "tokens", createTypedArray(runtime, "Int32Array", std::vector<int32_t>(result.tokens)));
         
         res.setProperty(runtime, "has_media", result.has_media);
         
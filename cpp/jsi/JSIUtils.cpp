@@ -1,6 +1,8 @@
 #include "JSIUtils.h"
 #include "JSITaskManager.h"
 #include "ThreadPool.h"
+#include <cstring>
+#include <stdexcept>
 
 namespace rnllama_jsi {
 
@@ -15,6 +17,43 @@ namespace rnllama_jsi {
         );
     }
 
+    std::vector<int32_t> getTokenArray(jsi::Runtime& runtime, const jsi::Value& value) {
+        jsi::Object obj = value.asObject(runtime);
+        std::vector<int32_t> tokens;
+
+        if (obj.isArray(runtime)) {
+            jsi::Array arr = obj.asArray(runtime);
+            const size_t n = arr.size(runtime);
+            tokens.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                tokens.push_back((int32_t) arr.getValueAtIndex(runtime, i).asNumber());
+            }
+            return tokens;
+        }
+
+        // Any other 32-bit typed array (Float32Array) would have its bits read as ids
+        jsi::Value constructor = obj.getProperty(runtime, "constructor");
+        auto isTypedArray = [&](const char* name) {
+            return jsi::Value::strictEquals(runtime, constructor, runtime.global().getProperty(runtime, name));
+        };
+        jsi::Value buffer = obj.getProperty(runtime, "buffer");
+        if (!(isTypedArray("Int32Array") || isTypedArray("Uint32Array")) ||
+            !buffer.isObject() || !buffer.asObject(runtime).isArrayBuffer(runtime)) {
+            jsi::Function typeError = runtime.global().getPropertyAsFunction(runtime, "TypeError");
+            throw jsi::JSError(runtime, typeError.callAsConstructor(runtime,
+                jsi::String::createFromUtf8(runtime, "Expected an array of tokens, an Int32Array or a Uint32Array")));
+        }
+
+        const size_t offset = (size_t) obj.getProperty(runtime, "byteOffset").asNumber();
+        const size_t length = (size_t) obj.getProperty(runtime, "length").asNumber();
+        jsi::ArrayBuffer arrayBuffer = buffer.asObject(runtime).getArrayBuffer(runtime);
+        tokens.resize(length);
+        if (length > 0) {
+            std::memcpy(tokens.data(), arrayBuffer.data(runtime) + offset, length * sizeof(int32_t));
+        }
+        return tokens;
+    }
+
     JsiFunctionPtr makeJsiFunction(
         jsi::Runtime& runtime,
         const jsi::Value& value,
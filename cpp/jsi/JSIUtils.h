@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 using namespace facebook;
 
@@ -41,6 +42,48 @@ namespace rnllama_jsi {
         std::function<void(bool shouldProceed)> callback
     );
 
+    // ArrayBuffer backing store that owns a native vector, so large results
+    // reach JS without a per-element copy
+    template <typename T>
+    class VectorBuffer : public jsi::MutableBuffer {
+    public:
+        explicit VectorBuffer(std::vector<T>&& values) : values_(std::move(values)) {}
+        size_t size() const override { return values_.size() * sizeof(T); }
+        uint8_t* data() override { return reinterpret_cast<uint8_t*>(values_.data()); }
+
+    private:
+        std::vector<T> values_;
+    };
+
+    template <typename T>
+    inline jsi::ArrayBuffer createArrayBuffer(jsi::Runtime& runtime, std::vector<T>&& values) {
+        return jsi::ArrayBuffer(runtime, std::make_shared<VectorBuffer<T>>(std::move(values)));
+    }
+
+    // `type` is the typed array constructor name, e.g. "Float32Array";
+    // offset is in bytes, length in elements
+    inline jsi::Value createTypedArrayView(
+        jsi::Runtime& runtime,
+        const jsi::ArrayBuffer& buffer,
+        const char* type,
+        size_t offset,
+        size_t length
+    ) {
+        return runtime.global().getPropertyAsFunction(runtime, type)
+            .callAsConstructor(runtime, jsi::Value(runtime, buffer), (double) offset, (double) length);
+    }
+
+    template <typename T>
+    inline jsi::Value createTypedArray(jsi::Runtime& runtime, const char* type, std::vector<T>&& values) {
+        const size_t length = values.size();
+        jsi::ArrayBuffer buffer = createArrayBuffer(runtime, std::move(values));
+        return createTypedArrayView(runtime, buffer, type, 0, length);
+    }
+
+    // Read token ids from a JS number array or an Int32Array / Uint32Array;
+    // throws a TypeError for any other typed array
+    std::vector<int32_t> getTokenArray(jsi::Runtime& runtime, const jsi::Value& value);
+
     // Safe console.log wrapper for JSI context
     inline void consoleLog(jsi::Runtime& runtime, const std::string& message) {
         auto console = runtime.global().getPropertyAsObject(runtime, "console");
@@ -512,6 +512,15 @@ namespace rnllama_jsi {
                     getPropertyAsInt(runtime, params, "state_cache_budget_mb", 160);
                 int stateCacheMaxCheckpoints =
                     getPropertyAsInt(runtime, params, "state_cache_max_checkpoints", 8);
+                bool stateCacheCompact = getPropertyAsBool(runtime, params, "state_cache_compact", false);
+                std::string stateCacheDir = getPropertyAsString(runtime, params, "state_cache_dir");
+                int stateCacheDiskBudgetMb =
+                    getPropertyAsInt(runtime, params, "state_cache_disk_budget_mb", 512);
+                int mediaCacheBudgetMb =
+                    getPropertyAsInt(runtime, params, "media_cache_budget_mb", 64);
+                std::string mediaCacheDir = getPropertyAsString(runtime, params, "media_cache_dir");
+                int mediaCacheDiskBudgetMb =
+                    getPropertyAsInt(runtime, params, "media_cache_disk_budget_mb", 256);
 
                 return createPromiseTask(runtime, callInvoker, [
                     contextId,
@@ -522,7 +531,13 @@ namespace rnllama_jsi {
                     useProgressCallback,
                     progressData,
                     stateCacheBudgetMb,
-                    stateCacheMaxCheckpoints
+                    stateCacheMaxCheckpoints,
+                    stateCacheCompact,
+                    stateCacheDir,
+                    stateCacheDiskBudgetMb,
+                    mediaCacheBudgetMb,
+                    mediaCacheDir,
+                    mediaCacheDiskBudgetMb
                 ]() mutable -> PromiseResultGenerator {
                     if (isContextLimitReached()) {
                         throw std::runtime_error("Context limit reached");
@@ -588,6 +603,15 @@ namespace rnllama_jsi {
                         ctx->state_cache_budget_bytes =
                             stateCacheBudgetMb > 0 ? (size_t) stateCacheBudgetMb * 1024 * 1024 : 0;
                         ctx->state_cache_max_checkpoints = stateCacheMaxCheckpoints;
+                        ctx->state_cache_compact = stateCacheCompact;
+                        ctx->state_cache_dir = stateCacheDir;
+                        ctx->state_cache_disk_budget_bytes =
+                            stateCacheDiskBudgetMb > 0 ? (size_t) stateCacheDiskBudgetMb * 1024 * 1024 : 0;
+                        ctx->media_cache_budget_bytes =
+                            mediaCacheBudgetMb > 0 ? (size_t) mediaCacheBudgetMb * 1024 * 1024 : 0;
+                        ctx->media_cache_dir = mediaCacheDir;
+                        ctx->media_cache_disk_budget_bytes =
+                            mediaCacheDiskBudgetMb > 0 ? (size_t) mediaCacheDiskBudgetMb * 1024 * 1024 : 0;
                     }
                     if (ctx->loadModel(cparams)) {
                          ctx->attachThreadpoolsIfAvailable();
@@ -780,11 +804,7 @@ namespace rnllama_jsi {
             2,
             [callInvoker](jsi::Runtime& runtime, const jsi::Value& thisValue, const jsi::Value* arguments, size_t count) -> jsi::Value {
                 int contextId = (int)arguments[0].asNumber();
-                std::vector<llama_token> tokens;
-                jsi::Array tokensArr = arguments[1].asObject(runtime).asArray(runtime);
-                for (size_t i = 0; i < tokensArr.size(runtime); ++i) {
-                    tokens.push_back((llama_token)tokensArr.getValueAtIndex(runtime, i).asNumber());
-                }
+                std::vector<llama_token> tokens = getTokenArray(runtime, arguments[1]);
 
                 return createPromiseTask(runtime, callInvoker, [contextId, tokens]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
@@ -946,13 +966,9 @@ namespace rnllama_jsi {
 
                     std::vector<float> result = ctx->completion->embedding(embdParams);
 
-                    return [result](jsi::Runtime& rt) {
+                    return [result = std::move(result)](jsi::Runtime& rt) mutable {
                         jsi::Object resultDict(rt);
-                        jsi::Array embeddingResult(rt, result.size());
-                        for (size_t i = 0; i < result.size(); i++) {
-                            embeddingResult.setValueAtIndex(rt, i, (double)result[i]);
-                        }
-                        resultDict.setProperty(rt, "embedding", embeddingResult);
+                        resultDict.setProperty(rt, "embedding", createTypedArray(rt, "Float32Array", std::move(result)));
                         return resultDict;
                     };
                 }, contextId);
@@ -960,6 +976,54 @@ namespace rnllama_jsi {
         );
         runtime.global().setProperty(runtime, "llamaEmbedding", embedding);
 
+        auto embeddingBatch = jsi::Function::createFromHostFunction(runtime,
+            jsi::PropNameID::forAscii(runtime, "llamaEmbeddingBatch"),
+            3,
+            [callInvoker](jsi::Runtime& runtime, const jsi::Value& thisValue, const jsi::Value* arguments, size_t count) -> jsi::Value {
+                int contextId = (int)arguments[0].asNumber();
+                jsi::Array textsArr = arguments[1].asObject(runtime).asArray(runtime);
+                std::vector<std::string> texts;
+                for (size_t i = 0; i < textsArr.size(runtime); i++) {
+                    texts.push_back(textsArr.getValueAtIndex(runtime, i).asString(runtime).utf8(runtime));
+                }
+                jsi::Object params = arguments[2].asObject(runtime);
+
+                int embd_normalize = 0;
+                bool has_embd_normalize = false;
+                if (params.hasProperty(runtime, "embd_normalize")) {
+                    embd_normalize = getPropertyAsInt(runtime, params, "embd_normalize", 2);
+                    has_embd_normalize = true;
+                }
+
+                return createPromiseTask(runtime, callInvoker, [contextId, texts, embd_normalize, has_embd_normalize]() -> PromiseResultGenerator {
+                    auto ctx = getContextOrThrow(contextId);
+
+                    if (!ctx->completion) throw std::runtime_error("Completion not initialized");
+                    if (ctx->params.embedding != true) throw std::runtime_error("Embedding is not enabled");
+                    throwIfContextBusy(ctx);
+
+                    const int normalize = has_embd_normalize ? embd_normalize : ctx->params.embd_normalize;
+                    std::vector<float> result = ctx->completion->embeddingBatch(texts, normalize);
+                    const size_t n_embd = texts.empty() ? 0 : result.size() / texts.size();
+
+                    return [result = std::move(result), n_embd](jsi::Runtime& rt) mutable {
+                        jsi::Object resultDict(rt);
+                        const size_t n_texts = n_embd == 0 ? 0 : result.size() / n_embd;
+                        // One buffer for the whole batch, one Float32Array view per text
+                        jsi::ArrayBuffer buffer = createArrayBuffer(rt, std::move(result));
+                        jsi::Array embeddings(rt, n_texts);
+                        for (size_t i = 0; i < n_texts; i++) {
+                            embeddings.setValueAtIndex(rt, i,
+                                createTypedArrayView(rt, buffer, "Float32Array", i * n_embd * sizeof(float), n_embd));
+                        }
+                        resultDict.setProperty(rt, "embeddings", embeddings);
+                        return resultDict;
+                    };
+                }, contextId);
+            }
+        );
+        runtime.global().setProperty(runtime, "llamaEmbeddingBatch", embeddingBatch);
+
         auto rerank = jsi::Function::createFromHostFunction(runtime,
             jsi::PropNameID::forAscii(runtime, "llamaRerank"),
             4,
@@ -982,15 +1046,8 @@ namespace rnllama_jsi {
 
                     std::vector<float> scores = ctx->completion->rerank(query, documents);
 
-                    return [scores](jsi::Runtime& rt) {
-                        jsi::Array result(rt, scores.size());
-                        for (size_t i = 0; i < scores.size(); i++) {
-                            jsi::Object item(rt);
-                            item.setProperty(rt, "score", (double)scores[i]);
-                            item.setProperty(rt, "index", (int)i);
-                            result.setValueAtIndex(rt, i, item);
-                        }
-                        return result;
+                    return [scores = std::move(scores)](jsi::Runtime& rt) mutable {
+                        return createTypedArray(rt, "Float32Array", std::move(scores));
                     };
                 }, contextId);
             }
@@ -1034,6 +1091,10 @@ namespace rnllama_jsi {
                 }
 
                 bool emitPartial = getPropertyAsBool(runtime, params, "emit_partial_completion", false);
+                int frameMs = getPropertyAsInt(runtime, params, "stream_frame_ms", 0);
+                int frameMaxTokens = getPropertyAsInt(runtime, params, "stream_frame_max_tokens", 0);
+                bool streamAudio = getPropertyAsBool(runtime, params, "stream_audio", false);
+                int audioChunkCodes = getPropertyAsInt(runtime, params, "stream_audio_chunk_codes", 0);
 
                 auto ctx = getContextOrThrow(contextId);
                 throwIfContextBusy(ctx);
@@ -1067,10 +1128,12 @@ namespace rnllama_jsi {
                                 guide_tokens.push_back((llama_token)tokVal.asNumber());
                             }
                         }
+                    } else if (guideVal.isObject()) {
+                        guide_tokens = getTokenArray(runtime, guideVal);
                     }
                 }
 
-                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, onToken, emitPartial, mediaPaths, chat_format, reasoning_format, generation_prompt, chat_parser, prefill_text, guide_tokens, callInvoker]() -> PromiseResultGenerator {
+                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, onToken, emitPartial, frameMs, frameMaxTokens, streamAudio, audioChunkCodes, mediaPaths, chat_format, reasoning_format, generation_prompt, chat_parser, prefill_text, guide_tokens, callInvoker]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
 
                     if (ctx->completion == nullptr) {
@@ -1111,18 +1174,98 @@ namespace rnllama_jsi {
 
                     size_t sent_count = 0;
 
+                    // Framed streaming: one JS call per frame of tokens
+                    std::unique_ptr<rnllama::llama_rn_token_framer> framer;
+                    if (emitPartial && onToken && (frameMs > 0 || frameMaxTokens > 0)) {
+                        framer.reset(new rnllama::llama_rn_token_framer());
+                        framer->interval_ms = std::max(0, frameMs);
+                        framer->max_tokens = std::max(0, frameMaxTokens);
+                        framer->on_frame = [&](rnllama::llama_rn_token_frame& frame) {
+                            rnllama::completion_chat_output partial_output;
+                            bool has_partial_output = false;
+                            try {
+                                partial_output = ctx->completion->parseChatOutput(true);
+                                has_partial_output = true;
+                            } catch (...) {
+                                // ignore parse errors for partial output
+                            }
+                            auto runtime = runtimePtr;
+                            if (!runtime) {
+                                return;
+                            }
+                            callInvoker->invokeAsync([onToken, frame, contextId, partial_output, has_partial_output, runtime]() {
+                                if (!g_llamaContexts.get(contextId)) {
+                                    return;
+                                }
+                                auto& rt = *runtime;
+                                jsi::Object res = createTokenFrameResult(rt, frame);
+                                if (has_partial_output) {
+                                    setChatOutputFields(rt, res, partial_output);
+                                }
+                                onToken->call(rt, res);
+                            });
+                        };
+                    }
+
+                    // Streamed TTS: PCM chunks go out through onToken as `audio`
+                    if (streamAudio && onToken && ctx->isVocoderEnabled()) {
+                        ctx->tts_wrapper->beginAudioStream(audioChunkCodes, [onToken, contextId, runtimePtr, callInvoker](std::vector<float> &&audio) {
+                            auto runtime = runtimePtr;
+                            if (!runtime) {
+                                return;
+                            }
+                            auto samples = std::make_shared<std::vector<float>>(std::move(audio));
+                            callInvoker->invokeAsync([onToken, samples, contextId, runtime]() {
+                                if (!g_llamaContexts.get(contextId)) {
+                                    return;
+                                }
+                                auto& rt = *runtime;
+                                jsi::Object res(rt);
+                                res.setProperty(rt, "token", jsi::String::createFromUtf8(rt, ""));
+                                res.setProperty(rt, "audio", createTypedArray(rt, "Float32Array", std::move(*samples)));
+                                onToken->call(rt, res);
+                            });
+                        }, [onToken, contextId, runtimePtr, callInvoker](const std::string &message) {
+                            auto runtime = runtimePtr;
+                            if (!runtime) {
+                                return;
+                            }
+                            callInvoker->invokeAsync([onToken, message, contextId, runtime]() {
+                                if (!g_llamaContexts.get(contextId)) {
+                                    return;
+                                }
+                                auto& rt = *runtime;
+                                jsi::Object res(rt);
+                                res.setProperty(rt, "token", jsi::String::createFromUtf8(rt, ""));
+                                res.setProperty(rt, "audio_error", jsi::String::createFromUtf8(rt, message));
+                                onToken->call(rt, res);
+                            });
+                        });
+                    }
+                    // Flush and drop the audio stream even if the completion throws
+                    struct audio_stream_on_exit {
+                        rnllama::llama_rn_context* ctx;
+                        ~audio_stream_on_exit() {
+                            try {
+                                if (ctx->isVocoderEnabled() && ctx->tts_wrapper->stream) {
+                                    ctx->tts_wrapper->endAudioStream(ctx);
+                                }
+                            } catch (...) {
+                                ctx->tts_wrapper->stream.reset();
+                            }
+                        }
+                    } audio_stream_guard{ctx};
+
                     while (ctx->completion->has_next_token && !ctx->completion->is_interrupted) {
                         const rnllama::completion_token_output token_with_probs = ctx->completion->doCompletion();
                         if (token_with_probs.tok == -1 || ctx->completion->incomplete) {
                             continue;
                         }
 
-                        const std::string token_text = common_token_to_piece(ctx->ctx, token_with_probs.tok);
                         size_t pos = std::min(sent_count, ctx->completion->generated_text.size());
-                        const std::string str_test = ctx->completion->generated_text.substr(pos);
 
                         bool is_stop_full = false;
-                        size_t stop_pos = ctx->completion->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
+                        size_t stop_pos = ctx->completion->findStoppingStrings(pos, rnllama::STOP_FULL);
                         if (stop_pos != std::string::npos) {
                             is_stop_full = true;
                             ctx->completion->generated_text.erase(
@@ -1130,14 +1273,18 @@ namespace rnllama_jsi {
                                 ctx->completion->generated_text.end());
                             pos = std::min(sent_count, ctx->completion->generated_text.size());
                         } else {
-                             stop_pos = ctx->completion->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_PARTIAL);
+                             stop_pos = ctx->completion->findStoppingStrings(pos, rnllama::STOP_PARTIAL);
                         }
 
                         if (stop_pos == std::string::npos || (!ctx->completion->has_next_token && !is_stop_full && stop_pos > 0)) {
                             const std::string to_send = ctx->completion->generated_text.substr(pos, std::string::npos);
                             sent_count += to_send.size();
 
-                            if (emitPartial && onToken) {
+                            if (framer) {
+                                rnllama::completion_token_output output_copy = token_with_probs;
+                                output_copy.text = to_send;
+                                framer->push(output_copy);
+                            } else if (emitPartial && onToken) {
                                 rnllama::completion_token_output output_copy = token_with_probs;
                                 output_copy.text = to_send;
 
@@ -1172,6 +1319,12 @@ namespace rnllama_jsi {
                         }
                     }
 
+                    if (framer) {
+                        framer->flush();
+                    }
+                    if (ctx->isVocoderEnabled() && ctx->tts_wrapper->stream) {
+                        ctx->tts_wrapper->endAudioStream(ctx);
+                    }
                     common_perf_print(ctx->ctx, ctx->completion->ctx_sampling);
                     ctx->completion->endCompletion();
 
@@ -1252,12 +1405,17 @@ namespace rnllama_jsi {
                 bool enabled = getPropertyAsBool(runtime, params, "enabled", true);
                 int nParallel = getPropertyAsInt(runtime, params, "n_parallel", 2);
                 int nBatch = getPropertyAsInt(runtime, params, "n_batch", 512);
+                int nPrefillBudget = getPropertyAsInt(runtime, params, "n_prefill_budget", 0);
+                double prefillTargetMs = getPropertyAsDouble(runtime, params, "prefill_target_ms", 100.0);
+                bool pipelineDecode = getPropertyAsBool(runtime, params, "pipeline_decode", false);
 
-                return createPromiseTask(runtime, callInvoker, [contextId, enabled, nParallel, nBatch]() -> PromiseResultGenerator {
+                return createPromiseTask(runtime, callInvoker, [contextId, enabled, nParallel, nBatch, nPrefillBudget, prefillTargetMs, pipelineDecode]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
                     if (enabled) {
                         ctx->enableParallelMode(nParallel, nBatch);
                         if (ctx->slot_manager) {
+                            ctx->slot_manager->set_prefill_budget(nPrefillBudget, (float)prefillTargetMs);
+                            ctx->slot_manager->pipeline_decode = pipelineDecode;
                             ctx->slot_manager->start_processing_loop();
                         }
                     } else {
@@ -1307,8 +1465,12 @@ namespace rnllama_jsi {
                 std::string save_prompt_state_path = stripFileScheme(getPropertyAsString(runtime, params, "save_prompt_state_path"));
                 int load_state_size = getPropertyAsInt(runtime, params, "load_state_size", -1);
                 int save_state_size = getPropertyAsInt(runtime, params, "save_state_size", -1);
+                int priority = getPropertyAsInt(runtime, params, "priority", 0);
+                int deadline_ms = getPropertyAsInt(runtime, params, "deadline_ms", 0);
+                int frameMs = getPropertyAsInt(runtime, params, "stream_frame_ms", 0);
+                int frameMaxTokens = getPropertyAsInt(runtime, params, "stream_frame_max_tokens", 0);
 
-                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, cparams, mediaPaths, chat_format, reasoning_format, generation_prompt, chat_parser, prefill_text, load_state_path, save_state_path, save_prompt_state_path, load_state_size, save_state_size, onToken, onComplete, callInvoker]() -> PromiseResultGenerator {
+                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, cparams, mediaPaths, chat_format, reasoning_format, generation_prompt, chat_parser, prefill_text, load_state_path, save_state_path, save_prompt_state_path, load_state_size, save_state_size, priority, deadline_ms, frameMs, frameMaxTokens, onToken, onComplete, callInvoker]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
                     if (!ctx->parallel_mode_enabled || !ctx->slot_manager) {
                         throw std::runtime_error("Parallel mode not enabled");
@@ -1319,20 +1481,20 @@ namespace rnllama_jsi {
                     auto tokenizeResult = ctx->tokenize(cparams.prompt, mediaPaths);
                     std::vector<llama_token> tokens = tokenizeResult.tokens;
 
-                    auto tokenCallback = [contextId, callInvoker, ctx, runtimePtr](const rnllama::completion_token_output& token) {
+                    // Runs on the delivery thread, so the partial parse works on the
+                    // streamed text instead of reading the slot
+                    auto streamedText = std::make_shared<std::string>(prefill_text);
+                    auto chatParser = std::make_shared<rnllama::chat_output_parser>(chat_format, reasoning_format, generation_prompt, chat_parser);
+                    auto tokenCallback = [contextId, callInvoker, runtimePtr, streamedText, chatParser](const rnllama::completion_token_output& token) {
                         int requestId = token.request_id;
+                        streamedText->append(token.text);
                         rnllama::completion_chat_output parsed_output;
                         bool has_parsed_output = false;
-                        if (ctx->slot_manager) {
-                            auto* slot = ctx->slot_manager->get_slot_by_request_id(requestId);
-                            if (slot) {
-                                try {
-                                    parsed_output = slot->parseChatOutput(true);
-                                    has_parsed_output = true;
-                                } catch (...) {
-                                    has_parsed_output = false;
-                                }
-                            }
+                        try {
+                            parsed_output = chatParser->parse(*streamedText, true);
+                            has_parsed_output = true;
+                        } catch (...) {
+                            has_parsed_output = false;
                         }
 
                         auto callbacks = RequestManager::getInstance().getRequest(contextId, requestId);
@@ -1358,6 +1520,38 @@ namespace rnllama_jsi {
                         }
                     };
 
+                    // Framed streaming: the same, once per frame of tokens
+                    std::function<void(rnllama::llama_rn_token_frame&)> frameCallback;
+                    if (frameMs > 0 || frameMaxTokens > 0) {
+                        frameCallback = [contextId, callInvoker, runtimePtr, streamedText, chatParser](rnllama::llama_rn_token_frame& frame) {
+                            int requestId = frame.request_id;
+                            streamedText->append(frame.text);
+                            rnllama::completion_chat_output parsed_output;
+                            bool has_parsed_output = false;
+                            try {
+                                parsed_output = chatParser->parse(*streamedText, true);
+                                has_parsed_output = true;
+                            } catch (...) {
+                                has_parsed_output = false;
+                            }
+
+                            auto callbacks = RequestManager::getInstance().getRequest(contextId, requestId);
+                            auto runtime = runtimePtr;
+                            if (!callbacks.onToken || !runtime) {
+                                return;
+                            }
+                            invokeAsyncTracked(callInvoker, contextId, [callbacks, contextId, frame, requestId, parsed_output, has_parsed_output, runtime](bool shouldProceed) {
+                                if (!shouldProceed || !g_llamaContexts.get(contextId)) return;
+                                auto& rt = *runtime;
+                                jsi::Object res = createTokenFrameResult(rt, frame);
+                                if (has_parsed_output) {
+                                    setChatOutputFields(rt, res, parsed_output);
+                                }
+                                callbacks.onToken->call(rt, res, jsi::Value(requestId));
+                            });
+                        };
+                    }
+
                     auto completeCallback = [contextId, callInvoker, runtimePtr](rnllama::llama_rn_slot* slot) {
                         int requestId = slot->request_id;
                         auto callbacks = RequestManager::getInstance().getRequest(contextId, requestId);
@@ -1382,9 +1576,6 @@ namespace rnllama_jsi {
                             std::string error_message = slot->error_message;
                             auto timings = slot->get_timings();
                             auto token_probs = slot->generated_token_probs;
-                            if (slot->parent_ctx && slot->ctx_sampling) {
-                                common_perf_print(slot->parent_ctx->ctx, slot->ctx_sampling);
-                            }
 
                             rnllama::completion_chat_output final_output;
                             bool has_final_output = false;
@@ -1447,6 +1638,8 @@ namespace rnllama_jsi {
                                 timingsObj.setProperty(rt, "predicted_ms", (double)timings.predicted_ms);
                                 timingsObj.setProperty(rt, "predicted_per_token_ms", (double)timings.predicted_per_token_ms);
                                 timingsObj.setProperty(rt, "predicted_per_second", (double)timings.predicted_per_second);
+                                timingsObj.setProperty(rt, "draft_n", (double)timings.draft_n);
+                                timingsObj.setProperty(rt, "draft_n_accepted", (double)timings.draft_n_accepted);
                                 res.setProperty(rt, "timings", timingsObj);
 
                                 callbacks.onComplete->call(rt, res);
@@ -1456,7 +1649,8 @@ namespace rnllama_jsi {
 
                     int requestId = ctx->slot_manager->queue_request(
                         cparams, tokens, mediaPaths, cparams.prompt, chat_format, reasoning_format, generation_prompt, chat_parser, prefill_text, load_state_path, save_state_path, save_prompt_state_path, load_state_size, save_state_size,
-                        tokenCallback, completeCallback
+                        tokenCallback, completeCallback, priority, deadline_ms,
+                        frameCallback, frameMs, frameMaxTokens
                     );
 
                     RequestManager::getInstance().addRequest(contextId, requestId, {onToken, onComplete, nullptr});
@@ -1504,8 +1698,9 @@ namespace rnllama_jsi {
                     embd_normalize = getPropertyAsInt(runtime, params, "embd_normalize", 2);
                     has_embd_normalize = true;
                 }
+                int priority = getPropertyAsInt(runtime, params, "priority", 0);
 
-                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, text, embd_normalize, has_embd_normalize, onResult, callInvoker]() -> PromiseResultGenerator {
+                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, text, embd_normalize, has_embd_normalize, priority, onResult, callInvoker]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
                     if (!ctx->parallel_mode_enabled || !ctx->slot_manager) {
                         throw std::runtime_error("Parallel mode not enabled");
@@ -1525,20 +1720,16 @@ namespace rnllama_jsi {
                             if (!runtime) {
                               return;
                             }
-                            invokeAsyncTracked(callInvoker, contextId, [callbacks, embCopy, runtime](bool shouldProceed) {
+                            invokeAsyncTracked(callInvoker, contextId, [callbacks, embCopy, runtime](bool shouldProceed) mutable {
                                 if (!shouldProceed) return;
                                 auto& rt = *runtime;
-                                jsi::Array res(rt, embCopy.size());
-                                for (size_t i = 0; i < embCopy.size(); i++) {
-                                    res.setValueAtIndex(rt, i, (double)embCopy[i]);
-                                }
-                                callbacks.onResult->call(rt, res);
+                                callbacks.onResult->call(rt, createTypedArray(rt, "Float32Array", std::move(embCopy)));
                             });
                         }
                     };
 
                     const int normalize = has_embd_normalize ? embd_normalize : ctx->params.embd_normalize;
-                    int requestId = ctx->slot_manager->queue_embedding_request(tokens, normalize, resultCallback);
+                    int requestId = ctx->slot_manager->queue_embedding_request(tokens, normalize, resultCallback, priority);
 
                     RequestManager::getInstance().addRequest(contextId, requestId, {nullptr, nullptr, onResult});
 
@@ -1567,8 +1758,9 @@ namespace rnllama_jsi {
                 auto onResult = makeJsiFunction(runtime, arguments[4], callInvoker);
 
                 int normalize = getPropertyAsInt(runtime, params, "normalize", 0);
+                int priority = getPropertyAsInt(runtime, params, "priority", 0);
 
-                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, query, documents, normalize, onResult, callInvoker]() -> PromiseResultGenerator {
+                return createPromiseTask(runtime, callInvoker, [runtimePtr = std::shared_ptr<jsi::Runtime>(&runtime, [](jsi::Runtime*){}), contextId, query, documents, normalize, priority, onResult, callInvoker]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
                     if (!ctx->parallel_mode_enabled || !ctx->slot_manager) {
                         throw std::runtime_error("Parallel mode not enabled");
@@ -1583,22 +1775,15 @@ namespace rnllama_jsi {
                             if (!runtime) {
                               return;
                             }
-                            invokeAsyncTracked(callInvoker, contextId, [callbacks, scoresCopy, runtime](bool shouldProceed) {
+                            invokeAsyncTracked(callInvoker, contextId, [callbacks, scoresCopy, runtime](bool shouldProceed) mutable {
                                 if (!shouldProceed) return;
                                 auto& rt = *runtime;
-                                jsi::Array res(rt, scoresCopy.size());
-                                for (size_t i = 0; i < scoresCopy.size(); i++) {
-                                    jsi::Object item(rt);
-                                    item.setProperty(rt, "score", (double)scoresCopy[i]);
-                                    item.setProperty(rt, "index", (int)i);
-                                    res.setValueAtIndex(rt, i, item);
-                                }
-                                callbacks.onResult->call(rt, res);
+                                callbacks.onResult->call(rt, createTypedArray(rt, "Float32Array", std::move(scoresCopy)));
                             });
                         }
                     };
 
-                    int requestId = ctx->slot_manager->queue_rerank_request(query, documents, normalize, resultCallback);
+                    int requestId = ctx->slot_manager->queue_rerank_request(query, documents, normalize, resultCallback, priority);
 
                     RequestManager::getInstance().addRequest(contextId, requestId, {nullptr, nullptr, onResult});
 
@@ -1626,6 +1811,7 @@ namespace rnllama_jsi {
                 reqObj.setProperty(rt, "request_id", req.request_id);
                 reqObj.setProperty(rt, "type", jsi::String::createFromUtf8(rt, req.type));
                 reqObj.setProperty(rt, "state", jsi::String::createFromUtf8(rt, req.state));
+                reqObj.setProperty(rt, "priority", req.priority);
                 reqObj.setProperty(rt, "prompt_length", (double)req.prompt_length);
                 reqObj.setProperty(rt, "tokens_generated", (double)req.tokens_generated);
                 reqObj.setProperty(rt, "prompt_ms", req.prompt_ms);
@@ -1666,6 +1852,7 @@ namespace rnllama_jsi {
                             reqObj.setProperty(rt, "request_id", req.request_id);
                             reqObj.setProperty(rt, "type", jsi::String::createFromUtf8(rt, req.type));
                             reqObj.setProperty(rt, "state", jsi::String::createFromUtf8(rt, req.state));
+                            reqObj.setProperty(rt, "priority", req.priority);
                             reqObj.setProperty(rt, "prompt_length", (double)req.prompt_length);
                             reqObj.setProperty(rt, "tokens_generated", (double)req.tokens_generated);
                             reqObj.setProperty(rt, "prompt_ms", req.prompt_ms);
@@ -1721,6 +1908,7 @@ namespace rnllama_jsi {
                                 reqObj.setProperty(rt, "request_id", req.request_id);
                                 reqObj.setProperty(rt, "type", jsi::String::createFromUtf8(rt, req.type));
                                 reqObj.setProperty(rt, "state", jsi::String::createFromUtf8(rt, req.state));
+                                reqObj.setProperty(rt, "priority", req.priority);
                                 reqObj.setProperty(rt, "prompt_length", (double)req.prompt_length);
                                 reqObj.setProperty(rt, "tokens_generated", (double)req.tokens_generated);
                                 reqObj.setProperty(rt, "prompt_ms", req.prompt_ms);
@@ -2094,11 +2282,7 @@ namespace rnllama_jsi {
             2,
             [callInvoker](jsi::Runtime& runtime, const jsi::Value& thisValue, const jsi::Value* arguments, size_t count) -> jsi::Value {
                 int contextId = (int)arguments[0].asNumber();
-                jsi::Array tokensArr = arguments[1].asObject(runtime).asArray(runtime);
-                std::vector<llama_token> tokens;
-                for (size_t i = 0; i < tokensArr.size(runtime); i++) {
-                    tokens.push_back((llama_token)tokensArr.getValueAtIndex(runtime, i).asNumber());
-                }
+                std::vector<llama_token> tokens = getTokenArray(runtime, arguments[1]);
 
                 return createPromiseTask(runtime, callInvoker, [contextId, tokens]() -> PromiseResultGenerator {
                     auto ctx = getContextOrThrow(contextId);
@@ -2106,12 +2290,8 @@ namespace rnllama_jsi {
 
                     try {
                         auto audio_data = ctx->tts_wrapper->decodeAudioTokens(ctx, tokens);
-                        return [audio_data](jsi::Runtime& rt) {
-                            jsi::Array res(rt, audio_data.size());
-                            for (size_t i = 0; i < audio_data.size(); i++) {
-                                res.setValueAtIndex(rt, i, (double)audio_data[i]);
-                            }
-                            return res;
+                        return [audio_data = std::move(audio_data)](jsi::Runtime& rt) mutable {
+                            return createTypedArray(rt, "Float32Array", std::move(audio_data));
                         };
                     } catch (const std::exception &e) {
                         throw std::runtime_error(e.what());
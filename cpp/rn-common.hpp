@@ -133,28 +133,6 @@ inline static std::string backend_devices_info() {
     return devices_array.dump();
 }
 
-// Helper function to check if string ends with suffix
-static bool ends_with(const std::string& str, const std::string& suffix) {
-  if (suffix.size() > str.size()) return false;
-  return std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
-}
-
-// Helper function to find partial stop string at end of text
-static size_t find_partial_stop_string(const std::string& stop, const std::string& text) {
-  if (!text.empty() && !stop.empty()) {
-      const char text_last_char = text.back();
-      for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-          if (stop[char_index] == text_last_char) {
-              const std::string current_partial = stop.substr(0, char_index + 1);
-              if (ends_with(text, current_partial)) {
-                  return text.size() - char_index - 1;
-              }
-          }
-      }
-  }
-  return std::string::npos;
-}
-
 // Helper function to find the length of common prefix between two token vectors
 static size_t find_common_prefix_length(const std::vector<llama_token> &a, const std::vector<llama_token> &b) {
   size_t i;
@@ -163,6 +141,47 @@ static size_t find_common_prefix_length(const std::vector<llama_token> &a, const
   return i;
 }
 
+// Attention sinks a context shift keeps: BOS plus n_keep tokens, or the whole
+// prompt for n_keep < 0, leaving at least 4 positions to generate into
+static int32_t context_shift_n_keep(int32_t n_keep, size_t num_prompt_tokens, int32_t n_ctx) {
+  const int32_t n_sinks = n_keep < 0 ? (int32_t) num_prompt_tokens : n_keep + 1;
+  return std::min(n_sinks, n_ctx - 4);
+}
+
+// Context shift for a full sequence: keep its first n_keep tokens (the
+// attention sinks), drop the n_discard after them and move the rest down.
+// `tokens` mirrors the sequence and is edited the same way. Returns false and
+// leaves everything as is when the memory can't shift positions (recurrent or
+// hybrid memory, M-RoPE) or the sequence holds media chunks.
+static bool shift_context(
+  llama_context* ctx,
+  llama_seq_id seq_id,
+  std::vector<llama_token>& tokens,
+  llama_pos& n_past,
+  int32_t n_keep,
+  int32_t n_discard
+) {
+  auto* mem = llama_get_memory(ctx);
+  if (mem == nullptr || !llama_memory_can_shift(mem)) {
+    return false;
+  }
+  if (std::find(tokens.begin(), tokens.end(), LLAMA_TOKEN_NULL) != tokens.end()) {
+    return false;
+  }
+
+  n_keep = std::max<int32_t>(0, n_keep);
+  n_discard = std::min<int32_t>(n_discard, n_past - n_keep);
+  if (n_discard <= 0 || tokens.size() < (size_t)(n_keep + n_discard)) {
+    return false;
+  }
+
+  llama_memory_seq_rm (mem, seq_id, n_keep            , n_keep + n_discard);
+  llama_memory_seq_add(mem, seq_id, n_keep + n_discard, n_past, -n_discard);
+  tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+  n_past -= n_discard;
+  return true;
+}
+
 // Helper function to format rerank task: [BOS]query[EOS][SEP]doc[EOS]
 static std::vector<llama_token> format_rerank_tokens(
   const llama_vocab* vocab,
@@ -3,6 +3,8 @@
 #include "rn-tts.h"
 #include "rn-mtmd.hpp"
 #include "rn-common.hpp"
+#include "rn-rerank.h"
+#include "rn-slot-manager.h"
 #include "llama-ext.h"  // llama_get_ctx_other (mem-shared MTP draft detection)
 
 #include <algorithm>
@@ -47,6 +49,9 @@ void llama_rn_context_completion::rewind() {
     resetGenerationTimings();
     prefill_text = "";
     generated_text = "";
+    partial_parser.reset();
+    stop_matcher = llama_rn_stop_matcher();
+    stop_pending = {};
     generated_text.reserve(parent_ctx->params.n_ctx);
     utf8_gate.reset();
     truncated = false;
@@ -63,6 +68,7 @@ void llama_rn_context_completion::rewind() {
         parent_ctx->tts_wrapper->audio_tokens.clear();
         parent_ctx->tts_wrapper->next_token_uses_guide_token = true;
         parent_ctx->tts_wrapper->guide_tokens.clear();
+        parent_ctx->tts_wrapper->stream.reset();
     }
 }
 
@@ -84,6 +90,54 @@ bool llama_rn_context_completion::initSampling() {
 // and keeps the full-clear behaviour.
 // ----------------------------------------------------------------------------
 
+const std::vector<uint8_t> &rn_state_checkpoint::raw(std::vector<uint8_t> &scratch) const {
+    if (!base) {
+        return data;
+    }
+    if (!llama_rn_state_delta::decode(base->data(), base->size(), data.data(), data.size(), raw_size, scratch)) {
+        scratch.clear();
+    }
+    return scratch;
+}
+
+void rn_state_checkpoint::compact(const std::vector<rn_state_checkpoint> &others) {
+    if (base || data.empty()) {
+        return;
+    }
+    std::shared_ptr<const std::vector<uint8_t>> current;
+    for (auto it = others.rbegin(); it != others.rend() && !current; ++it) {
+        current = it->base;
+    }
+    raw_size = data.size();
+    std::vector<uint8_t> enc;
+    if (current) {
+        llama_rn_state_delta::encode(current->data(), current->size(), data.data(), data.size(), enc);
+        // Past half the raw size a fresh base pays off over the next snapshots
+        if (enc.size() <= data.size() / 2) {
+            base = std::move(current);
+            data.swap(enc);
+            return;
+        }
+    }
+    auto own = std::make_shared<std::vector<uint8_t>>(std::move(data));
+    llama_rn_state_delta::encode(own->data(), own->size(), own->data(), own->size(), enc);
+    data.swap(enc);
+    base = std::move(own);
+}
+
+size_t rn_state_checkpoints_bytes(const std::vector<rn_state_checkpoint> &checkpoints) {
+    size_t n = 0;
+    std::vector<const std::vector<uint8_t> *> bases;
+    for (const auto &c : checkpoints) {
+        n += c.size_bytes();
+        if (c.base && std::find(bases.begin(), bases.end(), c.base.get()) == bases.end()) {
+            bases.push_back(c.base.get());
+            n += c.base->size();
+        }
+    }
+    return n;
+}
+
 void llama_rn_context_completion::probeStateCache() {
     if (state_cache_probed) {
         return;
@@ -114,17 +168,79 @@ void llama_rn_context_completion::probeStateCache() {
         llama_model_is_hybrid(model);
     if (state_cache_enabled) {
         LOG_INFO("prompt state cache enabled (recurrent/hybrid model)");
+        if (parent_ctx->state_cache_dir.empty() || parent_ctx->state_cache_disk_budget_bytes == 0) {
+            return;
+        }
+
+        // The model file by content (app container paths move between
+        // installs, and a fine-tune or requant can keep the name and size)
+        // and the cache layout. Read once here; adapters are added per key.
+        const std::string content_key = model_file_content_key(parent_ctx->params.model.path);
+        if (content_key.empty()) {
+            LOG_WARNING("prompt state disk cache disabled: cannot read model file %s",
+                        parent_ctx->params.model.path.c_str());
+            return;
+        }
+        char desc[256];
+        llama_model_desc(model, desc, sizeof(desc));
+        state_cache_model_id = content_key + "\n" + desc +
+            "\n" + std::to_string(llama_model_n_params(model)) +
+            "\n" + std::to_string(parent_ctx->params.cache_type_k) + "/" + std::to_string(parent_ctx->params.cache_type_v) +
+            "/" + std::to_string(parent_ctx->params.swa_full);
+        state_disk_cache.open(parent_ctx->state_cache_dir, parent_ctx->state_cache_disk_budget_bytes);
+    }
+}
+
+uint64_t llama_rn_context_completion::stateCacheModelKey() const {
+    // The model (see probeStateCache) and the adapters applied now
+    std::string key = state_cache_model_id;
+    for (const auto &la : parent_ctx->lora) {
+        key += "\n" + la.path + "@" + std::to_string(la.scale);
+    }
+    return llama_rn_state_disk_cache::hash_model_key(key);
+}
+
+void llama_rn_context_completion::spillStateCheckpoint(const rn_state_checkpoint &c, bool anchor) {
+    if (!state_disk_cache.enabled() || !c.spill || parent_ctx->ctx == nullptr) {
+        return;
+    }
+    // A pure recurrent model's partial state is all of its state
+    const llama_model *model = parent_ctx->model;
+    const bool partial_is_full = llama_model_is_recurrent(model) && !llama_model_is_hybrid(model);
+    const uint64_t model_key = stateCacheModelKey();
+    if (!anchor || partial_is_full) {
+        std::vector<uint8_t> scratch;
+        const auto &raw = c.raw(scratch);
+        if (!raw.empty()) {
+            state_disk_cache.put(model_key, c.tokens.data(), c.n_tokens(), raw.data(), raw.size(), partial_is_full);
+        }
+        return;
+    }
+
+    // The anchor (system prompt) also goes to disk whole, attention cells
+    // included, so it restores into an empty cache. Seq 0 holds exactly its
+    // tokens at capture time.
+    if (state_disk_cache.contains(model_key, c.tokens.data(), c.n_tokens(), /*full*/ true)) {
+        return;
+    }
+    const size_t size = llama_state_seq_get_size_ext(parent_ctx->ctx, /*seq_id*/ 0, LLAMA_STATE_SEQ_FLAGS_NONE);
+    std::vector<uint8_t> data;
+    try {
+        data.resize(size);
+    } catch (const std::bad_alloc &) {
+        return;
+    }
+    const size_t written = llama_state_seq_get_data_ext(
+        parent_ctx->ctx, data.data(), size, /*seq_id*/ 0, LLAMA_STATE_SEQ_FLAGS_NONE);
+    if (written > 0) {
+        state_disk_cache.put(model_key, c.tokens.data(), c.n_tokens(), data.data(), written, /*full*/ true);
     }
 }
 
 void llama_rn_context_completion::evictStateCheckpoints() {
     // Oldest first, but always keep the smallest-position snapshot: that is the
     // first message boundary (system-prompt end) a brand-new session shares.
-    auto total_bytes = [&]() {
-        size_t n = 0;
-        for (const auto &c : state_checkpoints) n += c.size_bytes();
-        return n;
-    };
+    auto total_bytes = [&]() { return rn_state_checkpoints_bytes(state_checkpoints); };
     auto smallest_pos = [&]() {
         size_t idx = 0;
         for (size_t i = 1; i < state_checkpoints.size(); i++) {
@@ -138,6 +254,7 @@ void llama_rn_context_completion::evictStateCheckpoints() {
         const size_t keep = smallest_pos();
         // Evict the oldest snapshot that is not the pinned stable-prefix one.
         size_t victim = (keep == 0 && state_checkpoints.size() > 1) ? 1 : 0;
+        spillStateCheckpoint(state_checkpoints[victim], /*anchor*/ false);
         state_checkpoints.erase(state_checkpoints.begin() + victim);
     }
 }
@@ -219,6 +336,8 @@ void llama_rn_context_completion::captureStateCheckpoint(
 
     rn_state_checkpoint ckpt;
     ckpt.tokens.assign(seq.begin(), seq.begin() + n);
+    ckpt.spill = !state_cache_shifted &&
+                 std::all_of(ckpt.tokens.begin(), ckpt.tokens.end(), [](llama_token t) { return t >= 0; });
     try {
         ckpt.data.resize(size);
     } catch (const std::bad_alloc &) {
@@ -241,14 +360,24 @@ void llama_rn_context_completion::captureStateCheckpoint(
     // Replace any snapshot at this boundary only after a successful capture
     // (a stale same-length one would shadow the current tokens).
     eraseStateCheckpointAt(n);
+    if (parent_ctx->state_cache_compact) {
+        ckpt.compact(state_checkpoints);
+    }
+    const bool anchor = std::all_of(state_checkpoints.begin(), state_checkpoints.end(),
+        [&](const rn_state_checkpoint &c) { return c.n_tokens() > n; });
+    if (anchor) {
+        spillStateCheckpoint(ckpt, /*anchor*/ true);
+    }
     state_checkpoints.push_back(std::move(ckpt));
     evictStateCheckpoints();
-    LOG_VERBOSE("captured state checkpoint: n_tokens=%zu, size=%.1f KiB, total=%zu",
-        n, written / 1024.0, state_checkpoints.size());
+    LOG_VERBOSE("captured state checkpoint: n_tokens=%zu, size=%.1f KiB, total=%zu (%.1f KiB)",
+        n, written / 1024.0, state_checkpoints.size(),
+        rn_state_checkpoints_bytes(state_checkpoints) / 1024.0);
 }
 
 int llama_rn_context_completion::findStateCheckpoint(
-        const std::vector<llama_token> &target, size_t max_len) const {
+        const std::vector<llama_token> &target, size_t max_len, size_t max_full_len,
+        std::unique_ptr<llama_rn_state_disk_cache::snapshot> *disk) {
     // Pick the longest snapshot whose tokens are a prefix of `target` and whose
     // length does not exceed `max_len` (the verified shared-prefix length).
     int best = -1;
@@ -267,6 +396,15 @@ int llama_rn_context_completion::findStateCheckpoint(
             best_len = n;
         }
     }
+
+    // The disk tier, for a longer one: partial snapshots within the same
+    // bound, full ones (which replace the whole sequence) up to max_full_len
+    if (disk != nullptr && state_disk_cache.enabled() && std::max(max_len, max_full_len) > best_len) {
+        *disk = state_disk_cache.find(stateCacheModelKey(), target, max_len, max_full_len);
+        if (*disk && (*disk)->n_tokens <= best_len) {
+            disk->reset();
+        }
+    }
     return best;
 }
 
@@ -281,11 +419,20 @@ bool llama_rn_context_completion::recoverStateCheckpoint(
     // and freeing it with a post-restore seq_rm(k-1) would roll back onto stale
     // rollback-ring state. A shorter snapshot leaves room by construction.
     const size_t search_max = total_tokens > 0 ? std::min(max_reuse, total_tokens - 1) : 0;
-    const int ckpt_idx = findStateCheckpoint(target, search_max);
-    if (ckpt_idx < 0 || !restoreStateCheckpoint((size_t) ckpt_idx)) {
-        return false;
+    std::unique_ptr<llama_rn_state_disk_cache::snapshot> disk;
+    const int ckpt_idx = findStateCheckpoint(target, search_max, total_tokens > 0 ? total_tokens - 1 : 0, &disk);
+    llama_pos k = 0;
+    if (disk) {
+        if (!restoreStateCheckpoint(*disk)) {
+            return false;
+        }
+        k = (llama_pos) disk->n_tokens;
+    } else {
+        if (ckpt_idx < 0 || !restoreStateCheckpoint((size_t) ckpt_idx)) {
+            return false;
+        }
+        k = (llama_pos) state_checkpoints[ckpt_idx].n_tokens();
     }
-    const llama_pos k = (llama_pos) state_checkpoints[ckpt_idx].n_tokens();
     // Recurrent part is back at k; truncating the live attention prefix to k
     // succeeds since nothing remains past k.
     llama_memory_seq_rm(kv, 0, k, -1);
@@ -298,8 +445,10 @@ bool llama_rn_context_completion::restoreStateCheckpoint(size_t index) {
         return false;
     }
     const auto &c = state_checkpoints[index];
-    const size_t read = llama_state_seq_set_data_ext(
-        parent_ctx->ctx, c.data.data(), c.data.size(), /*dest_seq_id*/ 0,
+    std::vector<uint8_t> scratch;
+    const auto &raw = c.raw(scratch);
+    const size_t read = raw.empty() ? 0 : llama_state_seq_set_data_ext(
+        parent_ctx->ctx, raw.data(), raw.size(), /*dest_seq_id*/ 0,
         LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
     if (read == 0) {
         LOG_WARNING("state checkpoint restore failed (n_tokens=%zu)", c.n_tokens());
@@ -308,6 +457,32 @@ bool llama_rn_context_completion::restoreStateCheckpoint(size_t index) {
     return true;
 }
 
+bool llama_rn_context_completion::restoreStateCheckpoint(const llama_rn_state_disk_cache::snapshot &snap) {
+    if (parent_ctx->ctx == nullptr) {
+        return false;
+    }
+    auto * kv = llama_get_memory(parent_ctx->ctx);
+    if (snap.full) {
+        llama_memory_seq_rm(kv, 0, -1, -1);
+    }
+    const size_t read = llama_state_seq_set_data_ext(
+        parent_ctx->ctx, snap.data, snap.size, /*dest_seq_id*/ 0,
+        snap.full ? LLAMA_STATE_SEQ_FLAGS_NONE : LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    if (read == 0) {
+        LOG_WARNING("disk state checkpoint restore failed (n_tokens=%zu)", snap.n_tokens);
+        if (snap.full) {
+            llama_memory_seq_rm(kv, 0, -1, -1);
+        }
+        return false;
+    }
+    if (snap.full) {
+        state_cache_shifted = false;
+    }
+    LOG_VERBOSE("restored %s state checkpoint from disk: n_tokens=%zu",
+        snap.full ? "full" : "partial", snap.n_tokens);
+    return true;
+}
+
 void llama_rn_context_completion::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
     const int n_left = parent_ctx->n_ctx - parent_ctx->params.n_keep;
     const int n_block_size = n_left / 2;
@@ -390,7 +565,10 @@ void llama_rn_context_completion::loadPrompt(const std::vector<std::string> &med
     if (!has_media) {
         std::vector<llama_token> text_tokens;
         // Text-only path - use modified tokenization for encoder-decoder models
-        text_tokens = ::common_tokenize(parent_ctx->ctx, parent_ctx->params.prompt, add_bos || is_enc_dec, true);
+        // Chat prompts usually extend the previous one; throwaway prompts stay out of the cache
+        text_tokens = allow_state_cache
+            ? parent_ctx->prompt_token_cache.tokenize(parent_ctx->ctx, parent_ctx->params.prompt, add_bos || is_enc_dec)
+            : ::common_tokenize(parent_ctx->ctx, parent_ctx->params.prompt, add_bos || is_enc_dec, true);
         num_prompt_tokens = text_tokens.size();
 
         // LOG tokens
@@ -401,6 +579,9 @@ void llama_rn_context_completion::loadPrompt(const std::vector<std::string> &med
         }
         LOG_INFO("%s\n", ss.str().c_str());
 
+        // params.n_keep is resolved below for prompt truncation; the context
+        // shift works from the value as requested, like the slot path
+        n_keep_request = parent_ctx->params.n_keep;
         if (parent_ctx->params.n_keep < 0) {
             parent_ctx->params.n_keep = (int)num_prompt_tokens;
         }
@@ -466,6 +647,25 @@ void llama_rn_context_completion::loadPrompt(const std::vector<std::string> &med
             }
         }
 
+        // TTS: a cached speaker's prefix restores from its snapshot when the
+        // live cache holds another speaker's prompt (or none)
+        if (cache_remove_success && !is_enc_dec && !mtp_draft_mem_shared && parent_ctx->isVocoderEnabled() &&
+            parent_ctx->tts_wrapper->speakers.load_prefix(parent_ctx->ctx, text_tokens, n_past)) {
+            LOG_INFO("speaker prefix ready: reusing %d/%zu prompt tokens", n_past, num_prompt_tokens);
+        }
+
+        // Cold start: a full snapshot on disk may hold the start of the prompt
+        // (the system prompt, from an earlier context or run)
+        const bool cold_ingest = n_past == 0;
+        if (cold_ingest) {
+            state_cache_shifted = false;
+            if (state_disk_cache.enabled() && state_cache_capture_allowed && !mtp_draft_mem_shared &&
+                recoverStateCheckpoint(text_tokens, /*max_reuse*/ 0, num_prompt_tokens, n_past)) {
+                LOG_INFO("restored state checkpoint from disk: reusing %d/%zu prompt tokens",
+                    n_past, num_prompt_tokens);
+            }
+        }
+
         // Frontier capture: the reused state already rests at n_past, so snapshot
         // it here — one readback, no decode split. tokens[0,n_past) is the verified
         // shared prefix, so it is token-exact. Restore point for a later
@@ -477,7 +677,6 @@ void llama_rn_context_completion::loadPrompt(const std::vector<std::string> &med
         // Cold ingest only lays boundary snapshots as it decodes (amortized once
         // per session; seeds the system-prefix anchor). Warm turns don't split —
         // the frontier capture above covers them, so the tail decodes in one batch.
-        const bool cold_ingest = n_past == 0;
         boundary_ckpts.clear();
         if (state_cache_enabled && state_cache_capture_allowed) {
             if (cold_ingest) {
@@ -595,6 +794,9 @@ void llama_rn_context_completion::beginCompletion(int chat_format, common_reason
     current_reasoning_format = reasoning_format;
     current_generation_prompt = generation_prompt;
     current_chat_parser = chat_parser;
+    partial_parser = std::make_unique<chat_output_parser>(chat_format, reasoning_format, generation_prompt, chat_parser);
+    stop_matcher = llama_rn_stop_matcher(parent_ctx->params.antiprompt);
+    stop_pending = {};
 }
 
 void llama_rn_context_completion::endCompletion() {
@@ -938,34 +1140,24 @@ completion_token_output llama_rn_context_completion::nextToken()
 
     if (embd.size() >= (size_t)parent_ctx->params.n_ctx)
     {
-        if (!parent_ctx->params.ctx_shift) {
-            // If context shifting is disabled, stop generation
+        // Shift context: keep the sink tokens, drop half of the rest
+        const int n_keep    = context_shift_n_keep(n_keep_request, num_prompt_tokens, parent_ctx->n_ctx);
+        const int n_discard = (n_past - n_keep) / 2;
+
+        if (!parent_ctx->params.ctx_shift ||
+            !shift_context(parent_ctx->ctx, 0, embd, n_past, n_keep, n_discard)) {
+            // Context shifting disabled or unsupported by this memory: stop generation
             LOG_WARNING("context full, n_ctx: %d, tokens: %d", parent_ctx->params.n_ctx, embd.size());
             has_next_token = false;
             context_full = true;
             return result;
         }
 
-        // Shift context
-
-        const int n_left    = n_past - parent_ctx->params.n_keep - 1;
-        const int n_discard = n_left/2;
-
-        auto * kv = llama_get_memory(parent_ctx->ctx);
-        llama_memory_seq_rm (kv, 0, parent_ctx->params.n_keep + 1            , parent_ctx->params.n_keep + n_discard + 1);
-        llama_memory_seq_add(kv, 0, parent_ctx->params.n_keep + 1 + n_discard, n_past, -n_discard);
-
-        for (size_t i = parent_ctx->params.n_keep + 1 + n_discard; i < embd.size(); i++)
-        {
-            embd[i - n_discard] = embd[i];
-        }
-        embd.resize(embd.size() - n_discard);
-
-        n_past -= n_discard;
         truncated = true;
 
         // A context shift remaps positions; old snapshots no longer line up.
         clearStateCheckpoints();
+        state_cache_shifted = true;
 
         LOG_VERBOSE("context shifted, new n_past: %d, new size: %d", n_past, embd.size());
     }
@@ -1107,36 +1299,24 @@ completion_token_output llama_rn_context_completion::nextToken()
     return result;
 }
 
-size_t llama_rn_context_completion::findStoppingStrings(const std::string &text, const size_t last_token_size,
-                            const stop_type type)
+size_t llama_rn_context_completion::findStoppingStrings(const size_t from, const stop_type type)
 {
-    size_t stop_pos = std::string::npos;
-    for (const std::string &word : parent_ctx->params.antiprompt)
+    if (type == STOP_PARTIAL)
     {
-        size_t pos;
-        if (type == STOP_FULL)
-        {
-            const size_t tmp = word.size() + last_token_size;
-            const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-            pos = text.find(word, from_pos);
-        }
-        else
-        {
-            pos = find_partial_stop_string(word, text);
-        }
-        if (pos != std::string::npos &&
-            (stop_pos == std::string::npos || pos < stop_pos))
-        {
-            if (type == STOP_FULL)
-            {
-                stopping_word = word;
-                stopped_word = true;
-                has_next_token = false;
-            }
-            stop_pos = pos;
-        }
+        const size_t pos = stop_matcher.partial_pos(from);
+        return pos == std::string::npos ? pos : pos - from;
     }
-    return stop_pos;
+
+    const llama_rn_stop_matcher::match match = stop_pending;
+    stop_pending = {};
+    if (!match.found() || match.pos < from)
+    {
+        return std::string::npos;
+    }
+    stopping_word = stop_matcher.word(match.word);
+    stopped_word = true;
+    has_next_token = false;
+    return match.pos - from;
 }
 
 completion_token_output llama_rn_context_completion::doCompletion()
@@ -1144,7 +1324,13 @@ completion_token_output llama_rn_context_completion::doCompletion()
     completion_token_output token_with_probs = nextToken();
 
     const std::string token_text = token_with_probs.tok == -1 ? "" : common_token_to_piece(parent_ctx->ctx, token_with_probs.tok);
-    generated_text += utf8_gate.feed(token_text);
+    const std::string text = utf8_gate.feed(token_text);
+    generated_text += text;
+    const llama_rn_stop_matcher::match match = stop_matcher.feed(text);
+    if (match.found() && (!stop_pending.found() || match.pos < stop_pending.pos))
+    {
+        stop_pending = match;
+    }
 
     if (parent_ctx->isVocoderEnabled()) {
         tts_type type = parent_ctx->tts_wrapper->getTTSType(parent_ctx);
@@ -1153,6 +1339,7 @@ completion_token_output llama_rn_context_completion::doCompletion()
         }
         if ((type == OUTETTS_V0_2 || type == OUTETTS_V0_3) && (token_with_probs.tok >= 151672 && token_with_probs.tok <= 155772)) {
             parent_ctx->tts_wrapper->audio_tokens.push_back(token_with_probs.tok);
+            parent_ctx->tts_wrapper->pushAudioToken(parent_ctx, token_with_probs.tok);
         }
     }
 
@@ -1189,29 +1376,80 @@ completion_token_output llama_rn_context_completion::doCompletion()
 }
 
 completion_chat_output llama_rn_context_completion::parseChatOutput(bool is_partial) {
+    if (is_partial && partial_parser) {
+        return partial_parser->parse(prefill_text + generated_text, true);
+    }
+    return parse_chat_output(prefill_text + generated_text, is_partial, current_chat_format,
+                             current_reasoning_format, current_generation_prompt, current_chat_parser);
+}
+
+completion_chat_output parse_chat_output(
+    const std::string& text,
+    bool is_partial,
+    int chat_format,
+    common_reasoning_format reasoning_format,
+    const std::string& generation_prompt,
+    const std::string& chat_parser
+) {
     common_chat_parser_params syntax;
-    syntax.format = static_cast<common_chat_format>(current_chat_format);
-    syntax.reasoning_format = current_reasoning_format;
-    syntax.generation_prompt = current_generation_prompt;
+    syntax.format = static_cast<common_chat_format>(chat_format);
+    syntax.reasoning_format = reasoning_format;
+    syntax.generation_prompt = generation_prompt;
     syntax.parse_tool_calls = true;
 
     // Load the PEG parser if available (required for COMMON_CHAT_FORMAT_PEG_* formats)
-    if (!current_chat_parser.empty()) {
-        syntax.parser.load(current_chat_parser);
+    if (!chat_parser.empty()) {
+        syntax.parser.load(chat_parser);
     }
 
-    common_chat_msg parsed_msg = common_chat_parse(prefill_text + generated_text, is_partial, syntax);
+    common_chat_msg parsed_msg = common_chat_parse(text, is_partial, syntax);
 
     completion_chat_output result;
 
     result.content = parsed_msg.content;
     result.reasoning_content = parsed_msg.reasoning_content;
-    result.accumulated_text = prefill_text + generated_text;
+    result.accumulated_text = text;
     result.tool_calls = parsed_msg.tool_calls;
 
     return result;
 }
 
+chat_output_parser::chat_output_parser(
+    int chat_format,
+    common_reasoning_format reasoning_format,
+    const std::string& generation_prompt,
+    const std::string& chat_parser
+) : chat_parser(chat_parser) {
+    syntax.format = static_cast<common_chat_format>(chat_format);
+    syntax.reasoning_format = reasoning_format;
+    syntax.generation_prompt = generation_prompt;
+    syntax.parse_tool_calls = true;
+}
+
+completion_chat_output chat_output_parser::parse(const std::string& text, bool is_partial) {
+    if (!session) {
+        if (!chat_parser.empty()) {
+            syntax.parser.load(chat_parser);
+        }
+        session = std::make_unique<common_chat_peg_parse_session>(syntax);
+    }
+    // Edited or replaced text (a stop word erased, then more tokens; another
+    // message) would corrupt the memoized parse
+    if (text.size() < session->size() || text.compare(0, session->size(), session->output()) != 0) {
+        session->reset();
+    }
+
+    const common_chat_msg& parsed_msg = session->append(text.substr(session->size()), is_partial);
+
+    completion_chat_output result;
+    result.content = parsed_msg.content;
+    result.reasoning_content = parsed_msg.reasoning_content;
+    result.accumulated_text = text;
+    result.tool_calls = parsed_msg.tool_calls;
+    result.diffs = session->diffs();
+    return result;
+}
+
 std::vector<float> llama_rn_context_completion::embedding(common_params &embd_params)
 {
     llama_memory_clear(llama_get_memory(parent_ctx->ctx), true);
@@ -1251,8 +1489,6 @@ std::vector<float> llama_rn_context_completion::embedding(common_params &embd_pa
 
 std::vector<float> llama_rn_context_completion::rerank(const std::string &query, const std::vector<std::string> &documents)
 {
-    std::vector<float> scores;
-
     // Check if this model supports reranking (requires rank pooling type)
     const enum llama_pooling_type pooling_type = llama_pooling_type(parent_ctx->ctx);
     if (pooling_type != LLAMA_POOLING_TYPE_RANK) {
@@ -1266,46 +1502,103 @@ std::vector<float> llama_rn_context_completion::rerank(const std::string &query,
     const llama_vocab * vocab = llama_model_get_vocab(parent_ctx->model);
     std::vector<llama_token> query_tokens = common_tokenize(vocab, query, false, true);
 
-    scores.reserve(documents.size());
-
-    for (size_t i = 0; i < documents.size(); ++i) {
-        rewind();
-        embd = {};
+    std::vector<std::vector<llama_token>> pairs;
+    pairs.reserve(documents.size());
+    for (const auto &document : documents) {
+        std::vector<llama_token> doc_tokens = common_tokenize(vocab, document, false, true);
+        pairs.push_back(format_rerank_tokens(vocab, query_tokens, doc_tokens));
+    }
 
-        const std::string & document = documents[i];
+    return runPooledBatch(std::move(pairs), 0).scores;
+}
 
-        std::vector<llama_token> doc_tokens = common_tokenize(vocab, document, false, true);
+std::vector<float> llama_rn_context_completion::embeddingBatch(const std::vector<std::string> &texts, int embd_normalize)
+{
+    const enum llama_pooling_type pooling_type = llama_pooling_type(parent_ctx->ctx);
+    if (pooling_type == LLAMA_POOLING_TYPE_NONE || pooling_type == LLAMA_POOLING_TYPE_RANK) {
+        throw std::runtime_error("batched embedding requires a pooled embedding model, pooling_type: " + std::to_string(pooling_type));
+    }
+    if (llama_model_has_encoder(parent_ctx->model)) {
+        throw std::runtime_error("batched embedding not supported for encoder models");
+    }
+    if (!parent_ctx->params.embedding) {
+        throw std::runtime_error("embedding disabled");
+    }
 
-        std::vector<llama_token> rerank_tokens = format_rerank_tokens(vocab, query_tokens, doc_tokens);
+    const bool add_bos = llama_vocab_get_add_bos(llama_model_get_vocab(parent_ctx->model));
+    std::vector<std::vector<llama_token>> inputs;
+    inputs.reserve(texts.size());
+    for (const auto &text : texts) {
+        inputs.push_back(common_tokenize(parent_ctx->ctx, text, add_bos, true));
+    }
 
-        llama_memory_clear(llama_get_memory(parent_ctx->ctx), false);
+    const int n_embd = llama_model_n_embd(parent_ctx->model);
+    std::vector<float> out = runPooledBatch(std::move(inputs), n_embd).embeddings;
+    for (size_t i = 0; i < texts.size(); i++) {
+        float *row = out.data() + i * n_embd;
+        const std::vector<float> pooled(row, row + n_embd);
+        common_embd_normalize(pooled.data(), row, n_embd, embd_normalize);
+    }
+    return out;
+}
 
-        // Process the rerank input
-        try {
-            parent_ctx->params.prompt = tokens_to_str(parent_ctx->ctx, rerank_tokens.begin(), rerank_tokens.end());
-            initSampling();
-            loadPrompt({}, /*allow_state_cache*/ false); // No media paths for rerank
-            beginCompletion();
-            doCompletion();
+llama_rn_rerank_batch llama_rn_context_completion::runPooledBatch(std::vector<std::vector<llama_token>> inputs, int32_t n_embd)
+{
+    // An empty input has nothing to pool and would come back as a silent
+    // -1e6 score or zero vector
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i].empty()) {
+            throw std::runtime_error("input " + std::to_string(i) + " is empty after tokenization");
+        }
+    }
 
-            // Get the rerank score (single embedding value for rank pooling)
-            float *data = llama_get_embeddings_seq(parent_ctx->ctx, 0);
-            if (data) {
-                scores.push_back(data[0]); // For rank pooling, the score is the first (and only) dimension
-            } else {
-                scores.push_back(-1e6f); // Default low score if computation failed
+    // Parallel slots decode on the same context from their own loop: wait
+    // until no step holds it, and keep it so none starts meanwhile
+    llama_rn_slot_manager *slot_manager = parent_ctx->slot_manager;
+    struct decode_lock {
+        llama_rn_slot_manager *mgr;
+        explicit decode_lock(llama_rn_slot_manager *mgr) : mgr(mgr) {
+            if (mgr != nullptr) {
+                mgr->lock_decode();
             }
-        } catch (const std::exception &e) {
-            LOG_WARNING("rerank computation failed for document %zu: %s", i, e.what());
-            scores.push_back(-1e6f);
         }
-        endCompletion();
-
-        // Clear KV cache again to prepare for next document or restore original state
-        llama_memory_clear(llama_get_memory(parent_ctx->ctx), false);
+        ~decode_lock() {
+            if (mgr != nullptr) {
+                mgr->unlock_decode();
+            }
+        }
+    } lock(slot_manager);
+
+    // Decode the inputs side by side in the sequences next to the
+    // completion's own (seq 0), which keeps its cached prompt; with parallel
+    // slots, only in those of idle slots
+    std::vector<llama_seq_id> lanes;
+    if (slot_manager != nullptr) {
+        lanes = slot_manager->borrow_idle_sequences();
+    } else {
+        const int32_t n_seq_max = (int32_t) llama_n_seq_max(parent_ctx->ctx);
+        for (llama_seq_id seq_id = 1; seq_id < n_seq_max; seq_id++) {
+            lanes.push_back(seq_id);
+        }
+    }
+    if (lanes.empty()) {
+        if (slot_manager != nullptr) {
+            std::lock_guard<std::mutex> slots_lock(slot_manager->slots_mutex);
+            auto &slot = slot_manager->slots[0];
+            if (slot.state != SLOT_STATE_IDLE || slot.lent_to >= 0) {
+                throw std::runtime_error("no idle sequence: every parallel slot is in use");
+            }
+            slot_manager->drop_cache(slot);
+            slot.n_past = 0;
+        }
+        rewind();
+        embd = {};
+        lanes.push_back(0);
     }
 
-    return scores;
+    llama_rn_rerank_batch engine(parent_ctx->ctx, lanes, std::move(inputs), n_embd);
+    engine.run(parent_ctx->params.n_batch);
+    return engine;
 }
 
 std::string llama_rn_context_completion::bench(int pp, int tg, int pl, int nr) {
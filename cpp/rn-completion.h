@@ -7,7 +7,10 @@
 #include "sampling.h"
 #include "nlohmann/json.hpp"
 #include "chat.h"
+#include "chat-peg-parser.h"
 #include "speculative.h"
+#include "rn-stop-matcher.h"
+#include "rn-rerank.h"
 #include <deque>
 
 using json = nlohmann::ordered_json;
@@ -27,15 +30,32 @@ struct llama_rn_context;
 struct rn_state_checkpoint {
     // Exact token sequence the snapshot represents (memory positions [0, n)).
     std::vector<llama_token> tokens;
-    // PARTIAL_ONLY per-sequence state blob for seq_id 0.
+    // PARTIAL_ONLY per-sequence state blob for seq_id 0, or with `base` set,
+    // its llama_rn_state_delta against that blob.
     std::vector<uint8_t> data;
+    // Compact encoding (state_cache_compact): the base snapshot, shared by
+    // the checkpoints encoded against it, and the decoded size.
+    std::shared_ptr<const std::vector<uint8_t>> base;
+    size_t raw_size = 0;
+    // The state follows from the tokens alone (no media, no context shift),
+    // so it may go to the disk tier.
+    bool spill = true;
 
     size_t n_tokens() const { return tokens.size(); }
+    // Encoded size; bases are counted by rn_state_checkpoints_bytes.
     size_t size_bytes() const {
         return data.size() + tokens.size() * sizeof(llama_token);
     }
+    // The state blob: `data`, or decoded into scratch. Empty if it won't decode.
+    const std::vector<uint8_t> &raw(std::vector<uint8_t> &scratch) const;
+    // Encode `data` against the newest base among `others`. A snapshot that
+    // encodes poorly against it (or the first one) becomes a base itself.
+    void compact(const std::vector<rn_state_checkpoint> &others);
 };
 
+// Bytes held by a set of checkpoints, each shared base counted once
+size_t rn_state_checkpoints_bytes(const std::vector<rn_state_checkpoint> &checkpoints);
+
 // Types defined in rn-llama.h (needed here for compilation)
 enum stop_type
 {
@@ -63,6 +83,37 @@ struct completion_chat_output
   std::string reasoning_content;
   std::vector<common_chat_tool_call> tool_calls;
   std::string accumulated_text;
+  std::vector<common_chat_msg_diff> diffs;  // Changes since the previous streaming parse
+};
+
+// Parse accumulated output text with a request's chat syntax
+completion_chat_output parse_chat_output(
+    const std::string& text,
+    bool is_partial,
+    int chat_format,
+    common_reasoning_format reasoning_format,
+    const std::string& generation_prompt,
+    const std::string& chat_parser
+);
+
+// Streaming chat output parser for one request: the parser is loaded on first
+// use and the parse resumes from the previous call (see
+// common_chat_peg_parse_session for what still scales with the output)
+struct chat_output_parser {
+    chat_output_parser(
+        int chat_format,
+        common_reasoning_format reasoning_format,
+        const std::string& generation_prompt,
+        const std::string& chat_parser
+    );
+
+    // `text` is the output so far; if it doesn't extend the previous one the parse starts over
+    completion_chat_output parse(const std::string& text, bool is_partial);
+
+private:
+    common_chat_parser_params syntax;
+    std::string chat_parser;
+    std::unique_ptr<common_chat_peg_parse_session> session;
 };
 
 // Completion context class
@@ -81,6 +132,7 @@ struct llama_rn_context_completion {
     size_t num_draft_tokens = 0;
     size_t num_draft_tokens_accepted = 0;
     size_t num_prompt_tokens = 0;
+    int32_t n_keep_request = 0;            // params.n_keep as the request set it (see context_shift_n_keep)
     size_t num_tokens_predicted = 0;
     int64_t t_start_generation = 0;
     double t_token_generation = 0.0;
@@ -113,6 +165,14 @@ struct llama_rn_context_completion {
     // Message-boundary snapshot positions for the current prompt, ascending
     // (see computeMessageBoundaries). Computed per loadPrompt.
     std::vector<llama_pos> boundary_ckpts;
+    // Disk tier: evicted snapshots, and a full-state copy of the first one
+    // (the system prompt) that restores after a context reload. Off unless
+    // the host sets a directory.
+    llama_rn_state_disk_cache state_disk_cache;
+    std::string state_cache_model_id;     // Model content and cache layout part of its keys
+    // Seq 0 went through a context shift since it was last empty; snapshots
+    // taken now don't follow from their tokens alone.
+    bool state_cache_shifted = false;
     bool incomplete = false;
     bool context_full = false;
     bool truncated = false;
@@ -120,11 +180,14 @@ struct llama_rn_context_completion {
     bool stopped_word = false;
     bool stopped_limit = false;
     std::string stopping_word;
+    llama_rn_stop_matcher stop_matcher;       // Over generated_text, built in beginCompletion
+    llama_rn_stop_matcher::match stop_pending; // Earliest full match not yet taken by findStoppingStrings
     // Current completion parameters for chat parsing
     int current_chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
     common_reasoning_format current_reasoning_format = COMMON_REASONING_FORMAT_NONE;
     std::string current_generation_prompt;
     std::string current_chat_parser;  // Serialized PEG parser for chat output parsing
+    std::unique_ptr<chat_output_parser> partial_parser;  // Streaming parse of the current completion
 
     // Sampling context
     common_sampler *ctx_sampling = nullptr;
@@ -162,13 +225,20 @@ struct llama_rn_context_completion {
     void captureStateCheckpoint();                // snapshot memory at current n_past (embd)
     // Snapshot at position n, tagged with seq[0, n) (MTP path uses spec_prompt).
     void captureStateCheckpoint(const std::vector<llama_token> &seq, size_t n);
-    int  findStateCheckpoint(const std::vector<llama_token> &target, size_t max_len) const;
+    // Index of the longest in-memory snapshot prefixing `target` (-1 if none).
+    // With `disk`, also searches the disk tier (full snapshots up to
+    // max_full_len) and sets *disk to a longer one found there.
+    int  findStateCheckpoint(const std::vector<llama_token> &target, size_t max_len, size_t max_full_len = 0,
+                             std::unique_ptr<llama_rn_state_disk_cache::snapshot> *disk = nullptr);
     bool restoreStateCheckpoint(size_t index);    // restore snapshot into seq 0
+    bool restoreStateCheckpoint(const llama_rn_state_disk_cache::snapshot &snap);
     // Restore the longest snapshot prefixing `target` (length <= max_reuse,
     // < total_tokens) and truncate the live prefix to it. Sets n_past_out.
     bool recoverStateCheckpoint(const std::vector<llama_token> &target, size_t max_reuse,
                                 size_t total_tokens, llama_pos &n_past_out);
     void evictStateCheckpoints();                 // enforce count / byte bounds
+    uint64_t stateCacheModelKey() const;          // what disk snapshots must match besides tokens
+    void spillStateCheckpoint(const rn_state_checkpoint &c, bool anchor);
     void clearStateCheckpoints();                 // drop all snapshots
     void eraseStateCheckpointAt(size_t n_tokens); // drop the snapshot at a boundary
     // Drop snapshots whose state includes tokens after this position. A
@@ -195,13 +265,22 @@ struct llama_rn_context_completion {
     void evalMTPPrompt();
     bool refillMTPTokens();
     completion_token_output nextTokenMTP();
-    size_t findStoppingStrings(const std::string &text, const size_t last_token_size, const stop_type type);
+    // Stop word in generated_text starting at or after `from`: a full match
+    // (which stops the completion) or the longest prefix at the end of the
+    // text. Returns its position relative to `from`, or npos.
+    size_t findStoppingStrings(const size_t from, const stop_type type);
     completion_token_output doCompletion();
     completion_chat_output parseChatOutput(bool is_partial);
 
     // Embedding methods
     std::vector<float> embedding(common_params &embd_params);
     std::vector<float> rerank(const std::string &query, const std::vector<std::string> &documents);
+    // Embeds all texts in shared batches, in the sequences beside the
+    // completion's, leaving its cache alone. Returns [texts x n_embd].
+    std::vector<float> embeddingBatch(const std::vector<std::string> &texts, int embd_normalize);
+    // With parallel slots, waits out their step in flight and decodes in idle
+    // slots' sequences only. Throws on an empty input.
+    llama_rn_rerank_batch runPooledBatch(std::vector<std::vector<llama_token>> inputs, int32_t n_embd);
 
     // Benchmarking methods
     std::string bench(int pp, int tg, int pl, int nr);
@@ -0,0 +1,215 @@
+#include "rn-delivery.h"
+#include "rn-slot.h"
+#include "rn-common.hpp"
+#include <algorithm>
+#include <chrono>
+
+namespace rnllama {
+
+void llama_rn_event_stream::push(llama_rn_delivery_event&& event) {
+    flush();
+    if (!overflow.empty() || !ring.push(std::move(event))) {
+        overflow.push_back(std::move(event));
+        n_overflow.store(overflow.size());
+    }
+}
+
+void llama_rn_event_stream::flush() {
+    while (!overflow.empty() && ring.push(std::move(overflow.front()))) {
+        overflow.pop_front();
+    }
+    n_overflow.store(overflow.size());
+}
+
+void llama_rn_token_framer::push(const completion_token_output& token) {
+    if (frame.tokens.empty()) {
+        t_first_us = lm_ggml_time_us();
+        frame.request_id = token.request_id;
+    }
+    frame.text += token.text;
+    frame.tokens.push_back(token);
+    if (max_tokens > 0 && frame.tokens.size() >= (size_t) max_tokens) {
+        flush();
+    } else {
+        poll();
+    }
+}
+
+void llama_rn_token_framer::poll() {
+    if (!frame.tokens.empty() && interval_ms > 0 &&
+        lm_ggml_time_us() - t_first_us >= (int64_t) interval_ms * 1000) {
+        flush();
+    }
+}
+
+int64_t llama_rn_token_framer::deadline_us() const {
+    if (frame.tokens.empty() || interval_ms <= 0) {
+        return -1;
+    }
+    return t_first_us + (int64_t) interval_ms * 1000;
+}
+
+void llama_rn_token_framer::flush() {
+    if (frame.tokens.empty()) {
+        return;
+    }
+    if (on_frame) {
+        on_frame(frame);
+    }
+    frame.text.clear();
+    frame.tokens.clear();
+}
+
+llama_rn_delivery::~llama_rn_delivery() {
+    stop();
+}
+
+std::shared_ptr<llama_rn_event_stream> llama_rn_delivery::open(int32_t request_id) {
+    auto stream = std::make_shared<llama_rn_event_stream>();
+    stream->request_id = request_id;
+
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    streams.push_back(stream);
+    return stream;
+}
+
+void llama_rn_delivery::flush() {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    for (auto& stream : streams) {
+        stream->flush();
+    }
+}
+
+void llama_rn_delivery::notify() {
+    {
+        // Under the lock, so the flag can't land between the delivery
+        // thread's predicate check and its wait
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        pending.store(true);
+    }
+    wake_cv.notify_one();
+}
+
+size_t llama_rn_delivery::deliver() {
+    std::lock_guard<std::mutex> deliver_lock(deliver_mutex);
+
+    std::vector<std::shared_ptr<llama_rn_event_stream>> current;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        current = streams;
+    }
+
+    // Round-robin in small bursts so one slow consumer doesn't hold back
+    // the other streams behind a full ring
+    static const size_t max_burst = 16;
+
+    size_t n_delivered = 0;
+    llama_rn_delivery_event event;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (auto& stream : current) {
+            for (size_t i = 0; i < max_burst && stream->ring.pop(event); i++) {
+                switch (event.type) {
+                    case llama_rn_delivery_event::EVENT_TOKEN:
+                        if (stream->framer) {
+                            stream->framer->push(event.token);
+                        } else if (stream->on_token) {
+                            stream->on_token(event.token);
+                        }
+                        break;
+                    case llama_rn_delivery_event::EVENT_COMPLETE:
+                        if (stream->framer) {
+                            stream->framer->flush();
+                        }
+                        if (stream->on_complete) {
+                            stream->on_complete(event.result.get());
+                        }
+                        break;
+                    case llama_rn_delivery_event::EVENT_VALUES:
+                        if (stream->on_values) {
+                            stream->on_values(event.request_id, event.values);
+                        }
+                        break;
+                }
+                event = llama_rn_delivery_event();
+                n_delivered++;
+                progress = true;
+            }
+        }
+    }
+    // Frames still open go out on time even while their slot waits: the
+    // delivery thread sleeps until the earliest deadline left
+    int64_t next_deadline = -1;
+    for (auto& stream : current) {
+        if (stream->framer) {
+            stream->framer->poll();
+            const int64_t deadline = stream->framer->deadline_us();
+            if (deadline >= 0 && (next_deadline < 0 || deadline < next_deadline)) {
+                next_deadline = deadline;
+            }
+        }
+    }
+    next_frame_us.store(next_deadline);
+    current.clear();
+
+    // A stream is done once its slot let go of it and nothing is left to deliver
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        streams.erase(std::remove_if(streams.begin(), streams.end(),
+            [](const std::shared_ptr<llama_rn_event_stream>& stream) {
+                return stream.use_count() == 1 && stream->ring.size() == 0 && stream->n_overflow.load() == 0 &&
+                       (!stream->framer || stream->framer->empty());
+            }), streams.end());
+    }
+
+    return n_delivered;
+}
+
+void llama_rn_delivery::start() {
+    if (active.exchange(true)) {
+        return;
+    }
+
+    thread = std::thread([this]() {
+        LOG_INFO("Delivery thread started");
+        while (active.load()) {
+            {
+                // Until notified, or until an open frame is due
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                const auto ready = [this]() { return pending.load() || !active.load(); };
+                const int64_t deadline = next_frame_us.load();
+                if (deadline < 0) {
+                    wake_cv.wait(lock, ready);
+                } else {
+                    const int64_t wait_us = deadline - lm_ggml_time_us();
+                    if (wait_us > 0) {
+                        wake_cv.wait_for(lock, std::chrono::microseconds(wait_us), ready);
+                    }
+                }
+                pending.store(false);
+            }
+            if (deliver() > 0 && on_drain) {
+                on_drain();
+            }
+        }
+        LOG_INFO("Delivery thread stopped");
+    });
+}
+
+void llama_rn_delivery::stop() {
+    bool was_active;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        was_active = active.exchange(false);
+    }
+    if (was_active) {
+        wake_cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    deliver();
+}
+
+} // namespace rnllama
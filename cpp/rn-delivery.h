@@ -0,0 +1,160 @@
+#ifndef RN_DELIVERY_H
+#define RN_DELIVERY_H
+
+#include "rn-completion.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rnllama {
+
+struct llama_rn_slot;
+
+// Lock-free single-producer/single-consumer ring of fixed capacity (a power
+// of two). Head and tail only ever grow; their difference is the fill level.
+template <typename T, size_t N>
+class llama_rn_spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "ring capacity must be a power of two");
+
+public:
+    llama_rn_spsc_ring() : items(new T[N]) {}
+
+    bool push(T&& item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[h & (N - 1)] = std::move(item);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(items[t & (N - 1)]);
+        items[t & (N - 1)] = T(); // Don't keep payloads alive in the ring
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() { return N; }
+
+private:
+    std::unique_ptr<T[]> items;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+struct llama_rn_delivery_event {
+    enum event_type {
+        EVENT_TOKEN,
+        EVENT_COMPLETE,
+        EVENT_VALUES,                       // Embedding or rerank result
+    };
+
+    event_type type = EVENT_TOKEN;
+    int32_t request_id = -1;
+    completion_token_output token;
+    std::shared_ptr<llama_rn_slot> result;  // Detached copy of the finished slot
+    std::vector<float> values;
+};
+
+// Consecutive tokens of one request, delivered in one call
+struct llama_rn_token_frame {
+    int32_t request_id = -1;
+    std::string text;                      // The tokens' text, concatenated
+    std::vector<completion_token_output> tokens;
+};
+
+// Groups a token stream into frames for consumers that pay per call (a hop
+// to the JS thread per token). A frame goes out once max_tokens are pending
+// or its first token has waited interval_ms. Used from one thread.
+struct llama_rn_token_framer {
+    int32_t interval_ms = 16;              // 0 = by count only
+    int32_t max_tokens = 0;                // 0 = by time only
+    std::function<void(llama_rn_token_frame&)> on_frame;
+
+    void push(const completion_token_output& token);
+    void poll();                           // Send the frame if it has waited long enough
+    void flush();
+    bool empty() const { return frame.tokens.empty(); }
+    int64_t deadline_us() const;           // When poll() sends the open frame; -1 if it never will
+
+private:
+    llama_rn_token_frame frame;
+    int64_t t_first_us = 0;
+};
+
+// Callback events of one request. The decode loop produces them under
+// slots_mutex; the delivery side runs the consumer callbacks, so parsing and
+// JS marshaling never hold up the next step.
+struct llama_rn_event_stream {
+    static constexpr size_t ring_size = 256;
+
+    int32_t request_id = -1;
+    std::function<void(const completion_token_output&)> on_token;
+    std::function<void(llama_rn_slot*)> on_complete;
+    std::function<void(int32_t, const std::vector<float>&)> on_values;
+    // Set for framed streaming: tokens go to it instead of on_token
+    std::unique_ptr<llama_rn_token_framer> framer;
+
+    llama_rn_spsc_ring<llama_rn_delivery_event, ring_size> ring;
+    std::deque<llama_rn_delivery_event> overflow; // Producer side only
+    std::atomic<size_t> n_overflow{0};            // Overflow size, readable by the consumer
+
+    void push(llama_rn_delivery_event&& event);
+    void flush();                          // Move overflowed events into the ring
+
+    // Backpressure: a stream whose consumer falls behind stops being decoded
+    bool congested() const { return n_overflow.load() > 0 || ring.size() >= ring_size / 2; }
+};
+
+struct llama_rn_delivery {
+    ~llama_rn_delivery();
+
+    // Producer side (under slots_mutex)
+    std::shared_ptr<llama_rn_event_stream> open(int32_t request_id);
+    void flush();                          // Retry overflowed events of all streams
+    void notify();                         // Wake the delivery thread
+
+    // Consumer side: run callbacks for everything queued; returns the event count
+    size_t deliver();
+
+    void start();
+    void stop();                           // Join the thread, then deliver what is left
+    bool running() const { return active.load(); }
+
+    // Called on the delivery thread after it drained events, so a producer
+    // held back by congested streams can resume
+    std::function<void()> on_drain;
+
+private:
+    std::mutex streams_mutex;
+    std::vector<std::shared_ptr<llama_rn_event_stream>> streams;
+
+    std::mutex deliver_mutex;              // One consumer at a time
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    std::atomic<bool> pending{false};      // Set under wake_mutex
+    std::atomic<bool> active{false};
+    std::atomic<int64_t> next_frame_us{-1}; // Earliest open frame deadline, -1 = none
+    std::thread thread;
+};
+
+} // namespace rnllama
+
+#endif /* RN_DELIVERY_H */
@@ -0,0 +1,440 @@
+#include "rn-istft.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(LM_GGML_USE_ACCELERATE)
+#include <Accelerate/Accelerate.h>
+#endif
+
+#ifdef _WIN32
+  #define M_PI 3.14159265358979323846
+#endif
+
+namespace rnllama {
+
+llama_rn_worker_pool::llama_rn_worker_pool(int n_threads) {
+    for (int i = 1; i < n_threads; i++) {
+        workers.emplace_back([this]() { work(); });
+    }
+}
+
+llama_rn_worker_pool::~llama_rn_worker_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_start.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void llama_rn_worker_pool::run(int n, const std::function<void(int)> &fn) {
+    if (workers.empty() || n <= 1) {
+        for (int i = 0; i < n; i++) fn(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        n_items = n;
+        next_item = 0;
+        n_busy = (int) workers.size();
+        generation++;
+    }
+    cv_start.notify_all();
+
+    for (int i = next_item++; i < n; i = next_item++) {
+        fn(i);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [this]() { return n_busy == 0; });
+    job = nullptr;
+}
+
+void llama_rn_worker_pool::work() {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(int)> *fn;
+        int n;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_start.wait(lock, [&]() { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            fn = job;
+            n = n_items;
+        }
+
+        for (int i = next_item++; i < n; i = next_item++) {
+            (*fn)(i);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--n_busy == 0) {
+            cv_done.notify_one();
+        }
+    }
+}
+
+// Mixed-radix FFT after KISS FFT (decimation in time, recursive over the
+// factorization, radix 4 first)
+
+llama_rn_fft::llama_rn_fft(int n) : n(n), twiddles(n) {
+    for (int i = 0; i < n; i++) {
+        const double phase = 2.0 * M_PI * i / n;
+        twiddles[i] = cpx((float) std::cos(phase), (float) std::sin(phase));
+    }
+
+    int remaining = n;
+    int p = 4;
+    const double floor_sqrt = std::floor(std::sqrt((double) n));
+    do {
+        while (remaining % p) {
+            switch (p) {
+                case 4: p = 2; break;
+                case 2: p = 3; break;
+                default: p += 2; break;
+            }
+            if (p > floor_sqrt) p = remaining;
+        }
+        remaining /= p;
+        factors.push_back(p);
+        factors.push_back(remaining);
+    } while (remaining > 1);
+}
+
+void llama_rn_fft::inverse(const cpx *in, cpx *out) const {
+    work(out, in, 1, factors.data());
+}
+
+void llama_rn_fft::work(cpx *out, const cpx *in, size_t stride, const int *f) const {
+    cpx *out_beg = out;
+    const int p = *f++;
+    const int m = *f++;
+    const cpx *out_end = out + p * m;
+
+    if (m == 1) {
+        do {
+            *out = *in;
+            in += stride;
+        } while (++out != out_end);
+    } else {
+        do {
+            work(out, in, stride * p, f);
+            in += stride;
+        } while ((out += m) != out_end);
+    }
+
+    out = out_beg;
+    switch (p) {
+        case 2: bfly2(out, stride, m); break;
+        case 3: bfly3(out, stride, m); break;
+        case 4: bfly4(out, stride, m); break;
+        case 5: bfly5(out, stride, m); break;
+        default: bfly_generic(out, stride, m, p); break;
+    }
+}
+
+void llama_rn_fft::bfly2(cpx *out, size_t stride, int m) const {
+    cpx *out2 = out + m;
+    const cpx *tw = twiddles.data();
+    for (int k = 0; k < m; k++) {
+        const cpx t = out2[k] * *tw;
+        tw += stride;
+        out2[k] = out[k] - t;
+        out[k] += t;
+    }
+}
+
+void llama_rn_fft::bfly3(cpx *out, size_t stride, int m) const {
+    const int m2 = 2 * m;
+    const float epi3 = twiddles[stride * m].imag();
+    const cpx *tw1 = twiddles.data();
+    const cpx *tw2 = twiddles.data();
+    for (int k = 0; k < m; k++, out++) {
+        const cpx s1 = out[m] * *tw1;
+        const cpx s2 = out[m2] * *tw2;
+        const cpx s3 = s1 + s2;
+        const cpx s0 = (s1 - s2) * epi3;
+        tw1 += stride;
+        tw2 += stride * 2;
+
+        const cpx half = out[0] - s3 * 0.5f;
+        out[0] += s3;
+        out[m2] = cpx(half.real() + s0.imag(), half.imag() - s0.real());
+        out[m]  = cpx(half.real() - s0.imag(), half.imag() + s0.real());
+    }
+}
+
+void llama_rn_fft::bfly4(cpx *out, size_t stride, int m) const {
+    const int m2 = 2 * m;
+    const int m3 = 3 * m;
+    const cpx *tw1 = twiddles.data();
+    const cpx *tw2 = twiddles.data();
+    const cpx *tw3 = twiddles.data();
+    for (int k = 0; k < m; k++, out++) {
+        const cpx s0 = out[m] * *tw1;
+        const cpx s1 = out[m2] * *tw2;
+        const cpx s2 = out[m3] * *tw3;
+        const cpx s5 = out[0] - s1;
+        const cpx s3 = s0 + s2;
+        const cpx s4 = s0 - s2;
+        tw1 += stride;
+        tw2 += stride * 2;
+        tw3 += stride * 3;
+
+        out[0] += s1;
+        out[m2] = out[0] - s3;
+        out[0] += s3;
+        // Inverse direction: multiply s4 by +i
+        out[m]  = cpx(s5.real() - s4.imag(), s5.imag() + s4.real());
+        out[m3] = cpx(s5.real() + s4.imag(), s5.imag() - s4.real());
+    }
+}
+
+void llama_rn_fft::bfly5(cpx *out, size_t stride, int m) const {
+    const cpx ya = twiddles[stride * m];
+    const cpx yb = twiddles[stride * 2 * m];
+    cpx *out0 = out;
+    cpx *out1 = out + m;
+    cpx *out2 = out + 2 * m;
+    cpx *out3 = out + 3 * m;
+    cpx *out4 = out + 4 * m;
+    const cpx *tw = twiddles.data();
+    for (int u = 0; u < m; u++) {
+        const cpx s0 = out0[u];
+        const cpx s1 = out1[u] * tw[u * stride];
+        const cpx s2 = out2[u] * tw[2 * u * stride];
+        const cpx s3 = out3[u] * tw[3 * u * stride];
+        const cpx s4 = out4[u] * tw[4 * u * stride];
+
+        const cpx s7 = s1 + s4;
+        const cpx s10 = s1 - s4;
+        const cpx s8 = s2 + s3;
+        const cpx s9 = s2 - s3;
+
+        out0[u] = s0 + s7 + s8;
+
+        const cpx s5(s0.real() + s7.real() * ya.real() + s8.real() * yb.real(),
+                     s0.imag() + s7.imag() * ya.real() + s8.imag() * yb.real());
+        const cpx s6( s10.imag() * ya.imag() + s9.imag() * yb.imag(),
+                     -s10.real() * ya.imag() - s9.real() * yb.imag());
+        out1[u] = s5 - s6;
+        out4[u] = s5 + s6;
+
+        const cpx s11(s0.real() + s7.real() * yb.real() + s8.real() * ya.real(),
+                      s0.imag() + s7.imag() * yb.real() + s8.imag() * ya.real());
+        const cpx s12(-s10.imag() * yb.imag() + s9.imag() * ya.imag(),
+                       s10.real() * yb.imag() - s9.real() * ya.imag());
+        out2[u] = s11 + s12;
+        out3[u] = s11 - s12;
+    }
+}
+
+void llama_rn_fft::bfly_generic(cpx *out, size_t stride, int m, int p) const {
+    std::vector<cpx> scratch(p);
+    for (int u = 0; u < m; u++) {
+        for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+            scratch[q1] = out[k];
+        }
+        for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+            size_t twidx = 0;
+            out[k] = scratch[0];
+            for (int q = 1; q < p; q++) {
+                twidx += stride * k;
+                if (twidx >= (size_t) n) twidx -= n;
+                out[k] += scratch[q] * twiddles[twidx];
+            }
+        }
+    }
+}
+
+llama_rn_istft::llama_rn_istft(int n_fft, int n_hop, int n_threads) :
+    n_fft(n_fft),
+    n_hop(n_hop),
+    fft(n_fft / 2),
+    super_twiddles(n_fft / 4),
+    window(n_fft),
+    window_sq(n_fft),
+    pool(std::max(1, n_threads)) {
+    const int n_half = n_fft / 2;
+    for (int i = 0; i < n_half / 2; i++) {
+        const double phase = M_PI * ((double) (i + 1) / n_half + 0.5);
+        super_twiddles[i] = llama_rn_fft::cpx((float) std::cos(phase), (float) std::sin(phase));
+    }
+    // Periodic Hann
+    for (int i = 0; i < n_fft; i++) {
+        window[i] = 0.5f * (1.0f - cosf((2.0 * M_PI * i) / n_fft));
+        window_sq[i] = window[i] * window[i];
+    }
+}
+
+// The vocoder was trained against a transform that sums the n/2 + 1 bins
+// without their conjugate mirror and scales by 1 / (n/2 + 1). In terms of a
+// real inverse FFT y (DC and Nyquist once, other bins twice):
+//   out[k] = (y[k] + Re X[0] + (-1)^k Re X[n/2]) / (2 (n/2 + 1))
+void llama_rn_istft::irfft(const llama_rn_fft::cpx *spec, float *out, llama_rn_fft::cpx *scratch) const {
+    using cpx = llama_rn_fft::cpx;
+    const int n_half = n_fft / 2;
+    const float dc = spec[0].real();
+    const float nyquist = spec[n_half].real();
+
+    // Pack the half spectrum into an n/2-point complex inverse FFT whose
+    // output interleaves the even and odd samples
+    cpx *packed = scratch;
+    cpx *result = scratch + n_half;
+    packed[0] = cpx(dc + nyquist, dc - nyquist);
+    for (int k = 1; k <= n_half / 2; k++) {
+        const cpx fk = spec[k];
+        const cpx fnkc = std::conj(spec[n_half - k]);
+        const cpx fek = fk + fnkc;
+        const cpx fok = (fk - fnkc) * super_twiddles[k - 1];
+        packed[k] = fek + fok;
+        packed[n_half - k] = std::conj(fek - fok);
+    }
+    fft.inverse(packed, result);
+
+    const float scale = 0.5f / (n_half + 1);
+    const float *y = reinterpret_cast<const float *>(result);
+    for (int k = 0; k < n_fft; k += 2) {
+        out[k]     = (y[k]     + dc + nyquist) * scale;
+        out[k + 1] = (y[k + 1] + dc - nyquist) * scale;
+    }
+}
+
+void llama_rn_istft::synthesize(const float *embd, int n_frames, int n_embd, float *frames) {
+    using cpx = llama_rn_fft::cpx;
+    const int n_bins = n_embd / 2;
+    const int n_chunks = std::min(n_frames, pool.size() * 4);
+    pool.run(n_chunks, [&](int chunk) {
+        std::vector<float> mag(n_bins);
+#if defined(LM_GGML_USE_ACCELERATE)
+        std::vector<float> sin_phi(n_bins);
+        std::vector<float> cos_phi(n_bins);
+#endif
+        std::vector<cpx> spec(n_bins);
+        std::vector<cpx> scratch(n_fft);
+        const int l_begin = (int) ((int64_t) n_frames * chunk / n_chunks);
+        const int l_end = (int) ((int64_t) n_frames * (chunk + 1) / n_chunks);
+        for (int l = l_begin; l < l_end; l++) {
+            const float *log_mag = embd + (size_t) l * n_embd;
+            const float *phase = log_mag + n_bins;
+#if defined(LM_GGML_USE_ACCELERATE)
+            vvexpf(mag.data(), log_mag, &n_bins);
+            vvsincosf(sin_phi.data(), cos_phi.data(), phase, &n_bins);
+            for (int k = 0; k < n_bins; k++) {
+                const float m = std::min(mag[k], 1e2f);
+                spec[k] = cpx(m * cos_phi[k], m * sin_phi[k]);
+            }
+#else
+            for (int k = 0; k < n_bins; k++) {
+                mag[k] = std::min(std::exp(log_mag[k]), 1e2f);
+            }
+            for (int k = 0; k < n_bins; k++) {
+                spec[k] = cpx(mag[k] * std::cos(phase[k]), mag[k] * std::sin(phase[k]));
+            }
+#endif
+            float *frame = frames + (size_t) l * n_fft;
+            irfft(spec.data(), frame, scratch.data());
+            for (int j = 0; j < n_fft; j++) {
+                frame[j] *= window[j];
+            }
+        }
+    });
+}
+
+std::vector<float> llama_rn_istft::run(const float *embd, int n_codes, int n_embd) {
+    std::lock_guard<std::mutex> lock(run_mutex);
+
+    const int n_pad = (n_fft - n_hop) / 2;
+    const int n_out = (n_codes - 1) * n_hop + n_fft;
+    if (n_codes <= 0 || n_embd / 2 != n_fft / 2 + 1) {
+        return {};
+    }
+
+    std::vector<float> frames((size_t) n_codes * n_fft);
+    synthesize(embd, n_codes, n_embd, frames.data());
+
+    // Overlap-add, normalized by the summed squared window
+    std::vector<float> signal(n_out, 0.0f);
+    std::vector<float> envelope(n_out, 0.0f);
+    for (int l = 0; l < n_codes; l++) {
+        float *dst = signal.data() + (size_t) l * n_hop;
+        float *env = envelope.data() + (size_t) l * n_hop;
+        const float *frame = frames.data() + (size_t) l * n_fft;
+        for (int j = 0; j < n_fft; j++) {
+            dst[j] += frame[j];
+            env[j] += window_sq[j];
+        }
+    }
+
+    std::vector<float> audio(std::max(0, n_out - 2 * n_pad));
+    for (size_t i = 0; i < audio.size(); i++) {
+        audio[i] = signal[i + n_pad] / envelope[i + n_pad];
+    }
+    return audio;
+}
+
+std::vector<float> llama_rn_istft::push(stream_state &st, const float *embd, int n_frames, int n_embd) {
+    std::lock_guard<std::mutex> lock(run_mutex);
+
+    if (n_frames <= 0 || n_embd / 2 != n_fft / 2 + 1) {
+        return {};
+    }
+
+    std::vector<float> frames((size_t) n_frames * n_fft);
+    synthesize(embd, n_frames, n_embd, frames.data());
+
+    const int64_t end = (st.n_frames + n_frames - 1) * n_hop + n_fft - st.tail_start;
+    st.signal.resize(end, 0.0f);
+    st.envelope.resize(end, 0.0f);
+    for (int l = 0; l < n_frames; l++) {
+        const int64_t offset = (st.n_frames + l) * n_hop - st.tail_start;
+        float *dst = st.signal.data() + offset;
+        float *env = st.envelope.data() + offset;
+        const float *frame = frames.data() + (size_t) l * n_fft;
+        for (int j = 0; j < n_fft; j++) {
+            dst[j] += frame[j];
+            env[j] += window_sq[j];
+        }
+    }
+    st.n_frames += n_frames;
+
+    // Samples before the start of the next frame are final
+    return emit(st, st.n_frames * n_hop);
+}
+
+std::vector<float> llama_rn_istft::finish(stream_state &st) {
+    std::lock_guard<std::mutex> lock(run_mutex);
+
+    std::vector<float> audio;
+    if (st.n_frames > 0) {
+        const int n_pad = (n_fft - n_hop) / 2;
+        audio = emit(st, (st.n_frames - 1) * n_hop + n_fft - n_pad);
+    }
+    st = stream_state();
+    return audio;
+}
+
+std::vector<float> llama_rn_istft::emit(stream_state &st, int64_t end) {
+    const int64_t n_pad = (n_fft - n_hop) / 2;
+    const int64_t begin = std::max(st.tail_start, n_pad);
+    std::vector<float> audio(std::max<int64_t>(0, end - begin));
+    for (size_t i = 0; i < audio.size(); i++) {
+        const int64_t idx = begin - st.tail_start + (int64_t) i;
+        audio[i] = st.signal[idx] / st.envelope[idx];
+    }
+
+    const int64_t n_done = std::min<int64_t>(end - st.tail_start, (int64_t) st.signal.size());
+    if (n_done > 0) {
+        st.signal.erase(st.signal.begin(), st.signal.begin() + n_done);
+        st.envelope.erase(st.envelope.begin(), st.envelope.begin() + n_done);
+        st.tail_start += n_done;
+    }
+    return audio;
+}
+
+} // namespace rnllama
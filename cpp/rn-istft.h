@@ -0,0 +1,110 @@
+#ifndef RN_ISTFT_H
+#define RN_ISTFT_H
+
+#include <atomic>
+#include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rnllama {
+
+// Persistent workers for data-parallel loops. run(n, fn) calls fn(i) for
+// every i in [0, n) across the workers and the calling thread, and returns
+// once all calls are done. One run at a time.
+struct llama_rn_worker_pool {
+    explicit llama_rn_worker_pool(int n_threads);
+    ~llama_rn_worker_pool();
+
+    void run(int n, const std::function<void(int)> &fn);
+    int size() const { return (int) workers.size() + 1; }
+
+private:
+    void work();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+    const std::function<void(int)> *job = nullptr;
+    int n_items = 0;
+    std::atomic<int> next_item{0};
+    int n_busy = 0;
+    uint64_t generation = 0;
+    bool stop = false;
+};
+
+// Inverse complex FFT of a fixed size (unnormalized), mixed radix 2/3/4/5
+// with a precomputed twiddle table. Other prime factors use a generic
+// butterfly.
+struct llama_rn_fft {
+    using cpx = std::complex<float>;
+
+    explicit llama_rn_fft(int n);
+
+    int size() const { return n; }
+    void inverse(const cpx *in, cpx *out) const;
+
+private:
+    void work(cpx *out, const cpx *in, size_t stride, const int *factors) const;
+    void bfly2(cpx *out, size_t stride, int m) const;
+    void bfly3(cpx *out, size_t stride, int m) const;
+    void bfly4(cpx *out, size_t stride, int m) const;
+    void bfly5(cpx *out, size_t stride, int m) const;
+    void bfly_generic(cpx *out, size_t stride, int m, int p) const;
+
+    int n;
+    std::vector<int> factors;              // (radix, remaining length) pairs
+    std::vector<cpx> twiddles;             // exp(2*pi*i*k/n)
+};
+
+// Inverse STFT of the vocoder output: frames of [log-magnitude | phase]
+// spectra to audio, windowed (periodic Hann) and overlap-added with
+// envelope normalization. Built once per size and kept by the TTS context;
+// the per-frame inverse FFTs are spread over a persistent worker pool.
+struct llama_rn_istft {
+    llama_rn_istft(int n_fft, int n_hop, int n_threads);
+
+    int n_threads() const { return pool.size(); }
+
+    // embd: n_codes frames of n_embd floats, n_embd = n_fft + 2
+    std::vector<float> run(const float *embd, int n_codes, int n_embd);
+
+    // Overlap-add tail of a streamed signal
+    struct stream_state {
+        int64_t n_frames = 0;              // Frames pushed so far
+        int64_t tail_start = 0;            // Signal index of signal[0]
+        std::vector<float> signal;
+        std::vector<float> envelope;
+    };
+
+    // Streaming: frames pushed in order produce the same samples as run()
+    // over all of them. push() returns the samples no later frame can
+    // overlap; finish() returns the rest and resets the state.
+    std::vector<float> push(stream_state &st, const float *embd, int n_frames, int n_embd);
+    std::vector<float> finish(stream_state &st);
+
+private:
+    // Windowed time-domain frames (n_fft each) for n_frames spectra
+    void synthesize(const float *embd, int n_frames, int n_embd, float *frames);
+    std::vector<float> emit(stream_state &st, int64_t end);
+
+    // Real inverse FFT of one frame (n_fft / 2 + 1 bins) into n_fft samples
+    void irfft(const llama_rn_fft::cpx *spec, float *out, llama_rn_fft::cpx *scratch) const;
+
+    int n_fft;
+    int n_hop;
+    llama_rn_fft fft;                      // Complex FFT of n_fft / 2 points
+    std::vector<llama_rn_fft::cpx> super_twiddles;
+    std::vector<float> window;
+    std::vector<float> window_sq;
+    llama_rn_worker_pool pool;
+    std::mutex run_mutex;
+};
+
+} // namespace rnllama
+
+#endif /* RN_ISTFT_H */
@@ -143,6 +143,25 @@ std::string tokens_to_output_formatted_string(const llama_context *ctx, const ll
     return token_piece_to_output_string(token == -1 ? "" : common_token_to_piece(ctx, token));
 }
 
+void llama_rn_token_string_cache::resolve(const llama_context *ctx, const llama_token *tokens, size_t n, std::vector<std::string> &out)
+{
+    out.resize(n);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < n; i++) {
+        auto it = strings.find(tokens[i]);
+        if (it == strings.end()) {
+            it = strings.emplace(tokens[i], tokens_to_output_formatted_string(ctx, tokens[i])).first;
+        }
+        out[i] = it->second;
+    }
+}
+
+void llama_rn_token_string_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    strings.clear();
+}
+
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end)
 {
     std::string ret;
@@ -384,6 +403,7 @@ bool llama_rn_context::loadModel(common_params &params_)
 {
     removeLoraAdapters();
     draft_model.reset();
+    token_strings.clear();
     params = params_;
 
     // Ensure n_parallel is set to a reasonable default for parallel decoding support
@@ -515,7 +535,6 @@ common_chat_params llama_rn_context::getFormattedChatWithJinja(
 ) const {
     common_chat_templates_inputs inputs;
     inputs.use_jinja = true;
-    inputs.messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
     auto useTools = !tools.empty();
     if (useTools) {
         inputs.tools = common_chat_tools_parse_oaicompat(json::parse(tools));
@@ -546,12 +565,24 @@ common_chat_params llama_rn_context::getFormattedChatWithJinja(
     inputs.chat_template_kwargs = chat_template_kwargs;
     inputs.force_pure_content = force_pure_content;
 
-    // If chat_template is provided, create new one and use it (probably slow)
+    // Everything besides the messages that changes the render; templates can
+    // print the date, so it is part of it too
+    char date[16];
+    const std::time_t now_time = std::chrono::system_clock::to_time_t(inputs.now);
+    std::strftime(date, sizeof(date), "%Y-%m-%d", std::localtime(&now_time));
+    std::string key = chat_template + '\x1f' + json_schema + '\x1f' + tools + '\x1f' + tool_choice + '\x1f' +
+        reasoning_format + '\x1f' + date + '\x1f' + (parallel_tool_calls ? '1' : '0') +
+        (enable_thinking ? '1' : '0') + (force_pure_content ? '1' : '0');
+    for (const auto& kv : chat_template_kwargs) {
+        key += '\x1f' + kv.first + '=' + kv.second;
+    }
+
+    // A provided chat_template is compiled once and kept
     if (!chat_template.empty()) {
-        auto tmps = common_chat_templates_init(model, chat_template);
-        return common_chat_templates_apply(tmps.get(), inputs);
+        auto tmps = chat_template_cache.get(model, chat_template);
+        return chat_render_cache.apply(tmps.get(), key, messages, inputs);
     } else {
-        return common_chat_templates_apply(templates.get(), inputs);
+        return chat_render_cache.apply(templates.get(), key, messages, inputs);
     }
 }
 
@@ -563,9 +594,9 @@ std::string llama_rn_context::getFormattedChat(
     inputs.messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
     inputs.use_jinja = false;
 
-    // If chat_template is provided, create new one and use it (probably slow)
+    // A provided chat_template is compiled once and kept
     if (!chat_template.empty()) {
-        auto tmps = common_chat_templates_init(model, chat_template);
+        auto tmps = chat_template_cache.get(model, chat_template);
         return common_chat_templates_apply(tmps.get(), inputs).prompt;
     } else {
         return common_chat_templates_apply(templates.get(), inputs).prompt;
@@ -588,7 +619,7 @@ llama_rn_tokenize_result llama_rn_context::tokenize(const std::string &text, con
       return tokenize_result;
   }
   std::vector<llama_token> text_tokens;
-  text_tokens = common_tokenize(ctx, text, /* add_special= */ false, /* parse_special= */ true);
+  text_tokens = prompt_token_cache.tokenize(ctx, text, /* add_special= */ false);
   llama_rn_tokenize_result tokenize_result;
   tokenize_result.tokens = text_tokens;
   tokenize_result.has_media = false;
@@ -622,6 +653,9 @@ void llama_rn_context::applyLoraAdapters(std::vector<common_adapter_lora_info> l
 
     common_set_adapter_lora(ctx, lora);
     this->lora = std::move(lora);
+    if (tts_wrapper != nullptr) {
+        tts_wrapper->speakers.clear_state();
+    }
     clear_init_lora_ownership(llama_init);
     owned_lora = std::move(loaded_adapters);
 }
@@ -635,6 +669,9 @@ void llama_rn_context::removeLoraAdapters() {
     this->lora.clear();
     clear_init_lora_ownership(llama_init);
     owned_lora.clear();
+    if (tts_wrapper != nullptr) {
+        tts_wrapper->speakers.clear_state();
+    }
 }
 
 std::vector<common_adapter_lora_info> llama_rn_context::getLoadedLoraAdapters() {
@@ -644,6 +681,7 @@ std::vector<common_adapter_lora_info> llama_rn_context::getLoadedLoraAdapters()
 bool llama_rn_context::initMultimodal(const std::string &mmproj_path, bool use_gpu, int image_min_tokens, int image_max_tokens) {
     try {
         mtmd_wrapper = new llama_rn_context_mtmd(mmproj_path, use_gpu, model, ctx, params, has_multimodal, params, image_min_tokens, image_max_tokens);
+        mtmd_wrapper->embd_cache.configure(media_cache_budget_bytes, media_cache_dir, media_cache_disk_budget_bytes);
         return true;
     } catch (const std::exception& e) {
         LOG_ERROR("[DEBUG] Failed to initialize multimodal: %s", e.what());
@@ -779,10 +817,20 @@ void llama_rn_context::clearCache(bool clear_data) {
 
     llama_memory_clear(kv, clear_data);
 
+    if (slot_manager != nullptr) {
+        std::lock_guard<std::mutex> lock(slot_manager->slots_mutex);
+        for (auto& slot : slot_manager->slots) {
+            slot_manager->drop_cache(slot);
+        }
+    }
+
     if (completion != nullptr) {
         completion->embd.clear();
         completion->n_past = 0;
         completion->clearStateCheckpoints();
+        if (tts_wrapper != nullptr) {
+            tts_wrapper->speakers.clear_state();
+        }
         LOG_INFO("Cache cleared and completion state reset (clear_data=%s)", clear_data ? "true" : "false");
     } else {
         LOG_INFO("Cache cleared (clear_data=%s)", clear_data ? "true" : "false");
@@ -5,6 +5,8 @@
 #include <iostream>
 #include <thread>
 #include <codecvt>
+#include <mutex>
+#include <unordered_map>
 #include "chat.h"
 #include "common.h"
 #include "ggml.h"
@@ -16,6 +18,7 @@
 #include "sampling.h"
 #include "nlohmann/json.hpp"
 #include "rn-tts.h"
+#include "rn-prompt-cache.h"
 #if defined(__ANDROID__)
 #include <android/log.h>
 #endif
@@ -30,6 +33,19 @@ std::string token_piece_to_output_string(const std::string & piece);
 
 std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token);
 
+// Output strings of token ids (tokens_to_output_formatted_string), each
+// formatted once per model: token probabilities list the same candidates
+// token after token. Safe to use from any thread.
+struct llama_rn_token_string_cache {
+    // The strings of n token ids, resolved under one lock
+    void resolve(const llama_context *ctx, const llama_token *tokens, size_t n, std::vector<std::string> &out);
+    void clear();
+
+private:
+    std::mutex mutex;
+    std::unordered_map<llama_token, std::string> strings;
+};
+
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end);
 
 // Token pieces are raw bytes (a multi-byte character can split across tokens;
@@ -106,6 +122,18 @@ struct llama_rn_context {
     // no-op on pure-attention models.
     size_t state_cache_budget_bytes = (size_t) 160 * 1024 * 1024; // 0 = disabled
     int32_t state_cache_max_checkpoints = 8;
+    // Keep snapshots delta-encoded against a base one: several times more
+    // restore points in the same budget, for a decode on each restore.
+    bool state_cache_compact = false;
+    // Disk tier for it; an empty directory disables it.
+    std::string state_cache_dir;
+    size_t state_cache_disk_budget_bytes = (size_t) 512 * 1024 * 1024;
+
+    // Encoded media cache (see rn-prompt-cache.h), set up by initMultimodal.
+    // A zero budget turns off the memory tier, an empty directory the disk tier.
+    size_t media_cache_budget_bytes = (size_t) 64 * 1024 * 1024;
+    std::string media_cache_dir;
+    size_t media_cache_disk_budget_bytes = (size_t) 256 * 1024 * 1024;
 
     // Completion context (DEPRECATED: Use slot_manager for parallel decoding)
     llama_rn_context_completion *completion = nullptr;
@@ -151,6 +179,12 @@ struct llama_rn_context {
       const std::string &chat_template
     ) const;
     llama_rn_tokenize_result tokenize(const std::string &text, const std::vector<std::string> &media_paths);
+    // Multi-turn chats re-render and re-tokenize a growing conversation each
+    // turn; these pick up from the previous turn (see rn-prompt-cache.h)
+    mutable llama_rn_chat_render_cache chat_render_cache;
+    mutable llama_rn_chat_template_cache chat_template_cache; // Custom templates passed per request
+    llama_rn_prompt_token_cache prompt_token_cache;
+    llama_rn_token_string_cache token_strings;  // For token probabilities
 
     // Lora methods
     std::vector<common_adapter_lora_info> lora;
@@ -6,9 +6,15 @@
 #include "tools/mtmd/mtmd-helper.h"
 #include "tools/mtmd/clip.h"
 #include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 
 namespace rnllama {
@@ -35,6 +41,12 @@ struct llama_rn_context_mtmd {
     // (the position the chunk eval resumed from). Instrumentation for the tests.
     llama_pos last_reused_n_past = 0;
 
+    // Encoded media by projector, preprocessing and content (see
+    // rn-prompt-cache.h). One per projector, so the completion path and
+    // every slot share it.
+    llama_rn_media_embd_cache embd_cache;
+    std::string embd_cache_prefix;         // Projector and preprocessing part of the keys
+
     // Constructor - Initialize multimodal
     llama_rn_context_mtmd(
         const std::string &mmproj_path,
@@ -79,79 +91,159 @@ struct llama_rn_context_mtmd {
     bool supportAudio() const;
 };
 
-// FNV-1a hash function for bitmap hashing
-inline std::string fnv_hash(const uint8_t * data, size_t len) {
-    const uint64_t fnv_prime = 0x100000001b3ULL;
-    uint64_t hash = 0xcbf29ce484222325ULL;
-
-    for (size_t i = 0; i < len; ++i) {
-        hash ^= data[i];
-        hash *= fnv_prime;
+// Content id of a decoded bitmap, for KV and encoded media reuse. Hashes 32
+// bytes per step in four 64-bit lanes (the xxHash64 construction). The "x64:"
+// prefix versions the id: ids from the former byte-wise FNV-1a were plain
+// decimal, so nothing keyed on one of those matches a new one by accident.
+inline std::string media_hash(const uint8_t * data, size_t len) {
+    static const uint64_t p1 = 11400714785074694791ULL;
+    static const uint64_t p2 = 14029467366897019727ULL;
+    static const uint64_t p3 = 1609587929392839161ULL;
+    static const uint64_t p4 = 9650029242287828579ULL;
+    static const uint64_t p5 = 2870177450012600261ULL;
+    const auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    const auto read64 = [](const uint8_t * p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+    const auto lane = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+    const auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ lane(0, v)) * p1 + p4; };
+
+    const uint8_t * p = data;
+    const uint8_t * end = data + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = p1 + p2, v2 = p2, v3 = 0, v4 = 0 - p1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = lane(v1, read64(p));
+            v2 = lane(v2, read64(p + 8));
+            v3 = lane(v3, read64(p + 16));
+            v4 = lane(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = p5;
+    }
+    h += (uint64_t) len;
+    for (; p + 8 <= end; p += 8) {
+        h = rotl(h ^ lane(0, read64(p)), 27) * p1 + p4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h = rotl(h ^ ((uint64_t) v * p1), 23) * p2 + p3;
+        p += 4;
     }
-    return std::to_string(hash);
+    for (; p < end; p++) {
+        h = rotl(h ^ (*p * p5), 11) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+
+    char id[24];
+    snprintf(id, sizeof(id), "x64:%016llx", (unsigned long long) h);
+    return id;
 }
 
-// Base64 encoding/decoding utilities
-static const std::string base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
-
-inline bool is_base64(uint8_t c) {
-    return (isalnum(c) || (c == '+') || (c == '/'));
+// Content id of a model or projector file: its size and the hash of its first
+// and last MiB, which hold the GGUF header and metadata and the tail of the
+// tensors. Reads 2 MiB at most; empty if the file can't be read.
+inline std::string model_file_content_key(const std::string & path) {
+    static const size_t sample = 1 << 20;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return std::string();
+    }
+    const size_t size = (size_t) file.tellg();
+    std::vector<uint8_t> buf(std::min(size, 2 * sample));
+    const size_t head = std::min(size, sample);
+    file.seekg(0);
+    file.read((char *) buf.data(), head);
+    if (buf.size() > head) {
+        file.seekg(size - (buf.size() - head));
+        file.read((char *) buf.data() + head, buf.size() - head);
+    }
+    if (!file) {
+        return std::string();
+    }
+    return std::to_string(size) + ":" + media_hash(buf.data(), buf.size());
 }
 
+// Base64 decoding
 using raw_buffer = std::vector<uint8_t>;
 
-inline raw_buffer base64_decode(const std::string & encoded_string) {
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-
-    int in_len = encoded_string.size();
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
-
-    raw_buffer ret;
-
-    while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++) {
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-            }
-
-            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
-
-            for (i = 0; (i < 3); i++) {
-                ret.push_back(char_array_3[i]);
-            }
-
-            i = 0;
+// Value of each base64 character; 0x80 for anything outside the alphabet
+inline const uint8_t * base64_table() {
+    static const auto table = [] {
+        static const char chars[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz"
+            "0123456789+/";
+        std::array<uint8_t, 256> t;
+        t.fill(0x80);
+        for (uint8_t i = 0; i < 64; i++) {
+            t[(uint8_t) chars[i]] = i;
         }
-    }
+        return t;
+    }();
+    return table.data();
+}
 
-    if (i) {
-        for (j = i; j < 4; j++) {
-            char_array_4[j] = 0;
+// Decodes up to the first character outside the alphabet ('=' padding
+// included); a trailing partial group of k characters gives k - 1 bytes.
+inline raw_buffer base64_decode(std::string_view encoded) {
+    const uint8_t * table = base64_table();
+    const uint8_t * in = reinterpret_cast<const uint8_t *>(encoded.data());
+    const size_t n = encoded.size();
+
+    raw_buffer ret(n / 4 * 3 + 3);
+    uint8_t * out = ret.data();
+    size_t i = 0;
+
+    // Eight characters into six bytes per step, while all are valid
+    for (; i + 8 <= n; i += 8) {
+        const uint64_t c0 = table[in[i + 0]], c1 = table[in[i + 1]], c2 = table[in[i + 2]], c3 = table[in[i + 3]];
+        const uint64_t c4 = table[in[i + 4]], c5 = table[in[i + 5]], c6 = table[in[i + 6]], c7 = table[in[i + 7]];
+        if ((c0 | c1 | c2 | c3 | c4 | c5 | c6 | c7) & 0x80) {
+            break;
         }
+        const uint64_t v = c0 << 42 | c1 << 36 | c2 << 30 | c3 << 24 | c4 << 18 | c5 << 12 | c6 << 6 | c7;
+        out[0] = (uint8_t) (v >> 40);
+        out[1] = (uint8_t) (v >> 32);
+        out[2] = (uint8_t) (v >> 24);
+        out[3] = (uint8_t) (v >> 16);
+        out[4] = (uint8_t) (v >> 8);
+        out[5] = (uint8_t) v;
+        out += 6;
+    }
 
-        for (j = 0; j < 4; j++) {
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+    // The rest (and the step that stopped) one character at a time
+    uint32_t acc = 0;
+    int n_acc = 0;
+    for (; i < n; i++) {
+        const uint8_t c = table[in[i]];
+        if (c & 0x80) {
+            break;
         }
-
-        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
-
-        for (j = 0; j < i - 1; j++) {
-            ret.push_back(char_array_3[j]);
+        acc = acc << 6 | c;
+        if (++n_acc == 4) {
+            out[0] = (uint8_t) (acc >> 16);
+            out[1] = (uint8_t) (acc >> 8);
+            out[2] = (uint8_t) acc;
+            out += 3;
+            acc = 0;
+            n_acc = 0;
         }
     }
+    if (n_acc > 1) {
+        acc <<= 6 * (4 - n_acc);
+        out[0] = (uint8_t) (acc >> 16);
+        out[1] = (uint8_t) (acc >> 8);
+        out += n_acc - 1;
+    }
 
+    ret.resize(out - ret.data());
     return ret;
 }
 
@@ -191,8 +283,10 @@ inline mtmd_tokenize_result tokenizeWithMedia(llama_rn_context_mtmd *mtmd_wrappe
                 throw std::runtime_error("Invalid base64 media format, missing comma separator");
             }
 
-            std::string header = media_path.substr(0, comma_pos);
-            std::string base64_data = media_path.substr(comma_pos + 1);
+            // Views into the URI; the payload is decoded in place
+            const std::string_view uri(media_path);
+            const std::string_view header = uri.substr(0, comma_pos);
+            const std::string_view base64_data = uri.substr(comma_pos + 1);
 
             if (header.find("base64") == std::string::npos) {
                 bitmaps.entries.clear();
@@ -215,7 +309,7 @@ inline mtmd_tokenize_result tokenizeWithMedia(llama_rn_context_mtmd *mtmd_wrappe
             }
 
             // Calculate bitmap hash (for KV caching)
-            std::string hash = bmp.data() != nullptr ? fnv_hash(bmp.data(), bmp.n_bytes()) : "";
+            std::string hash = bmp.data() != nullptr ? media_hash(bmp.data(), bmp.n_bytes()) : "";
             if (hash.empty()) {
                 const char * bitmap_id = mtmd_bitmap_get_id(bmp.ptr.get());
                 hash = bitmap_id != nullptr ? bitmap_id : "";
@@ -258,7 +352,7 @@ inline mtmd_tokenize_result tokenizeWithMedia(llama_rn_context_mtmd *mtmd_wrappe
             }
 
             // Calculate bitmap hash (for KV caching)
-            std::string hash = bmp.data() != nullptr ? fnv_hash(bmp.data(), bmp.n_bytes()) : "";
+            std::string hash = bmp.data() != nullptr ? media_hash(bmp.data(), bmp.n_bytes()) : "";
             if (hash.empty()) {
                 const char * bitmap_id = mtmd_bitmap_get_id(bmp.ptr.get());
                 hash = bitmap_id != nullptr ? bitmap_id : "";
@@ -605,6 +699,30 @@ inline void llama_rn_context_mtmd::processMedia(
 
     size_t num_chunks = mtmd_input_chunks_size(chunks);
 
+    // Encoded media cache keys, one per media chunk. Only when each input
+    // became one chunk: when preprocessing splits or merges inputs (video
+    // frames, long audio) the chunk's source is not known.
+    std::vector<std::string> media_keys(num_chunks);
+    const size_t n_media = chunk_pos_media.size();
+    const auto media_embd_size = [&](const mtmd_input_chunk *chunk) {
+        return (size_t) llama_model_n_embd_inp(llama_get_model(ctx)) * mtmd_input_chunk_get_n_tokens(chunk);
+    };
+    if (embd_cache.enabled() && !embd_cache_prefix.empty() && n_media > 0 && bitmap_hashes.size() == 2 * n_media) {
+        for (size_t i = 0, k = 0; i < num_chunks; i++) {
+            auto chunk = mtmd_input_chunks_get(chunks, i);
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                continue;
+            }
+            const std::string &source = bitmap_hashes[k];
+            const std::string &identity = bitmap_hashes[n_media + k];
+            k++;
+            if (!source.empty() && !identity.empty()) {
+                media_keys[i] = embd_cache_prefix + "|" + source + "|" + identity + "|" +
+                                std::to_string(mtmd_input_chunk_get_n_tokens(chunk));
+            }
+        }
+    }
+
     for (size_t i = 0; i < chunk_pos.size(); i++) {
 
         LOG_INFO("[DEBUG] Evaluating chunk %zu: n_past=%d, chunk_pos=%zu", i, n_past, chunk_pos[i]);
@@ -614,16 +732,43 @@ inline void llama_rn_context_mtmd::processMedia(
             bool chunk_logits_last = (i == num_chunks - 1);
             auto chunk = mtmd_input_chunks_get(chunks, i);
 
-            int32_t res = mtmd_helper_eval_chunk_single(
-                this->mtmd_ctx,
-                ctx,
-                chunk,
-                n_past,
-                seq_id,
-                n_batch,
-                chunk_logits_last,
-                &new_n_past
-            );
+            // A cached encoding is decoded as is; the helper that takes one
+            // never requests logits, so a final media chunk is encoded again.
+            int32_t res = -1;
+            bool decoded = false;
+            if (!media_keys[i].empty() && !chunk_logits_last) {
+                auto cached = embd_cache.get(media_keys[i]);
+                if (cached && cached->size() == media_embd_size(chunk)) {
+                    res = mtmd_helper_decode_image_chunk(
+                        this->mtmd_ctx,
+                        ctx,
+                        chunk,
+                        const_cast<float *>(cached->data()),
+                        n_past,
+                        seq_id,
+                        n_batch,
+                        &new_n_past,
+                        nullptr,
+                        nullptr
+                    );
+                    decoded = true;
+                }
+            }
+            if (!decoded) {
+                res = mtmd_helper_eval_chunk_single(
+                    this->mtmd_ctx,
+                    ctx,
+                    chunk,
+                    n_past,
+                    seq_id,
+                    n_batch,
+                    chunk_logits_last,
+                    &new_n_past
+                );
+                if (res == 0 && !media_keys[i].empty()) {
+                    embd_cache.put(media_keys[i], mtmd_get_output_embd(this->mtmd_ctx), media_embd_size(chunk));
+                }
+            }
             if (res != 0) {
                 mtmd_input_chunks_free(chunks);
                 throw std::runtime_error("Failed to evaluate chunks");
@@ -703,6 +848,16 @@ inline llama_rn_context_mtmd::llama_rn_context_mtmd(
 
     has_multimodal = true;
 
+    // The projector by content (app container paths move between installs, and
+    // a fine-tune keeps the name and size of its base) and what changes its
+    // preprocessing. Left empty, with no media cached, if the file can't be read.
+    const std::string mmproj_key = model_file_content_key(mmproj_path);
+    if (!mmproj_key.empty()) {
+        embd_cache_prefix = "mmproj:" + mmproj_key +
+                            "|tokens:" + std::to_string(image_min_tokens) + ":" + std::to_string(image_max_tokens) +
+                            "|embd:" + std::to_string(llama_model_n_embd_inp(model));
+    }
+
     // Check if the model uses M-RoPE or non-causal attention
     bool uses_mrope = mtmd_decode_use_mrope(mtmd_ctx);
     // No chunk exists during context init; nullptr uses the default image path.
@@ -0,0 +1,178 @@
+#include "rn-prefix-index.h"
+
+namespace rnllama {
+
+void llama_rn_prefix_index::update(llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+    auto it = entries.find(seq_id);
+    if (it != entries.end()) {
+        if (it->second == tokens) {
+            return;
+        }
+        erase(seq_id, it->second);
+        entries.erase(it);
+    }
+
+    if (tokens.empty()) {
+        return;
+    }
+
+    insert(seq_id, tokens);
+    entries[seq_id] = tokens;
+}
+
+void llama_rn_prefix_index::remove(llama_seq_id seq_id) {
+    auto it = entries.find(seq_id);
+    if (it == entries.end()) {
+        return;
+    }
+    erase(seq_id, it->second);
+    entries.erase(it);
+}
+
+void llama_rn_prefix_index::clear() {
+    root.children.clear();
+    entries.clear();
+}
+
+void llama_rn_prefix_index::insert(llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+    node* cur = &root;
+    size_t i = 0;
+
+    while (i < tokens.size()) {
+        auto it = cur->children.find(tokens[i]);
+        if (it == cur->children.end()) {
+            auto leaf = std::make_unique<node>();
+            leaf->label.assign(tokens.begin() + i, tokens.end());
+            leaf->seqs.insert(seq_id);
+            cur->children.emplace(tokens[i], std::move(leaf));
+            return;
+        }
+
+        node* child = it->second.get();
+        const size_t n_rest = tokens.size() - i;
+        size_t k = 0;
+        while (k < child->label.size() && k < n_rest && child->label[k] == tokens[i + k]) {
+            k++;
+        }
+
+        if (k < child->label.size()) {
+            // Split the edge at the divergence point
+            auto mid = std::make_unique<node>();
+            mid->label.assign(child->label.begin(), child->label.begin() + k);
+            mid->seqs = child->seqs;
+
+            std::unique_ptr<node> tail = std::move(it->second);
+            tail->label.erase(tail->label.begin(), tail->label.begin() + k);
+            const llama_token tail_key = tail->label.front();
+            mid->children.emplace(tail_key, std::move(tail));
+
+            it->second = std::move(mid);
+            child = it->second.get();
+        }
+
+        child->seqs.insert(seq_id);
+        i += k;
+        cur = child;
+    }
+}
+
+void llama_rn_prefix_index::erase(llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+    std::vector<std::pair<node*, llama_token>> path;
+    node* cur = &root;
+    size_t i = 0;
+
+    while (i < tokens.size()) {
+        auto it = cur->children.find(tokens[i]);
+        if (it == cur->children.end()) {
+            break;
+        }
+        node* child = it->second.get();
+        child->seqs.erase(seq_id);
+        path.emplace_back(cur, tokens[i]);
+        i += child->label.size();
+        cur = child;
+    }
+
+    // Prune orphaned nodes and re-merge edges that no longer fork, bottom-up
+    for (auto p = path.rbegin(); p != path.rend(); ++p) {
+        node* parent = p->first;
+        auto it = parent->children.find(p->second);
+        if (it == parent->children.end()) {
+            continue;
+        }
+        node* child = it->second.get();
+
+        if (child->seqs.empty()) {
+            parent->children.erase(it);
+            continue;
+        }
+
+        if (child->children.size() == 1 && child->children.begin()->second->seqs == child->seqs) {
+            std::unique_ptr<node> only = std::move(child->children.begin()->second);
+            child->children.clear();
+            child->label.insert(child->label.end(), only->label.begin(), only->label.end());
+            child->children = std::move(only->children);
+        }
+    }
+}
+
+llama_rn_prefix_index::match llama_rn_prefix_index::find_longest(
+    const std::vector<llama_token>& tokens,
+    const std::function<bool(llama_seq_id)>& accept
+) const {
+    match best;
+    const node* cur = &root;
+    size_t i = 0;
+
+    while (i < tokens.size()) {
+        auto it = cur->children.find(tokens[i]);
+        if (it == cur->children.end()) {
+            break;
+        }
+
+        const node* child = it->second.get();
+        llama_seq_id seq_id = -1;
+        for (llama_seq_id s : child->seqs) {
+            if (!accept || accept(s)) {
+                seq_id = s;
+                break;
+            }
+        }
+        if (seq_id < 0) {
+            break;
+        }
+
+        const size_t n_rest = tokens.size() - i;
+        size_t k = 0;
+        while (k < child->label.size() && k < n_rest && child->label[k] == tokens[i + k]) {
+            k++;
+        }
+
+        best.seq_id = seq_id;
+        best.n_tokens = i + k;
+
+        if (k < child->label.size()) {
+            break;
+        }
+        i += k;
+        cur = child;
+    }
+
+    return best;
+}
+
+size_t llama_rn_prefix_index::n_nodes() const {
+    size_t count = 0;
+    std::vector<const node*> stack = {&root};
+    while (!stack.empty()) {
+        const node* n = stack.back();
+        stack.pop_back();
+        for (const auto& child : n->children) {
+            count++;
+            stack.push_back(child.second.get());
+        }
+    }
+    return count;
+}
+
+} // namespace rnllama
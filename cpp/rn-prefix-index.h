@@ -0,0 +1,53 @@
+#ifndef RN_PREFIX_INDEX_H
+#define RN_PREFIX_INDEX_H
+
+#include "llama.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace rnllama {
+
+// Token-level radix tree over the token sequences held in KV by each
+// sequence (slot). Shared prefixes such as a common system prompt are stored
+// once, and a lookup returns the sequence holding the longest prefix of a
+// prompt, so it can be copied with llama_memory_seq_cp instead of prefilled.
+struct llama_rn_prefix_index {
+    struct match {
+        llama_seq_id seq_id = -1;
+        size_t n_tokens = 0;
+    };
+
+    // Replace the tokens indexed for seq_id (empty removes the entry)
+    void update(llama_seq_id seq_id, const std::vector<llama_token>& tokens);
+    void remove(llama_seq_id seq_id);
+    void clear();
+
+    // Longest prefix of tokens held by a sequence accepted by the filter
+    // (all sequences when no filter is given)
+    match find_longest(
+        const std::vector<llama_token>& tokens,
+        const std::function<bool(llama_seq_id)>& accept = nullptr
+    ) const;
+
+    size_t n_nodes() const;
+
+private:
+    struct node {
+        std::vector<llama_token> label;                      // Edge tokens leading to this node
+        std::map<llama_token, std::unique_ptr<node>> children; // Keyed by first label token
+        std::set<llama_seq_id> seqs;                         // Sequences running through the whole label
+    };
+
+    node root;
+    std::map<llama_seq_id, std::vector<llama_token>> entries;
+
+    void insert(llama_seq_id seq_id, const std::vector<llama_token>& tokens);
+    void erase(llama_seq_id seq_id, const std::vector<llama_token>& tokens);
+};
+
+} // namespace rnllama
+
+#endif /* RN_PREFIX_INDEX_H */
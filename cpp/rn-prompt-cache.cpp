@@ -0,0 +1,923 @@
+#include "rn-prompt-cache.h"
+#include "rn-llama.h"
+#include "llama-mmap.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace rnllama {
+
+static const size_t max_conversations = 4;
+// Incremental renders checked against full ones before a key is trusted
+static const int n_render_checks = 2;
+
+static const size_t max_chat_templates = 4;
+
+// State snapshot files: a header, the tokens, then the state data
+static const uint32_t state_file_magic = 0x43534e52; // "RNSC"
+static const uint32_t state_file_version = 1;
+static const char* state_file_ext = ".rnstate";
+// Delta encoding works on blocks of this many bytes (cache-sized planes)
+static const size_t delta_block = 64 * 1024;
+// Shorter zero runs stay inside literals
+static const size_t delta_min_zero_run = 8;
+
+// Encoded media files: a header, the key, then the embeddings
+static const uint32_t media_file_magic = 0x454d4e52; // "RNME"
+static const uint32_t media_file_version = 1;
+static const char* media_file_ext = ".rnembd";
+
+struct media_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_hash;
+    uint64_t key_size;
+    uint64_t n_floats;
+};
+
+struct state_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t model_key;
+    uint64_t n_tokens;
+    uint64_t data_size;
+    uint32_t full;
+    uint32_t reserved;
+};
+
+std::shared_ptr<common_chat_templates> llama_rn_chat_template_cache::get(const llama_model* model, const std::string& source) {
+    const size_t hash = std::hash<std::string>{}(source);
+    auto find = [&]() -> std::shared_ptr<common_chat_templates> {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->hash == hash && it->source == source) {
+                entries.splice(entries.begin(), entries, it);
+                return it->tmpls;
+            }
+        }
+        return nullptr;
+    };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto tmpls = find()) {
+            return tmpls;
+        }
+    }
+
+    // Compiled unlocked; callers may still be rendering with an evicted one
+    std::shared_ptr<common_chat_templates> compiled(
+        common_chat_templates_init(model, source).release(), common_chat_templates_deleter());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (auto tmpls = find()) {
+        return tmpls;
+    }
+    entries.push_front({hash, source, compiled});
+    if (entries.size() > max_chat_templates) {
+        entries.pop_back();
+    }
+    n_compiled++;
+    return compiled;
+}
+
+void llama_rn_chat_template_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+common_chat_params llama_rn_chat_render_cache::apply(
+    const common_chat_templates* tmpls,
+    const std::string& key,
+    const std::string& messages,
+    common_chat_templates_inputs inputs
+) {
+    std::lock_guard<std::mutex> lock(mutex);
+    n_calls++;
+    const bool add_generation_prompt = inputs.add_generation_prompt;
+
+    conversation* conv = nullptr;
+    std::vector<common_chat_msg> msgs;
+    for (auto& c : conversations) {
+        if (c.key != key) {
+            continue;
+        }
+        if (c.messages_json == messages && c.add_generation_prompt == add_generation_prompt) {
+            c.last_used = n_calls;
+            return c.result;
+        }
+        // Elements appended to the same JSON array text: only they need parsing
+        const size_t n = c.messages_json.size();
+        if (n >= 2 && messages.size() > n && c.messages_json[n - 1] == ']' && messages[n - 1] == ',' &&
+            messages.compare(0, n - 1, c.messages_json, 0, n - 1) == 0) {
+            const auto appended = common_chat_msgs_parse_oaicompat(json::parse("[" + messages.substr(n)));
+            msgs = c.messages;
+            msgs.insert(msgs.end(), appended.begin(), appended.end());
+            conv = &c;
+            break;
+        }
+    }
+    if (conv == nullptr) {
+        msgs = common_chat_msgs_parse_oaicompat(json::parse(messages));
+        for (auto& c : conversations) {
+            if (c.key == key && c.messages.size() <= msgs.size() &&
+                (conv == nullptr || c.messages.size() > conv->messages.size()) &&
+                std::equal(c.messages.begin(), c.messages.end(), msgs.begin())) {
+                conv = &c;
+            }
+        }
+    }
+
+    auto check = std::find_if(key_checks.begin(), key_checks.end(),
+                              [&](const std::pair<std::string, int>& k) { return k.first == key; });
+    if (check == key_checks.end()) {
+        if (key_checks.size() >= 2 * max_conversations) {
+            key_checks.erase(key_checks.begin());
+        }
+        key_checks.emplace_back(key, 0);
+        check = key_checks.end() - 1;
+    }
+    int& n_checked = check->second;
+
+    common_chat_params result;
+    std::string prompt;
+    bool incremental = false;
+
+    const size_t n_prev = conv != nullptr ? conv->messages.size() : 0;
+    size_t n_head = 0;
+    while (n_head < msgs.size() && (msgs[n_head].role == "system" || msgs[n_head].role == "developer")) {
+        n_head++;
+    }
+    if (conv != nullptr && !conv->prompt.empty() && n_checked >= 0 && n_prev < msgs.size() && n_prev > n_head) {
+        // The window starts at the same parity as in the conversation, for
+        // templates that check roles alternate
+        const size_t start = n_prev - (n_prev - n_head) % 2;
+        if (start > n_head) {
+            std::vector<common_chat_msg> window(msgs.begin(), msgs.begin() + n_head);
+            window.insert(window.end(), msgs.begin() + start, msgs.begin() + n_prev);
+            inputs.messages = window;
+            inputs.add_generation_prompt = false;
+            const std::string window_prev = common_chat_templates_render(tmpls, inputs);
+
+            window.insert(window.end(), msgs.begin() + n_prev, msgs.end());
+            inputs.messages = std::move(window);
+            const std::string window_all = common_chat_templates_render(tmpls, inputs);
+
+            inputs.add_generation_prompt = add_generation_prompt;
+            result = common_chat_templates_apply(tmpls, inputs);
+            if (string_starts_with(window_all, window_prev) && string_starts_with(result.prompt, window_all)) {
+                prompt = conv->prompt + window_all.substr(window_prev.size());
+                result.prompt = prompt + result.prompt.substr(window_all.size());
+                incremental = true;
+            } else {
+                n_checked = -1;
+            }
+        }
+    }
+
+    if (!incremental || n_checked < n_render_checks) {
+        inputs.messages = msgs;
+        inputs.add_generation_prompt = add_generation_prompt;
+        common_chat_params full = common_chat_templates_apply(tmpls, inputs);
+        if (incremental && full.prompt == result.prompt) {
+            n_checked++;
+        } else {
+            if (incremental) {
+                LOG_VERBOSE("Chat render: template output depends on where the conversation ends, rendering in full");
+                n_checked = -1;
+                incremental = false;
+            }
+            result = std::move(full);
+            prompt.clear();
+            if (n_checked >= 0) {
+                inputs.add_generation_prompt = false;
+                prompt = common_chat_templates_render(tmpls, inputs);
+            }
+        }
+    }
+
+    if (conv == nullptr) {
+        if (conversations.size() < max_conversations) {
+            conversations.emplace_back();
+            conv = &conversations.back();
+        } else {
+            conv = &*std::min_element(conversations.begin(), conversations.end(),
+                [](const conversation& a, const conversation& b) { return a.last_used < b.last_used; });
+        }
+        conv->key = key;
+    }
+    conv->messages_json = messages;
+    conv->messages = std::move(msgs);
+    conv->prompt = std::move(prompt);
+    conv->add_generation_prompt = add_generation_prompt;
+    conv->result = result;
+    conv->last_used = n_calls;
+
+    if (incremental) {
+        n_incremental++;
+    } else {
+        n_full++;
+    }
+    return result;
+}
+
+void llama_rn_chat_render_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    conversations.clear();
+    key_checks.clear();
+}
+
+std::vector<llama_token> llama_rn_prompt_token_cache::tokenize(llama_context* ctx, const std::string& text, bool add_special) {
+    const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(ctx));
+    std::lock_guard<std::mutex> lock(mutex);
+    n_calls++;
+    n_reused = 0;
+    if (add_special && llama_vocab_get_add_eos(vocab)) {
+        // The EOS goes after the whole text, not a fragment
+        return common_tokenize(ctx, text, add_special, true);
+    }
+
+    entry* base = nullptr;
+    const anchor* at = nullptr;
+    for (auto& e : entries) {
+        if (e.add_special != add_special) {
+            continue;
+        }
+        const size_t n = std::min(e.text.size(), text.size());
+        const size_t n_common = std::mismatch(e.text.begin(), e.text.begin() + n, text.begin()).first - e.text.begin();
+        // Last control token that ends inside the shared prefix
+        auto it = std::upper_bound(e.anchors.begin(), e.anchors.end(), n_common,
+                                   [](size_t pos, const anchor& a) { return pos < a.end; });
+        if (it == e.anchors.begin()) {
+            continue;
+        }
+        --it;
+        if (it->token > 0 && (at == nullptr || it->token > at->token)) {
+            base = &e;
+            at = &*it;
+        }
+    }
+
+    std::vector<llama_token> tokens;
+    if (at != nullptr) {
+        const std::vector<llama_token> suffix = common_tokenize(ctx, text.substr(at->pos), false, true);
+        if (!suffix.empty() && suffix[0] == base->tokens[at->token]) {
+            tokens.reserve(at->token + suffix.size());
+            tokens.assign(base->tokens.begin(), base->tokens.begin() + at->token);
+            tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+            n_reused = at->token;
+        }
+    }
+    if (n_reused == 0) {
+        tokens = common_tokenize(ctx, text, add_special, true);
+    }
+
+    // The text replaces the one it continued
+    std::vector<anchor> anchors;
+    size_t i_begin = 0;
+    size_t pos = 0;
+    if (n_reused > 0) {
+        anchors.assign(base->anchors.cbegin(), base->anchors.cbegin() + (at - base->anchors.data()));
+        i_begin = at->token;
+        pos = at->pos;
+    }
+    entry* e = base;
+    if (e == nullptr) {
+        if (entries.size() < max_conversations) {
+            entries.emplace_back();
+            e = &entries.back();
+        } else {
+            e = &*std::min_element(entries.begin(), entries.end(),
+                [](const entry& a, const entry& b) { return a.last_used < b.last_used; });
+        }
+    }
+    e->text = text;
+    e->add_special = add_special;
+    e->tokens = tokens;
+    e->anchors = std::move(anchors);
+    e->last_used = n_calls;
+    find_anchors(ctx, *e, i_begin, pos);
+
+    LOG_VERBOSE("Prompt tokens: %zu, %zu reused", tokens.size(), n_reused);
+    return tokens;
+}
+
+void llama_rn_prompt_token_cache::find_anchors(llama_context* ctx, entry& e, size_t i_begin, size_t pos) {
+    const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(ctx));
+    for (size_t i = i_begin; i < e.tokens.size(); i++) {
+        const llama_token token = e.tokens[i];
+        const llama_token_attr attr = llama_vocab_get_attr(vocab, token);
+        if (!(attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED))) {
+            continue;
+        }
+        if (i == 0 && e.add_special && token == llama_vocab_bos(vocab)) {
+            continue; // Added in front, not in the text
+        }
+        const std::string piece = common_token_to_piece(ctx, token, true);
+        const size_t found = piece.empty() ? std::string::npos : e.text.find(piece, pos);
+        if (found == std::string::npos) {
+            break; // Lost track of where the tokens are in the text
+        }
+        if (attr & LLAMA_TOKEN_ATTR_CONTROL) {
+            e.anchors.push_back({found, found + piece.size(), i});
+        }
+        pos = found + piece.size();
+    }
+}
+
+void llama_rn_prompt_token_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t llama_rn_state_disk_cache::hash_tokens(uint64_t model_key, const llama_token* tokens, size_t n_tokens) {
+    uint64_t hash = fnv1a(14695981039346656037ULL, &model_key, sizeof(model_key));
+    for (size_t i = 0; i < n_tokens; i++) {
+        hash = fnv1a(hash, &tokens[i], sizeof(llama_token));
+    }
+    return hash;
+}
+
+uint64_t llama_rn_state_disk_cache::hash_model_key(const std::string& description) {
+    return fnv1a(14695981039346656037ULL, description.data(), description.size());
+}
+
+llama_rn_state_disk_cache::snapshot::~snapshot() = default;
+
+void llama_rn_state_disk_cache::open(const std::string& dir, size_t budget_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    total_bytes = 0;
+    n_calls = 0;
+    this->dir = dir;
+    this->budget_bytes = 0;
+    if (dir.empty() || budget_bytes == 0) {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (!std::filesystem::is_directory(dir, ec)) {
+        LOG_WARNING("State disk cache: cannot create %s; disabled", dir.c_str());
+        return;
+    }
+    this->budget_bytes = budget_bytes;
+
+    // Files left by earlier runs, least recently used first
+    std::vector<std::pair<std::filesystem::file_time_type, entry>> found;
+    for (const auto& f : fs_list(dir, false)) {
+        if (!string_ends_with(f.name, state_file_ext)) {
+            continue;
+        }
+        state_file_header h = {};
+        try {
+            llama_file file(f.path.c_str(), "rb");
+            if (file.size() >= sizeof(h)) {
+                file.read_raw(&h, sizeof(h));
+            }
+        } catch (const std::exception&) {
+            continue;
+        }
+        if (h.magic != state_file_magic || h.version != state_file_version ||
+            f.size != sizeof(h) + h.n_tokens * sizeof(llama_token) + h.data_size) {
+            std::filesystem::remove(f.path, ec); // Left by an interrupted write or another version
+            continue;
+        }
+        const auto mtime = std::filesystem::last_write_time(f.path, ec);
+        found.push_back({mtime, {f.path, h.key, h.model_key, (size_t) h.n_tokens, h.full != 0, f.size, 0}});
+    }
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto& f : found) {
+        f.second.last_used = ++n_calls;
+        total_bytes += f.second.size;
+        entries.push_back(std::move(f.second));
+    }
+    evict(0);
+    LOG_INFO("State disk cache: %zu snapshots (%.1f MiB) in %s", entries.size(), total_bytes / (1024.0 * 1024.0), dir.c_str());
+}
+
+void llama_rn_state_disk_cache::evict(size_t incoming) {
+    while (!entries.empty() && total_bytes + incoming > budget_bytes) {
+        auto victim = std::min_element(entries.begin(), entries.end(),
+            [](const entry& a, const entry& b) { return a.last_used < b.last_used; });
+        std::error_code ec;
+        std::filesystem::remove(victim->path, ec);
+        total_bytes -= victim->size;
+        entries.erase(victim);
+    }
+}
+
+bool llama_rn_state_disk_cache::contains(uint64_t model_key, const llama_token* tokens, size_t n_tokens, bool full) {
+    const uint64_t key = hash_tokens(model_key, tokens, n_tokens);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& e : entries) {
+        if (e.key == key && e.model_key == model_key && e.n_tokens == n_tokens && e.full == full) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool llama_rn_state_disk_cache::put(
+    uint64_t model_key,
+    const llama_token* tokens,
+    size_t n_tokens,
+    const uint8_t* data,
+    size_t size,
+    bool full
+) {
+    const size_t file_size = sizeof(state_file_header) + n_tokens * sizeof(llama_token) + size;
+    if (!enabled() || n_tokens == 0 || file_size > budget_bytes) {
+        return false;
+    }
+    const uint64_t key = hash_tokens(model_key, tokens, n_tokens);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& e : entries) {
+        if (e.key == key && e.model_key == model_key && e.n_tokens == n_tokens && e.full == full) {
+            e.last_used = ++n_calls; // Same tokens, same state
+            return true;
+        }
+    }
+    evict(file_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx.%s%s", (unsigned long long) key, full ? "full" : "part", state_file_ext);
+    const std::string path = dir + "/" + name;
+    const std::string tmp_path = path + ".tmp";
+    std::error_code ec;
+    try {
+        // Written aside and renamed, so a reader never sees half a file
+        llama_file file(tmp_path.c_str(), "wb");
+        const state_file_header h = {state_file_magic, state_file_version, key, model_key,
+                                     (uint64_t) n_tokens, (uint64_t) size, full ? 1u : 0u, 0};
+        file.write_raw(&h, sizeof(h));
+        file.write_raw(tokens, n_tokens * sizeof(llama_token));
+        file.write_raw(data, size);
+    } catch (const std::exception& err) {
+        LOG_WARNING("State disk cache: cannot write %s: %s", tmp_path.c_str(), err.what());
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        LOG_WARNING("State disk cache: cannot rename %s: %s", tmp_path.c_str(), ec.message().c_str());
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+
+    entries.push_back({path, key, model_key, n_tokens, full, file_size, ++n_calls});
+    total_bytes += file_size;
+    n_written++;
+    LOG_VERBOSE("State disk cache: wrote %s snapshot of %zu tokens (%.1f KiB)", full ? "full" : "partial", n_tokens, size / 1024.0);
+    return true;
+}
+
+std::unique_ptr<llama_rn_state_disk_cache::snapshot> llama_rn_state_disk_cache::map(const entry& e) {
+    auto snap = std::make_unique<snapshot>();
+    try {
+        snap->file = std::make_unique<llama_file>(e.path.c_str(), "rb");
+        const uint8_t* base = nullptr;
+        size_t size = snap->file->size();
+        if (llama_mmap::SUPPORTED) {
+            snap->mapping = std::make_unique<llama_mmap>(snap->file.get());
+            base = static_cast<const uint8_t*>(snap->mapping->addr());
+        } else {
+            snap->buf.resize(size);
+            snap->file->read_raw(snap->buf.data(), size);
+            base = snap->buf.data();
+        }
+
+        state_file_header h;
+        if (size < sizeof(h)) {
+            return nullptr;
+        }
+        memcpy(&h, base, sizeof(h));
+        if (h.magic != state_file_magic || h.version != state_file_version || h.key != e.key ||
+            h.n_tokens != e.n_tokens || size != sizeof(h) + h.n_tokens * sizeof(llama_token) + h.data_size) {
+            return nullptr;
+        }
+        snap->tokens = reinterpret_cast<const llama_token*>(base + sizeof(h));
+        snap->n_tokens = (size_t) h.n_tokens;
+        snap->data = base + sizeof(h) + h.n_tokens * sizeof(llama_token);
+        snap->size = (size_t) h.data_size;
+        snap->full = h.full != 0;
+    } catch (const std::exception& err) {
+        LOG_WARNING("State disk cache: cannot map %s: %s", e.path.c_str(), err.what());
+        return nullptr;
+    }
+    return snap;
+}
+
+std::unique_ptr<llama_rn_state_disk_cache::snapshot> llama_rn_state_disk_cache::find(
+    uint64_t model_key,
+    const std::vector<llama_token>& target,
+    size_t max_partial,
+    size_t max_full
+) {
+    if (!enabled()) {
+        return nullptr;
+    }
+    const size_t n_max = std::min(target.size(), std::max(max_partial, max_full));
+
+    // Every prefix hashed in one pass; entries match by hash, then by tokens
+    std::vector<uint64_t> prefix_keys(n_max + 1);
+    uint64_t hash = fnv1a(14695981039346656037ULL, &model_key, sizeof(model_key));
+    prefix_keys[0] = hash;
+    for (size_t i = 0; i < n_max; i++) {
+        hash = fnv1a(hash, &target[i], sizeof(llama_token));
+        prefix_keys[i + 1] = hash;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const entry& e = entries[i];
+        const size_t limit = std::min(n_max, e.full ? max_full : max_partial);
+        if (e.model_key == model_key && e.n_tokens > 0 && e.n_tokens <= limit && prefix_keys[e.n_tokens] == e.key) {
+            candidates.push_back(i);
+        }
+    }
+    // Longest first; the smaller file of two as long
+    std::sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+        return entries[a].n_tokens != entries[b].n_tokens
+            ? entries[a].n_tokens > entries[b].n_tokens
+            : entries[a].size < entries[b].size;
+    });
+
+    std::unique_ptr<snapshot> found;
+    std::vector<size_t> missing;
+    for (size_t i : candidates) {
+        auto snap = map(entries[i]);
+        if (!snap) {
+            missing.push_back(i); // Deleted or damaged under us
+            continue;
+        }
+        if (std::equal(snap->tokens, snap->tokens + snap->n_tokens, target.begin())) {
+            entry& e = entries[i];
+            e.last_used = ++n_calls;
+            std::error_code ec;
+            std::filesystem::last_write_time(e.path, std::filesystem::file_time_type::clock::now(), ec);
+            n_found++;
+            found = std::move(snap);
+            break;
+        }
+    }
+    std::sort(missing.rbegin(), missing.rend());
+    for (size_t i : missing) {
+        std::error_code ec;
+        std::filesystem::remove(entries[i].path, ec);
+        total_bytes -= entries[i].size;
+        entries.erase(entries.begin() + i);
+    }
+    return found;
+}
+
+uint64_t llama_rn_media_embd_cache::hash_key(const std::string& key) {
+    return fnv1a(14695981039346656037ULL, key.data(), key.size());
+}
+
+void llama_rn_media_embd_cache::configure(size_t budget_bytes, const std::string& dir, size_t disk_budget_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    files.clear();
+    total_bytes = 0;
+    disk_bytes = 0;
+    n_calls = 0;
+    this->budget_bytes = budget_bytes;
+    this->dir = dir;
+    this->disk_budget_bytes = 0;
+    if (dir.empty() || disk_budget_bytes == 0) {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (!std::filesystem::is_directory(dir, ec)) {
+        LOG_WARNING("Media cache: cannot create %s; disk tier disabled", dir.c_str());
+        return;
+    }
+    this->disk_budget_bytes = disk_budget_bytes;
+
+    // Files left by earlier runs, least recently used first
+    std::vector<std::pair<std::filesystem::file_time_type, file_entry>> found;
+    for (const auto& f : fs_list(dir, false)) {
+        if (!string_ends_with(f.name, media_file_ext)) {
+            continue;
+        }
+        media_file_header h = {};
+        try {
+            llama_file file(f.path.c_str(), "rb");
+            if (file.size() >= sizeof(h)) {
+                file.read_raw(&h, sizeof(h));
+            }
+        } catch (const std::exception&) {
+            continue;
+        }
+        if (h.magic != media_file_magic || h.version != media_file_version ||
+            f.size != sizeof(h) + h.key_size + h.n_floats * sizeof(float)) {
+            std::filesystem::remove(f.path, ec); // Left by an interrupted write or another version
+            continue;
+        }
+        const auto mtime = std::filesystem::last_write_time(f.path, ec);
+        found.push_back({mtime, {f.path, h.key_hash, f.size, 0}});
+    }
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto& f : found) {
+        f.second.last_used = ++n_calls;
+        disk_bytes += f.second.size;
+        files.push_back(std::move(f.second));
+    }
+    evict_files(0);
+    LOG_INFO("Media cache: %zu encoded media (%.1f MiB) in %s", files.size(), disk_bytes / (1024.0 * 1024.0), dir.c_str());
+}
+
+void llama_rn_media_embd_cache::insert(const std::string& key, embd_ptr embd) {
+    const size_t size = embd->size() * sizeof(float) + key.size();
+    if (size > budget_bytes) {
+        return;
+    }
+    while (!entries.empty() && total_bytes + size > budget_bytes) {
+        auto victim = std::min_element(entries.begin(), entries.end(),
+            [](const entry& a, const entry& b) { return a.last_used < b.last_used; });
+        total_bytes -= victim->embd->size() * sizeof(float) + victim->key.size();
+        entries.erase(victim);
+    }
+    entries.push_back({key, std::move(embd), ++n_calls});
+    total_bytes += size;
+}
+
+void llama_rn_media_embd_cache::evict_files(size_t incoming) {
+    while (!files.empty() && disk_bytes + incoming > disk_budget_bytes) {
+        auto victim = std::min_element(files.begin(), files.end(),
+            [](const file_entry& a, const file_entry& b) { return a.last_used < b.last_used; });
+        std::error_code ec;
+        std::filesystem::remove(victim->path, ec);
+        disk_bytes -= victim->size;
+        files.erase(victim);
+    }
+}
+
+llama_rn_media_embd_cache::embd_ptr llama_rn_media_embd_cache::read_file(const file_entry& f, const std::string& key) {
+    try {
+        llama_file file(f.path.c_str(), "rb");
+        media_file_header h;
+        if (file.size() < sizeof(h)) {
+            return nullptr;
+        }
+        file.read_raw(&h, sizeof(h));
+        if (h.magic != media_file_magic || h.version != media_file_version || h.key_hash != f.key_hash ||
+            h.key_size != key.size() || file.size() != sizeof(h) + h.key_size + h.n_floats * sizeof(float)) {
+            return nullptr;
+        }
+        std::string stored_key(key.size(), '\0');
+        file.read_raw(stored_key.data(), stored_key.size());
+        if (stored_key != key) {
+            return nullptr;
+        }
+        std::vector<float> embd((size_t) h.n_floats);
+        file.read_raw(embd.data(), embd.size() * sizeof(float));
+        return std::make_shared<const std::vector<float>>(std::move(embd));
+    } catch (const std::exception& err) {
+        LOG_WARNING("Media cache: cannot read %s: %s", f.path.c_str(), err.what());
+        return nullptr;
+    }
+}
+
+void llama_rn_media_embd_cache::write_file(const std::string& key, const float* data, size_t n_floats) {
+    const size_t file_size = sizeof(media_file_header) + key.size() + n_floats * sizeof(float);
+    if (file_size > disk_budget_bytes) {
+        return;
+    }
+    const uint64_t key_hash = hash_key(key);
+    for (auto& f : files) {
+        if (f.key_hash == key_hash) {
+            f.last_used = ++n_calls;
+            return;
+        }
+    }
+    evict_files(file_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx%s", (unsigned long long) key_hash, media_file_ext);
+    const std::string path = dir + "/" + name;
+    const std::string tmp_path = path + ".tmp";
+    std::error_code ec;
+    try {
+        // Written aside and renamed, so a reader never sees half a file
+        llama_file file(tmp_path.c_str(), "wb");
+        const media_file_header h = {media_file_magic, media_file_version, key_hash,
+                                     (uint64_t) key.size(), (uint64_t) n_floats};
+        file.write_raw(&h, sizeof(h));
+        file.write_raw(key.data(), key.size());
+        file.write_raw(data, n_floats * sizeof(float));
+    } catch (const std::exception& err) {
+        LOG_WARNING("Media cache: cannot write %s: %s", tmp_path.c_str(), err.what());
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        LOG_WARNING("Media cache: cannot rename %s: %s", tmp_path.c_str(), ec.message().c_str());
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    files.push_back({path, key_hash, file_size, ++n_calls});
+    disk_bytes += file_size;
+}
+
+llama_rn_media_embd_cache::embd_ptr llama_rn_media_embd_cache::get(const std::string& key) {
+    if (!enabled()) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& e : entries) {
+        if (e.key == key) {
+            e.last_used = ++n_calls;
+            n_hits++;
+            return e.embd;
+        }
+    }
+    const uint64_t key_hash = hash_key(key);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i].key_hash != key_hash) {
+            continue;
+        }
+        std::error_code ec;
+        auto embd = read_file(files[i], key);
+        if (!embd) {
+            std::filesystem::remove(files[i].path, ec); // Deleted or damaged under us
+            disk_bytes -= files[i].size;
+            files.erase(files.begin() + i);
+            break;
+        }
+        files[i].last_used = ++n_calls;
+        std::filesystem::last_write_time(files[i].path, std::filesystem::file_time_type::clock::now(), ec);
+        n_disk_hits++;
+        insert(key, embd);
+        return embd;
+    }
+    n_misses++;
+    return nullptr;
+}
+
+void llama_rn_media_embd_cache::put(const std::string& key, const float* data, size_t n_floats) {
+    if (!enabled() || data == nullptr || n_floats == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    bool cached = false;
+    for (auto& e : entries) {
+        if (e.key == key) {
+            e.last_used = ++n_calls;
+            cached = true;
+            break;
+        }
+    }
+    if (!cached) {
+        insert(key, std::make_shared<const std::vector<float>>(data, data + n_floats));
+    }
+    if (disk_budget_bytes > 0) {
+        write_file(key, data, n_floats);
+    }
+}
+
+void llama_rn_media_embd_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    total_bytes = 0;
+}
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+}
+
+static bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs of (length << 1 | 1) followed by literal bytes, or (length << 1) zeros
+static void encode_zero_runs(const uint8_t* src, size_t n, std::vector<uint8_t>& out) {
+    size_t i = 0;
+    size_t lit = 0;
+    while (i < n) {
+        if (src[i] != 0) {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        for (uint64_t w; j + 8 <= n; j += 8) {
+            memcpy(&w, src + j, sizeof(w));
+            if (w != 0) {
+                break;
+            }
+        }
+        while (j < n && src[j] == 0) {
+            j++;
+        }
+        if (j - i >= delta_min_zero_run) {
+            if (i > lit) {
+                put_varint(out, (uint64_t) (i - lit) << 1 | 1);
+                out.insert(out.end(), src + lit, src + i);
+            }
+            put_varint(out, (uint64_t) (j - i) << 1);
+            lit = j;
+        }
+        i = j;
+    }
+    if (n > lit) {
+        put_varint(out, (uint64_t) (n - lit) << 1 | 1);
+        out.insert(out.end(), src + lit, src + n);
+    }
+}
+
+void llama_rn_state_delta::encode(const uint8_t* base, size_t base_size,
+                                  const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    out.clear();
+    std::vector<uint8_t> x(std::min(size, delta_block));
+    std::vector<uint8_t> planes(x.size());
+    for (size_t off = 0; off < size; off += delta_block) {
+        const size_t n = std::min(delta_block, size - off);
+        const size_t n_base = off < base_size ? std::min(n, base_size - off) : 0;
+        for (size_t i = 0; i < n_base; i++) {
+            x[i] = data[off + i] ^ base[off + i];
+        }
+        memcpy(x.data() + n_base, data + off + n_base, n - n_base);
+
+        const size_t n_words = n / 4;
+        for (size_t i = 0; i < n_words; i++) {
+            planes[i]               = x[4 * i];
+            planes[n_words + i]     = x[4 * i + 1];
+            planes[2 * n_words + i] = x[4 * i + 2];
+            planes[3 * n_words + i] = x[4 * i + 3];
+        }
+        memcpy(planes.data() + 4 * n_words, x.data() + 4 * n_words, n - 4 * n_words);
+        encode_zero_runs(planes.data(), n, out);
+    }
+}
+
+bool llama_rn_state_delta::decode(const uint8_t* base, size_t base_size,
+                                  const uint8_t* enc, size_t enc_size, size_t size, std::vector<uint8_t>& out) {
+    out.resize(size);
+    std::vector<uint8_t> planes(std::min(size, delta_block));
+    const uint8_t* p = enc;
+    const uint8_t* end = enc + enc_size;
+    for (size_t off = 0; off < size; off += delta_block) {
+        const size_t n = std::min(delta_block, size - off);
+        for (size_t k = 0; k < n; ) {
+            uint64_t v;
+            if (!get_varint(p, end, v)) {
+                return false;
+            }
+            const uint64_t len = v >> 1;
+            if (len == 0 || len > n - k) {
+                return false;
+            }
+            if (v & 1) {
+                if ((uint64_t) (end - p) < len) {
+                    return false;
+                }
+                memcpy(planes.data() + k, p, len);
+                p += len;
+            } else {
+                memset(planes.data() + k, 0, len);
+            }
+            k += len;
+        }
+
+        uint8_t* dst = out.data() + off;
+        const size_t n_words = n / 4;
+        for (size_t i = 0; i < n_words; i++) {
+            dst[4 * i]     = planes[i];
+            dst[4 * i + 1] = planes[n_words + i];
+            dst[4 * i + 2] = planes[2 * n_words + i];
+            dst[4 * i + 3] = planes[3 * n_words + i];
+        }
+        memcpy(dst + 4 * n_words, planes.data() + 4 * n_words, n - 4 * n_words);
+        const size_t n_base = off < base_size ? std::min(n, base_size - off) : 0;
+        for (size_t i = 0; i < n_base; i++) {
+            dst[i] ^= base[off + i];
+        }
+    }
+    return p == end;
+}
+
+} // namespace rnllama
@@ -0,0 +1,248 @@
+#ifndef RN_PROMPT_CACHE_H
+#define RN_PROMPT_CACHE_H
+
+#include "chat.h"
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct llama_file;
+struct llama_mmap;
+
+namespace rnllama {
+
+// Custom chat templates compiled for the context's model, most recently used
+// first. Compiling parses the template and probes its capabilities, which
+// takes longer than most renders.
+struct llama_rn_chat_template_cache {
+    std::shared_ptr<common_chat_templates> get(const llama_model* model, const std::string& source);
+    void clear();
+
+    size_t n_compiled = 0;
+
+private:
+    struct entry {
+        size_t hash;
+        std::string source;
+        std::shared_ptr<common_chat_templates> tmpls;
+    };
+
+    std::mutex mutex;
+    std::list<entry> entries;
+};
+
+// Renders chat prompts turn by turn. A conversation usually grows by a few
+// messages per call; when the new message list extends one rendered before,
+// only a short window (the leading system messages plus the messages from the
+// end of the previous list) goes through the template, and its rendering past
+// the previous messages is appended to the previous prompt.
+//
+// That is only right for templates that render a message the same wherever
+// the conversation ends (prefix-stable). Each set of render options is checked
+// against full renders on its first incremental turns and renders in full
+// from then on if they differ.
+struct llama_rn_chat_render_cache {
+    // `messages` is the OpenAI-style JSON array; `inputs` holds everything
+    // else, and `key` must identify it (template, tools, options).
+    common_chat_params apply(
+        const common_chat_templates* tmpls,
+        const std::string& key,
+        const std::string& messages,
+        common_chat_templates_inputs inputs
+    );
+    void clear();
+
+    size_t n_full = 0;                     // Renders of the whole conversation
+    size_t n_incremental = 0;              // Renders of a window only
+
+private:
+    struct conversation {
+        std::string key;
+        std::string messages_json;
+        std::vector<common_chat_msg> messages;
+        std::string prompt;                // Without the generation prompt; empty if not kept
+        bool add_generation_prompt = false;
+        common_chat_params result;
+        uint64_t last_used = 0;
+    };
+
+    std::mutex mutex;
+    std::vector<conversation> conversations;
+    std::vector<std::pair<std::string, int>> key_checks; // Verified turns per key, -1 = not prefix-stable
+    uint64_t n_calls = 0;
+};
+
+// Tokenizes prompts that share a prefix with one tokenized before. The text
+// splits into fragments at special tokens and each fragment is tokenized on
+// its own, so the tokens up to a control token in the shared prefix are
+// reused and only the text from there on is tokenized.
+struct llama_rn_prompt_token_cache {
+    std::vector<llama_token> tokenize(llama_context* ctx, const std::string& text, bool add_special);
+    void clear();
+
+    size_t n_reused = 0;                   // Tokens the last call took from the cache
+
+private:
+    struct anchor {
+        size_t pos;                        // Where the control token's text starts
+        size_t end;
+        size_t token;                      // Its index in the tokens
+    };
+
+    struct entry {
+        std::string text;
+        bool add_special = false;
+        std::vector<llama_token> tokens;
+        std::vector<anchor> anchors;       // Ascending
+        uint64_t last_used = 0;
+    };
+
+    // Locate the control tokens from token i_begin on, starting the search at pos
+    static void find_anchors(llama_context* ctx, entry& e, size_t i_begin, size_t pos);
+
+    std::mutex mutex;
+    std::vector<entry> entries;
+    uint64_t n_calls = 0;
+};
+
+// Second tier of the prompt state checkpoint cache (rn_state_checkpoint):
+// snapshots in a directory, one file each, named by a hash of the model key
+// and the tokens they represent. It has a byte budget of its own and deletes
+// the least recently used files first; file times keep that order across runs.
+//
+// A PARTIAL_ONLY snapshot only restores on top of a live cache that already
+// holds its tokens. A full one restores into an empty sequence, so it outlives
+// the context.
+struct llama_rn_state_disk_cache {
+    // A stored snapshot, mapped read-only
+    struct snapshot {
+        const llama_token* tokens = nullptr;
+        size_t n_tokens = 0;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        bool full = false;
+
+        ~snapshot();
+
+    private:
+        friend struct llama_rn_state_disk_cache;
+        std::unique_ptr<llama_file> file;
+        std::unique_ptr<llama_mmap> mapping;
+        std::vector<uint8_t> buf;          // File contents where mmap is unsupported
+    };
+
+    // Index the snapshots already in dir; an empty dir or budget disables the tier
+    void open(const std::string& dir, size_t budget_bytes);
+    bool enabled() const { return budget_bytes > 0; }
+
+    bool contains(uint64_t model_key, const llama_token* tokens, size_t n_tokens, bool full);
+    bool put(uint64_t model_key, const llama_token* tokens, size_t n_tokens,
+             const uint8_t* data, size_t size, bool full);
+    // The longest snapshot whose tokens prefix target: partial ones of up to
+    // max_partial tokens, full ones of up to max_full. nullptr if none.
+    std::unique_ptr<snapshot> find(uint64_t model_key, const std::vector<llama_token>& target,
+                                   size_t max_partial, size_t max_full);
+
+    // Stable hash of what a snapshot depends on besides its tokens
+    static uint64_t hash_model_key(const std::string& description);
+
+    size_t total_bytes = 0;
+    size_t n_written = 0;
+    size_t n_found = 0;
+
+private:
+    struct entry {
+        std::string path;
+        uint64_t key;                      // Hash of the model key and the tokens
+        uint64_t model_key;
+        size_t n_tokens;
+        bool full;
+        size_t size;                       // File size
+        uint64_t last_used;
+    };
+
+    static uint64_t hash_tokens(uint64_t model_key, const llama_token* tokens, size_t n_tokens);
+    std::unique_ptr<snapshot> map(const entry& e);
+    void evict(size_t incoming);
+
+    std::mutex mutex;
+    std::string dir;
+    size_t budget_bytes = 0;
+    std::vector<entry> entries;
+    uint64_t n_calls = 0;
+};
+
+// Encoded media: the projector's embeddings of an image or audio chunk, by a
+// key naming the projector, its preprocessing and the media content. Kept
+// within a byte budget, least recently used evicted first, so media seen
+// before is decoded from its embeddings without running the encoder again.
+// With a directory, entries are also written there (a budget of its own,
+// least recently used deleted first) and outlive the context.
+struct llama_rn_media_embd_cache {
+    using embd_ptr = std::shared_ptr<const std::vector<float>>;
+
+    // Empty dir or zero disk budget leaves the disk tier off. Resets the memory tier.
+    void configure(size_t budget_bytes, const std::string& dir, size_t disk_budget_bytes);
+    bool enabled() const { return budget_bytes > 0 || disk_budget_bytes > 0; }
+
+    // nullptr on a miss; a disk hit is promoted to memory
+    embd_ptr get(const std::string& key);
+    void put(const std::string& key, const float* data, size_t n_floats);
+    void clear();                          // Memory tier only
+
+    size_t total_bytes = 0;                // Memory tier
+    size_t disk_bytes = 0;
+    size_t n_hits = 0;
+    size_t n_disk_hits = 0;
+    size_t n_misses = 0;
+
+private:
+    struct entry {
+        std::string key;
+        embd_ptr embd;
+        uint64_t last_used;
+    };
+
+    struct file_entry {
+        std::string path;
+        uint64_t key_hash;
+        size_t size;                       // File size
+        uint64_t last_used;
+    };
+
+    static uint64_t hash_key(const std::string& key);
+    void insert(const std::string& key, embd_ptr embd);
+    embd_ptr read_file(const file_entry& f, const std::string& key);
+    void write_file(const std::string& key, const float* data, size_t n_floats);
+    void evict_files(size_t incoming);
+
+    std::mutex mutex;
+    size_t budget_bytes = 0;
+    std::string dir;
+    size_t disk_budget_bytes = 0;
+    std::vector<entry> entries;
+    std::vector<file_entry> files;
+    uint64_t n_calls = 0;
+};
+
+// Compact form of a state snapshot: its XOR against a base snapshot, with the
+// bytes of each 32-bit word split into planes and zero runs collapsed. Two
+// snapshots of the same model mostly agree in sign and exponent, so the high
+// planes of their XOR are nearly all zero. Sizes may differ; the part past
+// the base is stored as is.
+struct llama_rn_state_delta {
+    static void encode(const uint8_t* base, size_t base_size,
+                       const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+    // False if enc is malformed
+    static bool decode(const uint8_t* base, size_t base_size,
+                       const uint8_t* enc, size_t enc_size, size_t size, std::vector<uint8_t>& out);
+};
+
+} // namespace rnllama
+
+#endif /* RN_PROMPT_CACHE_H */
@@ -0,0 +1,306 @@
+#include "rn-rerank.h"
+#include "rn-llama.h"
+#include "rn-common.hpp"
+#include "llama-context.h"
+#include <algorithm>
+#include <numeric>
+
+namespace rnllama {
+
+llama_rn_rerank_batch::llama_rn_rerank_batch(
+    llama_context* ctx,
+    const std::vector<llama_seq_id>& lane_seq_ids,
+    std::vector<std::vector<llama_token>> pairs,
+    int32_t n_embd
+) : ctx(ctx), mem(llama_get_memory(ctx)), pairs(std::move(pairs)), n_embd(n_embd) {
+    scores.assign(this->pairs.size(), -1e6f);
+    embeddings.assign(this->pairs.size() * n_embd, 0.0f);
+
+    const llama_model* model = llama_get_model(ctx);
+    pool_last = pools_last_token(ctx);
+    n_max_pair = std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+
+    // Without a unified cache a batch is split into ubatches holding as many
+    // tokens of each sequence, so a pair not pooled from its last token only
+    // stays whole next to pairs of its own length. Visit pairs shortest first
+    // to line those up.
+    const llama_cparams& cparams = ctx->get_cparams();
+    equal_split = !pool_last && mem != nullptr && !cparams.kv_unified && cparams.n_seq_max > 1;
+    order.resize(this->pairs.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (equal_split) {
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return this->pairs[a].size() < this->pairs[b].size();
+        });
+    }
+
+    for (llama_seq_id seq_id : lane_seq_ids) {
+        lane l;
+        l.seq_id = seq_id;
+        lanes.push_back(l);
+        if (mem != nullptr) {
+            llama_memory_seq_rm(mem, seq_id, -1, -1);
+        }
+    }
+
+    // A single lane shares the prefix by trimming back to it after each
+    // pair, which recurrent state can't do
+    const bool can_trim = !llama_model_is_recurrent(model) && !llama_model_is_hybrid(model);
+    if (pool_last && this->pairs.size() > 1 && !lanes.empty() && (lanes.size() > 1 || can_trim)) {
+        size_t n_common = this->pairs[0].size();
+        for (const auto& pair : this->pairs) {
+            n_common = std::min(n_common, find_common_prefix_length(this->pairs[0], pair));
+            // Every pair keeps at least its own last token to pool
+            n_common = std::min(n_common, pair.empty() ? 0 : pair.size() - 1);
+        }
+        // A lone BOS isn't worth a decode of its own
+        n_prefix = n_common > 1 ? n_common : 0;
+    }
+}
+
+bool llama_rn_rerank_batch::pools_last_token(llama_context* ctx) {
+    // Which token a sequence is pooled from mirrors llm_graph_input_cls.
+    // Only a last-token pool can be split across decodes or share a prefix
+    // decoded earlier; memoryless (non-causal) models see one batch at a time.
+    const llama_model* model = llama_get_model(ctx);
+    const enum llama_pooling_type pooling = llama_pooling_type(ctx);
+    return llama_get_memory(ctx) != nullptr && (pooling == LLAMA_POOLING_TYPE_LAST ||
+        (pooling == LLAMA_POOLING_TYPE_RANK && (model->arch == LLM_ARCH_QWEN3 || model->arch == LLM_ARCH_QWEN3VL)));
+}
+
+size_t llama_rn_rerank_batch::token_begin(const lane& l) const {
+    return l.pair == lane_prefix ? 0 : n_prefix;
+}
+
+size_t llama_rn_rerank_batch::token_end(const lane& l) const {
+    return l.pair == lane_prefix ? n_prefix : pairs[l.pair].size();
+}
+
+int32_t llama_rn_rerank_batch::add_to_batch(llama_batch& batch, int32_t n_max) {
+    if (!pool_last) {
+        // A pair pooled from its first token (and any non-causal batch) must
+        // not straddle a ubatch: keep to the first one
+        n_max = std::min<int32_t>(n_max, (int32_t) llama_n_ubatch(ctx) - batch.n_tokens);
+    }
+
+    int32_t n_added = 0;
+    size_t batch_len = 0;                  // Length of the pairs in this batch (equal_split)
+    auto add_tokens = [&](lane& l) {
+        const auto& tokens = pairs[l.pair == lane_prefix ? 0 : l.pair];
+        const size_t begin = token_begin(l);
+        const size_t end = token_end(l);
+        while (begin + l.n_added < end && n_added < n_max) {
+            const size_t i = begin + l.n_added;
+            llama_batch_add(&batch, tokens[i], (llama_pos) i, {l.seq_id}, true);
+            l.n_added++;
+            n_added++;
+        }
+        l.finishing = begin + l.n_added == end;
+    };
+
+    // The shared prefix goes first, on its own: pairs are copied from it
+    if (n_prefix > 0 && !prefix_ready) {
+        lane& l = lanes[0];
+        if (l.pair == lane_idle) {
+            l.pair = lane_prefix;
+            l.n_added = 0;
+        }
+        if (!l.finishing) {
+            add_tokens(l);
+        }
+        if (n_added > 0) {
+            n_decodes++;
+        }
+        return n_added;
+    }
+
+    // Pairs already under way (split, or restarted after a deferral)
+    for (auto& l : lanes) {
+        if (l.pair < 0 || l.finishing || l.restart || n_added >= n_max) {
+            continue;
+        }
+        if (!pool_last && token_end(l) - token_begin(l) > (size_t)(n_max - n_added)) {
+            continue;
+        }
+        if (equal_split && batch_len > 0 && pairs[l.pair].size() != batch_len) {
+            continue;
+        }
+        if (equal_split) {
+            batch_len = pairs[l.pair].size();
+        }
+        add_tokens(l);
+    }
+
+    // Start pairs in free lanes; with several lanes the first one only holds the prefix
+    const size_t first_lane = n_prefix > 0 && lanes.size() > 1 ? 1 : 0;
+    for (size_t k = first_lane; k < lanes.size() && n_added < n_max; k++) {
+        lane& l = lanes[k];
+        if (l.pair != lane_idle) {
+            continue;
+        }
+
+        while (next_pair < pairs.size() && pairs[order[next_pair]].size() > (size_t) n_max_pair && !pool_last) {
+            LOG_WARNING("Rerank: pair %zu has %zu tokens, more than fit in one decode (%d); skipping",
+                        order[next_pair], pairs[order[next_pair]].size(), n_max_pair);
+            next_pair++;
+        }
+        if (next_pair >= pairs.size()) {
+            break;
+        }
+        const auto& pair = pairs[order[next_pair]];
+        if (!pool_last && pair.size() - n_prefix > (size_t)(n_max - n_added)) {
+            break; // Whole pairs only; it goes into the next batch
+        }
+        if (equal_split && batch_len > 0 && pair.size() != batch_len) {
+            break;
+        }
+        if (equal_split) {
+            batch_len = pair.size();
+        }
+
+        if (mem != nullptr && n_prefix > 0 && k > 0) {
+            llama_memory_seq_rm(mem, l.seq_id, -1, -1);
+            llama_memory_seq_cp(mem, lanes[0].seq_id, l.seq_id, -1, -1);
+        }
+        l.pair = (int32_t) order[next_pair++];
+        l.n_added = 0;
+        add_tokens(l);
+    }
+
+    if (n_added > 0) {
+        n_decodes++;
+    }
+    return n_added;
+}
+
+void llama_rn_rerank_batch::collect() {
+    for (auto& l : lanes) {
+        if (l.restart) {
+            l.restart = false;
+            l.n_added = 0;
+            if (mem != nullptr) {
+                llama_memory_seq_rm(mem, l.seq_id, -1, -1);
+            }
+            continue;
+        }
+        if (!l.finishing) {
+            continue;
+        }
+        l.finishing = false;
+
+        if (l.pair == lane_prefix) {
+            prefix_ready = true;
+            l.pair = lane_idle;
+            l.n_added = 0;
+            continue;
+        }
+
+        const float* data = llama_get_embeddings_seq(ctx, l.seq_id);
+        scores[l.pair] = data ? data[0] : -1e6f;
+        if (data && n_embd > 0) {
+            std::copy(data, data + n_embd, embeddings.begin() + (size_t) l.pair * n_embd);
+        }
+        n_scored++;
+        free_lane(l);
+    }
+}
+
+void llama_rn_rerank_batch::free_lane(lane& l) {
+    l.pair = lane_idle;
+    l.n_added = 0;
+    l.finishing = false;
+    if (mem == nullptr) {
+        return;
+    }
+
+    // A single lane keeps the prefix for the next pair
+    if (n_prefix > 0 && lanes.size() == 1) {
+        if (llama_memory_seq_rm(mem, l.seq_id, (llama_pos) n_prefix, -1)) {
+            return;
+        }
+        prefix_ready = false;
+    }
+    llama_memory_seq_rm(mem, l.seq_id, -1, -1);
+}
+
+void llama_rn_rerank_batch::defer(llama_seq_id seq_id, llama_pos pos) {
+    for (auto& l : lanes) {
+        if (l.seq_id != seq_id || l.pair == lane_idle) {
+            continue;
+        }
+        l.finishing = false;
+        if (pool_last) {
+            // Tokens before pos stay in this batch; carry on from there
+            l.n_added = (size_t) std::max<llama_pos>(0, pos - (llama_pos) token_begin(l));
+        } else {
+            // Whole pairs only: whatever part of it stays in this batch is
+            // thrown away after the decode and the pair starts over
+            l.restart = true;
+        }
+    }
+}
+
+bool llama_rn_rerank_batch::done() const {
+    if (next_pair < pairs.size()) {
+        return false;
+    }
+    for (const auto& l : lanes) {
+        if (l.pair >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool llama_rn_rerank_batch::has_lane(llama_seq_id seq_id) const {
+    for (const auto& l : lanes) {
+        if (l.seq_id == seq_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void llama_rn_rerank_batch::release() {
+    for (auto& l : lanes) {
+        l.pair = lane_idle;
+        l.n_added = 0;
+        l.finishing = false;
+        l.restart = false;
+        if (mem != nullptr) {
+            llama_memory_seq_rm(mem, l.seq_id, -1, -1);
+        }
+    }
+    prefix_ready = false;
+}
+
+std::vector<float> llama_rn_rerank_batch::run(int32_t n_batch) {
+    n_batch = std::min<int32_t>(n_batch, (int32_t) llama_n_batch(ctx));
+    if (!pool_last) {
+        // Keep each pair in a single ubatch, where its pooled token is taken
+        n_batch = std::min<int32_t>(n_batch, (int32_t) llama_n_ubatch(ctx));
+    }
+    n_max_pair = std::min(n_max_pair, n_batch);
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    while (!done()) {
+        batch.n_tokens = 0;
+        if (add_to_batch(batch, n_batch) == 0) {
+            break;
+        }
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            LOG_WARNING("Rerank: llama_decode failed with code %d", ret);
+            break;
+        }
+        collect();
+    }
+    llama_batch_free(batch);
+    release();
+
+    LOG_VERBOSE("Rerank: scored %zu/%zu pairs in %d decodes (%zu shared prefix tokens, %zu lanes)",
+                n_scored, pairs.size(), n_decodes, n_prefix, lanes.size());
+    return scores;
+}
+
+} // namespace rnllama
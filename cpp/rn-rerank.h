@@ -0,0 +1,85 @@
+#ifndef RN_RERANK_H
+#define RN_RERANK_H
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rnllama {
+
+// Scores query/document pairs of a pooled model many at a time: each pair is
+// decoded in its own sequence ("lane") of a shared llama_batch, and a pair's
+// score is the first value of its pooled embedding. When the model pools the
+// last token of a causal sequence, the query prefix all pairs share is
+// decoded once into the first lane and copied into the others with seq_cp.
+//
+// Lanes belong to the engine until release(); it never touches other
+// sequences, so no memory clear is needed around a rerank.
+//
+// With n_embd > 0 the inputs are any token sequences and the engine keeps
+// each one's whole pooled embedding, for batched embedding.
+struct llama_rn_rerank_batch {
+    llama_rn_rerank_batch(
+        llama_context* ctx,
+        const std::vector<llama_seq_id>& lane_seq_ids,
+        std::vector<std::vector<llama_token>> pairs,
+        int32_t n_embd = 0
+    );
+
+    // Append up to n_max tokens to the batch; returns the number added.
+    // Call collect() after the batch has been decoded.
+    int32_t add_to_batch(llama_batch& batch, int32_t n_max);
+    void collect();
+
+    // Decode failure recovery: the batch was cut at pos for this lane
+    void defer(llama_seq_id seq_id, llama_pos pos);
+
+    bool done() const;
+    bool has_lane(llama_seq_id seq_id) const;
+    void release();                        // Drop the lanes' memory
+
+    // Whether pairs can share a prefix: the model pools the last token of a causal sequence
+    static bool pools_last_token(llama_context* ctx);
+
+    // Standalone driver: decode everything in batches of up to n_batch tokens
+    std::vector<float> run(int32_t n_batch);
+
+    std::vector<float> scores;             // Per pair, -1e6 until scored
+    std::vector<float> embeddings;         // [pairs x n_embd] pooled outputs, zero until scored
+    size_t n_prefix = 0;                   // Shared prefix tokens (0 = not shared)
+    size_t n_scored = 0;
+    int32_t n_decodes = 0;                 // Batches this engine added tokens to
+
+private:
+    static const int32_t lane_idle = -1;
+    static const int32_t lane_prefix = -2;
+
+    struct lane {
+        llama_seq_id seq_id;
+        int32_t pair = lane_idle;          // Pair being decoded, or lane_idle / lane_prefix
+        size_t n_added = 0;                // Tokens of it added so far
+        bool finishing = false;            // Its last token is in the current batch
+        bool restart = false;              // Start the pair over once the batch is decoded
+    };
+
+    size_t token_begin(const lane& l) const;
+    size_t token_end(const lane& l) const;
+    void free_lane(lane& l);
+
+    llama_context* ctx;
+    llama_memory_t mem;
+    std::vector<std::vector<llama_token>> pairs;
+    std::vector<size_t> order;             // Pairs in the order they are started
+    std::vector<lane> lanes;
+    size_t next_pair = 0;                  // Into order
+    bool pool_last = false;                // Pooled token is the last one (chunking is safe)
+    bool equal_split = false;              // Only pairs of one length share a batch (non-unified cache)
+    bool prefix_ready = false;
+    int32_t n_max_pair = 0;                // Largest pair that fits one decode (unchunked models)
+    int32_t n_embd = 0;                    // Pooled values kept per pair (0 = score only)
+};
+
+} // namespace rnllama
+
+#endif /* RN_RERANK_H */
@@ -3,32 +3,64 @@
 #include "rn-llama.h"
 #include "rn-mtmd.hpp"
 #include "rn-common.hpp"
+#include "rn-rerank.h"
 #include "ggml.h"
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <numeric>
+#include <set>
 #include <stdexcept>
 
 namespace rnllama {
 
+// Shorter prefix matches are left to LRU slot choice and not copied across
+// slots: every prompt shares BOS or a template header with every used slot,
+// and a handful of tokens is not worth a cross-stream buffer copy
+static const size_t min_prefix_reuse_tokens = 16;
+
 // Constructor
 llama_rn_slot_manager::llama_rn_slot_manager(llama_rn_context* ctx) :
     parent_ctx(ctx),
     n_parallel(1),
     next_request_id(1),
     n_batch(512),
-    slot_prompt_similarity(0.5f),
+    n_batch_max(512),
+    n_decode_ok(0),
+    n_prefill_budget(0),
+    prefill_target_ms(100.0f),
+    n_prefill_budget_cur(512),
+    prefill_rr_cursor(0),
+    n_step_gen_tokens(0),
+    n_step_prompt_tokens(0),
+    n_step_mtp_tokens(0),
+    pipeline_decode(false),
+    step_pending(false),
+    t_step_submit(0),
     continuous_batching(false),
-    processing_active(false)
+    priority_aging_ms(5000),
+    preemption_enabled(true),
+    processing_active(false),
+    wake_pending(false),
+    loop_waiting(false)
 {
     // Initialize batch to zero/null - will be properly allocated later
     std::memset(&batch, 0, sizeof(batch));
+
+    // Slots held back by a congested stream become runnable once it drains
+    delivery.on_drain = [this]() {
+        if (loop_waiting.load()) {
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            slots_cv.notify_one();
+        }
+    };
 }
 
 // Destructor
 llama_rn_slot_manager::~llama_rn_slot_manager() {
     // Stop processing loop if active
     stop_processing_loop();
+    delivery.stop();
 
     reset_mtp_speculative();
 
@@ -44,6 +76,9 @@ llama_rn_slot_manager::~llama_rn_slot_manager() {
 bool llama_rn_slot_manager::init(int32_t n_parallel_, int32_t n_batch_, int32_t n_ctx) {
     n_parallel = n_parallel_;
     n_batch = n_batch_;
+    n_batch_max = n_batch_;
+    n_decode_ok = 0;
+    set_prefill_budget(n_prefill_budget, prefill_target_ms);
 
     LOG_INFO("Initializing slot manager with %d parallel slots, batch size %d", n_parallel, n_batch);
 
@@ -185,13 +220,18 @@ int32_t llama_rn_slot_manager::queue_request(
     int32_t load_state_size,
     int32_t save_state_size,
     std::function<void(const completion_token_output&)> on_token,
-    std::function<void(llama_rn_slot*)> on_complete
+    std::function<void(llama_rn_slot*)> on_complete,
+    int32_t priority,
+    int32_t deadline_ms,
+    std::function<void(llama_rn_token_frame&)> on_frame,
+    int32_t frame_interval_ms,
+    int32_t frame_max_tokens
 ) {
     // Generate unique request ID
     int32_t request_id = next_request_id++;
 
-    LOG_INFO("Queuing request %d with %zu prompt tokens (load_state=%s, save_state=%s, save_prompt_state=%s, load_size=%d, save_size=%d)",
-             request_id, prompt.size(),
+    LOG_INFO("Queuing request %d with %zu prompt tokens (priority=%d, load_state=%s, save_state=%s, save_prompt_state=%s, load_size=%d, save_size=%d)",
+             request_id, prompt.size(), priority,
              load_state_path.empty() ? "no" : load_state_path.c_str(),
              save_state_path.empty() ? "no" : save_state_path.c_str(),
              save_prompt_state_path.empty() ? "no" : save_prompt_state_path.c_str(),
@@ -218,11 +258,18 @@ int32_t llama_rn_slot_manager::queue_request(
     request.save_state_size = save_state_size;
     request.on_token = on_token;
     request.on_complete = on_complete;
+    request.on_frame = on_frame;
+    request.frame_interval_ms = std::max(0, frame_interval_ms);
+    request.frame_max_tokens = std::max(0, frame_max_tokens);
+    request.priority = priority;
+    request.t_queued = lm_ggml_time_us();
+    request.t_deadline = deadline_ms > 0 ? request.t_queued + (int64_t)deadline_ms * 1000 : 0;
 
     // Add to queue
     {
         std::lock_guard<std::mutex> lock(slots_mutex);
         queue_requests.emplace_back(std::move(request));
+        wake_pending = true;
     }
 
     // Notify processing thread that new work is available
@@ -245,7 +292,8 @@ int32_t llama_rn_slot_manager::queue_request(
 int32_t llama_rn_slot_manager::queue_embedding_request(
     const std::vector<llama_token>& tokens,
     int embd_normalize,
-    std::function<void(int32_t, const std::vector<float>&)> on_result
+    std::function<void(int32_t, const std::vector<float>&)> on_result,
+    int32_t priority
 ) {
     if (parent_ctx == nullptr || parent_ctx->model == nullptr || parent_ctx->ctx == nullptr) {
         LOG_ERROR("Cannot queue embedding: context not initialized");
@@ -270,10 +318,13 @@ int32_t llama_rn_slot_manager::queue_embedding_request(
     request.prompt_tokens = tokens;
     request.embd_normalize = embd_normalize;
     request.on_embedding = on_result;
+    request.priority = priority;
+    request.t_queued = lm_ggml_time_us();
 
     {
         std::lock_guard<std::mutex> lock(slots_mutex);
         queue_requests.emplace_back(std::move(request));
+        wake_pending = true;
     }
 
     slots_cv.notify_one();
@@ -296,7 +347,8 @@ int32_t llama_rn_slot_manager::queue_rerank_request(
     const std::string& query,
     const std::vector<std::string>& documents,
     int normalize,
-    std::function<void(int32_t, const std::vector<float>&)> on_results
+    std::function<void(int32_t, const std::vector<float>&)> on_results,
+    int32_t priority
 ) {
     if (parent_ctx == nullptr || parent_ctx->model == nullptr || parent_ctx->ctx == nullptr) {
         LOG_ERROR("Cannot queue rerank: context not initialized");
@@ -339,6 +391,8 @@ int32_t llama_rn_slot_manager::queue_rerank_request(
     request.task_type = SLOT_TASK_TYPE_RERANK;
     request.embd_normalize = normalize;
     request.on_rerank = on_results;
+    request.priority = priority;
+    request.t_queued = lm_ggml_time_us();
 
     try {
         std::vector<llama_token> query_tokens = common_tokenize(vocab, query, false, true);
@@ -349,16 +403,12 @@ int32_t llama_rn_slot_manager::queue_rerank_request(
 
         for (const std::string& doc : documents) {
             std::vector<llama_token> doc_tokens = common_tokenize(vocab, doc, false, true);
-            std::vector<llama_token> rerank_tokens = format_rerank_tokens(vocab, query_tokens, doc_tokens);
-
-            // Convert tokens back to text and re-tokenize using context-aware settings
-            std::string rerank_text = tokens_to_str(parent_ctx->ctx, rerank_tokens.begin(), rerank_tokens.end());
-            std::vector<llama_token> prompt_tokens = common_tokenize(
-                parent_ctx->ctx,
-                rerank_text,
-                add_bos || is_enc_dec,
-                true
-            );
+            std::vector<llama_token> prompt_tokens = format_rerank_tokens(vocab, query_tokens, doc_tokens);
+
+            // format_rerank_tokens only adds BOS when the vocab asks for it
+            if (is_enc_dec && !add_bos) {
+                prompt_tokens.insert(prompt_tokens.begin(), llama_vocab_bos(vocab));
+            }
 
             request.rerank_prompt_tokens.push_back(std::move(prompt_tokens));
         }
@@ -386,6 +436,7 @@ int32_t llama_rn_slot_manager::queue_rerank_request(
     {
         std::lock_guard<std::mutex> lock(slots_mutex);
         queue_requests.emplace_back(std::move(request));
+        wake_pending = true;
     }
 
     slots_cv.notify_one();
@@ -403,14 +454,36 @@ int32_t llama_rn_slot_manager::queue_rerank_request(
     return request_id;
 }
 
-// Get available slot (LRU strategy for now, similarity matching in Phase 3)
+// Get available slot: the one whose sequence already holds the longest
+// prefix of the prompt (least recently used of those that tie), falling
+// back to LRU when no slot holds a useful prefix
 llama_rn_slot* llama_rn_slot_manager::get_available_slot(const std::vector<llama_token>& prompt) {
+    auto is_available = [this](llama_seq_id seq_id) {
+        const auto& slot = slots[seq_id];
+        return (slot.state == SLOT_STATE_IDLE || slot.state == SLOT_STATE_DONE) && slot.lent_to < 0;
+    };
+
+    const auto match = prefix_index.find_longest(prompt, is_available);
+    if (match.seq_id >= 0 && match.n_tokens >= min_prefix_reuse_tokens) {
+        llama_rn_slot* matched = &slots[match.seq_id];
+        for (auto& slot : slots) {
+            if (slot.id != matched->id && is_available(slot.id) && slot.can_reuse_cache_prefix() &&
+                slot.t_last_used < matched->t_last_used &&
+                find_common_prefix_length(slot.cache_tokens, prompt) >= match.n_tokens) {
+                matched = &slot;
+            }
+        }
+        LOG_VERBOSE("Selected slot %d (prefix match %zu/%zu tokens)",
+                    matched->id, match.n_tokens, prompt.size());
+        return matched;
+    }
+
     llama_rn_slot* best_slot = nullptr;
     int64_t oldest_time = INT64_MAX;
 
     // Find idle or done slot with oldest t_last_used (LRU)
     for (auto& slot : slots) {
-        if (slot.state == SLOT_STATE_IDLE || slot.state == SLOT_STATE_DONE) {
+        if (is_available(slot.id)) {
             if (slot.t_last_used < oldest_time) {
                 oldest_time = slot.t_last_used;
                 best_slot = &slot;
@@ -427,6 +500,99 @@ llama_rn_slot* llama_rn_slot_manager::get_available_slot(const std::vector<llama
     return best_slot;
 }
 
+// Keep the prefix index in step with the tokens the slot's sequence holds
+void llama_rn_slot_manager::sync_prefix_index(const llama_rn_slot& slot) {
+    if (!slot.can_reuse_cache_prefix()) {
+        prefix_index.remove(slot.id);
+        return;
+    }
+    prefix_index.update(slot.id, slot.cache_tokens);
+}
+
+// The slot's sequence was cleared: its tokens must not be offered for reuse
+void llama_rn_slot_manager::drop_cache(llama_rn_slot& slot) {
+    slot.invalidate_cache();
+    prefix_index.remove(slot.id);
+}
+
+void llama_rn_slot_manager::lock_decode() {
+    std::unique_lock<std::mutex> lock(decode_mutex);
+    decode_cv.wait(lock, [this]() { return !decode_busy; });
+    decode_busy = true;
+}
+
+void llama_rn_slot_manager::unlock_decode() {
+    {
+        std::lock_guard<std::mutex> lock(decode_mutex);
+        decode_busy = false;
+    }
+    decode_cv.notify_all();
+}
+
+std::vector<llama_seq_id> llama_rn_slot_manager::borrow_idle_sequences() {
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    std::vector<llama_seq_id> seq_ids;
+    const llama_seq_id n_seq_max = (llama_seq_id) llama_n_seq_max(parent_ctx->ctx);
+    for (llama_seq_id seq_id = 1; seq_id < n_seq_max; seq_id++) {
+        if (seq_id >= (llama_seq_id) slots.size()) {
+            seq_ids.push_back(seq_id);
+            continue;
+        }
+        auto& slot = slots[seq_id];
+        if (slot.state == SLOT_STATE_IDLE && slot.lent_to < 0) {
+            drop_cache(slot);
+            slot.n_past = 0;
+            seq_ids.push_back(seq_id);
+        }
+    }
+    return seq_ids;
+}
+
+// Seed the slot's sequence with the longest prompt prefix held by another
+// slot, so a shared system prompt is prefilled once per context
+size_t llama_rn_slot_manager::copy_shared_prefix(llama_rn_slot& slot, const std::vector<llama_token>& prompt) {
+    if (parent_ctx == nullptr || parent_ctx->ctx == nullptr || !slot.can_reuse_cache_prefix()) {
+        return 0;
+    }
+
+    // Recurrent state is a single snapshot of the whole sequence and
+    // cannot be cut back to a prefix after the copy
+    const llama_model * model = llama_get_model(parent_ctx->ctx);
+    if (llama_model_is_recurrent(model) || llama_model_is_hybrid(model)) {
+        return 0;
+    }
+
+    const size_t n_own = find_common_prefix_length(slot.cache_tokens, prompt);
+    const auto match = prefix_index.find_longest(prompt, [&](llama_seq_id seq_id) {
+        return seq_id != slot.id;
+    });
+    if (match.seq_id < 0 || match.n_tokens < n_own + min_prefix_reuse_tokens) {
+        return 0;
+    }
+
+    // Only copy what the source still holds: it may be mid-prefill
+    const llama_rn_slot& src = slots[match.seq_id];
+    auto * kv = llama_get_memory(parent_ctx->ctx);
+    size_t n_copy = std::min(match.n_tokens, find_common_prefix_length(src.cache_tokens, prompt));
+    n_copy = std::min(n_copy, (size_t)std::max<llama_pos>(0, llama_memory_seq_pos_max(kv, src.id) + 1));
+    if (n_copy < n_own + min_prefix_reuse_tokens) {
+        return 0;
+    }
+
+    // Cross-stream copies (non-unified KV) only support whole sequences,
+    // so copy everything and trim back to the shared prefix
+    llama_memory_seq_rm(kv, slot.id, -1, -1);
+    llama_memory_seq_cp(kv, src.id, slot.id, -1, -1);
+    llama_memory_seq_rm(kv, slot.id, (llama_pos)n_copy, -1);
+
+    slot.cache_tokens.assign(prompt.begin(), prompt.begin() + n_copy);
+    slot.state_checkpoints.clear();
+    prefix_index.update(slot.id, slot.cache_tokens);
+
+    LOG_INFO("Slot %d: Copied %zu-token prompt prefix from slot %d", slot.id, n_copy, src.id);
+    return n_copy;
+}
+
 // Get slot by request ID
 llama_rn_slot* llama_rn_slot_manager::get_slot_by_request_id(int32_t request_id) {
     auto it = active_requests.find(request_id);
@@ -440,13 +606,71 @@ llama_rn_slot* llama_rn_slot_manager::get_slot_by_request_id(int32_t request_id)
 void llama_rn_slot_manager::release_slot(llama_rn_slot* slot) {
     LOG_VERBOSE("Releasing slot %d", slot->id);
 
+    // Hand borrowed rerank lanes back, without their sequences
+    if (slot->rerank_batch != nullptr) {
+        slot->rerank_batch->release();
+        for (auto& other : slots) {
+            if (other.lent_to == slot->id) {
+                other.lent_to = -1;
+            }
+        }
+        slot->rerank_batch.reset();
+    }
+
     // Update last used timestamp for LRU tracking
     slot->t_last_used = lm_ggml_time_us();
 
+    // The last sampled token is never decoded; keep cache_tokens in step
+    // with what the sequence actually holds for the next request's reuse
+    if (slot->n_past >= 0 && (size_t)slot->n_past < slot->cache_tokens.size()) {
+        slot->cache_tokens.resize(slot->n_past);
+    } else if (slot->num_draft_tokens_accepted > 0 && (size_t)slot->n_past > slot->cache_tokens.size() &&
+               parent_ctx && parent_ctx->ctx) {
+        // Accepted draft tokens past the stop point were decoded but never emitted
+        llama_memory_seq_rm(llama_get_memory(parent_ctx->ctx), slot->id, slot->cache_tokens.size(), -1);
+        slot->n_past = slot->cache_tokens.size();
+    }
+    sync_prefix_index(*slot);
+
     // Reset slot (cache_tokens is preserved by reset() for potential reuse)
     slot->reset();
 }
 
+// Set a rerank slot up with a batch engine: idle slots lend their sequences
+// as extra lanes so several documents are decoded in the same batch
+void llama_rn_slot_manager::start_rerank(llama_rn_slot& slot, std::vector<std::vector<llama_token>> pairs) {
+    // With a shared prefix the owner's lane holds only the query
+    const bool shared_prefix = pairs.size() > 1 && llama_rn_rerank_batch::pools_last_token(parent_ctx->ctx);
+    const size_t n_borrow = shared_prefix ? pairs.size() : pairs.size() - 1;
+
+    std::vector<llama_seq_id> lanes = { slot.id };
+    for (auto& other : slots) {
+        if (lanes.size() > n_borrow || &other == &slot) {
+            continue;
+        }
+        if (other.state == SLOT_STATE_IDLE && other.lent_to < 0) {
+            other.lent_to = slot.id;
+            drop_cache(other);
+            other.n_past = 0;
+            lanes.push_back(other.id);
+        }
+    }
+    drop_cache(slot);
+    slot.n_past = 0;
+
+    size_t n_tokens = 0;
+    for (const auto& pair : pairs) {
+        n_tokens += pair.size();
+    }
+    slot.num_prompt_tokens = n_tokens;
+    slot.n_prompt_tokens_processed = n_tokens;
+    slot.state = SLOT_STATE_PROCESSING_PROMPT;
+    slot.rerank_batch = std::make_shared<llama_rn_rerank_batch>(parent_ctx->ctx, lanes, std::move(pairs));
+
+    LOG_INFO("Slot %d: Reranking %zu documents on %zu lanes (%zu shared prefix tokens)",
+             slot.id, slot.rerank_batch->scores.size(), lanes.size(), slot.rerank_batch->n_prefix);
+}
+
 // Cancel request
 void llama_rn_slot_manager::cancel_request(int32_t request_id) {
     LOG_INFO("Cancelling request %d", request_id);
@@ -475,6 +699,17 @@ void llama_rn_slot_manager::cancel_request(int32_t request_id) {
             LOG_INFO("Request %d cancelled (was in pending queue)", request_id);
             cancelled = true;
         }
+
+        // Remove a parked generation (frees its sampler and saved state)
+        auto preempted_it = std::find_if(preempted_requests.begin(), preempted_requests.end(),
+            [request_id](const std::unique_ptr<llama_rn_preempted_request>& p) {
+                return p->slot.request_id == request_id;
+            });
+        if (preempted_it != preempted_requests.end()) {
+            preempted_requests.erase(preempted_it);
+            LOG_INFO("Request %d cancelled (was preempted)", request_id);
+            cancelled = true;
+        }
     }
 
     if (!cancelled) {
@@ -482,6 +717,10 @@ void llama_rn_slot_manager::cancel_request(int32_t request_id) {
         return;
     }
 
+    // The cancelled slot is released (and its successor assigned) next step
+    wake_pending = true;
+    slots_cv.notify_one();
+
     // Notify subscribers of status change
     bool has_subscribers = false;
     {
@@ -493,32 +732,165 @@ void llama_rn_slot_manager::cancel_request(int32_t request_id) {
     }
 }
 
-// Compute similarity between two token sequences (stub for Phase 3)
-float llama_rn_slot_manager::compute_similarity(
-    const std::vector<llama_token>& a,
-    const std::vector<llama_token>& b
-) {
-    // Longest Common Prefix (LCP) approach
-    size_t common_prefix = 0;
-    size_t max_len = std::min(a.size(), b.size());
-    for (size_t i = 0; i < max_len; i++) {
-        if (a[i] == b[i]) {
-            common_prefix++;
-        } else {
-            break;
+// Effective priority: the request's class, raised by one for every
+// priority_aging_ms spent waiting (so background work can't starve), plus up
+// to one more as its start deadline approaches
+double llama_rn_slot_manager::schedule_score(
+    int32_t priority, int64_t t_queued, int64_t t_deadline, int64_t t_now
+) const {
+    double score = priority;
+    if (priority_aging_ms > 0 && t_now > t_queued) {
+        score += (double)(t_now - t_queued) / (priority_aging_ms * 1000.0);
+    }
+    if (t_deadline > 0) {
+        const double window = (double)std::max<int64_t>(1, t_deadline - t_queued);
+        score += std::clamp(1.0 - (double)(t_deadline - t_now) / window, 0.0, 1.0);
+    }
+    return score;
+}
+
+// Free a slot for a request of the given priority by parking the
+// lowest-priority generation below it
+llama_rn_slot* llama_rn_slot_manager::preempt_slot_for(int32_t priority) {
+    if (!preemption_enabled) {
+        return nullptr;
+    }
+
+    llama_rn_slot* victim = nullptr;
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_STATE_GENERATING || slot.task_type != SLOT_TASK_TYPE_COMPLETION ||
+            slot.is_interrupted || slot.should_use_mtp() || slot.priority >= priority) {
+            continue;
+        }
+        // Lowest priority first, then the most recently queued
+        if (victim == nullptr || slot.priority < victim->priority ||
+            (slot.priority == victim->priority && slot.t_queued > victim->t_queued)) {
+            victim = &slot;
         }
     }
 
-    if (a.empty() && b.empty()) return 1.0f;
-    if (a.empty() || b.empty()) return 0.0f;
+    if (victim == nullptr || !preempt_slot(*victim)) {
+        return nullptr;
+    }
+    return victim;
+}
+
+// Park a generating slot: save its sequence, move the request out and clear
+// the sequence so the slot can take other work
+bool llama_rn_slot_manager::preempt_slot(llama_rn_slot& slot) {
+    if (parent_ctx == nullptr || parent_ctx->ctx == nullptr) {
+        return false;
+    }
 
-    return static_cast<float>(common_prefix) / static_cast<float>(std::max(a.size(), b.size()));
+    auto parked = std::make_unique<llama_rn_preempted_request>();
+    const size_t state_size = llama_state_seq_get_size_ext(parent_ctx->ctx, slot.id, 0);
+    if (state_size == 0) {
+        LOG_WARNING("Slot %d: Cannot preempt request %d (empty sequence state)", slot.id, slot.request_id);
+        return false;
+    }
+    parked->seq_state.resize(state_size);
+    const size_t n_written = llama_state_seq_get_data_ext(
+        parent_ctx->ctx, parked->seq_state.data(), parked->seq_state.size(), slot.id, 0);
+    if (n_written == 0) {
+        LOG_WARNING("Slot %d: Cannot preempt request %d (failed to save sequence state)", slot.id, slot.request_id);
+        return false;
+    }
+    parked->seq_state.resize(n_written);
+    parked->t_preempted = lm_ggml_time_us();
+
+    const int32_t request_id = slot.request_id;
+    active_requests.erase(request_id);
+    parked->slot.take_request(slot);
+
+    llama_memory_seq_rm(llama_get_memory(parent_ctx->ctx), slot.id, -1, -1);
+    drop_cache(slot);
+
+    LOG_INFO("Slot %d: Preempted request %d (priority %d, %zu KiB state)",
+             slot.id, request_id, parked->slot.priority, n_written / 1024);
+    preempted_requests.push_back(std::move(parked));
+    return true;
+}
+
+// Restore a parked generation into a free slot
+void llama_rn_slot_manager::resume_preempted(size_t index, llama_rn_slot& slot) {
+    std::unique_ptr<llama_rn_preempted_request> parked = std::move(preempted_requests[index]);
+    preempted_requests.erase(preempted_requests.begin() + index);
+
+    auto * kv = llama_get_memory(parent_ctx->ctx);
+    llama_memory_seq_rm(kv, slot.id, -1, -1);
+    drop_cache(slot);
+    slot.take_request(parked->slot);
+    active_requests[slot.request_id] = &slot;
+
+    const size_t n_read = llama_state_seq_set_data_ext(
+        parent_ctx->ctx, parked->seq_state.data(), parked->seq_state.size(), slot.id, 0);
+    if (n_read == 0) {
+        LOG_ERROR("Slot %d: Failed to restore preempted request %d", slot.id, slot.request_id);
+        llama_memory_seq_rm(kv, slot.id, -1, -1);
+        drop_cache(slot);
+        slot.error_message = "Failed to restore preempted request state";
+        slot.incomplete = true;
+        complete_slot(slot);
+        return;
+    }
+
+    // Time spent parked is not generation time
+    const int64_t t_parked = lm_ggml_time_us() - parked->t_preempted;
+    if (slot.t_start_generation > 0) {
+        slot.t_start_generation += t_parked;
+    }
+    sync_prefix_index(slot);
+
+    LOG_INFO("Slot %d: Resumed request %d after %.1f ms", slot.id, slot.request_id, t_parked / 1e3);
 }
 
 // Process pending queue
 void llama_rn_slot_manager::process_pending_queue() {
-    while (!queue_requests.empty()) {
-        llama_rn_queued_request& request = queue_requests.front();
+    while (!queue_requests.empty() || !preempted_requests.empty()) {
+        // Pick the best candidate; ties go to parked requests, then FIFO
+        const int64_t t_now = lm_ggml_time_us();
+        double best_score = 0.0;
+        size_t best_index = 0;
+        bool best_is_preempted = false;
+        bool have_best = false;
+        for (size_t i = 0; i < preempted_requests.size(); i++) {
+            const auto& parked = preempted_requests[i]->slot;
+            const double score = schedule_score(parked.priority, parked.t_queued, 0, t_now);
+            if (!have_best || score > best_score) {
+                best_score = score;
+                best_index = i;
+                best_is_preempted = true;
+                have_best = true;
+            }
+        }
+        for (size_t i = 0; i < queue_requests.size(); i++) {
+            const auto& queued = queue_requests[i];
+            const double score = schedule_score(queued.priority, queued.t_queued, queued.t_deadline, t_now);
+            if (!have_best || score > best_score) {
+                best_score = score;
+                best_index = i;
+                best_is_preempted = false;
+                have_best = true;
+            }
+        }
+
+        if (best_is_preempted) {
+            const auto& parked = preempted_requests[best_index]->slot;
+            // Its sequence is restored from the saved state, so take the LRU
+            // slot rather than one holding a prefix other requests may reuse
+            llama_rn_slot* slot = get_available_slot({});
+            if (slot == nullptr) {
+                slot = preempt_slot_for(parked.priority);
+            }
+            if (slot == nullptr) {
+                break;
+            }
+            resume_preempted(best_index, *slot);
+            continue;
+        }
+
+        llama_rn_queued_request request = std::move(queue_requests[best_index]);
+        queue_requests.erase(queue_requests.begin() + best_index);
 
         const std::vector<llama_token>* prompt_view = nullptr;
         std::vector<llama_token> empty_prompt;
@@ -536,11 +908,15 @@ void llama_rn_slot_manager::process_pending_queue() {
         }
 
         llama_rn_slot* slot = get_available_slot(*prompt_view);
+        if (slot == nullptr) {
+            slot = preempt_slot_for(request.priority);
+        }
         if (slot == nullptr) {
             LOG_VERBOSE(
-                "No available slots, stopping queue processing (request %d at front)",
+                "No available slots, stopping queue processing (request %d next)",
                 request.request_id
             );
+            queue_requests.insert(queue_requests.begin() + best_index, std::move(request));
             break;
         }
 
@@ -551,12 +927,15 @@ void llama_rn_slot_manager::process_pending_queue() {
         slot->request_id = request.request_id;
         slot->task_type = request.task_type;
         slot->is_interrupted = false;
+        slot->priority = request.priority;
+        slot->t_queued = request.t_queued;
 
         // Reset callbacks from previous usage
         slot->on_token_callback = nullptr;
         slot->on_complete_callback = nullptr;
         slot->on_embedding_callback = nullptr;
         slot->on_rerank_callback = nullptr;
+        slot->event_stream.reset();
 
         // Ensure we start without a sampling context unless set below
         if (slot->ctx_sampling != nullptr) {
@@ -584,13 +963,13 @@ void llama_rn_slot_manager::process_pending_queue() {
                         LOG_ERROR("Failed to load state for slot %d, request %d",
                                   slot->id, request.request_id);
                         // Mark slot as done with error
+                        sync_prefix_index(*slot);
                         slot->state = SLOT_STATE_DONE;
                         slot->incomplete = true;
                         slot->error_message = "Failed to load state from: " + slot->load_state_path;
                         if (request.on_complete) {
                             request.on_complete(slot);
                         }
-                        queue_requests.pop_front();
                         continue;
                     }
                 }
@@ -611,19 +990,22 @@ void llama_rn_slot_manager::process_pending_queue() {
                     slot->media_paths.clear();
                     slot->prompt_text.clear();
                     slot->media_processed = true;
+                    if (slot->load_state_path.empty()) {
+                        copy_shared_prefix(*slot, request.prompt_tokens);
+                    }
                     slot->load_prompt(request.prompt_tokens);
                 }
+                sync_prefix_index(*slot);
                 slot->i_batch = -1;
 
-                slot->on_token_callback = request.on_token;
-                slot->on_complete_callback = request.on_complete;
+                open_event_stream(*slot, request);
                 slot->current_chat_format = request.chat_format;
                 slot->current_reasoning_format = request.reasoning_format;
                 slot->current_generation_prompt = request.generation_prompt;
                 slot->current_chat_parser = request.chat_parser;
                 slot->prefill_text = request.prefill_text;
                 slot->n_remaining = request.params.n_predict;
-                slot->stop_words = request.params.antiprompt;
+                slot->stop_matcher = llama_rn_stop_matcher(request.params.antiprompt);
                 break;
             }
 
@@ -637,10 +1019,11 @@ void llama_rn_slot_manager::process_pending_queue() {
                 slot->prompt_text.clear();
                 slot->media_processed = true;
                 slot->embd_normalize = request.embd_normalize;
-                slot->on_embedding_callback = request.on_embedding;
+                open_event_stream(*slot, request);
                 slot->n_remaining = -1;
-                slot->stop_words.clear();
+                slot->stop_matcher = llama_rn_stop_matcher();
                 slot->load_prompt(request.prompt_tokens);
+                sync_prefix_index(*slot);
                 slot->i_batch = -1;
                 break;
             }
@@ -650,15 +1033,11 @@ void llama_rn_slot_manager::process_pending_queue() {
                 // Start timing (memory clear is part of the task, not overhead)
                 slot->t_start_process = lm_ggml_time_us();
 
-                if (parent_ctx && parent_ctx->ctx) {
-                    llama_memory_clear(llama_get_memory(parent_ctx->ctx), false);
-                }
                 if (request.rerank_prompt_tokens.empty()) {
                     LOG_WARNING("Rerank request %d has no documents to process", request.request_id);
                     if (request.on_rerank) {
                         request.on_rerank(request.request_id, {});
                     }
-                    queue_requests.pop_front();
                     continue;
                 }
 
@@ -666,44 +1045,146 @@ void llama_rn_slot_manager::process_pending_queue() {
                 slot->prompt_text.clear();
                 slot->media_processed = true;
                 slot->embd_normalize = request.embd_normalize;
-                slot->on_rerank_callback = request.on_rerank;
-                slot->rerank_prompt_tokens = std::move(request.rerank_prompt_tokens);
-                slot->rerank_scores.assign(slot->rerank_prompt_tokens.size(), 0.0f);
-                slot->rerank_current_index = 0;
+                open_event_stream(*slot, request);
                 slot->n_remaining = -1;
-                slot->stop_words.clear();
-                slot->load_prompt(slot->rerank_prompt_tokens[0]);
+                slot->stop_matcher = llama_rn_stop_matcher();
+                start_rerank(*slot, std::move(request.rerank_prompt_tokens));
                 slot->i_batch = -1;
                 break;
             }
 
             default:
                 LOG_ERROR("Unknown task type %d for request %d", request.task_type, request.request_id);
-                queue_requests.pop_front();
                 continue;
         }
 
         // Track active request
         active_requests[request.request_id] = slot;
+    }
+}
+
+void llama_rn_slot_manager::set_prefill_budget(int32_t n_budget, float target_ms) {
+    n_prefill_budget = std::max(0, n_budget);
+    prefill_target_ms = std::max(0.0f, target_ms);
+    n_prefill_budget_cur = n_prefill_budget > 0 ? std::min(n_prefill_budget, n_batch) : n_batch;
+}
 
-        // Remove from queue
-        queue_requests.pop_front();
+// Smallest prompt chunk a slot gets per step, so prefill always progresses
+int32_t llama_rn_slot_manager::prefill_min_chunk() const {
+    return std::min(n_batch, std::max<int32_t>(32, n_batch / 8));
+}
+
+// Keep steps that carry generating tokens near prefill_target_ms: shrink the
+// budget proportionally when over, grow it gradually when under and saturated
+void llama_rn_slot_manager::adapt_prefill_budget(double t_decode_ms) {
+    if (prefill_target_ms <= 0.0f || n_step_gen_tokens == 0 || n_step_prompt_tokens == 0) {
+        return;
+    }
+
+    const int32_t n_max = n_prefill_budget > 0 ? std::min(n_prefill_budget, n_batch) : n_batch;
+    const int32_t n_min = prefill_min_chunk();
+    const int32_t n_prev = n_prefill_budget_cur;
+
+    if (t_decode_ms > prefill_target_ms) {
+        n_prefill_budget_cur = (int32_t)(n_prefill_budget_cur * (prefill_target_ms / t_decode_ms));
+    } else if (n_step_prompt_tokens >= n_prefill_budget_cur && t_decode_ms < 0.8 * prefill_target_ms) {
+        n_prefill_budget_cur += std::max(n_min, n_prefill_budget_cur / 4);
+    }
+    n_prefill_budget_cur = std::clamp(n_prefill_budget_cur, std::min(n_min, n_max), n_max);
+
+    if (n_prefill_budget_cur != n_prev) {
+        LOG_VERBOSE("Prefill budget %d -> %d (decode %.1f ms, target %.1f ms)",
+                    n_prev, n_prefill_budget_cur, t_decode_ms, prefill_target_ms);
     }
 }
 
+// Add up to max_tokens prompt tokens of a slot to the batch; returns the
+// number of tokens added
+int32_t llama_rn_slot_manager::add_prompt_chunk(llama_rn_slot& slot, int32_t max_tokens) {
+    size_t prompt_end = slot.num_prompt_tokens;
+    if (slot.save_prompt_state_pending && slot.save_prompt_state_tokens >= 0 &&
+        slot.n_past <= slot.save_prompt_state_tokens) {
+        prompt_end = std::min(prompt_end, (size_t)slot.save_prompt_state_tokens);
+    }
+    // Stop at the armed in-memory snapshot position so it can be captured after decode
+    if (slot.state_ckpt_pending && slot.state_ckpt_tokens >= 0 &&
+        slot.n_past <= slot.state_ckpt_tokens) {
+        prompt_end = std::min(prompt_end, (size_t)slot.state_ckpt_tokens);
+    }
+
+    int32_t n_added = 0;
+    while (slot.n_past < (llama_pos)prompt_end && n_added < max_tokens && batch.n_tokens < n_batch) {
+        llama_token token = slot.prompt_tokens[slot.n_past];
+
+        // Skip LLAMA_TOKEN_NULL - these are media placeholders already in KV cache
+        if (token == LLAMA_TOKEN_NULL) {
+            LOG_VERBOSE("Slot %d: Skipping NULL token at pos %d (media chunk)", slot.id, slot.n_past);
+            slot.n_past++;
+            continue;
+        }
+
+        // Request logits for all tokens when embeddings/rerank are needed
+        bool need_logits = true;
+        if (slot.task_type == SLOT_TASK_TYPE_COMPLETION) {
+            need_logits = (slot.n_past == (llama_pos)(slot.num_prompt_tokens - 1));
+        }
+
+        // Add to batch with this slot's sequence ID
+        llama_batch_add(&batch, token, slot.n_past, {slot.id}, need_logits);
+
+        // Mark position in batch for this slot (will be overwritten each iteration)
+        slot.i_batch = batch.n_tokens - 1;
+
+        slot.n_past++;
+        n_added++;
+    }
+
+    return n_added;
+}
+
 // Build batch from all active slots
 void llama_rn_slot_manager::build_batch() {
     // Clear the batch
     batch.n_tokens = 0;
 
-    // First pass: Add tokens from GENERATING slots (previously sampled tokens)
+    // Generating slots whose consumer is behind sit this step out
+    int32_t n_gen_left = 0;
+    for (auto& slot : slots) {
+        slot.ngram_draft.clear();
+        slot.delivery_stalled = slot.state == SLOT_STATE_GENERATING &&
+            slot.event_stream != nullptr && slot.event_stream->congested();
+        if (slot.state == SLOT_STATE_GENERATING && !slot.generated_tokens.empty() && !slot.delivery_stalled &&
+            !(slot.task_type == SLOT_TASK_TYPE_COMPLETION && slot.should_use_mtp())) {
+            n_gen_left++;
+        }
+    }
+
+    // MTP pass: verification tokens of every MTP slot go first, so the shared
+    // MTP state sees each sequence contiguously at the head of the batch
+    add_mtp_drafts(n_gen_left);
+
+    // First pass: Add tokens from GENERATING slots (previously sampled tokens),
+    // each followed by its n-gram draft (if any) to verify in the same decode
     for (auto& slot : slots) {
         if (slot.state == SLOT_STATE_GENERATING) {
-            if (slot.task_type == SLOT_TASK_TYPE_COMPLETION && slot.should_use_mtp()) {
+            if ((slot.task_type == SLOT_TASK_TYPE_COMPLETION && slot.should_use_mtp()) || slot.delivery_stalled) {
                 continue;
             }
             // Only add if we have generated tokens (skip first iteration after prompt)
             if (!slot.generated_tokens.empty()) {
+                n_gen_left--;
+
+                // Draft into whatever room the remaining generating slots leave
+                if (slot.should_use_ngram()) {
+                    try {
+                        slot.draft_ngram(n_batch - batch.n_tokens - 1 - n_gen_left);
+                    } catch (const std::exception& e) {
+                        LOG_WARNING("Slot %d: N-gram drafting disabled: %s", slot.id, e.what());
+                        slot.params->speculative.types = { COMMON_SPECULATIVE_TYPE_NONE };
+                        slot.ngram_draft.clear();
+                    }
+                }
+
                 // Get the last generated token
                 llama_token token = slot.generated_tokens.back();
 
@@ -715,26 +1196,26 @@ void llama_rn_slot_manager::build_batch() {
 
                 slot.n_past++; // Increment for next token
 
-                LOG_VERBOSE("Slot %d: Added generated token %d at pos %d", slot.id, token, slot.n_past - 1);
+                for (size_t i = 0; i < slot.ngram_draft.size(); i++) {
+                    llama_batch_add(&batch, slot.ngram_draft[i], slot.n_past + (llama_pos) i, {slot.id}, true);
+                }
+
+                LOG_VERBOSE("Slot %d: Added generated token %d at pos %d (+%zu draft)",
+                            slot.id, token, slot.n_past - 1, slot.ngram_draft.size());
             }
         }
     }
 
-    // Second pass: Add prompt tokens from PROCESSING_PROMPT slots
-    for (auto& slot : slots) {
+    const int32_t n_gen_tokens = batch.n_tokens;
+
+    // Second pass: Collect PROCESSING_PROMPT slots, starting from a rotating
+    // slot so the same slot is not always served last
+    std::vector<llama_rn_slot*> prefill_slots;
+    const size_t n_slots = slots.size();
+    for (size_t k = 0; k < n_slots; k++) {
+        auto& slot = slots[(prefill_rr_cursor + k) % n_slots];
         if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
             if (slot.task_type == SLOT_TASK_TYPE_COMPLETION && slot.should_use_mtp()) {
-                if (!slot.media_paths.empty()) {
-                    LOG_ERROR("Slot %d: MTP speculative decoding does not support media inputs", slot.id);
-                    slot.incomplete = true;
-                    slot.error_message = "MTP speculative decoding currently supports text-only queued completions";
-                    complete_slot(slot);
-                    continue;
-                }
-
-                slot.state = SLOT_STATE_GENERATING;
-                slot.i_batch = -1;
-                LOG_INFO("Slot %d: Transitioned to GENERATING state with MTP speculative decoding", slot.id);
                 continue;
             }
 
@@ -780,6 +1261,7 @@ void llama_rn_slot_manager::build_batch() {
 
                     // Update prompt tokens with the processed result from processMedia
                     slot.prompt_tokens = slot.embd;
+                    slot.cache_tokens = slot.embd;
                     slot.num_prompt_tokens = slot.embd.size();
                     slot.media_processed = true;
                     if (slot.save_prompt_state_pending) {
@@ -823,64 +1305,187 @@ void llama_rn_slot_manager::build_batch() {
                 }
             }
 
-            // Process tokens up to n_batch limit (only for non-media slots)
-            size_t prompt_end = slot.num_prompt_tokens;
-            if (slot.save_prompt_state_pending && slot.save_prompt_state_tokens >= 0 &&
-                slot.n_past <= slot.save_prompt_state_tokens) {
-                prompt_end = std::min(prompt_end, (size_t)slot.save_prompt_state_tokens);
+            prefill_slots.push_back(&slot);
+        }
+    }
+    if (n_slots > 0) {
+        prefill_rr_cursor = (prefill_rr_cursor + 1) % n_slots;
+    }
+
+    // Third pass: Fill prompt tokens round-robin. While other slots are
+    // generating, completion prefill is capped by the per-step budget so a
+    // long prompt can't stall their streams; embedding/rerank prompts are
+    // pooled over the whole sequence and only limited by n_batch.
+    int32_t budget_left = n_gen_tokens > 0 ? std::min(n_prefill_budget_cur, n_batch) : n_batch;
+    const int32_t n_chunk = prefill_slots.empty() ? 0 :
+        std::max(prefill_min_chunk(), budget_left / (int32_t)prefill_slots.size());
+
+    bool progress = true;
+    while (progress && batch.n_tokens < n_batch) {
+        progress = false;
+        for (auto* slot : prefill_slots) {
+            if (slot->state != SLOT_STATE_PROCESSING_PROMPT) {
+                continue;
+            }
+            int32_t limit = n_batch - batch.n_tokens;
+            const bool budgeted = slot->task_type == SLOT_TASK_TYPE_COMPLETION;
+            if (budgeted) {
+                limit = std::min(limit, std::min(budget_left, n_chunk));
+            }
+            if (limit <= 0) {
+                continue;
+            }
+
+            // The rerank engine may use the whole batch buffer: a document
+            // that must be decoded in one piece can't wait for n_batch to recover
+            const int32_t n_added = slot->rerank_batch != nullptr
+                ? slot->rerank_batch->add_to_batch(batch, n_batch_max - batch.n_tokens)
+                : add_prompt_chunk(*slot, limit);
+            if (budgeted) {
+                budget_left -= n_added;
             }
+            progress = progress || n_added > 0;
+        }
+    }
 
-            while (slot.n_past < (llama_pos)prompt_end && batch.n_tokens < n_batch) {
-                llama_token token = slot.prompt_tokens[slot.n_past];
+    for (auto* slot_ptr : prefill_slots) {
+        auto& slot = *slot_ptr;
+        if (slot.state != SLOT_STATE_PROCESSING_PROMPT || slot.rerank_batch != nullptr) {
+            continue;
+        }
 
-                // Skip LLAMA_TOKEN_NULL - these are media placeholders already in KV cache
-                if (token == LLAMA_TOKEN_NULL) {
-                    LOG_VERBOSE("Slot %d: Skipping NULL token at pos %d (media chunk)", slot.id, slot.n_past);
-                    slot.n_past++;
-                    continue;
-                }
+        // If we've processed all prompt tokens, transition based on task type
+        if (slot.n_past >= (llama_pos)slot.num_prompt_tokens) {
+            slot.state = SLOT_STATE_GENERATING;
 
-                // Request logits for all tokens when embeddings/rerank are needed
-                bool need_logits = true;
-                if (slot.task_type == SLOT_TASK_TYPE_COMPLETION) {
-                    need_logits = (slot.n_past == (llama_pos)(slot.num_prompt_tokens - 1));
-                }
+            // Mark that prompt processing just finished - timing will be calculated after decode
+            slot.prompt_processing_finished = true;
+            slot.n_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_prompt_tokens_cache;
 
-                // Add to batch with this slot's sequence ID
-                llama_batch_add(&batch, token, slot.n_past, {slot.id}, need_logits);
+            if (slot.task_type == SLOT_TASK_TYPE_COMPLETION) {
+                LOG_INFO("Slot %d: Transitioned to GENERATING state", slot.id);
+            } else if (slot.task_type == SLOT_TASK_TYPE_EMBEDDING) {
+                LOG_INFO("Slot %d: Prompt processed for embedding task", slot.id);
+            }
+        }
 
-                // Mark position in batch for this slot (will be overwritten each iteration)
-                slot.i_batch = batch.n_tokens - 1;
+        LOG_VERBOSE("Slot %d: Processed prompt tokens, n_past=%d/%zu",
+                   slot.id, slot.n_past, slot.num_prompt_tokens);
+    }
+
+    n_step_gen_tokens = n_gen_tokens;
+    n_step_prompt_tokens = batch.n_tokens - n_gen_tokens;
 
-                slot.n_past++;
+    LOG_VERBOSE("Batch built with %d tokens", batch.n_tokens);
+}
+
+void llama_rn_slot_manager::add_mtp_drafts(int32_t n_reserved) {
+    n_step_mtp_tokens = 0;
+
+    std::vector<llama_rn_slot*> mtp_slots;
+    for (auto& slot : slots) {
+        if (slot.task_type != SLOT_TASK_TYPE_COMPLETION || !slot.should_use_mtp() ||
+            slot.is_interrupted || slot.delivery_stalled) {
+            continue;
+        }
+
+        if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+            if (!slot.media_paths.empty()) {
+                LOG_ERROR("Slot %d: MTP speculative decoding does not support media inputs", slot.id);
+                slot.incomplete = true;
+                slot.error_message = "MTP speculative decoding currently supports text-only queued completions";
+                complete_slot(slot);
+                continue;
             }
 
-            // If we've processed all prompt tokens, transition based on task type
-            if (slot.n_past >= (llama_pos)slot.num_prompt_tokens) {
-                slot.state = SLOT_STATE_GENERATING;
-
-                // Mark that prompt processing just finished - timing will be calculated after decode
-                slot.prompt_processing_finished = true;
-                slot.n_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_prompt_tokens_cache;
-
-                if (slot.task_type == SLOT_TASK_TYPE_COMPLETION) {
-                    LOG_INFO("Slot %d: Transitioned to GENERATING state", slot.id);
-                } else if (slot.task_type == SLOT_TASK_TYPE_EMBEDDING) {
-                    LOG_INFO("Slot %d: Prompt processed for embedding task", slot.id);
-                } else if (slot.task_type == SLOT_TASK_TYPE_RERANK) {
-                    LOG_INFO("Slot %d: Prompt processed for rerank task (doc %zu/%zu)",
-                             slot.id,
-                             slot.rerank_current_index + 1,
-                             slot.rerank_prompt_tokens.size());
-                }
+            slot.state = SLOT_STATE_GENERATING;
+            LOG_INFO("Slot %d: Transitioned to GENERATING state with MTP speculative decoding", slot.id);
+        } else if (slot.state != SLOT_STATE_GENERATING) {
+            continue;
+        }
+
+        slot.i_batch = -1;
+
+        // The MTP prompt is still evaluated on its own, once per request
+        if (slot.spec == nullptr) {
+            try {
+                slot.init_mtp();
+            } catch (const std::exception& e) {
+                LOG_ERROR("Slot %d: MTP speculative decoding failed: %s", slot.id, e.what());
+                slot.incomplete = true;
+                slot.error_message = e.what();
+                complete_slot(slot);
+                continue;
             }
+        }
+
+        mtp_slots.push_back(&slot);
+    }
+
+    if (mtp_slots.empty()) {
+        return;
+    }
+
+    // Split the batch room left by the other generating slots evenly
+    const int32_t n_mtp = (int32_t) mtp_slots.size();
+    const int32_t n_room = std::max<int32_t>(0, (n_batch - n_reserved - n_mtp) / n_mtp);
+
+    std::vector<int32_t> n_draft_limits(mtp_slots.size());
+    bool drafting = false;
+    for (size_t k = 0; k < mtp_slots.size(); k++) {
+        n_draft_limits[k] = mtp_slots[k]->prepare_mtp_draft(n_room);
+        drafting = drafting || n_draft_limits[k] > 0;
+    }
+
+    // One draft call for all sequences
+    if (drafting) {
+        common_speculative_draft(mtp_spec);
+    }
+
+    for (size_t k = 0; k < mtp_slots.size(); k++) {
+        llama_rn_slot& slot = *mtp_slots[k];
+        if (n_draft_limits[k] < 0) {
+            // Nothing left to generate; left out of the batch and finished when sampling
+            continue;
+        }
+        slot.finish_mtp_draft(n_draft_limits[k]);
 
-            LOG_VERBOSE("Slot %d: Processed prompt tokens, n_past=%d/%zu",
-                       slot.id, slot.n_past, slot.num_prompt_tokens);
+        slot.i_batch = batch.n_tokens;
+        llama_batch_add(&batch, slot.spec_id_last, slot.spec_n_past, {slot.id}, true);
+        for (size_t i = 0; i < slot.spec_draft.size(); i++) {
+            llama_batch_add(&batch, slot.spec_draft[i], slot.spec_n_past + (llama_pos) i + 1, {slot.id}, true);
         }
+
+        LOG_VERBOSE("Slot %d: Added MTP token %d at pos %d (+%zu draft)",
+                    slot.id, slot.spec_id_last, slot.spec_n_past, slot.spec_draft.size());
     }
 
-    LOG_VERBOSE("Batch built with %d tokens", batch.n_tokens);
+    n_step_mtp_tokens = batch.n_tokens;
+}
+
+bool llama_rn_slot_manager::process_mtp_batch() {
+    if (n_step_mtp_tokens == 0 || mtp_spec == nullptr) {
+        return true;
+    }
+
+    // Feed only the MTP slots' rows to the draft model
+    llama_batch view = batch;
+    view.n_tokens = n_step_mtp_tokens;
+    if (common_speculative_process(mtp_spec, view)) {
+        return true;
+    }
+
+    for (auto& slot : slots) {
+        if (slot.state == SLOT_STATE_GENERATING && slot.should_use_mtp() && slot.i_batch >= 0) {
+            LOG_ERROR("Slot %d: MTP speculative decoding failed: failed to process MTP target batch", slot.id);
+            drop_cache(slot);
+            slot.incomplete = true;
+            slot.error_message = "failed to process MTP target batch";
+            slot.i_batch = -1;
+            complete_slot(slot);
+        }
+    }
+    return false;
 }
 
 bool llama_rn_slot_manager::process_batch() {
@@ -894,34 +1499,251 @@ bool llama_rn_slot_manager::process_batch() {
         return false;
     }
 
-    // Call llama_decode with the unified batch
-    int ret = llama_decode(parent_ctx->ctx, batch);
+    // Set when the batch itself didn't fit (tokens deferred or a request
+    // failed); reclaiming idle KV alone says nothing about the batch size
+    bool batch_too_large = false;
+    while (batch.n_tokens > 0) {
+        // Call llama_decode with the unified batch
+        const int ret = llama_decode(parent_ctx->ctx, batch);
+        if (ret == 0) {
+            break;
+        }
 
-    if (ret != 0) {
-        // Decode failed
         if (ret == 1) {
-            LOG_ERROR("llama_decode failed: could not find a KV slot for the batch");
+            LOG_WARNING("llama_decode: could not find a KV slot for %d tokens", batch.n_tokens);
         } else {
-            LOG_ERROR("llama_decode failed with code: %d", ret);
+            LOG_WARNING("llama_decode failed with code %d (%d tokens)", ret, batch.n_tokens);
         }
 
-        // Try with smaller batch size next time
+        // Slots are only touched under the lock; decoding itself runs without it
+        std::lock_guard<std::mutex> lock(slots_mutex);
+
+        // Aborted and fatal decodes keep the ubatches that made it into memory;
+        // drop them so the retry starts from the same state
+        if (ret == 2 || ret < -1) {
+            auto * kv = llama_get_memory(parent_ctx->ctx);
+            std::map<llama_seq_id, llama_pos> pos_min;
+            for (int32_t i = 0; i < batch.n_tokens; i++) {
+                const llama_seq_id seq_id = batch.seq_id[i][0];
+                auto it = pos_min.find(seq_id);
+                if (it == pos_min.end() || batch.pos[i] < it->second) {
+                    pos_min[seq_id] = batch.pos[i];
+                }
+            }
+            for (const auto& entry : pos_min) {
+                llama_memory_seq_rm(kv, entry.first, entry.second, -1);
+            }
+        }
+
+        // 1. Out of KV cells: reclaim what idle slots keep for prefix reuse
+        if (ret == 1 && evict_idle_sequence()) {
+            continue;
+        }
+
+        // 2. Split the batch: defer half of the prompt tokens to later steps
+        if (batch.n_tokens > n_step_gen_tokens) {
+            defer_prompt_tokens(n_step_gen_tokens + (batch.n_tokens - n_step_gen_tokens) / 2);
+            batch_too_large = true;
+            continue;
+        }
+
+        // 3. Generation tokens alone don't fit: fail the lowest-priority request
+        llama_rn_slot* victim = nullptr;
+        for (int32_t i = 0; i < batch.n_tokens; i++) {
+            llama_rn_slot& slot = slots[batch.seq_id[i][0]];
+            if (victim == nullptr || slot.priority < victim->priority ||
+                (slot.priority == victim->priority && slot.n_past > victim->n_past)) {
+                victim = &slot;
+            }
+        }
+
+        drop_slot_from_batch(*victim);
+        batch_too_large = true;
+        fail_slot(*victim, ret == 1
+            ? "KV cache is full: not enough context left for this request"
+            : "llama_decode failed with code " + std::to_string(ret));
+    }
+
+    // Run smaller batches while under pressure and grow back once it clears
+    if (batch_too_large) {
+        n_decode_ok = 0;
         if (n_batch > 32) {
-            n_batch = n_batch / 2;
+            n_batch = std::max<int32_t>(32, n_batch / 2);
             LOG_WARNING("Reducing batch size to %d", n_batch);
         }
+    } else if (n_batch < n_batch_max && ++n_decode_ok >= 16) {
+        n_decode_ok = 0;
+        n_batch = std::min(n_batch_max, n_batch * 2);
+        LOG_INFO("Restoring batch size to %d", n_batch);
+    }
 
+    // Outputs are synchronized in finish_step(), when first needed
+    LOG_VERBOSE("Batch submitted successfully");
+    return true;
+}
+
+// Drop the KV an idle slot keeps for prefix reuse, least recently used first
+bool llama_rn_slot_manager::evict_idle_sequence() {
+    auto * kv = llama_get_memory(parent_ctx->ctx);
+
+    llama_rn_slot* victim = nullptr;
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_STATE_IDLE || slot.lent_to >= 0 || llama_memory_seq_pos_max(kv, slot.id) < 0) {
+            continue;
+        }
+        if (victim == nullptr || slot.t_last_used < victim->t_last_used) {
+            victim = &slot;
+        }
+    }
+    if (victim == nullptr) {
         return false;
     }
 
-    // Synchronize to ensure GPU work completes before timing measurements
-    // This is critical for accurate performance metrics when using Metal/GPU
-    llama_synchronize(parent_ctx->ctx);
-
-    LOG_VERBOSE("Batch processed successfully");
+    LOG_INFO("Slot %d: Evicting %zu cached tokens to free KV cache", victim->id, victim->cache_tokens.size());
+    llama_memory_seq_rm(kv, victim->id, -1, -1);
+    drop_cache(*victim);
+    victim->n_past = 0;
     return true;
 }
 
+// Cut the batch to n_keep tokens; slots whose prompt tokens were cut resume
+// from the first of them on a later step
+void llama_rn_slot_manager::defer_prompt_tokens(int32_t n_keep) {
+    n_keep = std::clamp(n_keep, n_step_gen_tokens, batch.n_tokens);
+
+    std::set<llama_seq_id> deferred;
+    for (int32_t i = n_keep; i < batch.n_tokens; i++) {
+        const llama_seq_id seq_id = batch.seq_id[i][0];
+        if (!deferred.insert(seq_id).second) {
+            continue;
+        }
+
+        // A slot's tokens are added in position order, so the first cut one
+        // is where it picks up again
+        llama_rn_slot& slot = slots[seq_id];
+        llama_rn_slot& owner = slot.lent_to >= 0 ? slots[slot.lent_to] : slot;
+        if (owner.rerank_batch != nullptr) {
+            owner.rerank_batch->defer(seq_id, batch.pos[i]);
+            continue;
+        }
+        slot.n_past = batch.pos[i];
+        slot.i_batch = -1;
+        if (slot.state == SLOT_STATE_GENERATING) {
+            slot.state = SLOT_STATE_PROCESSING_PROMPT;
+            slot.prompt_processing_finished = false;
+        }
+    }
+    for (int32_t i = 0; i < n_keep; i++) {
+        const llama_seq_id seq_id = batch.seq_id[i][0];
+        if (deferred.count(seq_id) > 0 && slots[seq_id].lent_to < 0 && slots[seq_id].rerank_batch == nullptr) {
+            slots[seq_id].i_batch = i;
+        }
+    }
+
+    LOG_INFO("Deferring %d prompt tokens of %zu slots to later steps", batch.n_tokens - n_keep, deferred.size());
+    batch.n_tokens = n_keep;
+    n_step_prompt_tokens = n_keep - n_step_gen_tokens;
+}
+
+// Remove a slot's tokens from the batch, keeping the other slots' batch
+// indices in step
+void llama_rn_slot_manager::drop_slot_from_batch(llama_rn_slot& slot) {
+    std::vector<int32_t> remap(batch.n_tokens, -1);
+    int32_t n_kept = 0;
+    int32_t n_gen_dropped = 0;
+    int32_t n_mtp_dropped = 0;
+
+    for (int32_t i = 0; i < batch.n_tokens; i++) {
+        if (batch.seq_id[i][0] == slot.id) {
+            n_gen_dropped += i < n_step_gen_tokens ? 1 : 0;
+            n_mtp_dropped += i < n_step_mtp_tokens ? 1 : 0;
+            continue;
+        }
+        batch.token[n_kept] = batch.token[i];
+        batch.pos[n_kept] = batch.pos[i];
+        batch.n_seq_id[n_kept] = batch.n_seq_id[i];
+        batch.seq_id[n_kept][0] = batch.seq_id[i][0];
+        batch.logits[n_kept] = batch.logits[i];
+        remap[i] = n_kept++;
+    }
+
+    for (auto& other : slots) {
+        if (&other != &slot && other.i_batch >= 0 && other.i_batch < batch.n_tokens) {
+            other.i_batch = remap[other.i_batch];
+        }
+    }
+
+    slot.i_batch = -1;
+    batch.n_tokens = n_kept;
+    n_step_gen_tokens -= n_gen_dropped;
+    n_step_mtp_tokens -= n_mtp_dropped;
+    n_step_prompt_tokens = batch.n_tokens - n_step_gen_tokens;
+}
+
+// Fail a single request and free its sequence
+void llama_rn_slot_manager::fail_slot(llama_rn_slot& slot, const std::string& error) {
+    LOG_ERROR("Slot %d: Request %d failed: %s", slot.id, slot.request_id, error.c_str());
+    if (parent_ctx && parent_ctx->ctx) {
+        llama_memory_seq_rm(llama_get_memory(parent_ctx->ctx), slot.id, -1, -1);
+    }
+    drop_cache(slot);
+    slot.incomplete = true;
+    slot.error_message = error;
+    complete_slot(slot);
+}
+
+// Route a request's callbacks through a delivery stream, so parsing and JS
+// marshaling in them run outside slots_mutex
+void llama_rn_slot_manager::open_event_stream(llama_rn_slot& slot, const llama_rn_queued_request& request) {
+    auto stream = delivery.open(request.request_id);
+    stream->on_token = request.on_token;
+    stream->on_complete = request.on_complete;
+    stream->on_values = request.task_type == SLOT_TASK_TYPE_RERANK ? request.on_rerank : request.on_embedding;
+    if (request.on_frame) {
+        stream->framer.reset(new llama_rn_token_framer());
+        stream->framer->interval_ms = request.frame_interval_ms;
+        stream->framer->max_tokens = request.frame_max_tokens;
+        stream->framer->on_frame = request.on_frame;
+    }
+    slot.event_stream = stream;
+
+    if (stream->on_token || stream->framer) {
+        slot.on_token_callback = [stream](const completion_token_output& token) {
+            llama_rn_delivery_event event;
+            event.type = llama_rn_delivery_event::EVENT_TOKEN;
+            event.request_id = token.request_id;
+            event.token = token;
+            stream->push(std::move(event));
+        };
+    }
+    if (stream->on_complete) {
+        slot.on_complete_callback = [stream](llama_rn_slot* done) {
+            if (done->parent_ctx && done->ctx_sampling) {
+                common_perf_print(done->parent_ctx->ctx, done->ctx_sampling);
+            }
+            llama_rn_delivery_event event;
+            event.type = llama_rn_delivery_event::EVENT_COMPLETE;
+            event.request_id = done->request_id;
+            event.result = done->snapshot_result();
+            stream->push(std::move(event));
+        };
+    }
+    if (stream->on_values) {
+        auto on_values = [stream](int32_t request_id, const std::vector<float>& values) {
+            llama_rn_delivery_event event;
+            event.type = llama_rn_delivery_event::EVENT_VALUES;
+            event.request_id = request_id;
+            event.values = values;
+            stream->push(std::move(event));
+        };
+        if (request.task_type == SLOT_TASK_TYPE_RERANK) {
+            slot.on_rerank_callback = on_values;
+        } else {
+            slot.on_embedding_callback = on_values;
+        }
+    }
+}
+
 void llama_rn_slot_manager::complete_slot(llama_rn_slot & slot) {
     slot.generated_text += slot.utf8_gate.finish();
     slot.state = SLOT_STATE_DONE;
@@ -955,6 +1777,26 @@ void llama_rn_slot_manager::sample_and_callback() {
         return data;
     };
 
+    // Rerank engines pick up the scores of the documents that finished in this batch
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_STATE_PROCESSING_PROMPT || slot.rerank_batch == nullptr) {
+            continue;
+        }
+        auto& engine = *slot.rerank_batch;
+        engine.collect();
+        if (!engine.done()) {
+            continue;
+        }
+
+        slot.t_prompt_processing = (lm_ggml_time_us() - slot.t_start_process) / 1e6;
+        LOG_INFO("Slot %d: Reranked %zu documents in %d decodes (%zu shared prefix tokens)",
+                 slot.id, engine.scores.size(), engine.n_decodes, engine.n_prefix);
+        if (slot.on_rerank_callback) {
+            slot.on_rerank_callback(slot.request_id, engine.scores);
+        }
+        slot.state = SLOT_STATE_DONE;
+    }
+
     // Process each slot in GENERATING state
     for (auto& slot : slots) {
         if (slot.state != SLOT_STATE_GENERATING) {
@@ -968,6 +1810,9 @@ void llama_rn_slot_manager::sample_and_callback() {
             slot.state = SLOT_STATE_DONE;
             continue;
         }
+        if (slot.delivery_stalled) {
+            continue;
+        }
         switch (slot.task_type) {
             case SLOT_TASK_TYPE_COMPLETION: {
                 if (slot.ctx_sampling == nullptr) {
@@ -1021,46 +1866,52 @@ void llama_rn_slot_manager::sample_and_callback() {
                             LOG_WARNING("Slot %d: Context full", slot.id);
                         }
 
-                        if (!slot.stop_words.empty() && !slot.generated_text.empty()) {
-                            const std::string& text = slot.generated_text;
-                            const size_t last_token_size = token_output.text.size();
-
-                            for (const std::string& word : slot.stop_words) {
-                                const size_t search_start = text.size() > word.size() + last_token_size
-                                    ? text.size() - word.size() - last_token_size
-                                    : 0;
-                                size_t pos = text.find(word, search_start);
-
-                                if (pos != std::string::npos) {
-                                    slot.stopped_word = true;
-                                    slot.stopping_word = word;
-                                    should_stop = true;
-                                    LOG_INFO("Slot %d: Stopped on word '%s'", slot.id, word.c_str());
-                                    break;
-                                }
-                            }
+                        const llama_rn_stop_matcher::match match = slot.stop_matcher.feed(token_output.text);
+                        if (match.found()) {
+                            slot.stopped_word = true;
+                            slot.stopping_word = slot.stop_matcher.word(match.word);
+                            should_stop = true;
+                            LOG_INFO("Slot %d: Stopped on word '%s'", slot.id, slot.stopping_word.c_str());
                         }
 
                         return should_stop;
                     };
 
+                    if (slot.i_batch < 0) {
+                        // Left out of the batch: the draft step found the slot had stopped
+                        finish_slot();
+                        continue;
+                    }
+
                     try {
-                        bool should_stop = false;
+                        // Verify the draft: every accepted token plus the target's
+                        // own next token come out of the shared decode
+                        std::vector<int> idxs(slot.spec_draft.size() + 1);
+                        std::iota(idxs.begin(), idxs.end(), slot.i_batch);
+                        const auto accepted = common_sampler_sample_and_accept_n(
+                            slot.ctx_sampling, parent_ctx->ctx, idxs, slot.spec_draft);
+                        const llama_tokens tokens = slot.accept_mtp_verification(accepted);
+                        slot.i_batch = -1;
 
-                        completion_token_output token_output = slot.next_token_mtp();
-                        const bool emitted = token_output.tok != -1;
-                        if (emitted) {
+                        bool should_stop = false;
+                        for (const llama_token tok : tokens) {
+                            completion_token_output token_output;
+                            token_output.tok = tok;
+                            slot.num_tokens_predicted++;
                             should_stop = emit_token(std::move(token_output));
+                            if (should_stop) {
+                                break;
+                            }
                         }
 
                         const bool done = should_stop ||
                             slot.stopped_limit ||
                             slot.context_full ||
-                            (slot.stopped_eos && slot.spec_pending_tokens.empty());
+                            slot.stopped_eos;
 
                         if (done) {
                             finish_slot();
-                        } else if (!emitted) {
+                        } else if (tokens.empty()) {
                             slot.incomplete = true;
                             slot.error_message = "MTP speculative decoding did not produce a token";
                             finish_slot();
@@ -1082,105 +1933,113 @@ void llama_rn_slot_manager::sample_and_callback() {
                     continue;
                 }
 
-                llama_token new_token_id = common_sampler_sample(slot.ctx_sampling, parent_ctx->ctx, slot.i_batch);
-                common_sampler_accept(slot.ctx_sampling, new_token_id, true);
-
-                if (llama_vocab_is_eog(vocab, new_token_id)) {
-                    slot.stopped_eos = true;
-                    LOG_INFO("Slot %d: Stopped on EOS token", slot.id);
-
-                    // Save state if path is provided
-                    if (!slot.save_state_path.empty()) {
-                        slot.save_state();
-                    }
-
-                    complete_slot(slot);
-                    continue;
+                // Sample the next token. With an n-gram draft in the batch, verify
+                // it instead: every accepted draft token plus the target's own
+                // next token come out of the same decode.
+                std::vector<llama_token> new_tokens;
+                if (!slot.ngram_draft.empty()) {
+                    std::vector<int> idxs(slot.ngram_draft.size() + 1);
+                    std::iota(idxs.begin(), idxs.end(), slot.i_batch);
+                    new_tokens = common_sampler_sample_and_accept_n(
+                        slot.ctx_sampling, parent_ctx->ctx, idxs, slot.ngram_draft);
+                    slot.accept_ngram_draft(new_tokens.size() - 1);
+                } else {
+                    llama_token new_token_id = common_sampler_sample(slot.ctx_sampling, parent_ctx->ctx, slot.i_batch);
+                    common_sampler_accept(slot.ctx_sampling, new_token_id, true);
+                    new_tokens.push_back(new_token_id);
                 }
 
-                std::string token_text = common_token_to_piece(parent_ctx->ctx, new_token_id);
-                token_text = slot.utf8_gate.feed(token_text);
-                slot.generated_text += token_text;
-
-                // Update token generation timing
-                const int64_t t_current = lm_ggml_time_us();
-                slot.t_token_generation = (t_current - slot.t_start_generation) / 1e6;
-
-                completion_token_output token_output;
-                token_output.tok = new_token_id;
-                token_output.text = token_text;
-                token_output.request_id = slot.request_id;
-
-                const int32_t n_probs = slot.params->sampling.n_probs;
-                if (n_probs > 0) {
-                  llama_token_data_array cur_p = *common_sampler_get_candidates(slot.ctx_sampling, true);
-                  for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
-                  {
-                      token_output.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
-                  }
-                }
+                for (const llama_token new_token_id : new_tokens) {
+                    if (llama_vocab_is_eog(vocab, new_token_id)) {
+                        slot.stopped_eos = true;
+                        LOG_INFO("Slot %d: Stopped on EOS token", slot.id);
 
-                slot.generated_tokens.push_back(new_token_id);
-                slot.n_decoded++;
-                slot.num_tokens_predicted++;
+                        // Save state if path is provided
+                        if (!slot.save_state_path.empty()) {
+                            slot.save_state();
+                        }
+
+                        complete_slot(slot);
+                        break;
+                    }
 
-                // Update cache_tokens to keep track of all processed tokens
-                // This is needed for state saving
-                slot.cache_tokens.push_back(new_token_id);
+                    std::string token_text = common_token_to_piece(parent_ctx->ctx, new_token_id);
+                    token_text = slot.utf8_gate.feed(token_text);
+                    slot.generated_text += token_text;
+
+                    // Update token generation timing
+                    const int64_t t_current = lm_ggml_time_us();
+                    slot.t_token_generation = (t_current - slot.t_start_generation) / 1e6;
+
+                    completion_token_output token_output;
+                    token_output.tok = new_token_id;
+                    token_output.text = token_text;
+                    token_output.request_id = slot.request_id;
+
+                    const int32_t n_probs = slot.params->sampling.n_probs;
+                    if (n_probs > 0) {
+                      llama_token_data_array cur_p = *common_sampler_get_candidates(slot.ctx_sampling, true);
+                      for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                      {
+                          token_output.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                      }
+                    }
 
-                // still emit an empty delta when it carries requested probs
-                if (slot.on_token_callback && (!token_output.text.empty() || !token_output.probs.empty())) {
-                    slot.on_token_callback(token_output);
-                }
+                    slot.generated_tokens.push_back(new_token_id);
+                    slot.n_decoded++;
+                    slot.num_tokens_predicted++;
 
-                bool should_stop = false;
+                    // Update cache_tokens to keep track of all processed tokens
+                    // This is needed for state saving
+                    slot.cache_tokens.push_back(new_token_id);
 
-                if (slot.n_remaining > 0) {
-                    slot.n_remaining--;
-                    if (slot.n_remaining == 0) {
-                        slot.stopped_limit = true;
-                        should_stop = true;
-                        LOG_INFO("Slot %d: Stopped on token limit", slot.id);
+                    // still emit an empty delta when it carries requested probs
+                    if (slot.on_token_callback && (!token_output.text.empty() || !token_output.probs.empty())) {
+                        slot.on_token_callback(token_output);
                     }
-                }
-
-                if (slot.n_past >= slot.n_ctx) {
-                    slot.context_full = true;
-                    should_stop = true;
-                    LOG_WARNING("Slot %d: Context full", slot.id);
-                }
 
-                if (!slot.stop_words.empty() && !slot.generated_text.empty()) {
-                    const std::string& text = slot.generated_text;
-                    const size_t last_token_size = token_text.size();
+                    bool should_stop = false;
 
-                    for (const std::string& word : slot.stop_words) {
-                        const size_t search_start = text.size() > word.size() + last_token_size
-                            ? text.size() - word.size() - last_token_size
-                            : 0;
-                        size_t pos = text.find(word, search_start);
+                    if (slot.n_remaining > 0) {
+                        slot.n_remaining--;
+                        if (slot.n_remaining == 0) {
+                            slot.stopped_limit = true;
+                            should_stop = true;
+                            LOG_INFO("Slot %d: Stopped on token limit", slot.id);
+                        }
+                    }
 
-                        if (pos != std::string::npos) {
-                            slot.stopped_word = true;
-                            slot.stopping_word = word;
+                    if (slot.n_past >= slot.n_ctx) {
+                        if (slot.shift_context()) {
+                            sync_prefix_index(slot);
+                        } else {
+                            slot.context_full = true;
                             should_stop = true;
-                            LOG_INFO("Slot %d: Stopped on word '%s'", slot.id, word.c_str());
-                            break;
+                            LOG_WARNING("Slot %d: Context full", slot.id);
                         }
                     }
-                }
 
-                if (should_stop) {
-                    // Save state if path is provided
-                    if (!slot.save_state_path.empty()) {
-                        slot.save_state();
+                    const llama_rn_stop_matcher::match match = slot.stop_matcher.feed(token_text);
+                    if (match.found()) {
+                        slot.stopped_word = true;
+                        slot.stopping_word = slot.stop_matcher.word(match.word);
+                        should_stop = true;
+                        LOG_INFO("Slot %d: Stopped on word '%s'", slot.id, slot.stopping_word.c_str());
                     }
 
-                    complete_slot(slot);
-                }
+                    LOG_VERBOSE("Slot %d: Generated token %d ('%s'), n_past=%d, n_decoded=%d",
+                               slot.id, new_token_id, token_text.c_str(), slot.n_past, slot.n_decoded);
+
+                    if (should_stop) {
+                        // Save state if path is provided
+                        if (!slot.save_state_path.empty()) {
+                            slot.save_state();
+                        }
 
-                LOG_VERBOSE("Slot %d: Generated token %d ('%s'), n_past=%d, n_decoded=%d",
-                           slot.id, new_token_id, token_text.c_str(), slot.n_past, slot.n_decoded);
+                        complete_slot(slot);
+                        break;
+                    }
+                }
                 break;
             }
 
@@ -1212,40 +2071,6 @@ void llama_rn_slot_manager::sample_and_callback() {
                 continue;
             }
 
-            case SLOT_TASK_TYPE_RERANK: {
-                const float* data = get_embedding_ptr(slot);
-                float score = data ? data[0] : -1e6f;
-
-                LOG_INFO("Rerank data: 0: %f", score);
-
-                if (slot.rerank_current_index < slot.rerank_scores.size()) {
-                    slot.rerank_scores[slot.rerank_current_index] = score;
-                }
-
-                slot.rerank_current_index++;
-
-                if (slot.rerank_current_index < slot.rerank_prompt_tokens.size()) {
-                    if (parent_ctx && parent_ctx->ctx) {
-                        llama_memory_clear(llama_get_memory(parent_ctx->ctx), false);
-                    }
-                    slot.load_prompt(slot.rerank_prompt_tokens[slot.rerank_current_index]);
-                    slot.state = SLOT_STATE_PROCESSING_PROMPT;
-                    slot.i_batch = -1;
-                    continue;
-                }
-
-                if (slot.on_rerank_callback) {
-                    slot.on_rerank_callback(slot.request_id, slot.rerank_scores);
-                }
-
-                if (parent_ctx && parent_ctx->ctx) {
-                    llama_memory_clear(llama_get_memory(parent_ctx->ctx), false);
-                }
-
-                slot.state = SLOT_STATE_DONE;
-                continue;
-            }
-
             default:
                 LOG_ERROR("Slot %d: Unknown task type %d in sampling", slot.id, slot.task_type);
                 slot.state = SLOT_STATE_DONE;
@@ -1272,6 +2097,76 @@ void llama_rn_slot_manager::release_completed_slots() {
 
 // Main processing loop
 void llama_rn_slot_manager::update_slots() {
+    // Last step on every exit: hand this step's callback events to the
+    // delivery thread, or deliver them here when there is none
+    struct deliver_on_exit {
+        llama_rn_slot_manager* mgr;
+        ~deliver_on_exit() {
+            {
+                std::lock_guard<std::mutex> lock(mgr->slots_mutex);
+                mgr->delivery.flush();
+            }
+            if (mgr->delivery.running()) {
+                mgr->delivery.notify();
+            } else {
+                mgr->delivery.deliver();
+            }
+        }
+    } deliver_guard{this};
+
+    // The step owns the context until its outputs are sampled; a pipelined
+    // one keeps it into the next call
+    if (!step_holds_decode) {
+        lock_decode();
+        step_holds_decode = true;
+    }
+    struct decode_on_exit {
+        llama_rn_slot_manager* mgr;
+        ~decode_on_exit() {
+            if (!mgr->step_pending && mgr->step_holds_decode) {
+                mgr->step_holds_decode = false;
+                mgr->unlock_decode();
+            }
+        }
+    } decode_guard{this};
+
+    const int64_t t_update_start = lm_ggml_time_us();
+
+    // Pipelined: sample the batch submitted by the previous call first; its
+    // tokens are what the next batch is built from
+    bool stepped = step_pending;
+    if (step_pending) {
+        finish_step();
+    }
+
+    if (start_step()) {
+        stepped = true;
+        if (!pipeline_decode) {
+            finish_step();
+        }
+    }
+
+    loop_stats.t_update_us += lm_ggml_time_us() - t_update_start;
+
+    if (!stepped) {
+        return;
+    }
+
+    // Step 8: Notify subscribers of status change (outside of slots_mutex)
+    // Check if there are subscribers before calling notify
+    bool has_subscribers = false;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        has_subscribers = !status_subscribers.empty();
+    }
+    if (has_subscribers) {
+        notify_status_change();
+    }
+}
+
+// Steps 1-4: assign queued requests, build the batch and submit it. Returns
+// false when no slot is active (nothing to finish).
+bool llama_rn_slot_manager::start_step() {
     // Step 1: Process pending queue (with mutex)
     {
         std::lock_guard<std::mutex> lock(slots_mutex);
@@ -1292,7 +2187,7 @@ void llama_rn_slot_manager::update_slots() {
 
     if (!has_active) {
         // No active slots, return early
-        return;
+        return false;
     }
 
     // Step 3: Build batch from all active slots (with mutex)
@@ -1301,8 +2196,9 @@ void llama_rn_slot_manager::update_slots() {
         build_batch();
     }
 
-    // Step 4: Process batch if we have tokens (NO mutex - llama_decode is thread-safe)
+    // Step 4: Submit batch if we have tokens (NO mutex - llama_decode is thread-safe)
     if (batch.n_tokens > 0) {
+        t_step_submit = lm_ggml_time_us();
         bool success = process_batch();
         if (!success) {
             LOG_ERROR("Batch processing failed");
@@ -1310,27 +2206,49 @@ void llama_rn_slot_manager::update_slots() {
             std::lock_guard<std::mutex> lock(slots_mutex);
             for (auto& slot : slots) {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_GENERATING) {
+                    // The failed batch may have left partial cells behind
+                    drop_cache(slot);
                     slot.incomplete = true;
+                    slot.error_message = "Batch processing failed";
                     complete_slot(slot);
                 }
             }
-            return;
+            batch.n_tokens = 0;
         }
+    }
+
+    step_pending = true;
+    return true;
+}
+
+// Steps 4.5-7: wait for the submitted batch, then sample, release and
+// reassign slots
+void llama_rn_slot_manager::finish_step() {
+    step_pending = false;
+
+    if (batch.n_tokens > 0) {
+        // Outputs are read from here on; on GPU backends the compute may
+        // still be running until now
+        llama_synchronize(parent_ctx->ctx);
+        const int64_t t_now = lm_ggml_time_us();
+
+        loop_stats.n_steps++;
+        loop_stats.n_tokens += batch.n_tokens;
+        loop_stats.t_compute_us += t_now - t_step_submit;
 
         // Step 4.5: Calculate timing for slots that just finished prompt processing
         // This must happen AFTER batch has been decoded
-        {
-            std::lock_guard<std::mutex> lock(slots_mutex);
-            const int64_t t_now = lm_ggml_time_us();
-            for (auto& slot : slots) {
-                if (slot.prompt_processing_finished) {
-                    slot.t_start_generation = t_now;
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process) / 1e6;
-                    slot.prompt_processing_finished = false;  // Clear the flag
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        adapt_prefill_budget((t_now - t_step_submit) / 1e3);
+        process_mtp_batch();
+        for (auto& slot : slots) {
+            if (slot.prompt_processing_finished) {
+                slot.t_start_generation = t_now;
+                slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process) / 1e6;
+                slot.prompt_processing_finished = false;  // Clear the flag
 
-                    LOG_VERBOSE("Slot %d: Prompt processing complete, time=%.3fs, tokens=%d (cached=%d)",
-                               slot.id, slot.t_prompt_processing, slot.n_prompt_tokens_processed, slot.n_prompt_tokens_cache);
-                }
+                LOG_VERBOSE("Slot %d: Prompt processing complete, time=%.3fs, tokens=%d (cached=%d)",
+                           slot.id, slot.t_prompt_processing, slot.n_prompt_tokens_processed, slot.n_prompt_tokens_cache);
             }
         }
     }
@@ -1358,6 +2276,19 @@ void llama_rn_slot_manager::update_slots() {
                 }
             }
         }
+
+        // In-memory snapshots for recurrent/hybrid prefix reuse on the next request
+        for (auto& slot : slots) {
+            if (!slot.state_ckpt_pending || slot.state != SLOT_STATE_PROCESSING_PROMPT) {
+                continue;
+            }
+            if (slot.n_past >= slot.state_ckpt_tokens) {
+                if (slot.n_past == slot.state_ckpt_tokens) {
+                    slot.capture_state_checkpoint((size_t)slot.state_ckpt_tokens);
+                }
+                slot.state_ckpt_pending = false;
+            }
+        }
     }
 
     // Step 5: Sample tokens and invoke callbacks for GENERATING slots (with mutex)
@@ -1377,17 +2308,24 @@ void llama_rn_slot_manager::update_slots() {
         std::lock_guard<std::mutex> lock(slots_mutex);
         process_pending_queue();
     }
+}
 
-    // Step 8: Notify subscribers of status change (outside of slots_mutex)
-    // Check if there are subscribers before calling notify
-    bool has_subscribers = false;
-    {
-        std::lock_guard<std::mutex> lock(subscribers_mutex);
-        has_subscribers = !status_subscribers.empty();
+// Whether the next step has work: a batch to sample, or an active slot that
+// isn't held back by its consumer (call with slots_mutex held)
+bool llama_rn_slot_manager::has_runnable_slot() const {
+    if (step_pending) {
+        return true;
     }
-    if (has_subscribers) {
-        notify_status_change();
+    for (const auto& slot : slots) {
+        if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+            return true;
+        }
+        if (slot.state == SLOT_STATE_GENERATING &&
+            (slot.event_stream == nullptr || !slot.event_stream->congested())) {
+            return true;
+        }
     }
+    return false;
 }
 
 // Start background processing loop
@@ -1399,6 +2337,7 @@ void llama_rn_slot_manager::start_processing_loop() {
     }
 
     processing_active.store(true);
+    delivery.start();
 
     // Start processing thread
     processing_thread = std::thread([this]() {
@@ -1408,31 +2347,37 @@ void llama_rn_slot_manager::start_processing_loop() {
             // Call update_slots (protected by mutex)
             update_slots();
 
-            // Wait for new work instead of sleeping
-            // This efficiently blocks until notified or until there's work to do
+            // Run the next step right away while it can make progress;
+            // otherwise block until a request is queued or cancelled, a
+            // congested stream drains, or the loop is stopped
             std::unique_lock<std::mutex> lock(slots_mutex);
-
-            // Check if we have any active work or pending requests
-            bool has_work = !queue_requests.empty();
-            if (!has_work) {
-                for (const auto& slot : slots) {
-                    if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_GENERATING) {
-                        has_work = true;
-                        break;
-                    }
+            loop_waiting.store(true);
+            auto can_step = [this]() {
+                return wake_pending || !processing_active.load() || has_runnable_slot();
+            };
+            if (!can_step()) {
+                // Slots held back by their consumer stay marked while the loop sleeps
+                for (auto& slot : slots) {
+                    slot.delivery_stalled = slot.state == SLOT_STATE_GENERATING &&
+                        slot.event_stream != nullptr && slot.event_stream->congested();
                 }
+                loop_stats.n_waits++;
+                slots_cv.wait(lock, can_step);
             }
+            loop_waiting.store(false);
+            wake_pending = false;
+        }
 
-            // If no work, wait for notification
-            if (!has_work && processing_active.load()) {
-                slots_cv.wait(lock, [this]() {
-                    // Wake up if: there are pending requests, or processing should stop
-                    return !queue_requests.empty() || !processing_active.load();
-                });
-            } else if (has_work) {
-                lock.unlock();
-                std::this_thread::sleep_for(std::chrono::microseconds(100));
-            }
+        // A pipelined step still holds the context: sample it now, so
+        // pooled batches don't wait on the next update_slots call
+        if (step_pending) {
+            finish_step();
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            delivery.flush();
+        }
+        if (step_holds_decode) {
+            step_holds_decode = false;
+            unlock_decode();
         }
 
         LOG_INFO("Processing loop stopped");
@@ -1446,7 +2391,11 @@ void llama_rn_slot_manager::stop_processing_loop() {
     }
 
     LOG_INFO("Stopping processing loop...");
-    processing_active.store(false);
+    {
+        // Under the lock, so the loop can't miss it between its check and wait
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        processing_active.store(false);
+    }
 
     // Notify condition variable to wake up the thread
     slots_cv.notify_all();
@@ -1456,6 +2405,9 @@ void llama_rn_slot_manager::stop_processing_loop() {
         processing_thread.join();
     }
 
+    // Deliver what the last steps produced
+    delivery.stop();
+
     LOG_INFO("Processing loop stopped");
 }
 
@@ -1466,7 +2418,7 @@ llama_rn_parallel_status llama_rn_slot_manager::get_status() {
     llama_rn_parallel_status status;
     status.n_parallel = n_parallel;
     status.active_slots = 0;
-    status.queued_requests = static_cast<int32_t>(queue_requests.size());
+    status.queued_requests = static_cast<int32_t>(queue_requests.size() + preempted_requests.size());
 
     // Add active slot requests
     for (const auto& slot : slots) {
@@ -1491,6 +2443,7 @@ llama_rn_parallel_status llama_rn_slot_manager::get_status() {
                 case SLOT_STATE_DONE: req_status.state = "done"; break;
             }
 
+            req_status.priority = slot.priority;
             req_status.prompt_length = slot.num_prompt_tokens;
             req_status.tokens_generated = slot.n_decoded;
             req_status.prompt_ms = slot.t_prompt_processing * 1e3;
@@ -1514,6 +2467,7 @@ llama_rn_parallel_status llama_rn_slot_manager::get_status() {
         }
 
         req_status.state = "queued";
+        req_status.priority = queued.priority;
         req_status.prompt_length = queued.prompt_tokens.size();
         req_status.tokens_generated = 0;
         req_status.prompt_ms = 0.0;
@@ -1523,13 +2477,31 @@ llama_rn_parallel_status llama_rn_slot_manager::get_status() {
         status.requests.push_back(req_status);
     }
 
+    // Add parked (preempted) requests
+    for (const auto& parked : preempted_requests) {
+        const llama_rn_slot& slot = parked->slot;
+        llama_rn_request_status req_status;
+        req_status.request_id = slot.request_id;
+        req_status.type = "completion";
+        req_status.state = "preempted";
+        req_status.priority = slot.priority;
+        req_status.prompt_length = slot.num_prompt_tokens;
+        req_status.tokens_generated = slot.n_decoded;
+        req_status.prompt_ms = slot.t_prompt_processing * 1e3;
+        req_status.generation_ms = slot.t_token_generation * 1e3;
+        req_status.tokens_per_second = (slot.n_decoded > 0 && slot.t_token_generation > 0.0)
+            ? slot.n_decoded / slot.t_token_generation : 0.0;
+
+        status.requests.push_back(req_status);
+    }
+
     return status;
 }
 
 bool llama_rn_slot_manager::has_pending_work() {
     std::lock_guard<std::mutex> lock(slots_mutex);
 
-    if (!queue_requests.empty()) {
+    if (!queue_requests.empty() || !preempted_requests.empty()) {
         return true;
     }
 
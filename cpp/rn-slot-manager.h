@@ -2,11 +2,14 @@
 #define RN_SLOT_MANAGER_H
 
 #include "rn-slot.h"
+#include "rn-prefix-index.h"
+#include "rn-delivery.h"
 #include "common.h"
 #include "llama.h"
 #include <vector>
 #include <deque>
 #include <map>
+#include <memory>
 #include <functional>
 #include <mutex>
 #include <thread>
@@ -23,7 +26,8 @@ struct completion_token_output;
 struct llama_rn_request_status {
     int32_t request_id;
     std::string type;           // "completion", "embedding", "rerank"
-    std::string state;          // "queued", "processing_prompt", "generating", "done"
+    std::string state;          // "queued", "preempted", "processing_prompt", "generating", "done"
+    int32_t priority;           // Scheduling priority (higher runs first)
     size_t prompt_length;
     size_t tokens_generated;
     double prompt_ms;
@@ -46,6 +50,9 @@ struct llama_rn_queued_request {
     std::vector<llama_token> prompt_tokens;
     std::function<void(const completion_token_output&)> on_token;
     std::function<void(llama_rn_slot*)> on_complete;
+    std::function<void(llama_rn_token_frame&)> on_frame; // Replaces on_token when set
+    int32_t frame_interval_ms = 16;
+    int32_t frame_max_tokens = 0;
 
     // Media paths for multimodal
     std::vector<std::string> media_paths;
@@ -75,6 +82,11 @@ struct llama_rn_queued_request {
     int32_t load_state_size;           // Number of tokens to load (0 or -1 = all tokens)
     int32_t save_state_size;           // Number of tokens to save (0 or -1 = all tokens)
 
+    // Scheduling
+    int32_t priority;                  // Higher runs first; may preempt lower-priority generation
+    int64_t t_queued;                  // Time the request was queued (us), for aging
+    int64_t t_deadline;                // Target time to start (us), 0 = none
+
     llama_rn_queued_request() :
         request_id(-1),
         task_type(SLOT_TASK_TYPE_COMPLETION),
@@ -82,10 +94,29 @@ struct llama_rn_queued_request {
         reasoning_format(COMMON_REASONING_FORMAT_NONE),
         embd_normalize(-1),
         load_state_size(-1),
-        save_state_size(-1)
+        save_state_size(-1),
+        priority(0),
+        t_queued(0),
+        t_deadline(0)
     {}
 };
 
+// Generation parked to free its slot for a higher-priority request
+struct llama_rn_preempted_request {
+    llama_rn_slot slot;                // Request state (sampler, tokens, callbacks)
+    std::vector<uint8_t> seq_state;    // Serialized sequence memory
+    int64_t t_preempted;               // Time the request was parked (us)
+};
+
+// Processing loop counters, for measuring step overhead against throughput
+struct llama_rn_loop_stats {
+    int64_t n_steps = 0;                   // Steps that decoded a batch
+    int64_t n_tokens = 0;                  // Tokens decoded
+    int64_t t_compute_us = 0;              // Batch submit to outputs ready
+    int64_t t_update_us = 0;               // Time spent in update_slots
+    int64_t n_waits = 0;                   // Times the loop blocked waiting for work
+};
+
 // Slot manager for parallel decoding
 struct llama_rn_slot_manager {
     // Parent context reference
@@ -97,6 +128,11 @@ struct llama_rn_slot_manager {
 
     // Request queue
     std::deque<llama_rn_queued_request> queue_requests;
+    std::vector<std::unique_ptr<llama_rn_preempted_request>> preempted_requests;
+
+    // Token prefixes held in each slot's KV sequence, for slot selection
+    // and cross-slot prefix copies
+    llama_rn_prefix_index prefix_index;
 
     // Request tracking
     std::map<int32_t, llama_rn_slot*> active_requests;  // request_id -> slot
@@ -105,6 +141,27 @@ struct llama_rn_slot_manager {
     // Batch processing
     llama_batch batch;
     int32_t n_batch;                       // Max batch size
+    int32_t n_batch_max;                   // Configured batch size; n_batch grows back to it
+    int32_t n_decode_ok;                   // Successful decodes since n_batch was last changed
+
+    // Chunked prefill: while any slot is generating, prompt tokens per step
+    // are capped so long prompts don't stall the generating streams
+    int32_t n_prefill_budget;              // Max prompt tokens per step (0 = n_batch)
+    float prefill_target_ms;               // Decode time per step to adapt the budget to (0 = fixed)
+    int32_t n_prefill_budget_cur;          // Current budget (adapted)
+    size_t prefill_rr_cursor;              // First slot to serve next step (round-robin)
+    int32_t n_step_gen_tokens;             // Generating tokens in the last built batch
+    int32_t n_step_prompt_tokens;          // Prompt tokens in the last built batch
+    int32_t n_step_mtp_tokens;             // MTP verification tokens at the head of the last built batch
+
+    // Pipelined delivery: update_slots samples the pending step, then submits
+    // the next batch and returns without waiting for it, so status updates,
+    // callback hand-off and loop scheduling overlap the graph compute.
+    // Sampling itself is not overlapped: step N+1 is built from the tokens
+    // sampled in step N, so it is submitted only after they are sampled.
+    bool pipeline_decode;
+    bool step_pending;                     // A step was started and is not sampled yet
+    int64_t t_step_submit;                 // Time the pending step's batch was submitted (us)
 
     // Shared MTP speculative decoding state. llama.cpp's MTP driver is
     // multi-sequence, so queued slots borrow this instead of creating one
@@ -120,14 +177,32 @@ struct llama_rn_slot_manager {
     lm_ggml_type mtp_spec_cache_type_v = LM_GGML_TYPE_F16;
 
     // Configuration
-    float slot_prompt_similarity;          // Threshold for cache reuse (0.0-1.0)
-    bool continuous_batching;              // Allow mixing prompt/generation
+    bool continuous_batching;
+    int32_t priority_aging_ms;             // Queue wait that raises effective priority by one (0 = no aging)
+    bool preemption_enabled;               // Park lower-priority generation for higher-priority requests              // Allow mixing prompt/generation
 
     // Processing loop control
     std::mutex slots_mutex;                // Mutex for thread-safe access to slots
     std::condition_variable slots_cv;      // Condition variable for efficient waiting
     std::thread processing_thread;         // Background processing thread
     std::atomic<bool> processing_active;   // Flag to control processing loop
+    bool wake_pending;                     // Work arrived since the loop last waited (under slots_mutex)
+    std::atomic<bool> loop_waiting;        // Loop may block on slots_cv; delivery wakes it
+    llama_rn_loop_stats loop_stats;
+
+    // The context runs one decode at a time. A step holds it from assigning
+    // requests until its outputs are sampled (across update_slots calls when
+    // pipelined); pooled batches run beside the slots wait for it in between.
+    // Not a mutex: a pipelined step may be finished on another thread.
+    std::mutex decode_mutex;
+    std::condition_variable decode_cv;
+    bool decode_busy = false;              // Under decode_mutex
+    bool step_holds_decode = false;        // update_slots holds the context
+
+    // Callback delivery: events go through per-request lock-free rings to a
+    // delivery thread (or are delivered after each update_slots call when no
+    // processing loop runs)
+    llama_rn_delivery delivery;
 
     // Status subscription support
     std::map<int32_t, std::function<void(const llama_rn_parallel_status&)>> status_subscribers;
@@ -160,20 +235,28 @@ struct llama_rn_slot_manager {
         int32_t load_state_size,
         int32_t save_state_size,
         std::function<void(const completion_token_output&)> on_token,
-        std::function<void(llama_rn_slot*)> on_complete
+        std::function<void(llama_rn_slot*)> on_complete,
+        int32_t priority = 0,
+        int32_t deadline_ms = 0,
+        // Framed streaming: tokens arrive in frames here instead of on_token
+        std::function<void(llama_rn_token_frame&)> on_frame = nullptr,
+        int32_t frame_interval_ms = 16,
+        int32_t frame_max_tokens = 0
     );
 
     int32_t queue_embedding_request(
         const std::vector<llama_token>& tokens,
         int embd_normalize,
-        std::function<void(int32_t, const std::vector<float>&)> on_result
+        std::function<void(int32_t, const std::vector<float>&)> on_result,
+        int32_t priority = 0
     );
 
     int32_t queue_rerank_request(
         const std::string& query,
         const std::vector<std::string>& documents,
         int normalize,
-        std::function<void(int32_t, const std::vector<float>&)> on_results
+        std::function<void(int32_t, const std::vector<float>&)> on_results,
+        int32_t priority = 0
     );
 
     // Slot management
@@ -181,6 +264,7 @@ struct llama_rn_slot_manager {
     llama_rn_slot* get_slot_by_request_id(int32_t request_id);
     void release_slot(llama_rn_slot* slot);
     void cancel_request(int32_t request_id);
+    void start_rerank(llama_rn_slot& slot, std::vector<std::vector<llama_token>> pairs);
 
     // Processing loop management
     void start_processing_loop();
@@ -188,20 +272,54 @@ struct llama_rn_slot_manager {
 
     // Main processing loop (protected by mutex)
     void update_slots();
+    bool start_step();                     // Queue, build and submit a batch
+    void finish_step();                    // Wait for the outputs, sample, release
+    bool has_runnable_slot() const;        // Some slot can make progress next step
+
+    // Prefix sharing across slots
+    void sync_prefix_index(const llama_rn_slot& slot);
+    void drop_cache(llama_rn_slot& slot);  // Forget the cached tokens and their index entry
+
+    // Exclusive use of the context outside the slot loop. While held, no
+    // step runs, so idle slots stay idle and their sequences may be used.
+    void lock_decode();
+    void unlock_decode();
+    // Sequences a pooled batch may use: those of idle slots, caches dropped,
+    // and any no slot owns. Never seq 0. Call with the decode lock held.
+    std::vector<llama_seq_id> borrow_idle_sequences();
+    size_t copy_shared_prefix(llama_rn_slot& slot, const std::vector<llama_token>& prompt);
 
     // Helper methods
-    float compute_similarity(const std::vector<llama_token>& a,
-                            const std::vector<llama_token>& b);
     void build_batch();
+    void add_mtp_drafts(int32_t n_reserved);
+    bool process_mtp_batch();
+    int32_t add_prompt_chunk(llama_rn_slot& slot, int32_t max_tokens);
+    void set_prefill_budget(int32_t n_budget, float target_ms);
+    int32_t prefill_min_chunk() const;
+    void adapt_prefill_budget(double t_decode_ms);
     bool process_batch();
+
+    // Decode failure recovery: free idle KV, defer prompt tokens, drop a request
+    bool evict_idle_sequence();
+    void defer_prompt_tokens(int32_t n_keep);
+    void drop_slot_from_batch(llama_rn_slot& slot);
+    void fail_slot(llama_rn_slot& slot, const std::string& error);
     void sample_and_callback();
 
+    void open_event_stream(llama_rn_slot& slot, const llama_rn_queued_request& request);
+
     // Finish a slot's generation: flush the UTF-8 gate, mark done, notify
     void complete_slot(llama_rn_slot & slot);
     common_speculative* ensure_mtp_speculative(common_params& params);
     llama_context* get_mtp_draft_context() const;
     void reset_mtp_speculative();
 
+    // Scheduling: effective priority with aging and deadline urgency
+    double schedule_score(int32_t priority, int64_t t_queued, int64_t t_deadline, int64_t t_now) const;
+    llama_rn_slot* preempt_slot_for(int32_t priority);
+    bool preempt_slot(llama_rn_slot& slot);
+    void resume_preempted(size_t index, llama_rn_slot& slot);
+
     // Process pending queue
     void process_pending_queue();
 
@@ -41,6 +41,8 @@ llama_rn_slot::llama_rn_slot() :
     t_start_process(0),
     t_start_generation(0),
     t_last_used(0),
+    priority(0),
+    t_queued(0),
     n_prompt_tokens_cache(0),
     n_prompt_tokens_processed(0),
     t_prompt_processing(0.0),
@@ -48,19 +50,23 @@ llama_rn_slot::llama_rn_slot() :
     is_interrupted(false),
     prompt_processing_finished(false),
     media_processed(false),
-    rerank_current_index(0),
+    delivery_stalled(false),
+    lent_to(-1),
     load_state_size(-1),
     save_state_size(-1),
     save_prompt_state_pending(false),
     save_prompt_state_tokens(-1),
     num_draft_tokens(0),
-    num_draft_tokens_accepted(0)
+    num_draft_tokens_accepted(0),
+    state_ckpt_pending(false),
+    state_ckpt_tokens(-1)
 {
 }
 
 // Destructor
 llama_rn_slot::~llama_rn_slot() {
     reset_speculative();
+    free_ngram();
     if (ctx_sampling != nullptr) {
         common_sampler_free(ctx_sampling);
         ctx_sampling = nullptr;
@@ -95,11 +101,14 @@ void llama_rn_slot::reset() {
     stopped_word = false;
     stopped_limit = false;
     stopping_word.clear();
-    stop_words.clear();
+    stop_matcher = llama_rn_stop_matcher();
     error_message.clear();
     num_draft_tokens = 0;
     num_draft_tokens_accepted = 0;
     reset_speculative();
+    ngram_active = false;
+    ngram_history.clear();
+    ngram_draft.clear();
 
     // Clear multimodal state
     bitmap_past_hashes.clear();
@@ -128,13 +137,13 @@ void llama_rn_slot::reset() {
     on_complete_callback = nullptr;
     on_embedding_callback = nullptr;
     on_rerank_callback = nullptr;
+    event_stream.reset();
+    delivery_stalled = false;
 
     // Reset task-specific data
     task_type = SLOT_TASK_TYPE_COMPLETION;
     embd_normalize = -1;
-    rerank_prompt_tokens.clear();
-    rerank_scores.clear();
-    rerank_current_index = 0;
+    rerank_batch.reset();
 
     // Reset state management
     if (!load_state_path.empty() || !save_state_path.empty() || !save_prompt_state_path.empty()) {
@@ -151,6 +160,12 @@ void llama_rn_slot::reset() {
     save_state_size = -1;
     save_prompt_state_pending = false;
     save_prompt_state_tokens = -1;
+    state_ckpt_pending = false;
+    state_ckpt_tokens = -1;
+
+    // Reset scheduling fields
+    priority = 0;
+    t_queued = 0;
 
     // Reset timing fields
     t_start_process = 0;
@@ -160,7 +175,7 @@ void llama_rn_slot::reset() {
     t_prompt_processing = 0.0;
     t_token_generation = 0.0;
 
-    // Note: Keep cache_tokens for potential reuse
+    // Note: Keep cache_tokens and state_checkpoints for potential reuse
     // Note: Keep t_last_used for LRU tracking
 }
 
@@ -245,22 +260,32 @@ void llama_rn_slot::load_prompt(const std::vector<llama_token>& tokens) {
             cache_tokens = tokens;
         }
     } else {
-        // No loaded state, start fresh
-        n_past = 0;
+        // No loaded state: keep whatever prefix this slot's previous request
+        // left in its sequence and process only the diverged tail
         n_decoded = 0;
-        n_prompt_tokens_cache = 0;
+        n_past = reuse_cache_prefix(tokens);
+        n_prompt_tokens_cache = n_past;
 
-        // Clear KV cache for this slot's sequence to ensure clean state
-        if (parent_ctx && parent_ctx->ctx) {
-            auto * kv = llama_get_memory(parent_ctx->ctx);
-            llama_memory_seq_rm(kv, id, 0, parent_ctx->params.n_ctx);
-            LOG_VERBOSE("Slot %d: Cleared KV cache for sequence (0 to %d)", id, parent_ctx->params.n_ctx);
+        if (n_past > 0) {
+            LOG_INFO("Slot %d (req=%d): Reusing %d/%zu prompt tokens from slot cache",
+                     id, request_id, n_past, tokens.size());
         }
 
         // Initialize cache_tokens with prompt tokens
         cache_tokens = tokens;
     }
 
+    // Arm a snapshot just before the last prompt token: every follow-up turn
+    // (and a regenerate of this one) shares that prefix, while the last token
+    // is re-evaluated anyway for fresh logits
+    state_ckpt_pending = false;
+    state_ckpt_tokens = -1;
+    if (state_cache_enabled() && can_reuse_cache_prefix() && tokens.size() > 1 &&
+        n_past < (llama_pos)tokens.size() - 1) {
+        state_ckpt_tokens = (llama_pos)tokens.size() - 1;
+        state_ckpt_pending = true;
+    }
+
     // Configure prompt checkpointing for recurrent/hybrid models when save_state_size is provided
     save_prompt_state_pending = false;
     save_prompt_state_tokens = -1;
@@ -290,6 +315,254 @@ void llama_rn_slot::load_prompt(const std::vector<llama_token>& tokens) {
     }
 }
 
+bool llama_rn_slot::can_reuse_cache_prefix() const {
+    // Pooled embeddings and rerank scores need the whole sequence in one
+    // decode; media prompts go through processMedia; MTP re-evaluates its
+    // prompt through the draft context
+    return task_type == SLOT_TASK_TYPE_COMPLETION &&
+           media_paths.empty() &&
+           !should_use_mtp();
+}
+
+llama_pos llama_rn_slot::reuse_cache_prefix(const std::vector<llama_token>& tokens) {
+    if (!parent_ctx || !parent_ctx->ctx) {
+        return 0;
+    }
+    auto * kv = llama_get_memory(parent_ctx->ctx);
+
+    size_t n_common = 0;
+    if (can_reuse_cache_prefix()) {
+        n_common = find_common_prefix_length(cache_tokens, tokens);
+
+        // Media placeholders are not vocab ids; the chunk behind them can differ
+        const auto null_it = std::find(tokens.begin(), tokens.begin() + n_common, LLAMA_TOKEN_NULL);
+        n_common = std::distance(tokens.begin(), null_it);
+
+        // Never trust more than the sequence actually holds
+        const llama_pos pos_max = llama_memory_seq_pos_max(kv, id);
+        n_common = std::min(n_common, (size_t)std::max<llama_pos>(0, pos_max + 1));
+    }
+
+    // At least one token must be evaluated to produce logits
+    llama_pos n_reuse = (llama_pos)n_common;
+    if (n_reuse > 0 && n_reuse == (llama_pos)tokens.size()) {
+        n_reuse--;
+    }
+
+    if (n_reuse > 0) {
+        if (llama_memory_seq_rm(kv, id, n_reuse, -1)) {
+            return n_reuse;
+        }
+
+        // Recurrent/hybrid: seq_rm can't roll back that far; restore the
+        // longest snapshot that prefixes the prompt and reprocess the tail
+        llama_pos n_restored = 0;
+        if (recover_state_checkpoint(tokens, n_common, n_restored)) {
+            LOG_INFO("Slot %d (req=%d): Restored state checkpoint at %d/%zu tokens",
+                     id, request_id, n_restored, tokens.size());
+            return n_restored;
+        }
+        LOG_VERBOSE("Slot %d: No usable state checkpoint, clearing sequence", id);
+    }
+
+    // Fresh start: clear this slot's sequence. Snapshots only restore on top
+    // of their live attention prefix, so they go with it.
+    llama_memory_seq_rm(kv, id, -1, -1);
+    state_checkpoints.clear();
+    LOG_VERBOSE("Slot %d: Cleared KV cache for sequence", id);
+    return 0;
+}
+
+void llama_rn_slot::invalidate_cache() {
+    cache_tokens.clear();
+    state_checkpoints.clear();
+    state_ckpt_pending = false;
+    state_ckpt_tokens = -1;
+}
+
+bool llama_rn_slot::shift_context() {
+    // MTP drafts against its own copy of the sequence, which would go stale
+    if (params == nullptr || !params->ctx_shift || should_use_mtp()) {
+        return false;
+    }
+
+    // Keep the sink tokens, drop half of the rest
+    const int32_t n_keep = context_shift_n_keep(params->n_keep, num_prompt_tokens, n_ctx);
+    const int32_t n_discard = (n_past - n_keep) / 2;
+    if (!rnllama::shift_context(parent_ctx->ctx, id, cache_tokens, n_past, n_keep, n_discard)) {
+        return false;
+    }
+    truncated = true;
+
+    // Snapshots past the sinks describe positions that no longer exist
+    state_checkpoints.erase(
+        std::remove_if(state_checkpoints.begin(), state_checkpoints.end(),
+            [&](const rn_state_checkpoint& ckpt) { return ckpt.n_tokens() > (size_t) n_keep; }),
+        state_checkpoints.end());
+
+    LOG_VERBOSE("Slot %d: Context shifted, kept %d, discarded %d, new n_past: %d", id, n_keep, n_discard, n_past);
+    return true;
+}
+
+void llama_rn_slot::take_request(llama_rn_slot& other) {
+    const int32_t own_id = id;
+    llama_rn_context* own_parent_ctx = parent_ctx;
+    const int32_t own_n_ctx = n_ctx;
+    const int64_t own_t_last_used = t_last_used;
+    // The n-gram context is indexed by slot id and stays with the slot
+    common_speculative* own_ngram_spec = ngram_spec;
+    std::vector<common_speculative_type> own_ngram_spec_types = ngram_spec_types;
+    const int32_t own_ngram_n_max = ngram_n_max;
+
+    reset_speculative();
+    if (ctx_sampling != nullptr) {
+        common_sampler_free(ctx_sampling);
+        ctx_sampling = nullptr;
+    }
+
+    *this = other;
+    id = own_id;
+    parent_ctx = own_parent_ctx;
+    n_ctx = own_n_ctx;
+    t_last_used = own_t_last_used;
+    ngram_spec = own_ngram_spec;
+    ngram_spec_types = own_ngram_spec_types;
+    ngram_n_max = own_ngram_n_max;
+    ngram_active = false;
+    ngram_history.clear();
+    ngram_draft.clear();
+    params = other.params != nullptr ? &params_storage : nullptr;
+
+    // The sampler now belongs to this slot
+    other.ctx_sampling = nullptr;
+    other.reset();
+}
+
+bool llama_rn_slot::state_cache_enabled() const {
+    if (!parent_ctx || !parent_ctx->model || parent_ctx->state_cache_budget_bytes == 0) {
+        return false;
+    }
+    return llama_model_is_recurrent(parent_ctx->model) || llama_model_is_hybrid(parent_ctx->model);
+}
+
+void llama_rn_slot::capture_state_checkpoint(size_t n_tokens) {
+    if (!state_cache_enabled() || !parent_ctx->ctx) {
+        return;
+    }
+    if (n_tokens == 0 || n_tokens > cache_tokens.size()) {
+        return;
+    }
+    for (const auto& c : state_checkpoints) {
+        if (c.n_tokens() == n_tokens &&
+            std::equal(c.tokens.begin(), c.tokens.end(), cache_tokens.begin())) {
+            return;
+        }
+    }
+
+    const size_t size = llama_state_seq_get_size_ext(
+        parent_ctx->ctx, id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    if (size == 0) {
+        return;
+    }
+
+    rn_state_checkpoint ckpt;
+    ckpt.tokens.assign(cache_tokens.begin(), cache_tokens.begin() + n_tokens);
+    try {
+        ckpt.data.resize(size);
+    } catch (const std::bad_alloc&) {
+        LOG_WARNING("Slot %d: State checkpoint alloc failed (n_tokens=%zu, %.1f MiB)",
+                   id, n_tokens, size / (1024.0 * 1024.0));
+        return;
+    }
+    const size_t written = llama_state_seq_get_data_ext(
+        parent_ctx->ctx, ckpt.data.data(), size, id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    if (written == 0) {
+        LOG_WARNING("Slot %d: State checkpoint capture failed (n_tokens=%zu)", id, n_tokens);
+        return;
+    }
+    ckpt.data.resize(written);
+
+    state_checkpoints.erase(
+        std::remove_if(state_checkpoints.begin(), state_checkpoints.end(),
+            [&](const rn_state_checkpoint& c) { return c.n_tokens() == n_tokens; }),
+        state_checkpoints.end());
+    if (parent_ctx->state_cache_compact) {
+        ckpt.compact(state_checkpoints);
+    }
+    state_checkpoints.push_back(std::move(ckpt));
+    evict_state_checkpoints();
+    LOG_VERBOSE("Slot %d: Captured state checkpoint: n_tokens=%zu, size=%.1f KiB, total=%zu",
+               id, n_tokens, written / 1024.0, state_checkpoints.size());
+}
+
+bool llama_rn_slot::recover_state_checkpoint(
+    const std::vector<llama_token>& target, size_t max_reuse, llama_pos& n_past_out) {
+    if (!parent_ctx || !parent_ctx->ctx || target.empty()) {
+        return false;
+    }
+
+    // Longest snapshot prefixing `target`, leaving one token to evaluate
+    const size_t search_max = std::min(max_reuse, target.size() - 1);
+    int best = -1;
+    size_t best_len = 0;
+    for (size_t i = 0; i < state_checkpoints.size(); i++) {
+        const auto& c = state_checkpoints[i];
+        const size_t n = c.n_tokens();
+        if (n == 0 || n > search_max || n <= best_len) {
+            continue;
+        }
+        if (std::equal(c.tokens.begin(), c.tokens.end(), target.begin())) {
+            best = (int)i;
+            best_len = n;
+        }
+    }
+    if (best < 0) {
+        return false;
+    }
+
+    const auto& c = state_checkpoints[best];
+    std::vector<uint8_t> scratch;
+    const auto& raw = c.raw(scratch);
+    const size_t read = raw.empty() ? 0 : llama_state_seq_set_data_ext(
+        parent_ctx->ctx, raw.data(), raw.size(), id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    if (read == 0) {
+        LOG_WARNING("Slot %d: State checkpoint restore failed (n_tokens=%zu)", id, c.n_tokens());
+        return false;
+    }
+
+    // Recurrent part is back at best_len; the live attention prefix trims to it
+    const llama_pos k = (llama_pos)best_len;
+    llama_memory_seq_rm(llama_get_memory(parent_ctx->ctx), id, k, -1);
+    n_past_out = k;
+    return true;
+}
+
+void llama_rn_slot::evict_state_checkpoints() {
+    // The host budget covers the whole context; split it across slots
+    const int32_t n_slots = (parent_ctx && parent_ctx->slot_manager)
+        ? std::max<int32_t>(1, parent_ctx->slot_manager->n_parallel)
+        : 1;
+    const size_t budget_bytes = parent_ctx->state_cache_budget_bytes / n_slots;
+    size_t max_checkpoints = 8;
+    if (parent_ctx->state_cache_max_checkpoints > 0) {
+        max_checkpoints = (size_t)parent_ctx->state_cache_max_checkpoints;
+    } else if (parent_ctx->state_cache_max_checkpoints == 0) {
+        max_checkpoints = std::numeric_limits<size_t>::max();
+    }
+
+    auto total_bytes = [&]() { return rn_state_checkpoints_bytes(state_checkpoints); };
+    // Oldest first, but keep the shortest one: the shared system-prompt prefix
+    while (state_checkpoints.size() > 1 &&
+           (state_checkpoints.size() > max_checkpoints || total_bytes() > budget_bytes)) {
+        size_t keep = 0;
+        for (size_t i = 1; i < state_checkpoints.size(); i++) {
+            if (state_checkpoints[i].n_tokens() < state_checkpoints[keep].n_tokens()) keep = i;
+        }
+        const size_t victim = keep == 0 ? 1 : 0;
+        state_checkpoints.erase(state_checkpoints.begin() + victim);
+    }
+}
+
 // Check if there are generated tokens to retrieve
 bool llama_rn_slot::has_next_token() const {
     return !generated_tokens.empty() && state != SLOT_STATE_IDLE;
@@ -467,20 +740,18 @@ void llama_rn_slot::eval_mtp_prompt() {
     common_speculative_begin(spec, seq_id, spec_prompt);
 }
 
-bool llama_rn_slot::refill_mtp_tokens() {
-    const llama_seq_id seq_id = id;
-
+int32_t llama_rn_slot::prepare_mtp_draft(int32_t n_room) {
     if (spec_id_last == LLAMA_TOKEN_NULL || stopped_eos || stopped_limit || context_full) {
-        return false;
+        return -1;
     }
     if (n_remaining == 0) {
         stopped_limit = true;
-        return false;
+        return -1;
     }
 
     if (spec_n_past + 1 >= n_ctx) {
         context_full = true;
-        return false;
+        return -1;
     }
 
     spec_draft.clear();
@@ -492,13 +763,13 @@ bool llama_rn_slot::refill_mtp_tokens() {
         ? params->speculative.draft.n_max
         : std::max<int32_t>(0, remaining - 1);
     const int32_t n_draft_ctx = std::max<int32_t>(0, n_ctx - (int32_t) spec_n_past - 1);
-    const int32_t n_draft_batch = std::max<int32_t>(0, llama_n_batch(parent_ctx->ctx) - 1);
+    const int32_t n_draft_batch = std::max<int32_t>(0, n_room);
     const int32_t n_draft_limit = std::min<int32_t>(
         params->speculative.draft.n_max,
         std::min<int32_t>(n_draft_remaining, std::min<int32_t>(n_draft_ctx, n_draft_batch)));
 
     if (n_draft_limit > 0) {
-        common_speculative_get_draft_params(spec, seq_id) = {
+        common_speculative_get_draft_params(spec, id) = {
             /* .drafting = */ true,
             /* .n_max    = */ n_draft_limit,
             /* .n_past   = */ spec_n_past,
@@ -506,38 +777,34 @@ bool llama_rn_slot::refill_mtp_tokens() {
             /* .prompt   = */ &spec_prompt,
             /* .result   = */ &spec_draft,
         };
-        common_speculative_draft(spec);
+    }
+
+    return n_draft_limit;
+}
+
+void llama_rn_slot::finish_mtp_draft(int32_t n_draft_limit) {
+    if (n_draft_limit > 0) {
+        // A sequence that drafted nothing stays flagged; clear it so a later
+        // shared draft call does not pick up these stale params
+        common_speculative_get_draft_params(spec, id).drafting = false;
 
         if ((int32_t) spec_draft.size() > n_draft_limit) {
             spec_draft.resize(n_draft_limit);
         }
 
-        common_context_seq_rm(spec_ctx, seq_id, spec_n_past, -1);
-    }
-
-    const size_t n_draft = spec_draft.size();
-    num_draft_tokens += n_draft;
-
-    common_batch_clear(spec_batch);
-    common_batch_add(spec_batch, spec_id_last, spec_n_past, { seq_id }, true);
-    for (size_t i = 0; i < n_draft; ++i) {
-        common_batch_add(spec_batch, spec_draft[i],
-                         spec_n_past + (llama_pos) i + 1, { seq_id }, true);
+        common_context_seq_rm(spec_ctx, id, spec_n_past, -1);
     }
 
-    const int ret = llama_decode(parent_ctx->ctx, spec_batch);
-    if (ret != 0) {
-        throw std::runtime_error("failed to evaluate MTP target batch, ret=" + std::to_string(ret));
-    }
-    if (!common_speculative_process(spec, spec_batch)) {
-        throw std::runtime_error("failed to process MTP target batch");
-    }
+    num_draft_tokens += spec_draft.size();
+}
 
-    auto accepted = common_sampler_sample_and_accept_n(ctx_sampling, parent_ctx->ctx, spec_draft);
+llama_tokens llama_rn_slot::accept_mtp_verification(const llama_tokens& accepted) {
+    llama_tokens result;
     if (accepted.empty()) {
-        return false;
+        return result;
     }
 
+    const size_t n_draft = spec_draft.size();
     size_t accepted_count = accepted.size();
     bool saw_eos = false;
     const llama_vocab* vocab = llama_model_get_vocab(parent_ctx->model);
@@ -548,7 +815,7 @@ bool llama_rn_slot::refill_mtp_tokens() {
             break;
         }
 
-        spec_pending_tokens.push_back(accepted[i]);
+        result.push_back(accepted[i]);
     }
 
     const size_t n_accepted_draft = saw_eos
@@ -557,7 +824,7 @@ bool llama_rn_slot::refill_mtp_tokens() {
     if (n_draft > 0) {
         const size_t n_accepted = std::min(n_accepted_draft, n_draft);
         num_draft_tokens_accepted += n_accepted;
-        common_speculative_accept(spec, seq_id, (uint16_t) n_accepted);
+        common_speculative_accept(spec, id, (uint16_t) n_accepted);
     }
 
     for (size_t i = 0; i < accepted_count; ++i) {
@@ -568,13 +835,50 @@ bool llama_rn_slot::refill_mtp_tokens() {
     spec_n_past += (llama_pos) accepted_count;
     n_past = spec_n_past;
 
-    common_context_seq_rm(parent_ctx->ctx, seq_id, spec_n_past, -1);
-    common_context_seq_rm(spec_ctx, seq_id, spec_n_past, -1);
+    common_context_seq_rm(parent_ctx->ctx, id, spec_n_past, -1);
+    common_context_seq_rm(spec_ctx, id, spec_n_past, -1);
 
     if (saw_eos) {
         stopped_eos = true;
     }
 
+    return result;
+}
+
+bool llama_rn_slot::refill_mtp_tokens() {
+    const llama_seq_id seq_id = id;
+
+    const int32_t n_draft_limit = prepare_mtp_draft(llama_n_batch(parent_ctx->ctx) - 1);
+    if (n_draft_limit < 0) {
+        return false;
+    }
+    if (n_draft_limit > 0) {
+        common_speculative_draft(spec);
+    }
+    finish_mtp_draft(n_draft_limit);
+
+    const size_t n_draft = spec_draft.size();
+
+    common_batch_clear(spec_batch);
+    common_batch_add(spec_batch, spec_id_last, spec_n_past, { seq_id }, true);
+    for (size_t i = 0; i < n_draft; ++i) {
+        common_batch_add(spec_batch, spec_draft[i],
+                         spec_n_past + (llama_pos) i + 1, { seq_id }, true);
+    }
+
+    const int ret = llama_decode(parent_ctx->ctx, spec_batch);
+    if (ret != 0) {
+        throw std::runtime_error("failed to evaluate MTP target batch, ret=" + std::to_string(ret));
+    }
+    if (!common_speculative_process(spec, spec_batch)) {
+        throw std::runtime_error("failed to process MTP target batch");
+    }
+
+    auto accepted = common_sampler_sample_and_accept_n(ctx_sampling, parent_ctx->ctx, spec_draft);
+    for (const llama_token tok : accept_mtp_verification(accepted)) {
+        spec_pending_tokens.push_back(tok);
+    }
+
     return !spec_pending_tokens.empty();
 }
 
@@ -599,29 +903,170 @@ completion_token_output llama_rn_slot::next_token_mtp() {
     return result;
 }
 
-// Parse chat output (tool calls, reasoning content, etc.)
-completion_chat_output llama_rn_slot::parseChatOutput(bool is_partial) {
-    common_chat_parser_params syntax;
-    syntax.format = static_cast<common_chat_format>(current_chat_format);
-    syntax.reasoning_format = current_reasoning_format;
-    syntax.generation_prompt = current_generation_prompt;
-    syntax.parse_tool_calls = true;
+static bool is_ngram_speculative_type(common_speculative_type type) {
+    switch (type) {
+        case COMMON_SPECULATIVE_TYPE_NGRAM_SIMPLE:
+        case COMMON_SPECULATIVE_TYPE_NGRAM_MAP_K:
+        case COMMON_SPECULATIVE_TYPE_NGRAM_MAP_K4V:
+        case COMMON_SPECULATIVE_TYPE_NGRAM_MOD:
+        case COMMON_SPECULATIVE_TYPE_NGRAM_CACHE:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    // Load the PEG parser if available (required for COMMON_CHAT_FORMAT_PEG_* formats)
-    if (!current_chat_parser.empty()) {
-        syntax.parser.load(current_chat_parser);
+bool llama_rn_slot::should_use_ngram() const {
+    if (params == nullptr || task_type != SLOT_TASK_TYPE_COMPLETION || should_use_mtp()) {
+        return false;
+    }
+    // Rejected drafts are rolled back with seq_rm, which recurrent state can't
+    // do; per-token probabilities are only reported for single-token sampling
+    if (!media_paths.empty() || params->sampling.n_probs > 0) {
+        return false;
+    }
+    if (parent_ctx == nullptr || parent_ctx->model == nullptr ||
+        llama_model_is_recurrent(parent_ctx->model) || llama_model_is_hybrid(parent_ctx->model)) {
+        return false;
     }
 
-    std::string full_text = prefill_text + generated_text;
+    const auto & types = params->speculative.types;
+    return std::any_of(types.begin(), types.end(), is_ngram_speculative_type);
+}
 
-    common_chat_msg parsed_msg = common_chat_parse(full_text, is_partial, syntax);
+void llama_rn_slot::free_ngram() {
+    if (ngram_spec != nullptr) {
+        common_speculative_free(ngram_spec);
+        ngram_spec = nullptr;
+    }
+    ngram_spec_types.clear();
+    ngram_n_max = 0;
+    ngram_active = false;
+}
 
-    completion_chat_output result;
-    result.content = parsed_msg.content;
-    result.reasoning_content = parsed_msg.reasoning_content;
-    result.accumulated_text = full_text;
-    result.tool_calls = parsed_msg.tool_calls;
+// Draft up to n_room tokens continuing this slot's history. The draft is
+// kept in ngram_draft until the manager verifies it after the decode.
+const llama_tokens& llama_rn_slot::draft_ngram(int32_t n_room) {
+    ngram_draft.clear();
+    if (generated_tokens.empty() || cache_tokens.empty()) {
+        return ngram_draft;
+    }
 
+    if (!ngram_active) {
+        std::vector<common_speculative_type> types;
+        for (const auto type : params->speculative.types) {
+            if (is_ngram_speculative_type(type)) {
+                types.push_back(type);
+            }
+        }
+
+        if (ngram_spec == nullptr || types != ngram_spec_types) {
+            free_ngram();
+            common_params_speculative spec_params = params->speculative;
+            spec_params.types = types;
+            ngram_spec = common_speculative_init(spec_params, (uint32_t) id + 1);
+            if (ngram_spec == nullptr) {
+                throw std::runtime_error("failed to initialize n-gram speculative decoding");
+            }
+            ngram_spec_types = types;
+            ngram_n_max = common_speculative_n_max(&spec_params);
+        }
+
+        ngram_history.assign(cache_tokens.begin(), cache_tokens.end() - 1);
+        common_speculative_begin(ngram_spec, id, ngram_history);
+        ngram_active = true;
+    } else if (ngram_history.size() + 1 < cache_tokens.size()) {
+        ngram_history.insert(ngram_history.end(),
+                             cache_tokens.begin() + ngram_history.size(), cache_tokens.end() - 1);
+    }
+
+    // Draft + sampled token must fit the remaining budget and the context
+    int32_t n_max = std::min(ngram_n_max, n_room);
+    if (n_remaining > 0) {
+        n_max = std::min(n_max, n_remaining - 1);
+    }
+    n_max = std::min(n_max, n_ctx - (int32_t) n_past - 2);
+    if (n_max <= 0) {
+        return ngram_draft;
+    }
+
+    common_speculative_get_draft_params(ngram_spec, id) = {
+        /* .drafting = */ true,
+        /* .n_max    = */ n_max,
+        /* .n_past   = */ n_past,
+        /* .id_last  = */ generated_tokens.back(),
+        /* .prompt   = */ &ngram_history,
+        /* .result   = */ &ngram_draft,
+    };
+    common_speculative_draft(ngram_spec);
+
+    if ((int32_t) ngram_draft.size() > n_max) {
+        ngram_draft.resize(n_max);
+    }
+    num_draft_tokens += ngram_draft.size();
+    return ngram_draft;
+}
+
+// Keep the first n_accepted draft tokens in this slot's sequence and drop the
+// rejected tail. n_past already covers the token the draft was appended to.
+void llama_rn_slot::accept_ngram_draft(size_t n_accepted) {
+    n_accepted = std::min(n_accepted, ngram_draft.size());
+    num_draft_tokens_accepted += n_accepted;
+    common_speculative_accept(ngram_spec, id, (uint16_t) n_accepted);
+
+    n_past += (llama_pos) n_accepted;
+    if (n_accepted < ngram_draft.size()) {
+        llama_memory_seq_rm(llama_get_memory(parent_ctx->ctx), id, n_past, -1);
+    }
+    ngram_draft.clear();
+}
+
+// Parse chat output (tool calls, reasoning content, etc.)
+completion_chat_output llama_rn_slot::parseChatOutput(bool is_partial) {
+    return parse_chat_output(prefill_text + generated_text, is_partial, current_chat_format,
+                             current_reasoning_format, current_generation_prompt, current_chat_parser);
+}
+
+std::shared_ptr<llama_rn_slot> llama_rn_slot::snapshot_result() const {
+    auto result = std::make_shared<llama_rn_slot>();
+    result->id = id;
+    result->request_id = request_id;
+    result->state = state;
+    result->task_type = task_type;
+    result->parent_ctx = parent_ctx;
+    result->n_ctx = n_ctx;
+    result->n_past = n_past;
+    result->n_decoded = n_decoded;
+    result->n_remaining = n_remaining;
+    result->cache_tokens = cache_tokens;
+    result->generated_tokens = generated_tokens;
+    result->generated_text = generated_text;
+    result->prefill_text = prefill_text;
+    result->generated_token_probs = generated_token_probs;
+    result->num_prompt_tokens = num_prompt_tokens;
+    result->num_tokens_predicted = num_tokens_predicted;
+    result->incomplete = incomplete;
+    result->context_full = context_full;
+    result->truncated = truncated;
+    result->stopped_eos = stopped_eos;
+    result->stopped_word = stopped_word;
+    result->stopped_limit = stopped_limit;
+    result->stopping_word = stopping_word;
+    result->error_message = error_message;
+    result->is_interrupted = is_interrupted;
+    result->current_chat_format = current_chat_format;
+    result->current_reasoning_format = current_reasoning_format;
+    result->current_generation_prompt = current_generation_prompt;
+    result->current_chat_parser = current_chat_parser;
+    result->num_draft_tokens = num_draft_tokens;
+    result->num_draft_tokens_accepted = num_draft_tokens_accepted;
+    result->priority = priority;
+    result->t_start_process = t_start_process;
+    result->t_start_generation = t_start_generation;
+    result->n_prompt_tokens_cache = n_prompt_tokens_cache;
+    result->n_prompt_tokens_processed = n_prompt_tokens_processed;
+    result->t_prompt_processing = t_prompt_processing;
+    result->t_token_generation = t_token_generation;
     return result;
 }
 
@@ -644,6 +1089,9 @@ slot_timings llama_rn_slot::get_timings() const {
         timings.predicted_per_second = n_decoded / t_token_generation;
     }
 
+    timings.draft_n = (int32_t) num_draft_tokens;
+    timings.draft_n_accepted = (int32_t) num_draft_tokens_accepted;
+
     return timings;
 }
 
@@ -705,11 +1153,14 @@ bool llama_rn_slot::load_state() {
     );
 
     if (nread == 0) {
-        cache_tokens.clear();
+        invalidate_cache();
         LOG_ERROR("Slot %d: Failed to load state from file: %s", id, load_state_path.c_str());
         return false;
     }
 
+    // The loaded sequence replaces whatever the in-memory snapshots built on
+    state_checkpoints.clear();
+
     state_tokens.resize(n_token_count_out);
 
     // Apply load_state_size limit if specified (not supported for recurrent/hybrid models)
@@ -4,19 +4,24 @@
 #include "common.h"
 #include "llama.h"
 #include "rn-llama.h"
+#include "rn-completion.h"
+#include "rn-stop-matcher.h"
 #include "sampling.h"
 #include "speculative.h"
 #include <deque>
 #include <vector>
 #include <string>
 #include <functional>
+#include <memory>
 
 namespace rnllama {
 
 // Forward declarations
 struct llama_rn_context;
+struct llama_rn_event_stream;
 struct completion_token_output;
 struct completion_chat_output;
+struct llama_rn_rerank_batch;
 
 // Slot timings result
 struct slot_timings {
@@ -31,6 +36,9 @@ struct slot_timings {
     double predicted_ms = 0.0;             // Total time for token generation (ms)
     double predicted_per_token_ms = 0.0;   // Time per generated token (ms)
     double predicted_per_second = 0.0;     // Tokens per second for generation
+
+    int32_t draft_n = 0;                   // Number of speculative draft tokens proposed
+    int32_t draft_n_accepted = 0;          // Number of draft tokens accepted
 };
 
 // Slot task types
@@ -66,7 +74,7 @@ struct llama_rn_slot {
 
     // Token management
     std::vector<llama_token> prompt_tokens;
-    std::vector<llama_token> cache_tokens;  // For KV cache reuse
+    std::vector<llama_token> cache_tokens;  // Tokens held in this slot's KV sequence (kept across requests)
     std::vector<llama_token> generated_tokens;
     std::string generated_text;
     utf8_stream_gate utf8_gate;
@@ -96,7 +104,7 @@ struct llama_rn_slot {
     bool stopped_word;
     bool stopped_limit;
     std::string stopping_word;
-    std::vector<std::string> stop_words;  // Stop words for this slot
+    llama_rn_stop_matcher stop_matcher;    // Stop words for this slot, over generated_text
     std::string error_message;             // Error message if completion failed
 
     // Chat parsing state
@@ -124,11 +132,26 @@ struct llama_rn_slot {
     size_t num_draft_tokens;
     size_t num_draft_tokens_accepted;
 
+    // Speculative decoding by n-gram lookup over the slot's own history. Draft
+    // tokens ride in the shared batch behind the last sampled token and are
+    // verified from the same decode. The context is kept across requests while
+    // the requested n-gram types stay the same.
+    common_speculative *ngram_spec = nullptr;
+    std::vector<common_speculative_type> ngram_spec_types;
+    int32_t ngram_n_max = 0;               // Max draft length of the configured types
+    bool ngram_active = false;             // begin() called for the current request
+    llama_tokens ngram_history;            // Tokens before the last sampled one
+    llama_tokens ngram_draft;              // Draft appended to the current batch
+
     // Timing
     int64_t t_start_process;       // Start time for processing (us)
     int64_t t_start_generation;    // Start time for generation (us)
     int64_t t_last_used;           // Last time slot was used (us)
 
+    // Scheduling
+    int32_t priority;              // Request priority (higher runs first)
+    int64_t t_queued;              // Time the request was queued (us)
+
     // Timing metrics
     int32_t n_prompt_tokens_cache;     // Number of prompt tokens from cache
     int32_t n_prompt_tokens_processed; // Number of prompt tokens processed
@@ -147,15 +170,18 @@ struct llama_rn_slot {
     // Completion callback (per-slot)
     std::function<void(llama_rn_slot*)> on_complete_callback;
 
+    // Delivery stream the callbacks above feed (see rn-delivery.h)
+    std::shared_ptr<llama_rn_event_stream> event_stream;
+    bool delivery_stalled;                 // Skipped this step: consumer is behind
+
     // Embedding task state
     int embd_normalize;
     std::function<void(int32_t, const std::vector<float>&)> on_embedding_callback;
 
     // Rerank task state
     std::function<void(int32_t, const std::vector<float>&)> on_rerank_callback;
-    std::vector<std::vector<llama_token>> rerank_prompt_tokens;
-    std::vector<float> rerank_scores;
-    size_t rerank_current_index;
+    std::shared_ptr<llama_rn_rerank_batch> rerank_batch; // Scores all documents across lanes
+    int32_t lent_to;                       // Rerank slot using this idle slot's sequence as a lane (-1 = none)
 
     // State management (per-slot)
     std::string load_state_path;      // Path to load state from before processing
@@ -166,6 +192,13 @@ struct llama_rn_slot {
     bool save_prompt_state_pending;   // Save prompt checkpoint before generation
     llama_pos save_prompt_state_tokens; // Prompt token count to save
 
+    // In-memory prefix snapshots of this slot's sequence for recurrent/hybrid
+    // models, where seq_rm can't roll back to the divergence point (see
+    // rn_state_checkpoint). Kept across requests, oldest first.
+    std::vector<rn_state_checkpoint> state_checkpoints;
+    bool state_ckpt_pending;          // Snapshot armed for the current prompt ingest
+    llama_pos state_ckpt_tokens;      // Prompt position to snapshot at
+
     // Constructor
     llama_rn_slot();
 
@@ -174,7 +207,21 @@ struct llama_rn_slot {
 
     // Methods
     void reset();                          // Reset to IDLE state
+    // Copy of the request's results, detached from the slot's resources,
+    // for completion callbacks that run after the slot is reused
+    std::shared_ptr<llama_rn_slot> snapshot_result() const;
     void load_prompt(const std::vector<llama_token>& tokens);
+    // Keep the longest prefix of `tokens` still held in this slot's sequence,
+    // trimming the rest; returns the reused position (new n_past).
+    llama_pos reuse_cache_prefix(const std::vector<llama_token>& tokens);
+    bool can_reuse_cache_prefix() const;
+    void invalidate_cache();               // Sequence memory was cleared externally (see llama_rn_slot_manager::drop_cache)
+    // Make room in a full sequence by dropping tokens after the n_keep sinks
+    // (requires ctx_shift); false when it can't, and generation must stop
+    bool shift_context();
+    // Move the in-flight request of `other` into this slot, leaving `other`
+    // idle. Sequence memory is not touched; the caller transfers it.
+    void take_request(llama_rn_slot& other);
     bool has_next_token() const;
     completion_token_output get_next_token();
     completion_chat_output parseChatOutput(bool is_partial);
@@ -184,6 +231,17 @@ struct llama_rn_slot {
     void eval_mtp_prompt();
     bool refill_mtp_tokens();
     completion_token_output next_token_mtp();
+    // MTP step split for the shared batch: set up this slot's draft request
+    // (returns the draft limit, -1 when generation must stop), clean up after
+    // common_speculative_draft, then consume the verified tokens of one decode
+    // of [spec_id_last, spec_draft...] and return the tokens to emit.
+    int32_t prepare_mtp_draft(int32_t n_room);
+    void finish_mtp_draft(int32_t n_draft_limit);
+    llama_tokens accept_mtp_verification(const llama_tokens& accepted);
+    bool should_use_ngram() const;
+    const llama_tokens& draft_ngram(int32_t n_room);
+    void accept_ngram_draft(size_t n_accepted);
+    void free_ngram();
 
     // Timing methods
     slot_timings get_timings() const;      // Get timing information for this slot
@@ -192,6 +250,13 @@ struct llama_rn_slot {
     bool load_state();             // Load state into this slot's sequence
     bool save_state();             // Save state from this slot's sequence
     bool save_prompt_state_checkpoint();  // Save prompt checkpoint
+
+    // In-memory state checkpoints (recurrent/hybrid prefix reuse)
+    bool state_cache_enabled() const;
+    void capture_state_checkpoint(size_t n_tokens);
+    bool recover_state_checkpoint(const std::vector<llama_token>& target, size_t max_reuse,
+                                  llama_pos& n_past_out);
+    void evict_state_checkpoints();
 };
 
 } // namespace rnllama
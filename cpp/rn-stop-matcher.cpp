@@ -0,0 +1,104 @@
+#include "rn-stop-matcher.h"
+#include <deque>
+
+namespace rnllama {
+
+llama_rn_stop_matcher::llama_rn_stop_matcher(const std::vector<std::string>& words) : words(words) {
+    for (const auto& word : words) {
+        for (unsigned char ch : word) {
+            if (byte_class[ch] == 0) {
+                byte_class[ch] = (uint8_t) n_classes++;
+            }
+        }
+    }
+
+    // Trie, with -1 for missing edges until the failure links fill them in
+    delta.assign(n_classes, -1);
+    depth.assign(1, 0);
+    out.assign(1, -1);
+    for (size_t i = 0; i < words.size(); i++) {
+        int32_t s = 0;
+        for (unsigned char ch : words[i]) {
+            int32_t& next = delta[s * n_classes + byte_class[ch]];
+            if (next < 0) {
+                next = (int32_t) depth.size();
+                delta.resize(delta.size() + n_classes, -1);
+                depth.push_back(depth[s] + 1);
+                out.push_back(-1);
+            }
+            s = delta[s * n_classes + byte_class[ch]];
+        }
+        // An empty word can't end anywhere; a repeated one keeps its first index
+        if (s != 0 && out[s] < 0) {
+            out[s] = (int32_t) i;
+        }
+    }
+
+    // Breadth first, so a state's failure target is complete before it
+    const int32_t n_states = (int32_t) depth.size();
+    fail.assign(n_states, 0);
+    std::deque<int32_t> queue;
+    for (int32_t c = 0; c < n_classes; c++) {
+        int32_t& next = delta[c];
+        if (next < 0) {
+            next = 0;
+        } else {
+            queue.push_back(next);
+        }
+    }
+    while (!queue.empty()) {
+        const int32_t s = queue.front();
+        queue.pop_front();
+        if (out[s] < 0) {
+            out[s] = out[fail[s]];
+        }
+        for (int32_t c = 0; c < n_classes; c++) {
+            int32_t& next = delta[s * n_classes + c];
+            const int32_t via_fail = delta[fail[s] * n_classes + c];
+            if (next < 0) {
+                next = via_fail;
+            } else {
+                fail[next] = via_fail;
+                queue.push_back(next);
+            }
+        }
+    }
+}
+
+llama_rn_stop_matcher::match llama_rn_stop_matcher::feed(std::string_view text) {
+    match best;
+    if (words.empty()) {
+        fed += text.size();
+        return best;
+    }
+    for (unsigned char ch : text) {
+        state = delta[state * n_classes + byte_class[ch]];
+        fed++;
+        const int32_t w = out[state];
+        if (w < 0) {
+            continue;
+        }
+        // A longer word ending later can still start first
+        const size_t pos = fed - words[w].size();
+        if (!best.found() || pos < best.pos || (pos == best.pos && w < best.word)) {
+            best.pos = pos;
+            best.word = w;
+        }
+    }
+    return best;
+}
+
+size_t llama_rn_stop_matcher::partial_pos(size_t from) const {
+    int32_t s = state;
+    while (s != 0 && fed - depth[s] < from) {
+        s = fail[s];
+    }
+    return s == 0 ? std::string::npos : fed - depth[s];
+}
+
+void llama_rn_stop_matcher::reset() {
+    state = 0;
+    fed = 0;
+}
+
+} // namespace rnllama
@@ -0,0 +1,58 @@
+#ifndef RN_STOP_MATCHER_H
+#define RN_STOP_MATCHER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rnllama {
+
+// Stop words of one request compiled into an Aho-Corasick automaton over
+// bytes. The output is fed as it is generated: each call only walks the new
+// bytes and finds every stop word ending in them, and the automaton's state
+// is the longest stop word prefix the output ends with (a partial match).
+// Positions count from the first byte fed.
+struct llama_rn_stop_matcher {
+    struct match {
+        size_t pos = std::string::npos;    // Where the stop word starts
+        int32_t word = -1;                 // Index into the words
+
+        bool found() const { return word >= 0; }
+    };
+
+    llama_rn_stop_matcher() = default;
+    explicit llama_rn_stop_matcher(const std::vector<std::string>& words);
+
+    // Advance over text appended to the output. Returns the stop word ending
+    // in it that starts first (the first listed on a tie).
+    match feed(std::string_view text);
+
+    // Start of the longest stop word prefix the output ends with, leaving out
+    // prefixes that begin before `from`; npos if there is none
+    size_t partial_pos(size_t from = 0) const;
+
+    void reset();                          // Same words, new output
+
+    bool empty() const { return words.empty(); }
+    size_t n_fed() const { return fed; }
+    const std::string& word(int32_t i) const { return words[i]; }
+
+private:
+    std::vector<std::string> words;
+    std::array<uint8_t, 256> byte_class{}; // Bytes that occur in no word share class 0
+    int32_t n_classes = 1;
+    std::vector<int32_t> delta;            // State x class transitions
+    std::vector<int32_t> fail;
+    std::vector<int32_t> depth;            // Length of the prefix a state stands for
+    std::vector<int32_t> out;              // Longest word ending at a state, or -1
+
+    int32_t state = 0;
+    size_t fed = 0;
+};
+
+} // namespace rnllama
+
+#endif /* RN_STOP_MATCHER_H */
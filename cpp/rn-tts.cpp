@@ -8,12 +8,7 @@
 #include <iomanip>
 #include <codecvt>
 #include <locale>
-#include <thread>
-#include <cmath>
-
-#ifdef _WIN32
-  #define M_PI 3.14159265358979323846
-#endif
+#include <algorithm>
 
 namespace rnllama {
 
@@ -306,160 +301,6 @@ void llama_rn_context_tts::setGuideTokens(const std::vector<llama_token> &tokens
     guide_tokens = tokens;
 }
 
-// Audio processing functions - FFT and related utilities
-static void fill_hann_window(int length, bool periodic, float * output) {
-    int offset = -1;
-    if (periodic) {
-        offset = 0;
-    }
-    for (int i = 0; i < length; i++) {
-        output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
-    }
-}
-
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
-}
-
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
-
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
-    }
-
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
-
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
-
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
-
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
-        }
-    }
-
-    for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
-    }
-}
-
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
-
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
-
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
-    }
-
-    output.resize(n_out - 2 * n_pad);
-}
-
-std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
-    const int n_fft = 1280;
-    const int n_hop = 320;
-    const int n_win = 1280;
-    const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
-
-    std::vector<float> hann(n_fft);
-
-    fill_hann_window(hann.size(), true, hann.data());
-
-    int n_spec = n_embd*n_codes;
-
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
-
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
-        }
-    }
-
-    for (int k = 0; k < n_embd/2; ++k) {
-        for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
-
-            mag = exp(mag);
-
-            if (mag > 1e2) {
-                mag = 1e2;
-            }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
-        }
-    }
-
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
-        }
-    }
-
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
-
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
-                }
-            }
-        });
-    }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
-    }
-
-    std::vector<float> audio;
-    std::vector<float> env;
-
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env);
-
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
-    }
-
-    return audio;
-}
-
 // Forward declarations from rn-llama.h
 extern bool rnllama_verbose;
 void log(const char *level, const char *function, int line, const char *format, ...);
@@ -493,29 +334,127 @@ tts_type llama_rn_context_tts::getTTSType(llama_rn_context* main_ctx, json speak
     return OUTETTS_V0_2;
 }
 
-llama_rn_audio_completion_result llama_rn_context_tts::getFormattedAudioCompletion(llama_rn_context* main_ctx, const std::string &speaker_json_str, const std::string &text_to_speak) {
-    std::string audio_text = default_audio_text;
-    std::string audio_data = default_audio_data;
+llama_rn_tts_speaker_cache::entry * llama_rn_tts_speaker_cache::find(const std::string &speaker_json) {
+    for (auto &e : entries) {
+        if (e.speaker_json == speaker_json) {
+            e.last_used = ++n_calls;
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+llama_rn_tts_speaker_cache::entry & llama_rn_tts_speaker_cache::put(entry &&e) {
+    if (entries.size() >= std::max<size_t>(1, max_entries)) {
+        auto lru = std::min_element(entries.begin(), entries.end(),
+            [](const entry &a, const entry &b) { return a.last_used < b.last_used; });
+        entries.erase(lru);
+    }
+    e.last_used = ++n_calls;
+    entries.push_back(std::move(e));
+    return entries.back();
+}
 
-    json speaker = speaker_json_str.empty() ? json::object() : json::parse(speaker_json_str);
-    const tts_type tts_type = getTTSType(main_ctx, speaker);
-    if (tts_type == UNKNOWN) {
-        LOG_ERROR("Unknown TTS version");
-        return {"", nullptr};
+bool llama_rn_tts_speaker_cache::load_prefix(llama_context *ctx, const std::vector<llama_token> &tokens, llama_pos &n_past) {
+    entry *match = nullptr;
+    for (auto &e : entries) {
+        const size_t n = e.head_tokens.size();
+        // Leave at least one token to evaluate
+        if (n > (size_t) n_past && n < tokens.size() &&
+            std::equal(e.head_tokens.begin(), e.head_tokens.end(), tokens.begin()) &&
+            (match == nullptr || n > match->head_tokens.size())) {
+            match = &e;
+        }
+    }
+    if (match == nullptr) {
+        return false;
+    }
+    match->last_used = ++n_calls;
+
+    auto * mem = llama_get_memory(ctx);
+    const llama_pos n_head = (llama_pos) match->head_tokens.size();
+    if (!match->state.empty()) {
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        if (llama_state_seq_set_data(ctx, match->state.data(), match->state.size(), 0) != 0) {
+            n_past = n_head;
+            n_restored++;
+            return true;
+        }
+        LOG_WARNING("speaker prefix restore failed (n_tokens=%d)", n_head);
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        match->state.clear();
+        n_past = 0;
+    }
+
+    // First use: decode the prefix on its own so seq 0 holds exactly it
+    const int n_batch = (int) llama_n_batch(ctx);
+    for (llama_pos i = n_past; i < n_head; i += n_batch) {
+        const int n_eval = std::min(n_batch, (int) (n_head - i));
+        llama_batch batch = llama_batch_init(n_eval, 0, 1);
+        for (int j = 0; j < n_eval; j++) {
+            llama_batch_add(&batch, match->head_tokens[i + j], i + j, { 0 }, false);
+        }
+        const int ret = llama_decode(ctx, batch);
+        llama_batch_free(batch);
+        if (ret != 0) {
+            llama_memory_seq_rm(mem, 0, i, -1);
+            n_past = i;
+            return false;
+        }
     }
+    n_past = n_head;
+
+    const size_t size = llama_state_seq_get_size(ctx, 0);
+    match->state.resize(size);
+    const size_t written = size > 0 ? llama_state_seq_get_data(ctx, match->state.data(), size, 0) : 0;
+    match->state.resize(written);
+    return true;
+}
 
-    if (tts_type == OUTETTS_V0_3) {
-        audio_text = std::regex_replace(audio_text, std::regex(R"(<\|text_sep\|>)"), "<|space|>");
-        audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_start\|>)"), "");
-        audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_end\|>)"), "<|space|>");
+void llama_rn_tts_speaker_cache::clear_state() {
+    for (auto &e : entries) {
+        e.state.clear();
+        e.state.shrink_to_fit();
     }
+}
+
+llama_rn_audio_completion_result llama_rn_context_tts::getFormattedAudioCompletion(llama_rn_context* main_ctx, const std::string &speaker_json_str, const std::string &text_to_speak) {
+    const llama_rn_tts_speaker_cache::entry *cached = speakers.find(speaker_json_str);
+    if (cached == nullptr) {
+        std::string audio_text = default_audio_text;
+        std::string audio_data = default_audio_data;
+
+        json speaker = speaker_json_str.empty() ? json::object() : json::parse(speaker_json_str);
+        const tts_type tts_type = getTTSType(main_ctx, speaker);
+        if (tts_type == UNKNOWN) {
+            LOG_ERROR("Unknown TTS version");
+            return {"", nullptr};
+        }
 
-    if (!speaker_json_str.empty()) {
-        audio_text = audio_text_from_speaker(speaker, tts_type);
-        audio_data = audio_data_from_speaker(speaker, tts_type);
+        if (tts_type == OUTETTS_V0_3) {
+            audio_text = std::regex_replace(audio_text, std::regex(R"(<\|text_sep\|>)"), "<|space|>");
+            audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_start\|>)"), "");
+            audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_end\|>)"), "<|space|>");
+        }
+
+        if (!speaker_json_str.empty()) {
+            audio_text = audio_text_from_speaker(speaker, tts_type);
+            audio_data = audio_data_from_speaker(speaker, tts_type);
+        }
+
+        llama_rn_tts_speaker_cache::entry e;
+        e.speaker_json = speaker_json_str;
+        e.type = tts_type;
+        e.head = "<|im_start|>\n" + audio_text;
+        e.tail = "<|text_end|>\n" + audio_data + "\n";
+        // Tokenized as loadPrompt tokenizes the whole prompt
+        const llama_vocab * vocab = llama_model_get_vocab(main_ctx->model);
+        e.head_tokens = common_tokenize(main_ctx->ctx, e.head, llama_vocab_get_add_bos(vocab), true);
+        cached = &speakers.put(std::move(e));
     }
 
-    std::string prompt = "<|im_start|>\n" + audio_text + process_text(text_to_speak, tts_type) + "<|text_end|>\n" + audio_data + "\n";
+    const tts_type tts_type = cached->type;
+    std::string prompt = cached->head + process_text(text_to_speak, tts_type) + cached->tail;
 
     if (tts_type == OUTETTS_V0_1) {
         return {prompt, OUTETTS_V1_GRAMMAR};
@@ -578,27 +517,122 @@ std::vector<float> llama_rn_context_tts::decodeAudioTokens(llama_rn_context* mai
         return std::vector<float>();
     }
 
+    int n_embd = 0;
+    const float * embd = encodeCodes(tokens_audio.data(), n_codes, n_embd);
+    if (embd == nullptr) {
+        return std::vector<float>();
+    }
+    return getIstft(main_ctx)->run(embd, n_codes, n_embd);
+}
+
+const float * llama_rn_context_tts::encodeCodes(const llama_token *codes, int n_codes, int &n_embd) {
     llama_batch batch = llama_batch_init(n_codes, 0, 1);
-    for (size_t i = 0; i < tokens_audio.size(); ++i) {
-        llama_batch_add(&batch, tokens_audio[i], i, { 0 }, true);
+    for (int i = 0; i < n_codes; ++i) {
+        llama_batch_add(&batch, codes[i], i, { 0 }, true);
     }
     if (batch.n_tokens != n_codes) {
         LOG_ERROR("batch.n_tokens != n_codes: %d != %d", batch.n_tokens, n_codes);
         llama_batch_free(batch);
-        return std::vector<float>();
+        return nullptr;
     }
     if (llama_encode(ctx, batch) != 0) {
         LOG_ERROR("llama_encode() failed");
         llama_batch_free(batch);
-        return std::vector<float>();
+        return nullptr;
     }
     llama_synchronize(ctx);
-    // WavTokenizer exposes the decoder spectrogram width as n_embd_out after llama.cpp b7996.
-    const int n_embd = llama_model_n_embd_out(model);
-    const float * embd = llama_get_embeddings(ctx);
-    auto audio = embd_to_audio(embd, n_codes, n_embd, main_ctx->params.cpuparams.n_threads);
     llama_batch_free(batch);
-    return audio;
+    // WavTokenizer exposes the decoder spectrogram width as n_embd_out after llama.cpp b7996.
+    n_embd = llama_model_n_embd_out(model);
+    return llama_get_embeddings(ctx);
+}
+
+llama_rn_istft * llama_rn_context_tts::getIstft(llama_rn_context* main_ctx) {
+    const int n_threads = std::max(1, (int) main_ctx->params.cpuparams.n_threads);
+    if (!istft || istft->n_threads() != n_threads) {
+        istft = std::make_unique<llama_rn_istft>(1280, 320, n_threads);
+    }
+    return istft.get();
+}
+
+void llama_rn_context_tts::beginAudioStream(int chunk_codes, std::function<void(std::vector<float> &&)> on_audio,
+                                            std::function<void(const std::string &)> on_error) {
+    stream = std::make_unique<audio_stream>();
+    if (chunk_codes > 0) {
+        stream->chunk_codes = chunk_codes;
+    }
+    // The whole window is encoded as one batch
+    const int n_window_max = std::max(1, (int) llama_n_batch(ctx) - stream->lookahead_codes);
+    stream->chunk_codes = std::min(stream->chunk_codes, n_window_max);
+    stream->context_codes = std::min(stream->context_codes, n_window_max - stream->chunk_codes);
+    stream->on_audio = std::move(on_audio);
+    stream->on_error = std::move(on_error);
+}
+
+void llama_rn_context_tts::pushAudioToken(llama_rn_context* main_ctx, llama_token token) {
+    if (!stream || stream->failed) {
+        return;
+    }
+    const tts_type tts_type = getTTSType(main_ctx);
+    if ((tts_type != OUTETTS_V0_3 && tts_type != OUTETTS_V0_2) || token < 151672 || token > 155772) {
+        return;
+    }
+    stream->codes.push_back(token - 151672);
+
+    const int n_ready = (int) stream->codes.size() - stream->lookahead_codes;
+    if (n_ready - stream->n_committed >= stream->chunk_codes) {
+        vocodeStreamWindow(main_ctx, n_ready);
+    }
+}
+
+void llama_rn_context_tts::endAudioStream(llama_rn_context* main_ctx) {
+    if (!stream) {
+        return;
+    }
+    if (stream->failed) {
+        stream.reset();
+        return;
+    }
+    // Remaining codes have no more look-ahead coming
+    while (stream->n_committed < (int) stream->codes.size()) {
+        const int n_commit = std::min((int) stream->codes.size(), stream->n_committed + stream->chunk_codes);
+        vocodeStreamWindow(main_ctx, n_commit);
+        if (stream->failed) {
+            stream.reset();
+            return;
+        }
+    }
+    std::vector<float> tail = getIstft(main_ctx)->finish(stream->istft_state);
+    if (!tail.empty() && stream->on_audio) {
+        stream->on_audio(std::move(tail));
+    }
+    stream.reset();
+}
+
+void llama_rn_context_tts::vocodeStreamWindow(llama_rn_context* main_ctx, int n_commit) {
+    audio_stream &st = *stream;
+    const int n_codes = (int) st.codes.size();
+    const int window_begin = std::max(0, st.n_committed - st.context_codes);
+    const int window_end = std::min(n_codes, n_commit + st.lookahead_codes);
+
+    int n_embd = 0;
+    const float * embd = encodeCodes(st.codes.data() + window_begin, window_end - window_begin, n_embd);
+    if (embd == nullptr) {
+        // Later windows overlap-add onto this one, so the stream can't go on
+        LOG_ERROR("Audio stream: vocoder failed on codes %d-%d", window_begin, window_end);
+        st.failed = true;
+        if (st.on_error) {
+            st.on_error("Vocoder failed to decode the audio codes");
+        }
+        return;
+    }
+    const int n_frames = n_commit - st.n_committed;
+    std::vector<float> audio = getIstft(main_ctx)->push(
+        st.istft_state, embd + (size_t) (st.n_committed - window_begin) * n_embd, n_frames, n_embd);
+    st.n_committed = n_commit;
+    if (!audio.empty() && st.on_audio) {
+        st.on_audio(std::move(audio));
+    }
 }
 
 }
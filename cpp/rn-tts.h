@@ -3,9 +3,12 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <functional>
 #include "llama.h"
 #include "nlohmann/json.hpp"
 #include "common.h"
+#include "rn-istft.h"
 
 using json = nlohmann::ordered_json;
 
@@ -28,6 +31,41 @@ struct llama_rn_audio_completion_result {
     const char *grammar;
 };
 
+// OuteTTS prompts are <|im_start|>, the speaker's words, the text to speak,
+// then the speaker's audio codes. Per speaker this keeps the formatted pieces
+// around the text, and the tokens and KV state of everything before the text,
+// so each sentence after the first only formats and prefills its own part.
+// The speaker's audio comes after the text, so its attention state depends on
+// the text and is prefilled every time.
+struct llama_rn_tts_speaker_cache {
+    struct entry {
+        std::string speaker_json;          // Key ("" = built-in speaker)
+        tts_type type = UNKNOWN;
+        std::string head;                  // Before the text
+        std::string tail;                  // After the text
+        std::vector<llama_token> head_tokens;
+        std::vector<uint8_t> state;        // Seq 0 holding exactly head_tokens; empty until laid down
+        uint64_t last_used = 0;
+    };
+
+    size_t max_entries = 4;
+    size_t n_restored = 0;                 // Prompts whose speaker prefix came from a snapshot
+
+    entry *find(const std::string &speaker_json);
+    entry &put(entry &&e);
+
+    // When tokens start with a cached speaker prefix the live cache lacks
+    // (n_past short of it), restore its snapshot, or decode it and take one,
+    // and advance n_past past it. Seq 0 must hold exactly [0, n_past).
+    bool load_prefix(llama_context *ctx, const std::vector<llama_token> &tokens, llama_pos &n_past);
+    // Drop the KV snapshots (adapters changed), keeping the formatted pieces
+    void clear_state();
+
+private:
+    std::vector<entry> entries;
+    uint64_t n_calls = 0;
+};
+
 // TTS context for TTS-specific functionality
 struct llama_rn_context_tts {
     // TTS state fields
@@ -41,6 +79,26 @@ struct llama_rn_context_tts {
     llama_model *model = nullptr;
     llama_context *ctx = nullptr;
     tts_type type = UNKNOWN;
+    std::unique_ptr<llama_rn_istft> istft; // Built on first decode
+
+    // Streaming decode: audio codes are vocoded in windows while the
+    // completion is still generating them. Each window re-encodes a few
+    // look-back codes for context and holds back a few look-ahead codes;
+    // the iSTFT overlap-add tail carries over, so the chunks join seamlessly.
+    struct audio_stream {
+        int chunk_codes = 8;             // Codes per window (75 codes/s at 24 kHz)
+        int context_codes = 16;          // Look-back codes re-encoded with each window
+        int lookahead_codes = 2;         // Newest codes held back until the next window
+        std::function<void(std::vector<float> &&)> on_audio;
+        std::function<void(const std::string &)> on_error;
+        bool failed = false;             // A window failed to encode; no more audio
+        std::vector<llama_token> codes;  // Vocoder codes received so far
+        int n_committed = 0;             // Codes already turned into audio frames
+        llama_rn_istft::stream_state istft_state;
+    };
+    std::unique_ptr<audio_stream> stream;
+
+    llama_rn_tts_speaker_cache speakers;
 
     // Constructor and destructor
     llama_rn_context_tts(const std::string &vocoder_model_path, int batch_size = -1);
@@ -52,6 +110,20 @@ struct llama_rn_context_tts {
     std::vector<llama_token> getAudioCompletionGuideTokens(llama_rn_context* main_ctx, const std::string &text_to_speak);
     std::vector<float> decodeAudioTokens(llama_rn_context* main_ctx, const std::vector<llama_token> &tokens);
     void setGuideTokens(const std::vector<llama_token> &tokens);
+
+    // Streaming decode (see audio_stream). on_audio is called with PCM chunks
+    // on the thread that generates the codes; on_error once if the vocoder
+    // fails, which ends the stream.
+    void beginAudioStream(int chunk_codes, std::function<void(std::vector<float> &&)> on_audio,
+                          std::function<void(const std::string &)> on_error = nullptr);
+    void pushAudioToken(llama_rn_context* main_ctx, llama_token token);
+    void endAudioStream(llama_rn_context* main_ctx);
+
+private:
+    // Vocoder output for n_codes codes, n_embd floats per code; nullptr on failure
+    const float *encodeCodes(const llama_token *codes, int n_codes, int &n_embd);
+    llama_rn_istft *getIstft(llama_rn_context* main_ctx);
+    void vocodeStreamWindow(llama_rn_context* main_ctx, int n_commit);
 };
 
 }
@@ -1,7 +1,7 @@
 export interface EmbeddingItem {
   id: string
   text: string
-  embedding: number[]
+  embedding: ArrayLike<number>
 }
 
 export interface SearchResult {
@@ -22,8 +22,8 @@ export interface RerankResult {
 }
 
 export const calculateCosineSimilarity = (
-  vecA: number[],
-  vecB: number[],
+  vecA: ArrayLike<number>,
+  vecB: ArrayLike<number>,
 ): number => {
   if (vecA.length !== vecB.length) return 0
 
@@ -44,7 +44,7 @@ export const calculateCosineSimilarity = (
 }
 
 export const rankEmbeddingSearchResults = (
-  queryEmbedding: number[],
+  queryEmbedding: ArrayLike<number>,
   items: EmbeddingItem[],
   limit = 3,
 ): SearchResult[] =>
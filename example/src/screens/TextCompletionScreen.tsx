@@ -148,7 +148,9 @@ export default function TextCompletionScreen({
                 setFormattedPrompt(formatted.prompt)
                 const tokenized = await context.tokenize(formatted.prompt)
                 const detokenizedTokens = await Promise.all(
-                  tokenized.tokens.map((token) => context.detokenize([token])),
+                  Array.from(tokenized.tokens, (token) =>
+                    context.detokenize([token]),
+                  ),
                 )
                 setPromptTokens(detokenizedTokens)
               } catch (formatError) {
@@ -216,7 +218,7 @@ export default function TextCompletionScreen({
         // Tokenize the prompt to show individual tokens
         const tokenized = await ctx.tokenize(formatted.prompt)
         const detokenizedTokens = await Promise.all(
-          tokenized.tokens.map((token) => ctx.detokenize([token])),
+          Array.from(tokenized.tokens, (token) => ctx.detokenize([token])),
         )
         setPromptTokens(detokenizedTokens)
       } catch (formatError) {
@@ -374,7 +376,7 @@ export default function TextCompletionScreen({
                               editableResult,
                             )
                             const detokenizedTokens = await Promise.all(
-                              tokenized.tokens.map((token) =>
+                              Array.from(tokenized.tokens, (token) =>
                                 context.detokenize([token]),
                               ),
                             )
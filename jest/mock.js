@@ -1,7 +1,7 @@
 const { NativeModules } = require('react-native')
 
 if (!NativeModules.RNLlama) {
-  const demoEmbedding = new Array(768).fill(0.01)
+  const demoEmbedding = new Float32Array(768).fill(0.01)
   const benchJson =
     '{"n_kv_max":2048,"n_batch":2048,"n_ubatch":512,"flash_attn":0,"is_pp_shared":0,"n_gpu_layers":99,"n_threads":8,"n_threads_batch":8,"pp":128,"tg":128,"pl":1,"n_kv":256,"t_pp":0.23381,"speed_pp":547.453064,"t_tg":3.503684,"speed_tg":36.532974,"t":3.737494,"speed":68.495094}'
 
@@ -181,7 +181,7 @@ if (!NativeModules.RNLlama) {
     setGlobal(
       'llamaTokenize',
       jest.fn(async () => ({
-        tokens: [],
+        tokens: new Int32Array(0),
         has_media: false,
         bitmap_hashes: [],
         chunk_pos: [],
@@ -203,15 +203,17 @@ if (!NativeModules.RNLlama) {
     )
     setGlobal(
       'llamaEmbedding',
-      jest.fn(async () => ({ embedding: demoEmbedding })),
+      jest.fn(async () => ({ embedding: new Float32Array(demoEmbedding) })),
+    )
+    setGlobal(
+      'llamaEmbeddingBatch',
+      jest.fn(async (_id, texts) => ({
+        embeddings: texts.map(() => new Float32Array(demoEmbedding)),
+      })),
     )
     setGlobal(
       'llamaRerank',
-      jest.fn(async () => [
-        { score: 0.9, index: 0 },
-        { score: 0.5, index: 1 },
-        { score: 0.2, index: 2 },
-      ]),
+      jest.fn(async () => new Float32Array([0.9, 0.5, 0.2])),
     )
     setGlobal(
       'llamaBench',
@@ -284,7 +286,7 @@ if (!NativeModules.RNLlama) {
     )
     setGlobal(
       'llamaDecodeAudioTokens',
-      jest.fn(async () => []),
+      jest.fn(async () => new Float32Array(0)),
     )
     setGlobal(
       'llamaReleaseVocoder',
@@ -316,7 +318,8 @@ if (!NativeModules.RNLlama) {
       'llamaQueueEmbedding',
       jest.fn(async (_ctx, _text, _params, onResult) => {
         const reqId = getNextRequestId()
-        if (typeof onResult === 'function') onResult([...demoEmbedding])
+        if (typeof onResult === 'function')
+          onResult(new Float32Array(demoEmbedding))
         return { requestId: reqId }
       }),
     )
@@ -324,11 +327,11 @@ if (!NativeModules.RNLlama) {
       'llamaQueueRerank',
       jest.fn(async (_ctx, _query, documents, _params, onResult) => {
         const reqId = getNextRequestId()
-        const results = (documents || []).map((_, index) => ({
-          index,
-          score: 1 - index * 0.1,
-        }))
-        if (typeof onResult === 'function') onResult(results)
+        const scores = Float32Array.from(
+          documents || [],
+          (_, index) => 1 - index * 0.1,
+        )
+        if (typeof onResult === 'function') onResult(scores)
         return { requestId: reqId }
       }),
     )
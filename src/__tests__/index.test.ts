@@ -373,7 +373,7 @@ test('Parallel APIs - embedding', async () => {
 
   const result = await promise
   expect(result).toHaveProperty('embedding')
-  expect(Array.isArray(result.embedding)).toBe(true)
+  expect(result.embedding).toBeInstanceOf(Float32Array)
   expect(result.embedding.length).toBe(768)
 
   await context.release()
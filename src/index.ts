@@ -10,6 +10,7 @@ import type {
   NativeCompletionResult,
   NativeTokenizeResult,
   NativeEmbeddingResult,
+  NativeEmbeddingBatchResult,
   NativeSessionLoadResult,
   NativeEmbeddingParams,
   NativeRerankParams,
@@ -57,6 +58,7 @@ export type {
   NativeCompletionResult,
   NativeTokenizeResult,
   NativeEmbeddingResult,
+  NativeEmbeddingBatchResult,
   NativeSessionLoadResult,
   NativeEmbeddingParams,
   NativeRerankParams,
@@ -93,6 +95,7 @@ const jsiBindingKeys = [
   'llamaDetokenize',
   'llamaGetFormattedChat',
   'llamaEmbedding',
+  'llamaEmbeddingBatch',
   'llamaRerank',
   'llamaBench',
   'llamaToggleNativeLog',
@@ -189,6 +192,18 @@ export type TokenData = {
   tool_calls?: Array<ToolCall>
   accumulated_text?: string
   requestId?: number
+  // Framed streaming (stream_frame_ms / stream_frame_max_tokens): `token` holds
+  // the text of all tokens in the frame. The typed arrays share one buffer;
+  // probs are n_probs entries per token.
+  n_tokens?: number
+  tokens?: Int32Array
+  n_probs?: number
+  prob_tokens?: Int32Array
+  probs?: Float32Array
+  // Streamed TTS (stream_audio): PCM samples decoded since the previous chunk
+  audio?: Float32Array
+  // Streamed TTS: the vocoder failed; no more audio follows for this completion
+  audio_error?: string
 }
 
 export type ContextParams = Omit<
@@ -233,6 +248,11 @@ export type EmbeddingParams = NativeEmbeddingParams
 
 export type RerankParams = {
   normalize?: number
+  /**
+   * Scheduling priority when queued in parallel mode (higher runs first).
+   * Default: `0`
+   */
+  priority?: number
 }
 
 export type RerankResult = {
@@ -241,6 +261,17 @@ export type RerankResult = {
   document?: string
 }
 
+// Native rerank returns one score per document, in input order
+const toRerankResults = (
+  scores: Float32Array,
+  documents: string[],
+): RerankResult[] =>
+  Array.from(scores, (score, index) => ({
+    score,
+    index,
+    document: documents[index],
+  })).sort((a, b) => b.score - a.score)
+
 export type CompletionResponseFormat = {
   type: 'text' | 'json_object' | 'json_schema'
   json_schema?: {
@@ -560,14 +591,8 @@ export class LlamaContext {
             query,
             documents,
             params || {},
-            (results) => {
-              const sortedResults = results
-                .map((result: NativeRerankResult) => ({
-                  ...result,
-                  document: documents[result.index],
-                }))
-                .sort((a: RerankResult, b: RerankResult) => b.score - a.score)
-              resolveResult(sortedResults)
+            (scores) => {
+              resolveResult(toRerankResults(scores, documents))
             },
           )
 
@@ -580,13 +605,25 @@ export class LlamaContext {
         }
       }),
 
-    enable: (config?: { n_parallel?: number; n_batch?: number }) =>
+    enable: (config?: {
+      n_parallel?: number
+      n_batch?: number
+      n_prefill_budget?: number
+      prefill_target_ms?: number
+      pipeline_decode?: boolean
+    }) =>
       getJsi().llamaEnableParallelMode(this.id, { enabled: true, ...config }),
 
     disable: () =>
       getJsi().llamaEnableParallelMode(this.id, { enabled: false }),
 
-    configure: (config: { n_parallel?: number; n_batch?: number }) =>
+    configure: (config: {
+      n_parallel?: number
+      n_batch?: number
+      n_prefill_budget?: number
+      prefill_target_ms?: number
+      pipeline_decode?: boolean
+    }) =>
       getJsi().llamaEnableParallelMode(this.id, { enabled: true, ...config }),
 
     /**
@@ -883,7 +920,7 @@ export class LlamaContext {
     return llamaTokenize(this.id, text, mediaPaths)
   }
 
-  detokenize(tokens: number[]): Promise<string> {
+  detokenize(tokens: number[] | Int32Array): Promise<string> {
     const { llamaDetokenize } = getJsi()
     return llamaDetokenize(this.id, tokens)
   }
@@ -896,20 +933,26 @@ export class LlamaContext {
     return llamaEmbedding(this.id, text, params || {})
   }
 
+  /**
+   * Embed many texts in shared batches. Unlike `embedding`, this leaves the
+   * cached chat prompt in place. Requires a pooled embedding model.
+   */
+  embeddingBatch(
+    texts: string[],
+    params?: EmbeddingParams,
+  ): Promise<NativeEmbeddingBatchResult> {
+    const { llamaEmbeddingBatch } = getJsi()
+    return llamaEmbeddingBatch(this.id, texts, params || {})
+  }
+
   async rerank(
     query: string,
     documents: string[],
     params?: RerankParams,
   ): Promise<RerankResult[]> {
     const { llamaRerank } = getJsi()
-    const results = await llamaRerank(this.id, query, documents, params || {})
-
-    return results
-      .map((result) => ({
-        ...result,
-        document: documents[result.index],
-      }))
-      .sort((a, b) => b.score - a.score)
+    const scores = await llamaRerank(this.id, query, documents, params || {})
+    return toRerankResults(scores, documents)
   }
 
   async bench(
@@ -1050,7 +1093,9 @@ export class LlamaContext {
     return await llamaGetAudioCompletionGuideTokens(this.id, textToSpeak)
   }
 
-  async decodeAudioTokens(tokens: number[]): Promise<Array<number>> {
+  async decodeAudioTokens(
+    tokens: number[] | Int32Array,
+  ): Promise<Float32Array> {
     const { llamaDecodeAudioTokens } = getJsi()
     return await llamaDecodeAudioTokens(this.id, tokens)
   }
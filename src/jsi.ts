@@ -6,8 +6,8 @@ import type {
   NativeCompletionResult,
   NativeTokenizeResult,
   NativeEmbeddingResult,
+  NativeEmbeddingBatchResult,
   NativeSessionLoadResult,
-  NativeRerankResult,
   JinjaFormattedChatResult,
   ParallelStatus,
 } from './types'
@@ -36,7 +36,10 @@ declare global {
     text: string,
     mediaPaths?: string[],
   ) => Promise<NativeTokenizeResult>
-  var llamaDetokenize: (contextId: number, tokens: number[]) => Promise<string>
+  var llamaDetokenize: (
+    contextId: number,
+    tokens: number[] | Int32Array,
+  ) => Promise<string>
   var llamaGetFormattedChat: (
     contextId: number,
     messages: string,
@@ -48,12 +51,17 @@ declare global {
     text: string,
     params: object,
   ) => Promise<NativeEmbeddingResult>
+  var llamaEmbeddingBatch: (
+    contextId: number,
+    texts: string[],
+    params: object,
+  ) => Promise<NativeEmbeddingBatchResult>
   var llamaRerank: (
     contextId: number,
     query: string,
     documents: string[],
     params: object,
-  ) => Promise<NativeRerankResult[]>
+  ) => Promise<Float32Array>
   var llamaBench: (
     contextId: number,
     pp: number,
@@ -110,15 +118,22 @@ declare global {
   ) => Promise<number[]>
   var llamaDecodeAudioTokens: (
     contextId: number,
-    tokens: number[],
-  ) => Promise<number[]>
+    tokens: number[] | Int32Array,
+  ) => Promise<Float32Array>
   var llamaReleaseVocoder: (contextId: number) => Promise<void>
   var llamaClearCache: (contextId: number, clearData: boolean) => Promise<void>
 
   // Parallel decoding
   var llamaEnableParallelMode: (
     contextId: number,
-    params: { enabled: boolean; n_parallel?: number; n_batch?: number },
+    params: {
+      enabled: boolean
+      n_parallel?: number
+      n_batch?: number
+      n_prefill_budget?: number
+      prefill_target_ms?: number
+      pipeline_decode?: boolean
+    },
   ) => Promise<boolean>
   var llamaQueueCompletion: (
     contextId: number,
@@ -134,14 +149,14 @@ declare global {
     contextId: number,
     text: string,
     params: object,
-    onResult: (result: number[]) => void,
+    onResult: (result: Float32Array) => void,
   ) => Promise<{ requestId: number }>
   var llamaQueueRerank: (
     contextId: number,
     query: string,
     documents: string[],
     params: object,
-    onResult: (result: NativeRerankResult[]) => void,
+    onResult: (scores: Float32Array) => void,
   ) => Promise<{ requestId: number }>
   var llamaGetParallelStatus: (contextId: number) => Promise<ParallelStatus>
   var llamaSubscribeParallelStatus: (
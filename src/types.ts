@@ -1,5 +1,10 @@
 export type NativeEmbeddingParams = {
   embd_normalize?: number
+  /**
+   * Scheduling priority when queued in parallel mode (higher runs first).
+   * Default: `0`
+   */
+  priority?: number
 }
 
 export type NativeSpeculativeType =
@@ -9,6 +14,15 @@ export type NativeSpeculativeType =
    * Alias for draft-mtp.
    */
   | 'mtp'
+  /**
+   * Draft-model-free n-gram lookup over the request's own prompt and output.
+   * Supported for queued completions in parallel mode.
+   */
+  | 'ngram-simple'
+  | 'ngram-map-k'
+  | 'ngram-map-k4v'
+  | 'ngram-mod'
+  | 'ngram-cache'
 
 export type NativeSpeculativeParams = {
   enabled?: boolean
@@ -167,7 +181,11 @@ export type NativeContextParams = {
   pooling_type?: number
 
   /**
-   * Enable context shifting to handle prompts larger than context size
+   * Enable context shifting: prompts larger than the context are truncated,
+   * and when generation fills the context (or a parallel slot's share of it)
+   * half of the tokens after the `n_keep` sink tokens are dropped in place
+   * instead of stopping. Not available for recurrent/hybrid models,
+   * multimodal prompts or MTP; those still stop with `context_full`.
    */
   ctx_shift?: boolean
 
@@ -199,6 +217,44 @@ export type NativeContextParams = {
    */
   state_cache_max_checkpoints?: number
 
+  /**
+   * Keep snapshots delta-encoded against a base snapshot, so the same budget
+   * holds several times more restore points. Each restore decodes one.
+   * Default false.
+   */
+  state_cache_compact?: boolean
+
+  /**
+   * Directory for a disk tier of the prompt state cache: snapshots evicted
+   * from memory, and the system prompt's state, which restores in a later
+   * context or app run. Unset disables it.
+   */
+  state_cache_dir?: string
+
+  /**
+   * Disk budget (MiB) for `state_cache_dir`; least recently used snapshots
+   * are deleted first. Default 512.
+   */
+  state_cache_disk_budget_mb?: number
+
+  /**
+   * Memory budget (MiB) for encoded images and audio, so media sent again
+   * (in any slot) skips the multimodal encoder. 0 disables it. Default 64.
+   */
+  media_cache_budget_mb?: number
+
+  /**
+   * Directory for a disk tier of the encoded media cache, kept across
+   * contexts and app runs. Unset disables it.
+   */
+  media_cache_dir?: string
+
+  /**
+   * Disk budget (MiB) for `media_cache_dir`; least recently used entries are
+   * deleted first. Default 256.
+   */
+  media_cache_disk_budget_mb?: number
+
   // Embedding params
   embedding?: boolean
   embd_normalize?: number
@@ -286,6 +342,11 @@ export type NativeCompletionParams = {
    * Default: `0`
    */
   n_probs?: number
+  /**
+   * Number of tokens after BOS kept at the start of the context when it is
+   * shifted (see `ctx_shift`); -1 keeps the whole prompt. Default: `0`
+   */
+  n_keep?: number
   /**
    * Per-completion speculative decoding override. For MTP on recurrent/hybrid
    * models, load the model with matching MTP options first.
@@ -399,7 +460,31 @@ export type NativeCompletionParams = {
    * Help prevent hallucinations by forcing the TTS to use the correct words.
    * Default: `[]`
    */
-  guide_tokens?: Array<number>
+  guide_tokens?: Array<number> | Int32Array
+
+  /**
+   * Deliver streamed tokens in frames instead of one callback per token: a
+   * frame goes out once its first token has waited this many ms (16 matches
+   * a 60 Hz UI). The callback then gets the frame's text in `token` and its
+   * token ids in `tokens`. Default: `0` (per token)
+   */
+  stream_frame_ms?: number
+  /**
+   * Also close a frame once it holds this many tokens. Default: `0` (no cap)
+   */
+  stream_frame_max_tokens?: number
+
+  /**
+   * With a vocoder loaded (initVocoder), decode audio while the completion is
+   * still generating codes. The callback gets PCM chunks (24 kHz) in `audio`,
+   * with `token` empty. If the vocoder fails, one last event carries
+   * `audio_error` and the audio stream ends. Default: `false`
+   */
+  stream_audio?: boolean
+  /**
+   * Audio codes per streamed chunk (75 codes per second). Default: `8`
+   */
+  stream_audio_chunk_codes?: number
 
   emit_partial_completion: boolean
 }
@@ -447,6 +532,23 @@ export type NativeParallelCompletionParams = NativeCompletionParams & {
    * Example: `512` to save only the last 512 tokens
    */
   save_state_size?: number
+
+  /**
+   * Scheduling priority (higher runs first). Queued requests are ordered by
+   * priority, and waiting requests gain one priority level every few seconds
+   * so low-priority work is not starved. A higher-priority request may
+   * preempt a lower-priority generation when all slots are busy; the
+   * preempted request is parked and resumes later without losing progress.
+   * Default: `0`
+   */
+  priority?: number
+
+  /**
+   * Target time to first token in milliseconds from queueing. Requests
+   * approaching their deadline are scheduled ahead of others in the same
+   * priority class. Default: `0` (no deadline)
+   */
+  deadline_ms?: number
 }
 
 export type NativeCompletionTokenProbItem = {
@@ -469,6 +571,11 @@ export type NativeCompletionResultTimings = {
   predicted_ms: number
   predicted_per_token_ms: number
   predicted_per_second: number
+  /**
+   * Speculative draft tokens proposed / accepted (parallel mode)
+   */
+  draft_n?: number
+  draft_n_accepted?: number
 }
 
 export type NativeCompletionResult = {
@@ -517,7 +624,7 @@ export type NativeCompletionResult = {
 }
 
 export type NativeTokenizeResult = {
-  tokens: Array<number>
+  tokens: Int32Array
   /**
    * Whether the tokenization contains media
    */
@@ -537,7 +644,15 @@ export type NativeTokenizeResult = {
 }
 
 export type NativeEmbeddingResult = {
-  embedding: Array<number>
+  embedding: Float32Array
+}
+
+export type NativeEmbeddingBatchResult = {
+  /**
+   * One embedding per input text, in input order. The rows are views over a
+   * single buffer.
+   */
+  embeddings: Array<Float32Array>
 }
 
 export type NativeLlamaContext = {
@@ -655,7 +770,8 @@ export type NativeBackendDeviceInfo = {
 export type ParallelRequestStatus = {
   request_id: number
   type: 'completion' | 'embedding' | 'rerank'
-  state: 'queued' | 'processing_prompt' | 'generating' | 'done'
+  state: 'queued' | 'preempted' | 'processing_prompt' | 'generating' | 'done'
+  priority: number
   prompt_length: number
   tokens_generated: number
   prompt_ms: number
@@ -3,7 +3,8 @@
 // Covers the utf8 helpers and utf8_stream_gate directly, then the consumer
 // seam: parseChatOutput driven with a production-shaped Gemma4 tool-call
 // parser, with text entering through the gate exactly as the generation
-// loops feed it.
+// loops feed it. Ends with the streaming chat_output_parser checked against
+// full parses.
 //
 // Convention: malformed bytes enter only via utf8_gate.feed()/finish(), never
 // by assigning generated_text directly - the production contract, and what
@@ -516,6 +517,144 @@ static bool test_slot_toolcall_invalid_utf8(const std::string & parser) {
     }
 }
 
+// ---------------------------------------------------------------------------
+// Streaming parse: chat_output_parser keeps the parse state between tokens and
+// must agree with a full parse of the same text at every step.
+// ---------------------------------------------------------------------------
+
+// Reasoning block, content and JSON tool calls, in the shape the generated
+// parsers take.
+static std::string build_reasoning_json_tool_parser() {
+    auto parser = build_chat_peg_parser([&](common_chat_peg_builder & p) {
+        auto reasoning = p.optional(p.reasoning_block(
+            p.literal("<think>") + p.reasoning(p.until("</think>")) + p.literal("</think>") + p.space()));
+        auto tool_call = p.tool(
+            p.tool_open(p.literal("<tool_call>")) + p.space() +
+            "{\"name\": \"" + p.tool_name(p.chars("[a-z_]", 1, -1)) + "\", \"arguments\": " +
+            p.tool_args(p.json()) + "}" + p.space() +
+            p.tool_close(p.literal("</tool_call>")));
+        return reasoning + p.content(p.until("<tool_call>")) + p.zero_or_more(tool_call + p.space()) + p.end();
+    });
+    return parser.save();
+}
+
+static bool same_output(const completion_chat_output & a, const completion_chat_output & b) {
+    if (a.content != b.content || a.reasoning_content != b.reasoning_content ||
+        a.tool_calls.size() != b.tool_calls.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.tool_calls.size(); i++) {
+        if (a.tool_calls[i].name != b.tool_calls[i].name ||
+            a.tool_calls[i].arguments != b.tool_calls[i].arguments ||
+            a.tool_calls[i].id != b.tool_calls[i].id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Feed `raw` `step` bytes at a time; every streamed result (or parse error)
+// must match a full parse, and the deltas must add up to the final message.
+static bool stream_matches_full_parse(const std::string & raw, int format, const std::string & parser,
+                                      const std::string & generation_prompt, size_t step) {
+    chat_output_parser stream(format, COMMON_REASONING_FORMAT_NONE, generation_prompt, parser);
+    std::string content;
+    std::string reasoning;
+    std::string text;
+    for (size_t i = 0; i < raw.size(); i += step) {
+        text += raw.substr(i, step);
+
+        completion_chat_output full;
+        bool full_ok = true;
+        try {
+            full = parse_chat_output(text, true, format, COMMON_REASONING_FORMAT_NONE, generation_prompt, parser);
+        } catch (const std::exception &) {
+            full_ok = false;
+        }
+
+        completion_chat_output streamed;
+        bool streamed_ok = true;
+        try {
+            streamed = stream.parse(text, true);
+        } catch (const std::exception &) {
+            streamed_ok = false;
+        }
+
+        if (full_ok != streamed_ok || (full_ok && !same_output(full, streamed))) {
+            std::cout << "[step " << step << ": mismatch after " << text.size() << " bytes] ";
+            return false;
+        }
+        for (const auto & diff : streamed.diffs) {
+            content += diff.content_delta;
+            reasoning += diff.reasoning_content_delta;
+        }
+    }
+
+    auto final_full = parse_chat_output(text, false, format, COMMON_REASONING_FORMAT_NONE, generation_prompt, parser);
+    auto final_streamed = stream.parse(text, false);
+    if (!same_output(final_full, final_streamed)) {
+        std::cout << "[step " << step << ": final mismatch] ";
+        return false;
+    }
+    for (const auto & diff : final_streamed.diffs) {
+        content += diff.content_delta;
+        reasoning += diff.reasoning_content_delta;
+    }
+    if (content != final_full.content || reasoning != final_full.reasoning_content) {
+        std::cout << "[step " << step << ": deltas don't add up] ";
+        return false;
+    }
+    return true;
+}
+
+static bool test_streaming_matches_full_gemma4(const std::string & parser) {
+    const std::string raw = std::string("<|channel>thought\nThe user wants the weather.<channel|>") +
+        "Let me check Z\xC3\xBCrich \xF0\x9F\x8C\x8D for you." +
+        "<|tool_call>call:get_weather{city:<|\"|>Z\xC3\xBCrich<|\"|>}<tool_call|>";
+    for (size_t step : {1, 3, 7}) {
+        if (!stream_matches_full_parse(raw, COMMON_CHAT_FORMAT_PEG_GEMMA4, parser, "", step)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_streaming_matches_full_reasoning_tools() {
+    const std::string parser = build_reasoning_json_tool_parser();
+    std::string long_content;
+    for (int i = 0; i < 40; i++) {
+        long_content += "Paragraph " + std::to_string(i) + " of the answer, with <tags> and \"quotes\".\n";
+    }
+    const std::string raw = "The question is about two cities.</think>\n" + long_content +
+        "<tool_call>{\"name\": \"get_weather\", \"arguments\": {\"city\": \"Paris\", \"days\": [1, 2.5, -3e2], "
+        "\"opts\": {\"unit\": \"c\\u00b0\", \"alerts\": true, \"extra\": null}}}</tool_call>\n"
+        "<tool_call>{\"name\": \"get_time\", \"arguments\": {\"tz\": \"Europe/Paris\"}}</tool_call>";
+    // The generation prompt opens the reasoning block, as with a thinking template
+    for (size_t step : {1, 2, 5}) {
+        if (!stream_matches_full_parse(raw, COMMON_CHAT_FORMAT_PEG_NATIVE, parser, "<think>", step)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Text that doesn't extend the previous call (a new or edited output) restarts the parse.
+static bool test_streaming_restarts_on_new_text(const std::string & parser) {
+    chat_output_parser stream(COMMON_CHAT_FORMAT_PEG_GEMMA4, COMMON_REASONING_FORMAT_NONE, "", parser);
+    (void) stream.parse("A first answer that is fairly long", true);
+    auto streamed = stream.parse("Second", true);
+    auto full = parse_chat_output("Second", true, COMMON_CHAT_FORMAT_PEG_GEMMA4, COMMON_REASONING_FORMAT_NONE, "", parser);
+    if (!same_output(full, streamed) || streamed.content != "Second") {
+        return false;
+    }
+    // Rewritten text no shorter than before (an erased stop word followed by
+    // new tokens) restarts too
+    const std::string rewritten = "Secant, and then some more";
+    streamed = stream.parse(rewritten, true);
+    full = parse_chat_output(rewritten, true, COMMON_CHAT_FORMAT_PEG_GEMMA4, COMMON_REASONING_FORMAT_NONE, "", parser);
+    return same_output(full, streamed) && streamed.content == rewritten;
+}
+
 int main() {
     std::cout << "=== chat parse UTF-8 robustness tests ===" << std::endl;
 
@@ -543,6 +682,10 @@ int main() {
     results.run_test("token display text is always well-formed", test_token_piece_display_text());
     results.run_test("slot reuse clears generation state", test_slot_clear_generation_state());
     results.run_test("slot parseChatOutput with invalid UTF-8 byte", test_slot_toolcall_invalid_utf8(parser));
+    // streaming parse
+    results.run_test("streaming parse matches full parse (gemma4 tool call)", test_streaming_matches_full_gemma4(parser));
+    results.run_test("streaming parse matches full parse (reasoning + JSON tools)", test_streaming_matches_full_reasoning_tools());
+    results.run_test("streaming parse restarts on non-appended text", test_streaming_restarts_on_new_text(parser));
 
     results.print_summary();
     return results.passed_tests == results.total_tests ? 0 : 1;
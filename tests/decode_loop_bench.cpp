@@ -0,0 +1,145 @@
+// Benchmark for the parallel processing loop: serial vs pipelined decoding.
+// Runs rounds of concurrent greedy requests through the background loop and
+// reports throughput next to the per-step host overhead (wall time not spent
+// in graph compute). Pipelining can hide only the status/callback part of it;
+// sampling stays between one step's compute and the next.
+//
+//   BENCH,<model>,<mode>,<n_parallel>,<steps>,<tokens>,<wall_ms>,<gen_tps>,<step_ms>,<overhead_us>,<waits>
+//
+// Env: MODELS_DIR, BENCH_MODEL (path, overrides the model list), RNLLAMA_NGL,
+//      BENCH_GEN (default 64), BENCH_ROUNDS (default 4), BENCH_PARALLEL (default 4).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rn-llama.h"
+#include "rn-slot-manager.h"
+#include "common.h"
+
+using namespace rnllama;
+
+namespace {
+
+int env_i(const char *k, int d) {
+    const char *v = std::getenv(k);
+    return v ? std::atoi(v) : d;
+}
+
+struct RunResult {
+    llama_rn_loop_stats stats;
+    int64_t n_generated = 0;
+    double wall_ms = 0;
+};
+
+RunResult run(llama_rn_context &ctx, bool pipelined, int n_parallel, int rounds, int max_new) {
+    auto *mgr = ctx.slot_manager;
+    mgr->pipeline_decode = pipelined;
+    mgr->loop_stats = llama_rn_loop_stats();
+
+    common_params params = ctx.params;
+    params.n_predict = max_new;
+    params.sampling.temp = 0.0f;
+    params.sampling.top_k = 1;
+    params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+
+    const int n_requests = n_parallel * rounds;
+    std::atomic<int> n_done{0};
+    std::atomic<int64_t> n_generated{0};
+
+    const auto t0 = std::chrono::steady_clock::now();
+    mgr->start_processing_loop();
+    for (int i = 0; i < n_requests; i++) {
+        const std::string prompt = "Write a short note about topic number " + std::to_string(i + 1) + ".";
+        mgr->queue_request(
+            params, common_tokenize(ctx.ctx, prompt, true), std::vector<std::string>(), prompt,
+            0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [](const completion_token_output &) {},
+            [&](llama_rn_slot *slot) {
+                n_generated += slot->n_decoded;
+                n_done++;
+            }
+        );
+    }
+    while (n_done < n_requests) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    mgr->stop_processing_loop();
+
+    RunResult r;
+    r.stats = mgr->loop_stats;
+    r.n_generated = n_generated;
+    r.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return r;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const char *env_dir = std::getenv("MODELS_DIR");
+    std::filesystem::path models_dir =
+        env_dir ? std::filesystem::path(env_dir)
+                : std::filesystem::path(__FILE__).parent_path() / "models";
+    const int max_new    = env_i("BENCH_GEN", 64);
+    const int rounds     = env_i("BENCH_ROUNDS", 4);
+    const int n_parallel = env_i("BENCH_PARALLEL", 4);
+
+    // key -> file (subset that exists is run)
+    std::vector<std::pair<std::string, std::string>> models = {
+        {"lfm2", "lfm2.gguf"}, {"granite4", "granite4.gguf"},
+        {"qwen35", "qwen35.gguf"}, {"gemma4", "gemma4.gguf"},
+        {"smollm2", "smollm2.gguf"},
+    };
+    if (const char *path = std::getenv("BENCH_MODEL")) {
+        models = {{std::filesystem::path(path).stem().string(), path}};
+    }
+    std::vector<std::string> want;
+    for (int i = 1; i < argc; i++) want.push_back(argv[i]);
+
+    printf("BENCH_HEADER,model,mode,n_parallel,steps,tokens,wall_ms,gen_tps,step_ms,overhead_us,waits\n");
+    for (const auto &m : models) {
+        if (!want.empty() && std::find(want.begin(), want.end(), m.first) == want.end()) continue;
+        const auto p = models_dir / m.second;
+        if (!std::filesystem::exists(p)) continue;
+
+        llama_rn_context ctx;
+        common_params params;
+        params.model.path = p.string();
+        params.n_ctx = 1024 * n_parallel;
+        params.n_batch = 512;
+        params.n_ubatch = 512;
+        params.n_parallel = n_parallel;
+        params.cpuparams.n_threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+        const char *ngl = std::getenv("RNLLAMA_NGL");
+        params.n_gpu_layers = ngl ? std::atoi(ngl) : 0;
+        params.no_kv_offload = params.n_gpu_layers == 0;
+        if (!ctx.loadModel(params)) {
+            printf("BENCH,%s,load-failed,0,0,0,0,0,0,0,0\n", m.first.c_str());
+            continue;
+        }
+        ctx.enableParallelMode(n_parallel, 512);
+
+        run(ctx, false, n_parallel, 1, 8); // Warm-up
+
+        for (const bool pipelined : {false, true}) {
+            const RunResult r = run(ctx, pipelined, n_parallel, rounds, max_new);
+            const double steps = std::max<int64_t>(1, r.stats.n_steps);
+            const double overhead_us = (r.wall_ms * 1e3 - r.stats.t_compute_us) / steps;
+            printf("BENCH,%s,%s,%d,%lld,%lld,%.1f,%.1f,%.3f,%.1f,%lld\n",
+                   m.first.c_str(), pipelined ? "pipelined" : "serial", n_parallel,
+                   (long long) r.stats.n_steps, (long long) r.n_generated, r.wall_ms,
+                   r.n_generated / (r.wall_ms / 1e3), r.wall_ms / steps, overhead_us,
+                   (long long) r.stats.n_waits);
+            fflush(stdout);
+        }
+        ctx.disableParallelMode();
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+// Benchmark for the vocoder iSTFT: the previous per-call implementation
+// (naive O(n^2) irfft, transposes, threads spawned per call) against
+// llama_rn_istft (mixed-radix FFT, cached tables, persistent pool). Both run
+// on the same random spectrogram; the max abs difference checks that the
+// output is unchanged, and streaming the same frames in chunks must match
+// the one-shot result.
+//
+//   BENCH,<impl>,<n_codes>,<n_threads>,<ms>,<max_abs_diff>
+//
+// Env: BENCH_THREADS (default 4), BENCH_ROUNDS (default 3).
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "rn-istft.h"
+
+#ifdef _WIN32
+  #define M_PI 3.14159265358979323846
+#endif
+
+using namespace rnllama;
+
+namespace {
+
+int env_i(const char *k, int d) {
+    const char *v = std::getenv(k);
+    return v ? std::atoi(v) : d;
+}
+
+// Reference: the implementation that rn-tts.cpp used before llama_rn_istft
+
+void ref_fill_hann_window(int length, bool periodic, float * output) {
+    int offset = -1;
+    if (periodic) {
+        offset = 0;
+    }
+    for (int i = 0; i < length; i++) {
+        output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+    }
+}
+
+void ref_twiddle(float * real, float * imag, int k, int N) {
+    float angle = 2 * M_PI * k / N;
+    *real = cos(angle);
+    *imag = sin(angle);
+}
+
+void ref_irfft(int n, const float * inp_cplx, float * out_real) {
+    int N = n / 2 + 1;
+
+    std::vector<float> real_input(N);
+    std::vector<float> imag_input(N);
+    for (int i = 0; i < N; ++i) {
+        real_input[i] = inp_cplx[2 * i];
+        imag_input[i] = inp_cplx[2 * i + 1];
+    }
+
+    std::vector<float> real_output(n);
+    std::vector<float> imag_output(n);
+
+    for (int k = 0; k < n; ++k) {
+        real_output[k] = 0.0f;
+        imag_output[k] = 0.0f;
+        for (int m = 0; m < N; ++m) {
+            float twiddle_real;
+            float twiddle_imag;
+
+            ref_twiddle(&twiddle_real, &twiddle_imag, k * m, n);
+
+            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
+            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        out_real[i] = real_output[i] / N;
+    }
+}
+
+void ref_fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
+    int64_t output_height = n_out;
+    int64_t kernel_w = n_win;
+    int64_t stride_w = n_hop;
+    int64_t width    = n_out;
+
+    output.resize(width, 0.0f);
+
+    int64_t col_idx = 0;
+    for (int64_t w_col = 0; w_col < width; ++w_col) {
+        int64_t start = w_col * stride_w - n_pad;
+        int64_t end   = start + kernel_w;
+
+        for (int64_t w_im = start; w_im < end; ++w_im) {
+            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
+                output[w_im] += data[col_idx];
+            }
+            col_idx++;
+        }
+    }
+
+    output.resize(n_out - 2 * n_pad);
+}
+
+std::vector<float> ref_embd_to_audio(const float * embd, const int n_codes, const int n_embd, const int n_thread) {
+    const int n_fft = 1280;
+    const int n_hop = 320;
+    const int n_win = 1280;
+    const int n_pad = (n_win - n_hop)/2;
+    const int n_out = (n_codes - 1)*n_hop + n_win;
+
+    std::vector<float> hann(n_fft);
+    ref_fill_hann_window(hann.size(), true, hann.data());
+
+    int n_spec = n_embd*n_codes;
+
+    std::vector<float> E (n_spec);
+    std::vector<float> S (n_spec);
+    std::vector<float> ST(n_spec);
+
+    for (int l = 0; l < n_codes; ++l) {
+        for (int k = 0; k < n_embd; ++k) {
+            E[k*n_codes + l] = embd[l*n_embd + k];
+        }
+    }
+
+    for (int k = 0; k < n_embd/2; ++k) {
+        for (int l = 0; l < n_codes; ++l) {
+            float mag = E[(k           )*n_codes + l];
+            float phi = E[(k + n_embd/2)*n_codes + l];
+
+            mag = exp(mag);
+
+            if (mag > 1e2) {
+                mag = 1e2;
+            }
+            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
+            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
+        }
+    }
+
+    for (int l = 0; l < n_codes; ++l) {
+        for (int k = 0; k < n_embd/2; ++k) {
+            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
+            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
+        }
+    }
+
+    std::vector<float> res  (n_codes*n_fft);
+    std::vector<float> hann2(n_codes*n_fft);
+
+    std::vector<std::thread> workers(n_thread);
+    for (int i = 0; i < n_thread; ++i) {
+        workers[i] = std::thread([&, i]() {
+            for (int l = i; l < n_codes; l += n_thread) {
+                ref_irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
+                for (int j = 0; j < n_fft; ++j) {
+                    res  [l*n_fft + j] *= hann[j];
+                    hann2[l*n_fft + j]  = hann[j] * hann[j];
+                }
+            }
+        });
+    }
+    for (int i = 0; i < n_thread; ++i) {
+        workers[i].join();
+    }
+
+    std::vector<float> audio;
+    std::vector<float> env;
+
+    ref_fold(res,   n_out, n_win, n_hop, n_pad, audio);
+    ref_fold(hann2, n_out, n_win, n_hop, n_pad, env);
+
+    for (size_t i = 0; i < audio.size(); ++i) {
+        audio[i] /= env[i];
+    }
+
+    return audio;
+}
+
+template <typename F>
+double time_ms(int rounds, F &&fn) {
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        const auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+    }
+    return best;
+}
+
+} // namespace
+
+int main() {
+    const int n_threads = std::max(1, env_i("BENCH_THREADS", 4));
+    const int rounds = std::max(1, env_i("BENCH_ROUNDS", 3));
+    const int n_fft = 1280;
+    const int n_hop = 320;
+    const int n_embd = n_fft + 2;
+
+    llama_rn_istft istft(n_fft, n_hop, n_threads);
+    std::mt19937 rng(42);
+    std::normal_distribution<float> log_mag(-1.0f, 1.5f);
+    std::uniform_real_distribution<float> phase(-M_PI, M_PI);
+
+    int failed = 0;
+    for (int n_codes : {1, 8, 75, 300}) {
+        std::vector<float> embd((size_t) n_codes * n_embd);
+        for (int l = 0; l < n_codes; l++) {
+            for (int k = 0; k < n_embd / 2; k++) {
+                embd[(size_t) l * n_embd + k] = log_mag(rng);
+                embd[(size_t) l * n_embd + n_embd / 2 + k] = phase(rng);
+            }
+        }
+
+        std::vector<float> expected;
+        std::vector<float> actual;
+        const double ref_ms = time_ms(rounds, [&]() { expected = ref_embd_to_audio(embd.data(), n_codes, n_embd, n_threads); });
+        const double new_ms = time_ms(rounds, [&]() { actual = istft.run(embd.data(), n_codes, n_embd); });
+
+        float max_diff = expected.size() == actual.size() ? 0.0f : INFINITY;
+        float max_ref = 0.0f;
+        for (size_t i = 0; i < std::min(expected.size(), actual.size()); i++) {
+            max_diff = std::max(max_diff, std::fabs(expected[i] - actual[i]));
+            max_ref = std::max(max_ref, std::fabs(expected[i]));
+        }
+        printf("BENCH,reference,%d,%d,%.3f,0\n", n_codes, n_threads, ref_ms);
+        printf("BENCH,istft,%d,%d,%.3f,%g\n", n_codes, n_threads, new_ms, max_diff);
+        if (!(max_diff <= 1e-4f * std::max(1.0f, max_ref))) {
+            fprintf(stderr, "mismatch at n_codes=%d: max abs diff %g (max |ref| %g)\n", n_codes, max_diff, max_ref);
+            failed++;
+        }
+
+        // Streaming in uneven chunks must reproduce run() sample for sample
+        llama_rn_istft::stream_state st;
+        std::vector<float> streamed;
+        for (int l = 0, n = 1; l < n_codes; l += n, n = n % 7 + 1) {
+            const int n_frames = std::min(n, n_codes - l);
+            auto chunk = istft.push(st, embd.data() + (size_t) l * n_embd, n_frames, n_embd);
+            streamed.insert(streamed.end(), chunk.begin(), chunk.end());
+        }
+        auto tail = istft.finish(st);
+        streamed.insert(streamed.end(), tail.begin(), tail.end());
+        float stream_diff = streamed.size() == actual.size() ? 0.0f : INFINITY;
+        for (size_t i = 0; i < std::min(streamed.size(), actual.size()); i++) {
+            stream_diff = std::max(stream_diff, std::fabs(streamed[i] - actual[i]));
+        }
+        printf("BENCH,istft_stream,%d,%d,0,%g\n", n_codes, n_threads, stream_diff);
+        if (!(stream_diff <= 1e-6f * std::max(1.0f, max_ref))) {
+            fprintf(stderr, "stream mismatch at n_codes=%d: %zu vs %zu samples, max abs diff %g\n", n_codes, streamed.size(), actual.size(), stream_diff);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -6,7 +6,8 @@
 //   BENCH,<model>,<phase>,<prompt_tokens>,<reused>,<ttft_ms>,<gen_tps>,<rss_mb>,<hwm_mb>
 //
 // Env: MODELS_DIR, RNLLAMA_NGL, BENCH_TURNS (default 8), BENCH_GEN (default 32),
-//      BENCH_BUDGET_MB (branch builds only; <0 = default, 0 = cache off).
+//      BENCH_BUDGET_MB (branch builds only; <0 = default, 0 = cache off),
+//      BENCH_COMPACT (branch builds only; 1 = delta-encoded snapshots).
 
 #include <chrono>
 #include <cstdio>
@@ -71,6 +72,7 @@ struct Bench {
 #ifdef KV_BENCH_HAS_STATE_CACHE
         const int budget = env_i("BENCH_BUDGET_MB", -1);
         if (budget >= 0) ctx.state_cache_budget_bytes = (size_t) budget * 1024 * 1024;
+        ctx.state_cache_compact = env_i("BENCH_COMPACT", 0) != 0;
 #endif
         if (!ctx.loadModel(params)) return false;
         if (ctx.completion == nullptr) ctx.completion = new llama_rn_context_completion(&ctx);
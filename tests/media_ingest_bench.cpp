@@ -0,0 +1,205 @@
+// Benchmark for data URI media ingestion: the previous base64 decoder and
+// bitmap hash against the current ones in rn-mtmd.hpp, on a payload the size
+// of a 12-megapixel RGB photo. Decoded bytes must match the reference, and
+// media_hash must match the xxHash64 test vectors.
+//
+//   BENCH,<step>,<impl>,<bytes>,<ms>,<MB/s>
+//
+// Env: BENCH_MPIX (default 12), BENCH_ROUNDS (default 5).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "rn-mtmd.hpp"
+
+using namespace rnllama;
+
+namespace {
+
+int env_i(const char *k, int d) {
+    const char *v = std::getenv(k);
+    return v ? std::atoi(v) : d;
+}
+
+// Reference: the helpers rn-mtmd.hpp used before (byte-wise FNV-1a, and a
+// base64 decoder that looks up each character in the alphabet string)
+std::string ref_fnv_hash(const uint8_t * data, size_t len) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= fnv_prime;
+    }
+    return std::to_string(hash);
+}
+
+// Base64 encoding/decoding utilities
+const std::string ref_base64_chars =
+             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+             "abcdefghijklmnopqrstuvwxyz"
+             "0123456789+/";
+
+bool ref_is_base64(uint8_t c) {
+    return (isalnum(c) || (c == '+') || (c == '/'));
+}
+
+raw_buffer ref_base64_decode(const std::string & encoded_string) {
+    int i = 0;
+    int j = 0;
+    int in_ = 0;
+
+    int in_len = encoded_string.size();
+
+    uint8_t char_array_4[4];
+    uint8_t char_array_3[3];
+
+    raw_buffer ret;
+
+    while (in_len-- && (encoded_string[in_] != '=') && ref_is_base64(encoded_string[in_])) {
+        char_array_4[i++] = encoded_string[in_]; in_++;
+        if (i == 4) {
+            for (i = 0; i < 4; i++) {
+                char_array_4[i] = ref_base64_chars.find(char_array_4[i]);
+            }
+
+            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
+            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+
+            for (i = 0; (i < 3); i++) {
+                ret.push_back(char_array_3[i]);
+            }
+
+            i = 0;
+        }
+    }
+
+    if (i) {
+        for (j = i; j < 4; j++) {
+            char_array_4[j] = 0;
+        }
+
+        for (j = 0; j < 4; j++) {
+            char_array_4[j] = ref_base64_chars.find(char_array_4[j]);
+        }
+
+        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
+        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+
+        for (j = 0; j < i - 1; j++) {
+            ret.push_back(char_array_3[j]);
+        }
+    }
+
+    return ret;
+}
+
+std::string base64_encode(const std::vector<uint8_t> &data) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        const uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+        out += chars[v >> 18];
+        out += chars[(v >> 12) & 63];
+        out += chars[(v >> 6) & 63];
+        out += chars[v & 63];
+    }
+    if (i < data.size()) {
+        const uint32_t v = data[i] << 16 | (i + 1 < data.size() ? data[i + 1] << 8 : 0);
+        out += chars[v >> 18];
+        out += chars[(v >> 12) & 63];
+        out += i + 1 < data.size() ? chars[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+template <typename F>
+double time_ms(int rounds, F &&fn) {
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        const auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+    }
+    return best;
+}
+
+void report(const char *step, const char *impl, size_t bytes, double ms) {
+    printf("BENCH,%s,%s,%zu,%.3f,%.0f\n", step, impl, bytes, ms, bytes / (1024.0 * 1024.0) / (ms / 1000.0));
+}
+
+} // namespace
+
+int main() {
+    const int mpix = std::max(1, env_i("BENCH_MPIX", 12));
+    const int rounds = std::max(1, env_i("BENCH_ROUNDS", 5));
+    int failed = 0;
+
+    // xxHash64 test vectors (seed 0)
+    const struct { const char *in; uint64_t h; } vectors[] = {
+        {"", 0xef46db3751d8e999ULL},
+        {"a", 0xd24ec4f1a98c6e5bULL},
+        {"abc", 0x44bc2cf5ad770999ULL},
+    };
+    for (const auto &v : vectors) {
+        char expected[24];
+        snprintf(expected, sizeof(expected), "x64:%016llx", (unsigned long long) v.h);
+        const std::string got = media_hash(reinterpret_cast<const uint8_t *>(v.in), strlen(v.in));
+        if (got != expected) {
+            fprintf(stderr, "media_hash(\"%s\") = %s, expected %s\n", v.in, got.c_str(), expected);
+            failed++;
+        }
+    }
+
+    // Edge cases: padding, partial groups, stray characters
+    for (const std::string s : {"", "QQ", "QUI", "QUJD", "QUJDRA==", "QUJDREU=", "QUJDREVG", "QUJDREVGRw",
+                                "QUJD\nREVG", "QUJDREVGR0hJSktM!TU5P", "QUJDREVGR0hJSktMTU5P", "Q"}) {
+        if (base64_decode(s) != ref_base64_decode(s)) {
+            fprintf(stderr, "base64 mismatch on \"%s\"\n", s.c_str());
+            failed++;
+        }
+    }
+
+    std::mt19937 rng(42);
+    std::vector<uint8_t> pixels((size_t) mpix * 1000 * 1000 * 3);
+    for (auto &b : pixels) {
+        b = (uint8_t) rng();
+    }
+    const std::string uri = "data:image/jpeg;base64," + base64_encode(pixels);
+    const size_t comma_pos = uri.find(',');
+
+    raw_buffer ref_out;
+    raw_buffer out;
+    const double ref_ms = time_ms(rounds, [&]() { ref_out = ref_base64_decode(uri.substr(comma_pos + 1)); });
+    const double new_ms = time_ms(rounds, [&]() { out = base64_decode(std::string_view(uri).substr(comma_pos + 1)); });
+    report("base64", "reference", uri.size(), ref_ms);
+    report("base64", "table", uri.size(), new_ms);
+    if (out != ref_out || out != pixels) {
+        fprintf(stderr, "base64 mismatch on the payload (%zu vs %zu bytes)\n", out.size(), ref_out.size());
+        failed++;
+    }
+
+    std::string ref_id;
+    std::string id;
+    const double ref_hash_ms = time_ms(rounds, [&]() { ref_id = ref_fnv_hash(pixels.data(), pixels.size()); });
+    const double new_hash_ms = time_ms(rounds, [&]() { id = media_hash(pixels.data(), pixels.size()); });
+    report("hash", "fnv1a", pixels.size(), ref_hash_ms);
+    report("hash", "media_hash", pixels.size(), new_hash_ms);
+    if (id == media_hash(pixels.data(), pixels.size() - 1) || ref_id.empty()) {
+        fprintf(stderr, "media_hash ignores the last byte\n");
+        failed++;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -2,17 +2,24 @@
 #include <fstream>
 #include <iomanip>
 #include <cassert>
+#include <cmath>
 #include <filesystem>
 #include <vector>
 #include <string>
 #include <thread>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
 
 // Include rnllama headers
 #include "rn-llama.h"
 #include "rn-completion.h"
 #include "rn-slot.h"
 #include "rn-slot-manager.h"
+#include "rn-rerank.h"
+#include "rn-common.hpp"
 #include "common.h"
 
 using namespace rnllama;
@@ -1096,6 +1103,1359 @@ bool test_state_reuse() {
     }
 }
 
+// Test 22b: Follow-up request on the same slot reuses the cached KV prefix
+bool test_slot_kv_prefix_reuse() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+        params.n_predict = 2;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(1, 128);
+
+        const std::string base = "The quick brown fox jumps over the lazy dog.";
+        const std::vector<std::string> prompts = {base, base + " It was a sunny day."};
+        std::vector<int32_t> cache_n;
+
+        for (const auto& prompt_str : prompts) {
+            std::vector<llama_token> prompt = common_tokenize(ctx.ctx, prompt_str, false);
+            bool complete = false;
+            int32_t n_cached = -1;
+
+            int32_t req_id = ctx.slot_manager->queue_request(
+                params, prompt, std::vector<std::string>(), prompt_str, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [&](const completion_token_output& token) {},
+                [&](llama_rn_slot* slot) {
+                    n_cached = slot->n_prompt_tokens_cache;
+                    complete = true;
+                }
+            );
+            if (req_id < 0) return false;
+
+            int iterations = 0;
+            while (!complete && iterations < 100) {
+                ctx.slot_manager->update_slots();
+                iterations++;
+            }
+            if (!complete) return false;
+            cache_n.push_back(n_cached);
+        }
+
+        const size_t base_len = common_tokenize(ctx.ctx, base, false).size();
+        std::cout << "[cache_n: " << cache_n[0] << " -> " << cache_n[1] << "] ";
+        return cache_n[0] == 0 && cache_n[1] > 0 && (size_t)cache_n[1] <= base_len;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22c: Radix prefix index longest-match lookup and removal
+bool test_prefix_index() {
+    try {
+        llama_rn_prefix_index index;
+        index.update(0, {1, 2, 3, 4, 5, 6, 7, 8});
+        index.update(1, {1, 2, 3, 4, 5, 20, 21});
+
+        auto m = index.find_longest({1, 2, 3, 4, 5, 20, 21, 22});
+        if (m.seq_id != 1 || m.n_tokens != 7) return false;
+
+        m = index.find_longest({1, 2, 3, 9});
+        if (m.seq_id < 0 || m.n_tokens != 3) return false;
+
+        // Filtered lookup only considers accepted sequences
+        m = index.find_longest({1, 2, 3, 4, 5, 20}, [](llama_seq_id s) { return s == 0; });
+        if (m.seq_id != 0 || m.n_tokens != 5) return false;
+
+        // Removing the fork merges the remaining path back into one edge
+        index.remove(1);
+        if (index.n_nodes() != 1) return false;
+        m = index.find_longest({1, 2, 3, 4, 5, 20});
+        if (m.seq_id != 0 || m.n_tokens != 5) return false;
+
+        index.update(0, {});
+        return index.n_nodes() == 0 && index.find_longest({1, 2}).seq_id == -1;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Test 22d: A busy slot's prompt prefix is copied into another slot
+bool test_cross_slot_prefix_copy() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 256;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+        params.n_predict = 16;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 256);
+
+        const std::string system =
+            "You are a helpful assistant. Answer concisely and accurately, "
+            "cite sources when you can, and never make up facts you do not know.";
+        const std::string prompt1_str = system + " Question: what is a cat?";
+        const std::string prompt2_str = system + " Question: what is a dog?";
+        std::vector<llama_token> prompt1 = common_tokenize(ctx.ctx, prompt1_str, false);
+        std::vector<llama_token> prompt2 = common_tokenize(ctx.ctx, prompt2_str, false);
+
+        bool complete1 = false, complete2 = false;
+        int32_t slot1 = -1, slot2 = -1;
+        int32_t cache_n2 = -1;
+
+        ctx.slot_manager->queue_request(
+            params, prompt1, std::vector<std::string>(), prompt1_str, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) { slot1 = slot->id; complete1 = true; }
+        );
+
+        // Prefill the first request so its prefix is in KV while it generates
+        ctx.slot_manager->update_slots();
+
+        ctx.slot_manager->queue_request(
+            params, prompt2, std::vector<std::string>(), prompt2_str, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) {
+                slot2 = slot->id;
+                cache_n2 = slot->n_prompt_tokens_cache;
+                complete2 = true;
+            }
+        );
+
+        int iterations = 0;
+        while ((!complete1 || !complete2) && iterations < 200) {
+            ctx.slot_manager->update_slots();
+            iterations++;
+        }
+        if (!complete1 || !complete2) return false;
+
+        const size_t n_shared = common_tokenize(ctx.ctx, system, false).size();
+        std::cout << "[slots " << slot1 << "/" << slot2 << ", cache_n=" << cache_n2
+                  << ", shared=" << n_shared << "] ";
+        return slot1 != slot2 && cache_n2 >= 16 && (size_t)cache_n2 <= prompt2.size() - 1;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22d2: A prompt sharing only a few tokens with a slot's history takes
+// the least recently used slot; a long shared prefix goes to its holder
+bool test_slot_choice_short_prefix() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 256;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+        params.n_predict = 2;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 256);
+
+        const std::string story =
+            "Once upon a time there was a princess who lived in a tall castle by the sea, "
+            "far away from the noisy towns of the kingdom.";
+        const std::vector<std::string> prompts = {
+            "The quick brown fox jumps over the lazy dog.",
+            story,
+            "Once upon a hill stood a tree.",
+            story + " She had a cat.",
+        };
+        std::vector<int32_t> slot_ids;
+
+        for (const auto& prompt_str : prompts) {
+            std::vector<llama_token> prompt = common_tokenize(ctx.ctx, prompt_str, false);
+            bool complete = false;
+            int32_t slot_id = -1;
+
+            int32_t req_id = ctx.slot_manager->queue_request(
+                params, prompt, std::vector<std::string>(), prompt_str, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [&](const completion_token_output& token) {},
+                [&](llama_rn_slot* slot) {
+                    slot_id = slot->id;
+                    complete = true;
+                }
+            );
+            if (req_id < 0) return false;
+
+            int iterations = 0;
+            while (!complete && iterations < 100) {
+                ctx.slot_manager->update_slots();
+                iterations++;
+            }
+            if (!complete) return false;
+            slot_ids.push_back(slot_id);
+        }
+
+        std::cout << "[slots " << slot_ids[0] << "," << slot_ids[1] << "," << slot_ids[2] << "," << slot_ids[3] << "] ";
+        // The short "Once upon a" match must not take the story's slot
+        return slot_ids[0] != slot_ids[1] && slot_ids[2] == slot_ids[0] && slot_ids[3] == slot_ids[1];
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22d3: A slot whose cached tokens are dropped leaves the prefix index
+bool test_prefix_index_evict() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 256;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+        params.n_predict = 2;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 256);
+
+        const std::string prompt_str =
+            "Once upon a time there was a princess who lived in a tall castle by the sea.";
+        std::vector<llama_token> prompt = common_tokenize(ctx.ctx, prompt_str, false);
+        bool complete = false;
+        int32_t slot_id = -1;
+
+        int32_t req_id = ctx.slot_manager->queue_request(
+            params, prompt, std::vector<std::string>(), prompt_str, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) {
+                slot_id = slot->id;
+                complete = true;
+            }
+        );
+        if (req_id < 0) return false;
+
+        int iterations = 0;
+        while (!complete && iterations < 100) {
+            ctx.slot_manager->update_slots();
+            iterations++;
+        }
+        if (!complete) return false;
+
+        std::lock_guard<std::mutex> lock(ctx.slot_manager->slots_mutex);
+        if (ctx.slot_manager->prefix_index.find_longest(prompt).seq_id != slot_id) {
+            std::cout << "[Finished slot not indexed] ";
+            return false;
+        }
+        if (!ctx.slot_manager->evict_idle_sequence()) {
+            std::cout << "[Nothing evicted] ";
+            return false;
+        }
+        return ctx.slot_manager->prefix_index.find_longest(prompt).seq_id == -1;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22e: Higher-priority request preempts a running one, which resumes afterwards
+bool test_priority_preemption() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(1, 128); // Single slot: the high-priority request must preempt
+
+        common_params low_params = params;
+        low_params.n_predict = 20;
+        low_params.sampling.ignore_eos = true;
+        common_params high_params = params;
+        high_params.n_predict = 3;
+
+        std::vector<llama_token> prompt_low = common_tokenize(ctx.ctx, "Write a long story.", false);
+        std::vector<llama_token> prompt_high = common_tokenize(ctx.ctx, "Quick question.", false);
+
+        std::vector<int32_t> completion_order;
+        int tokens_low = 0;
+        bool saw_preempted = false;
+
+        int32_t req_low = ctx.slot_manager->queue_request(
+            low_params, prompt_low, std::vector<std::string>(), "Write a long story.", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) {
+                tokens_low = slot->n_decoded;
+                completion_order.push_back(slot->request_id);
+            },
+            0
+        );
+
+        for (int i = 0; i < 3; i++) {
+            ctx.slot_manager->update_slots();
+        }
+
+        int32_t req_high = ctx.slot_manager->queue_request(
+            high_params, prompt_high, std::vector<std::string>(), "Quick question.", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) { completion_order.push_back(slot->request_id); },
+            10
+        );
+
+        int iterations = 0;
+        while (completion_order.size() < 2 && iterations < 200) {
+            ctx.slot_manager->update_slots();
+            for (const auto& req : ctx.slot_manager->get_status().requests) {
+                if (req.request_id == req_low && req.state == "preempted") {
+                    saw_preempted = true;
+                }
+            }
+            iterations++;
+        }
+
+        std::cout << "[low tokens=" << tokens_low << ", preempted=" << saw_preempted << "] ";
+        return completion_order.size() == 2 &&
+               completion_order[0] == req_high &&
+               completion_order[1] == req_low &&
+               saw_preempted &&
+               tokens_low == low_params.n_predict;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22f: A long prompt is prefilled in budgeted chunks while another slot keeps generating
+bool test_chunked_prefill_budget() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+        const int32_t n_budget = 16;
+        ctx.slot_manager->set_prefill_budget(n_budget, 0.0f); // Fixed budget
+
+        common_params gen_params = params;
+        gen_params.n_predict = 40;
+        gen_params.sampling.ignore_eos = true;
+        common_params long_params = params;
+        long_params.n_predict = 2;
+
+        std::string long_text;
+        for (int i = 0; i < 4; i++) {
+            long_text += "The quick brown fox jumps over the lazy dog. ";
+        }
+        std::vector<llama_token> prompt_gen = common_tokenize(ctx.ctx, "Tell me a story.", false);
+        std::vector<llama_token> prompt_long = common_tokenize(ctx.ctx, long_text, false);
+
+        int completed = 0;
+
+        int32_t req_gen = ctx.slot_manager->queue_request(
+            gen_params, prompt_gen, std::vector<std::string>(), "Tell me a story.", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) { completed++; }
+        );
+        ctx.slot_manager->update_slots();
+        ctx.slot_manager->update_slots();
+
+        int32_t req_long = ctx.slot_manager->queue_request(
+            long_params, prompt_long, std::vector<std::string>(), long_text, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {},
+            [&](llama_rn_slot* slot) { completed++; }
+        );
+
+        int prefill_steps = 0;
+        bool budget_respected = true;
+        bool gen_stalled = false;
+        int iterations = 0;
+        while (completed < 2 && iterations < 200) {
+            auto* long_slot = ctx.slot_manager->get_slot_by_request_id(req_long);
+            auto* gen_slot = ctx.slot_manager->get_slot_by_request_id(req_gen);
+            const bool prefilling = long_slot && long_slot->state == SLOT_STATE_PROCESSING_PROMPT;
+            const int32_t decoded_before = gen_slot ? gen_slot->n_decoded : 0;
+
+            ctx.slot_manager->update_slots();
+            iterations++;
+
+            if (!prefilling || !gen_slot || ctx.slot_manager->n_step_gen_tokens == 0) {
+                continue;
+            }
+            prefill_steps++;
+            if (ctx.slot_manager->n_step_prompt_tokens > n_budget) {
+                budget_respected = false;
+            }
+            if (gen_slot->request_id == req_gen && gen_slot->n_decoded == decoded_before) {
+                gen_stalled = true;
+            }
+        }
+
+        std::cout << "[prompt=" << prompt_long.size() << ", prefill steps=" << prefill_steps << "] ";
+        return completed == 2 &&
+               budget_respected &&
+               !gen_stalled &&
+               prefill_steps >= (int)(prompt_long.size() / n_budget);
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22g: N-gram drafts verified in the shared batch leave greedy output unchanged
+bool test_ngram_speculative_decoding() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+
+        common_params base_params = params;
+        base_params.n_predict = 48;
+        base_params.sampling.temp = 0.0f;
+        base_params.sampling.ignore_eos = true;
+
+        common_params spec_params = base_params;
+        spec_params.speculative.types = { COMMON_SPECULATIVE_TYPE_NGRAM_SIMPLE };
+        spec_params.speculative.ngram_simple.size_n = 1; // Drafts even on non-repetitive output
+        spec_params.speculative.ngram_simple.size_m = 4;
+
+        const std::string prompt = "the dog and the fox and the dog and the fox and the";
+        std::vector<llama_token> prompt_tokens = common_tokenize(ctx.ctx, prompt, false);
+
+        auto run = [&](const common_params& run_params, slot_timings& timings) {
+            std::vector<llama_token> out;
+            bool done = false;
+            ctx.slot_manager->queue_request(
+                run_params, prompt_tokens, std::vector<std::string>(), prompt, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [&](const completion_token_output& token) {},
+                [&](llama_rn_slot* slot) {
+                    out = slot->generated_tokens;
+                    timings = slot->get_timings();
+                    done = true;
+                }
+            );
+            int iterations = 0;
+            while (!done && iterations < 200) {
+                ctx.slot_manager->update_slots();
+                iterations++;
+            }
+            return out;
+        };
+
+        slot_timings base_timings, spec_timings;
+        std::vector<llama_token> base_out = run(base_params, base_timings);
+        std::vector<llama_token> spec_out = run(spec_params, spec_timings);
+
+        std::cout << "[drafted=" << spec_timings.draft_n << ", accepted=" << spec_timings.draft_n_accepted << "] ";
+        return base_out.size() == (size_t)base_params.n_predict &&
+               spec_out == base_out &&
+               base_timings.draft_n == 0 &&
+               spec_timings.draft_n > 0 &&
+               spec_timings.draft_n_accepted <= spec_timings.draft_n;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22h: Decode failure recovery defers prompt tokens and fails single requests
+bool test_decode_failure_recovery() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+        auto* mgr = ctx.slot_manager;
+        auto* kv = llama_get_memory(ctx.ctx);
+
+        common_params gen_params = params;
+        gen_params.n_predict = 20;
+        gen_params.sampling.ignore_eos = true;
+
+        std::string long_text;
+        for (int i = 0; i < 4; i++) {
+            long_text += "The quick brown fox jumps over the lazy dog. ";
+        }
+        std::vector<llama_token> prompt_gen = common_tokenize(ctx.ctx, "Tell me a story.", false);
+        std::vector<llama_token> prompt_long = common_tokenize(ctx.ctx, long_text, false);
+
+        struct outcome {
+            bool incomplete = false;
+            std::string error_message;
+            int32_t n_decoded = 0;
+        };
+        std::map<int32_t, outcome> finished;
+        auto queue = [&](const std::vector<llama_token>& prompt, const std::string& text) {
+            return mgr->queue_request(
+                gen_params, prompt, std::vector<std::string>(), text, 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [&](const completion_token_output& token) {},
+                [&](llama_rn_slot* slot) {
+                    auto& done = finished[slot->request_id];
+                    done.incomplete = slot->incomplete;
+                    done.error_message = slot->error_message;
+                    done.n_decoded = slot->n_decoded;
+                }
+            );
+        };
+        // One update_slots step with a hook between building and decoding
+        auto step = [&](const std::function<void()>& before_decode) {
+            mgr->process_pending_queue();
+            mgr->build_batch();
+            before_decode();
+            if (!mgr->process_batch()) {
+                return false;
+            }
+            mgr->process_mtp_batch();
+            mgr->sample_and_callback();
+            mgr->release_completed_slots();
+            return true;
+        };
+        auto run_until = [&](size_t n_finished) {
+            for (int i = 0; i < 200 && finished.size() < n_finished; i++) {
+                mgr->update_slots();
+            }
+        };
+
+        // Split: half of a long prompt is deferred, the generating slot keeps going
+        int32_t req_gen = queue(prompt_gen, "Tell me a story.");
+        mgr->update_slots();
+        mgr->update_slots();
+        int32_t req_long = queue(prompt_long, long_text);
+
+        bool deferred_ok = false;
+        step([&]() {
+            auto* long_slot = mgr->get_slot_by_request_id(req_long);
+            const int32_t n_prompt_step = mgr->n_step_prompt_tokens;
+            const llama_pos n_past_start = long_slot->n_past - n_prompt_step;
+            mgr->defer_prompt_tokens(mgr->n_step_gen_tokens + n_prompt_step / 2);
+            deferred_ok = long_slot->n_past == n_past_start + n_prompt_step / 2 &&
+                          long_slot->state == SLOT_STATE_PROCESSING_PROMPT &&
+                          mgr->batch.n_tokens == mgr->n_step_gen_tokens + n_prompt_step / 2;
+        });
+        run_until(2);
+
+        const bool split_ok = deferred_ok &&
+            finished.count(req_gen) && !finished[req_gen].incomplete && finished[req_gen].n_decoded == 20 &&
+            finished.count(req_long) && !finished[req_long].incomplete && finished[req_long].n_decoded == 20;
+
+        // Drop: one request fails with its own error, the other is unaffected
+        int32_t req_a = queue(prompt_gen, "Tell me a story.");
+        int32_t req_b = queue(prompt_long, long_text);
+        for (int i = 0; i < 20; i++) {
+            auto* slot_b = mgr->get_slot_by_request_id(req_b);
+            if (slot_b && !slot_b->generated_tokens.empty()) {
+                break;
+            }
+            mgr->update_slots();
+        }
+
+        bool remap_ok = false;
+        step([&]() {
+            auto* slot_a = mgr->get_slot_by_request_id(req_a);
+            auto* slot_b = mgr->get_slot_by_request_id(req_b);
+            mgr->drop_slot_from_batch(*slot_b);
+            mgr->fail_slot(*slot_b, "KV cache is full: not enough context left for this request");
+            remap_ok = mgr->batch.n_tokens == 1 &&
+                       slot_a->i_batch == 0 &&
+                       mgr->batch.seq_id[0][0] == slot_a->id;
+        });
+        run_until(4);
+
+        const bool drop_ok = remap_ok &&
+            finished.count(req_b) && finished[req_b].incomplete &&
+            finished[req_b].error_message.find("KV cache is full") != std::string::npos &&
+            finished.count(req_a) && !finished[req_a].incomplete && finished[req_a].n_decoded == 20;
+
+        // Evict: idle slots give up their cached prefix
+        int evicted = 0;
+        while (mgr->evict_idle_sequence()) {
+            evicted++;
+        }
+        bool evict_ok = evicted > 0;
+        for (const auto& slot : mgr->slots) {
+            evict_ok = evict_ok && slot.cache_tokens.empty() && llama_memory_seq_pos_max(kv, slot.id) < 0;
+        }
+
+        // Regrow: a reduced batch size recovers after a run of clean decodes
+        mgr->n_batch = 32;
+        int32_t req_c = queue(prompt_gen, "Tell me a story.");
+        run_until(5);
+        const bool regrow_ok = mgr->n_batch > 32 && finished.count(req_c) && !finished[req_c].incomplete;
+
+        std::cout << "[split=" << split_ok << ", drop=" << drop_ok
+                  << ", evicted=" << evicted << ", n_batch=" << mgr->n_batch << "] ";
+        return split_ok && drop_ok && evict_ok && regrow_ok;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22i: Callbacks are delivered off the decode loop, in order, with backpressure
+bool test_deferred_callback_delivery() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+        auto* mgr = ctx.slot_manager;
+
+        common_params slow_params = params;
+        slow_params.n_predict = 300;
+        slow_params.sampling.ignore_eos = true;
+        // ignore_eos only takes effect at load time; ban EOS for this request
+        slow_params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+
+        std::vector<llama_token> prompt = common_tokenize(ctx.ctx, "Tell me a story.", false);
+        const std::thread::id caller = std::this_thread::get_id();
+
+        std::atomic<bool> done{false};
+        std::atomic<bool> off_thread{true};
+        std::atomic<bool> token_after_complete{false};
+        std::string streamed;
+        std::string final_text;
+        int32_t n_decoded = 0;
+
+        mgr->start_processing_loop();
+        int32_t req = mgr->queue_request(
+            slow_params, prompt, std::vector<std::string>(), "Tell me a story.", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+            [&](const completion_token_output& token) {
+                // Slow consumer: slower than the decode loop produces
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                off_thread = off_thread && std::this_thread::get_id() != caller;
+                token_after_complete = token_after_complete || done;
+                streamed += token.text;
+            },
+            [&](llama_rn_slot* slot) {
+                off_thread = off_thread && std::this_thread::get_id() != caller;
+                final_text = slot->generated_text;
+                n_decoded = slot->n_decoded;
+                done = true;
+            }
+        );
+
+        // The consumer falls behind; its slot must be held back while the
+        // manager stays responsive
+        bool stalled = false;
+        double max_status_ms = 0.0;
+        for (int i = 0; i < 20000 && !done; i++) {
+            const auto t0 = std::chrono::steady_clock::now();
+            mgr->get_status();
+            {
+                std::lock_guard<std::mutex> lock(mgr->slots_mutex);
+                for (const auto& slot : mgr->slots) {
+                    stalled = stalled || (slot.request_id == req && slot.delivery_stalled);
+                }
+            }
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            max_status_ms = std::max(max_status_ms, ms);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        mgr->stop_processing_loop();
+
+        std::cout << "[decoded=" << n_decoded << ", stalled=" << stalled
+                  << ", max status ms=" << max_status_ms << "] ";
+        return done && off_thread && !token_after_complete && stalled &&
+               n_decoded == 300 &&
+               final_text.compare(0, streamed.size(), streamed) == 0 &&
+               max_status_ms < 100.0;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22j: Pipelined decoding (next batch submitted before returning) leaves greedy output unchanged
+bool test_pipelined_decode() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+        auto* mgr = ctx.slot_manager;
+
+        common_params gen_params = params;
+        gen_params.n_predict = 24;
+        gen_params.sampling.temp = 0.0f;
+        gen_params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+
+        const std::vector<std::string> prompts = {"Tell me a story.", "The quick brown fox"};
+
+        // Both requests run concurrently; returns their tokens in queue order
+        auto run = [&](bool pipelined, bool loop) {
+            mgr->pipeline_decode = pipelined;
+            std::vector<std::vector<llama_token>> out(prompts.size());
+            std::atomic<int> n_done{0};
+            if (loop) {
+                mgr->start_processing_loop();
+            }
+            for (size_t i = 0; i < prompts.size(); i++) {
+                mgr->queue_request(
+                    gen_params, common_tokenize(ctx.ctx, prompts[i], false), std::vector<std::string>(), prompts[i],
+                    0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                    [](const completion_token_output&) {},
+                    [&, i](llama_rn_slot* slot) {
+                        out[i] = slot->generated_tokens;
+                        n_done++;
+                    }
+                );
+            }
+            for (int i = 0; i < 2000 && n_done < (int)prompts.size(); i++) {
+                if (loop) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                } else {
+                    mgr->update_slots();
+                }
+            }
+            if (loop) {
+                mgr->stop_processing_loop();
+            }
+            return out;
+        };
+
+        auto serial_out = run(false, false);
+        const int64_t n_steps_serial = mgr->loop_stats.n_steps;
+        auto pipelined_out = run(true, false);
+        const bool drained = !mgr->step_pending;
+        auto loop_out = run(true, true);
+
+        bool sizes_ok = true;
+        for (const auto& tokens : serial_out) {
+            sizes_ok = sizes_ok && tokens.size() == (size_t)gen_params.n_predict;
+        }
+
+        std::cout << "[steps=" << mgr->loop_stats.n_steps << ", serial steps=" << n_steps_serial
+                  << ", waits=" << mgr->loop_stats.n_waits << "] ";
+        return sizes_ok && drained &&
+               pipelined_out == serial_out &&
+               loop_out == serial_out &&
+               n_steps_serial > 0 && mgr->loop_stats.n_steps > n_steps_serial &&
+               mgr->loop_stats.n_tokens >= mgr->loop_stats.n_steps;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22k: Batched rerank matches scoring each document on its own
+bool test_batched_rerank() {
+    try {
+        const std::string query = "Which animal is known for being quick and brown?";
+        const std::vector<std::string> documents = {
+            "The quick brown fox jumps over the lazy dog.",
+            "Paris is the capital of France.",
+            "A fox is a small omnivorous mammal with a bushy tail, found on every continent except Antarctica.",
+            "Bananas are yellow.",
+            "Brown bears hibernate through the winter months in dens.",
+        };
+
+        auto load = [](llama_rn_context& ctx, enum llama_pooling_type pooling) {
+            common_params params;
+            params.model.path = "../tiny-random-llama.gguf";
+            params.n_ctx = 2048;
+            params.n_batch = 256;
+            params.n_ubatch = 256;
+            params.n_parallel = 4;
+            params.embedding = true;
+            params.pooling_type = pooling;
+            params.cpuparams.n_threads = 1;
+            params.n_gpu_layers = 0;
+            params.no_kv_offload = true;
+            return ctx.loadModel(params);
+        };
+
+        auto make_pairs = [&](llama_rn_context& ctx) {
+            const llama_vocab* vocab = llama_model_get_vocab(ctx.model);
+            const auto query_tokens = common_tokenize(vocab, query, false, true);
+            std::vector<std::vector<llama_token>> pairs;
+            for (const auto& doc : documents) {
+                pairs.push_back(format_rerank_tokens(vocab, query_tokens, common_tokenize(vocab, doc, false, true)));
+            }
+            return pairs;
+        };
+
+        // One document at a time in a cleared context, as rerank used to work
+        auto reference = [](llama_rn_context& ctx, const std::vector<std::vector<llama_token>>& pairs) {
+            std::vector<float> scores;
+            for (const auto& pair : pairs) {
+                llama_memory_clear(llama_get_memory(ctx.ctx), true);
+                llama_batch batch = llama_batch_init(pair.size(), 0, 1);
+                for (size_t i = 0; i < pair.size(); i++) {
+                    llama_batch_add(&batch, pair[i], (llama_pos) i, {0}, true);
+                }
+                const float* data = llama_decode(ctx.ctx, batch) == 0 ? llama_get_embeddings_seq(ctx.ctx, 0) : nullptr;
+                scores.push_back(data ? data[0] : NAN);
+                llama_batch_free(batch);
+            }
+            llama_memory_clear(llama_get_memory(ctx.ctx), true);
+            return scores;
+        };
+
+        auto close = [](const std::vector<float>& a, const std::vector<float>& b) {
+            if (a.size() != b.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < a.size(); i++) {
+                // Batch composition changes the accumulation order in the kernels
+                if (!(std::fabs(a[i] - b[i]) <= 1e-2f * std::max(1.0f, std::fabs(b[i])))) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        // Slot manager rerank on a rank-pooled context borrows idle slots as
+        // lanes. The test model has no classifier head, so its rank output is
+        // only meaningful for one sequence per ubatch: check the plumbing here
+        // and the scores on a last-token-pooled context below.
+        llama_rn_context rank_ctx;
+        if (!load(rank_ctx, LLAMA_POOLING_TYPE_RANK)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+        rank_ctx.enableParallelMode(4, 256);
+        auto* mgr = rank_ctx.slot_manager;
+        std::vector<float> slot_scores;
+        bool done = false;
+        mgr->queue_rerank_request(query, documents, -1, [&](int32_t, const std::vector<float>& scores) {
+            slot_scores = scores;
+            done = true;
+        });
+        int n_steps = 0;
+        for (; n_steps < 200 && !done; n_steps++) {
+            mgr->update_slots();
+        }
+        bool scored = slot_scores.size() == documents.size();
+        for (float score : slot_scores) {
+            scored = scored && std::isfinite(score) && score > -1e6f;
+        }
+        bool lanes_returned = true;
+        for (const auto& slot : mgr->slots) {
+            lanes_returned = lanes_returned && slot.lent_to < 0 && slot.rerank_batch == nullptr;
+        }
+
+        // Last-token pooling shares the query prefix; chunked and single-lane runs agree
+        llama_rn_context last_ctx;
+        if (!load(last_ctx, LLAMA_POOLING_TYPE_LAST)) {
+            return false;
+        }
+        const auto last_ref = reference(last_ctx, make_pairs(last_ctx));
+
+        llama_rn_rerank_batch lanes_engine(last_ctx.ctx, {1, 2, 3}, make_pairs(last_ctx));
+        const auto lanes_scores = lanes_engine.run(256);
+        llama_rn_rerank_batch chunked_engine(last_ctx.ctx, {1, 2, 3}, make_pairs(last_ctx));
+        const auto chunked_scores = chunked_engine.run(16);
+        llama_rn_rerank_batch single_engine(last_ctx.ctx, {0}, make_pairs(last_ctx));
+        const auto single_scores = single_engine.run(256);
+
+        std::cout << "[steps=" << n_steps << ", decodes=" << lanes_engine.n_decodes << "/" << chunked_engine.n_decodes << "/"
+                  << single_engine.n_decodes << ", prefix=" << lanes_engine.n_prefix << "] ";
+        return done && scored && lanes_returned && n_steps < (int) documents.size() &&
+               close(lanes_scores, last_ref) && close(chunked_scores, last_ref) && close(single_scores, last_ref) &&
+               lanes_engine.n_prefix > 0 && lanes_engine.n_scored == documents.size() &&
+               lanes_engine.n_decodes < (int32_t) documents.size() &&
+               llama_memory_seq_pos_max(llama_get_memory(last_ctx.ctx), 1) < 0;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22l: A slot stops on the first stop word to appear in its output
+bool test_slot_stop_words() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.n_parallel = 1;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(1, 128);
+        auto* mgr = ctx.slot_manager;
+
+        common_params gen_params = params;
+        gen_params.n_predict = 24;
+        gen_params.sampling.temp = 0.0f;
+        gen_params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+
+        const std::string prompt = "Tell me a story.";
+        auto run = [&](const std::vector<std::string>& stop_words, std::string& stopping_word) {
+            gen_params.antiprompt = stop_words;
+            std::string text;
+            bool done = false;
+            mgr->queue_request(
+                gen_params, common_tokenize(ctx.ctx, prompt, false), std::vector<std::string>(), prompt,
+                0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [](const completion_token_output&) {},
+                [&](llama_rn_slot* slot) {
+                    text = slot->generated_text;
+                    stopping_word = slot->stopped_word ? slot->stopping_word : "";
+                    done = true;
+                }
+            );
+            for (int i = 0; i < 200 && !done; i++) {
+                mgr->update_slots();
+            }
+            return text;
+        };
+
+        std::string none;
+        const std::string full = run({}, none);
+        if (full.size() < 8) {
+            std::cout << "[SKIP: Output too short] ";
+            return true;
+        }
+
+        // A word from the first half of the output, listed after one that never appears
+        const std::string word = full.substr(full.size() / 4, 3);
+        const size_t word_pos = full.find(word);
+        std::string stopping_word;
+        const std::string stopped = run({"\x01never", word}, stopping_word);
+
+        std::cout << "[stopped after " << stopped.size() << "/" << full.size() << " bytes] ";
+        return none.empty() && stopping_word == word &&
+               stopped.size() >= word_pos + word.size() && stopped.size() < full.size() &&
+               full.compare(0, stopped.size(), stopped) == 0;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22m: Batched embedding matches one-at-a-time embedding and keeps the completion's cache
+bool test_batched_embedding() {
+    try {
+        std::vector<std::string> texts;
+        for (int i = 0; i < 12; i++) {
+            texts.push_back("Chunk " + std::to_string(i) + " of a long document about " +
+                            (i % 2 ? "lighthouses and the sea." : "mountains and glaciers."));
+        }
+
+        bool ok = true;
+        for (auto pooling : {LLAMA_POOLING_TYPE_MEAN, LLAMA_POOLING_TYPE_LAST}) {
+            llama_rn_context ctx;
+
+            common_params params;
+            params.model.path = "../tiny-random-llama.gguf";
+            params.n_ctx = 2048;
+            params.n_batch = 256;
+            params.n_ubatch = 256;
+            params.n_parallel = 4;
+            params.embedding = true;
+            params.pooling_type = pooling;
+            params.cpuparams.n_threads = 1;
+            params.n_gpu_layers = 0;
+            params.no_kv_offload = true;
+
+            if (!ctx.loadModel(params)) {
+                std::cout << "[SKIP: Model not loaded] ";
+                return true;
+            }
+            auto* cmpl = ctx.completion;
+            const int n_embd = llama_model_n_embd(ctx.model);
+
+            // One text at a time in a cleared context
+            llama_memory_t mem = llama_get_memory(ctx.ctx);
+            std::vector<std::vector<float>> reference;
+            for (const auto& text : texts) {
+                const auto tokens = common_tokenize(ctx.ctx, text, true, true);
+                llama_memory_clear(mem, true);
+                llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+                for (size_t i = 0; i < tokens.size(); i++) {
+                    llama_batch_add(&batch, tokens[i], (llama_pos) i, {0}, true);
+                }
+                const float* data = llama_decode(ctx.ctx, batch) == 0 ? llama_get_embeddings_seq(ctx.ctx, 0) : nullptr;
+                reference.push_back(data ? std::vector<float>(data, data + n_embd) : std::vector<float>(n_embd, NAN));
+                llama_batch_free(batch);
+            }
+
+            // An embedding() call leaves its prompt in seq 0, as a chat turn would
+            common_params embd_params = ctx.params;
+            ctx.params.prompt = "Tell me about the ocean.";
+            ctx.params.n_predict = 0;
+            cmpl->embedding(embd_params);
+
+            const llama_pos seq0_before = llama_memory_seq_pos_max(mem, 0);
+            const size_t embd_before = cmpl->embd.size();
+
+            const auto raw = cmpl->embeddingBatch(texts, -1);
+            const auto normalized = cmpl->embeddingBatch(texts, 2);
+
+            bool match = raw.size() == texts.size() * n_embd && normalized.size() == raw.size();
+            for (size_t i = 0; match && i < texts.size(); i++) {
+                double norm = 0.0;
+                for (int j = 0; j < n_embd; j++) {
+                    const float a = raw[i * n_embd + j];
+                    const float b = reference[i][j];
+                    match = match && std::fabs(a - b) <= 1e-2f * std::max(1.0f, std::fabs(b));
+                    norm += (double) normalized[i * n_embd + j] * normalized[i * n_embd + j];
+                }
+                match = match && std::fabs(norm - 1.0) < 1e-3;
+            }
+
+            bool lanes_clear = true;
+            for (llama_seq_id seq_id = 1; seq_id < 4; seq_id++) {
+                lanes_clear = lanes_clear && llama_memory_seq_pos_max(mem, seq_id) < 0;
+            }
+            const bool cache_kept = seq0_before >= 0 && llama_memory_seq_pos_max(mem, 0) == seq0_before &&
+                                    cmpl->embd.size() == embd_before;
+
+            // An empty input is an error, not a zero vector
+            bool empty_rejected = false;
+            try {
+                cmpl->runPooledBatch({{}}, n_embd);
+            } catch (const std::runtime_error&) {
+                empty_rejected = true;
+            }
+
+            // With parallel slots the texts go to idle slots' sequences, after
+            // any step in flight, and seq 0 is left alone
+            ctx.enableParallelMode(2, 256);
+            const auto parallel = cmpl->embeddingBatch(texts, -1);
+            bool parallel_match = parallel.size() == raw.size() && llama_memory_seq_pos_max(mem, 0) == seq0_before;
+            for (size_t i = 0; parallel_match && i < raw.size(); i++) {
+                parallel_match = std::fabs(parallel[i] - raw[i]) <= 1e-2f * std::max(1.0f, std::fabs(raw[i]));
+            }
+
+            std::cout << "[" << (pooling == LLAMA_POOLING_TYPE_MEAN ? "mean" : "last") << ": match=" << match
+                      << " lanes_clear=" << lanes_clear << " cache_kept=" << cache_kept
+                      << " empty_rejected=" << empty_rejected << " parallel=" << parallel_match << "] ";
+            ok = ok && match && lanes_clear && cache_kept && empty_rejected && parallel_match;
+        }
+        return ok;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22n: Framed streaming delivers a request's tokens in frames, by count and by time
+bool test_framed_token_delivery() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 1024;
+        params.n_batch = 128;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 128);
+        auto* mgr = ctx.slot_manager;
+
+        common_params gen_params = params;
+        gen_params.n_predict = 30;
+        gen_params.sampling.n_probs = 3;
+        gen_params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+        std::vector<llama_token> prompt = common_tokenize(ctx.ctx, "Tell me a story.", false);
+
+        struct stream_result {
+            std::mutex mutex;
+            std::vector<size_t> frame_sizes;
+            std::string streamed;
+            size_t n_tokens = 0;
+            bool probs_ok = true;
+            bool per_token_calls = false;
+            bool frame_after_complete = false;
+            std::atomic<bool> done{false};
+            std::string final_text;
+        };
+        auto queue = [&](stream_result& r, int32_t interval_ms, int32_t max_tokens) {
+            return mgr->queue_request(
+                gen_params, prompt, std::vector<std::string>(), "Tell me a story.", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                [&](const completion_token_output&) { r.per_token_calls = true; },
+                [&](llama_rn_slot* slot) {
+                    std::lock_guard<std::mutex> lock(r.mutex);
+                    r.final_text = slot->generated_text;
+                    r.done = true;
+                },
+                0, 0,
+                [&](llama_rn_token_frame& frame) {
+                    std::lock_guard<std::mutex> lock(r.mutex);
+                    r.frame_after_complete = r.frame_after_complete || r.done;
+                    r.frame_sizes.push_back(frame.tokens.size());
+                    r.streamed += frame.text;
+                    r.n_tokens += frame.tokens.size();
+                    for (const auto& token : frame.tokens) {
+                        // top_p / min_p may leave fewer candidates
+                        r.probs_ok = r.probs_ok && !token.probs.empty() && token.probs.size() <= 3;
+                    }
+                },
+                interval_ms, max_tokens
+            );
+        };
+
+        mgr->start_processing_loop();
+        stream_result by_count, by_time;
+        queue(by_count, 0, 4);
+        queue(by_time, 50, 0);
+        for (int i = 0; i < 20000 && !(by_count.done && by_time.done); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        mgr->stop_processing_loop();
+
+        bool count_ok = by_count.done && by_count.n_tokens == 30 && by_count.frame_sizes.size() == 8;
+        for (size_t i = 0; i + 1 < by_count.frame_sizes.size(); i++) {
+            count_ok = count_ok && by_count.frame_sizes[i] == 4;
+        }
+        const bool time_ok = by_time.done && by_time.n_tokens == 30 &&
+                             by_time.frame_sizes.size() < 30;
+        std::cout << "[count frames=" << by_count.frame_sizes.size()
+                  << ", time frames=" << by_time.frame_sizes.size() << "] ";
+        return count_ok && time_ok &&
+               by_count.final_text.compare(0, by_count.streamed.size(), by_count.streamed) == 0 &&
+               by_time.final_text.compare(0, by_time.streamed.size(), by_time.streamed) == 0 &&
+               by_count.probs_ok && by_time.probs_ok &&
+               !by_count.per_token_calls && !by_time.per_token_calls &&
+               !by_count.frame_after_complete && !by_time.frame_after_complete;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
+// Test 22o: Context shift - a slot that fills its context drops tokens after
+// the sinks and keeps generating, instead of stopping with context_full
+bool test_slot_context_shift() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 256;
+        params.n_batch = 64;
+        params.n_parallel = 2;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0;
+        params.no_kv_offload = true;
+
+        if (!ctx.loadModel(params)) {
+            std::cout << "[SKIP: Model not loaded] ";
+            return true;
+        }
+
+        ctx.enableParallelMode(2, 64);
+        auto* mgr = ctx.slot_manager;
+        const int32_t n_ctx_slot = mgr->slots[0].n_ctx;
+
+        common_params gen_params = params;
+        gen_params.n_predict = n_ctx_slot * 2;
+        gen_params.n_keep = 3;
+        gen_params.sampling.logit_bias.push_back({llama_vocab_eos(llama_model_get_vocab(ctx.model)), -INFINITY});
+        std::vector<llama_token> prompt = common_tokenize(ctx.ctx, "Tell me a story about the sea.", true);
+
+        struct run_result {
+            std::atomic<bool> done{false};
+            size_t n_predicted = 0;
+            bool context_full = false;
+            bool truncated = false;
+        };
+        auto queue = [&](run_result& r, bool ctx_shift) {
+            common_params p = gen_params;
+            p.ctx_shift = ctx_shift;
+            return mgr->queue_request(
+                p, prompt, std::vector<std::string>(), "", 0, COMMON_REASONING_FORMAT_NONE, "", "", "", "", "", "", -1, -1,
+                nullptr,
+                [&r](llama_rn_slot* slot) {
+                    r.n_predicted = slot->num_tokens_predicted;
+                    r.context_full = slot->context_full;
+                    r.truncated = slot->truncated;
+                    r.done = true;
+                }
+            );
+        };
+
+        mgr->start_processing_loop();
+        run_result shifted, plain;
+        queue(shifted, true);
+        queue(plain, false);
+        for (int i = 0; i < 60000 && !(shifted.done && plain.done); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        mgr->stop_processing_loop();
+
+        std::cout << "[slot n_ctx=" << n_ctx_slot << ", shifted predicted=" << shifted.n_predicted
+                  << ", plain predicted=" << plain.n_predicted << "] ";
+
+        const bool shifted_ok = shifted.done && !shifted.context_full && shifted.truncated &&
+                                shifted.n_predicted == (size_t) gen_params.n_predict;
+        const bool plain_ok = plain.done && plain.context_full &&
+                              plain.n_predicted < (size_t) n_ctx_slot;
+        return shifted_ok && plain_ok;
+    } catch (const std::exception& e) {
+        std::cout << "[Exception: " << e.what() << "] ";
+        return false;
+    } catch (...) {
+        std::cout << "[Unknown exception] ";
+        return false;
+    }
+}
+
 // Test 23: Status API - get_status() basic functionality
 bool test_status_api_basic() {
     try {
@@ -1504,6 +2864,22 @@ int main() {
     results.run_test("Queue Overflow Handling", test_queue_overflow());
     results.run_test("Queue Request with State", test_queue_request_with_state());
     results.run_test("State Reuse", test_state_reuse());
+    results.run_test("Slot KV Prefix Reuse", test_slot_kv_prefix_reuse());
+    results.run_test("Prefix Index", test_prefix_index());
+    results.run_test("Cross-Slot Prefix Copy", test_cross_slot_prefix_copy());
+    results.run_test("Slot Choice Short Prefix", test_slot_choice_short_prefix());
+    results.run_test("Prefix Index Evict", test_prefix_index_evict());
+    results.run_test("Priority Preemption", test_priority_preemption());
+    results.run_test("Chunked Prefill Budget", test_chunked_prefill_budget());
+    results.run_test("N-gram Speculative Decoding", test_ngram_speculative_decoding());
+    results.run_test("Decode Failure Recovery", test_decode_failure_recovery());
+    results.run_test("Deferred Callback Delivery", test_deferred_callback_delivery());
+    results.run_test("Pipelined Decode", test_pipelined_decode());
+    results.run_test("Batched Rerank", test_batched_rerank());
+    results.run_test("Slot Stop Words", test_slot_stop_words());
+    results.run_test("Batched Embedding", test_batched_embedding());
+    results.run_test("Framed Token Delivery", test_framed_token_delivery());
+    results.run_test("Slot Context Shift", test_slot_context_shift());
 
     std::cout << "\n--- Status API Tests ---" << std::endl;
 
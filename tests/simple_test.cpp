@@ -1,5 +1,8 @@
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <filesystem>
 #include <vector>
 #include <string>
@@ -335,6 +338,446 @@ bool test_completion_generation_timing() {
     }
 }
 
+// Test stop word matching against a plain search of the whole text
+bool test_stop_matcher() {
+    const std::vector<std::string> words = {"</s>", "abab", "ba", "b", "", "\xE2\x80\x94", "abab"};
+    const std::string alphabet[] = {"a", "b", "</", "s>", "\xE2\x80\x94", "x"};
+    llama_rn_stop_matcher matcher(words);
+
+    uint32_t seed = 42;
+    for (int run = 0; run < 50; run++) {
+        matcher.reset();
+        std::string text;
+        while (text.size() < 200) {
+            std::string chunk;
+            const int n_pieces = 1 + (int) ((seed = seed * 1103515245 + 12345) >> 16) % 4;
+            for (int i = 0; i < n_pieces; i++) {
+                chunk += alphabet[((seed = seed * 1103515245 + 12345) >> 16) % 6];
+            }
+            const size_t prev = text.size();
+            text += chunk;
+
+            // Earliest start among the words ending in the new chunk
+            size_t want_pos = std::string::npos;
+            int32_t want_word = -1;
+            for (size_t w = 0; w < words.size(); w++) {
+                if (words[w].empty()) {
+                    continue;
+                }
+                for (size_t pos = text.find(words[w]); pos != std::string::npos; pos = text.find(words[w], pos + 1)) {
+                    const size_t end = pos + words[w].size();
+                    if (end > prev && end <= text.size() && pos < want_pos) {
+                        want_pos = pos;
+                        want_word = (int32_t) w;
+                    }
+                }
+            }
+            const auto match = matcher.feed(chunk);
+            if (match.pos != want_pos || match.word != want_word) {
+                std::cout << "Full match at " << match.pos << " (word " << match.word << "), expected "
+                          << want_pos << " (word " << want_word << ")" << std::endl;
+                return false;
+            }
+
+            // Longest word prefix at the end of the text, starting at or after from
+            const size_t from = run % 2 ? prev : 0;
+            size_t want_partial = std::string::npos;
+            for (const auto& word : words) {
+                for (size_t n = std::min(word.size(), text.size() - from); n > 0; n--) {
+                    if (text.compare(text.size() - n, n, word, 0, n) == 0) {
+                        want_partial = std::min(want_partial, text.size() - n);
+                        break;
+                    }
+                }
+            }
+            if (matcher.partial_pos(from) != want_partial) {
+                std::cout << "Partial match at " << matcher.partial_pos(from) << ", expected " << want_partial << std::endl;
+                return false;
+            }
+        }
+    }
+
+    llama_rn_stop_matcher none;
+    return none.empty() && !none.feed("abc").found() && none.partial_pos() == std::string::npos;
+}
+
+// Test turn-by-turn chat rendering and prompt tokenization against doing both from scratch
+bool test_incremental_chat_prompt() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0; // CPU only for tests
+        params.no_kv_offload = true; // Force CPU-only mode
+
+        if (!ctx.loadModel(params)) {
+            return false;
+        }
+
+        // The model's template, one with </s> (a control token) closing each
+        // reply, and two whose output depends on where the conversation ends
+        const std::vector<std::string> chat_templates = {
+            "",
+            "{% for m in messages %}{% if m['role'] == 'assistant' %}{{ m['content'] }}</s>{% else %}"
+            "<s>{{ m['role'] }}: {{ m['content'] }}\n{% endif %}{% endfor %}"
+            "{% if add_generation_prompt %}<s>assistant: {% endif %}",
+            "{{ messages|length }}{% for m in messages %}{{ m['role'] }}: {{ m['content'] }}\n{% endfor %}",
+            "{% for m in messages %}{{ loop.index }}. {{ m['role'] }}: {{ m['content'] }}\n{% endfor %}",
+        };
+        bool tokens_reused = false;
+        for (size_t t = 0; t < chat_templates.size(); t++) {
+            const std::string& chat_template = chat_templates[t];
+            auto tmpls = common_chat_templates_init(ctx.model, chat_template);
+            const size_t n_incremental = ctx.chat_render_cache.n_incremental;
+
+            json msgs = json::array();
+            msgs.push_back({{"role", "system"}, {"content", "You are a helpful assistant."}});
+            for (int turn = 0; turn < 8; turn++) {
+                msgs.push_back({{"role", "user"}, {"content", "Question " + std::to_string(turn) + "?"}});
+                const common_chat_params cached = ctx.getFormattedChatWithJinja(
+                    msgs.dump(), chat_template, "", "", false, "", false, "none", true);
+
+                common_chat_templates_inputs inputs;
+                inputs.messages = common_chat_msgs_parse_oaicompat(msgs);
+                inputs.reasoning_format = COMMON_REASONING_FORMAT_NONE;
+                inputs.enable_thinking = false;
+                const common_chat_params full = common_chat_templates_apply(tmpls.get(), inputs);
+                if (cached.prompt != full.prompt || cached.format != full.format ||
+                    cached.generation_prompt != full.generation_prompt || cached.parser != full.parser) {
+                    std::cout << "Template " << t << ", turn " << turn << ": prompt \"" << cached.prompt
+                              << "\", expected \"" << full.prompt << "\"" << std::endl;
+                    return false;
+                }
+
+                const auto tokens = ctx.prompt_token_cache.tokenize(ctx.ctx, cached.prompt, true);
+                if (tokens != common_tokenize(ctx.ctx, full.prompt, true, true)) {
+                    std::cout << "Template " << t << ", turn " << turn << ": tokens differ" << std::endl;
+                    return false;
+                }
+                tokens_reused = tokens_reused || ctx.prompt_token_cache.n_reused > 0;
+
+                msgs.push_back({{"role", "assistant"}, {"content", "Answer " + std::to_string(turn) + "."}});
+            }
+
+            // Incremental renders of the last two must be caught and stopped
+            const bool prefix_stable = t < 2;
+            if ((ctx.chat_render_cache.n_incremental > n_incremental) != prefix_stable) {
+                std::cout << "Template " << t << " rendered incrementally "
+                          << ctx.chat_render_cache.n_incremental - n_incremental << " times" << std::endl;
+                return false;
+            }
+        }
+
+        return tokens_reused;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    } catch (...) {
+        std::cout << "Unknown exception" << std::endl;
+        return false;
+    }
+}
+
+// Test custom chat templates are compiled once and evicted least recently used first
+bool test_chat_template_cache() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0; // CPU only for tests
+        params.no_kv_offload = true; // Force CPU-only mode
+
+        if (!ctx.loadModel(params)) {
+            return false;
+        }
+
+        auto chat_template = [](int i) {
+            return "{% for m in messages %}[" + std::to_string(i) + "] {{ m['role'] }}: {{ m['content'] }}\n{% endfor %}";
+        };
+        const std::string messages = R"([{"role": "user", "content": "Hello"}])";
+        for (int i = 0; i < 3; i++) {
+            const auto jinja_prompt = ctx.getFormattedChatWithJinja(messages, chat_template(0), "", "", false, "", false, "none", i == 0).prompt;
+            if (jinja_prompt.rfind("[0] user: Hello\n", 0) != 0) {
+                std::cout << "Unexpected prompt: " << jinja_prompt << std::endl;
+                return false;
+            }
+        }
+        if (ctx.chat_template_cache.n_compiled != 1) {
+            std::cout << "Compiled " << ctx.chat_template_cache.n_compiled << " times" << std::endl;
+            return false;
+        }
+
+        // Four more push the first one out
+        for (int i = 1; i <= 4; i++) {
+            ctx.getFormattedChatWithJinja(messages, chat_template(i), "", "", false, "", false, "none", true);
+        }
+        ctx.getFormattedChatWithJinja(messages, chat_template(4), "", "", false, "", false, "none", false);
+        const size_t n_compiled = ctx.chat_template_cache.n_compiled;
+        ctx.getFormattedChatWithJinja(messages, chat_template(0), "", "", false, "", false, "none", true);
+        return n_compiled == 5 && ctx.chat_template_cache.n_compiled == 6;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    } catch (...) {
+        std::cout << "Unknown exception" << std::endl;
+        return false;
+    }
+}
+
+// Test the disk tier of the prompt state cache: prefix lookup, LRU budget and reopening
+bool test_state_disk_cache() {
+    try {
+        const std::string dir = (std::filesystem::temp_directory_path() / "rnllama_state_disk_cache_test").string();
+        std::filesystem::remove_all(dir);
+
+        std::vector<llama_token> target;
+        for (int i = 0; i < 40; i++) {
+            target.push_back(100 + i);
+        }
+        auto blob = [](size_t size, uint8_t fill) { return std::vector<uint8_t>(size, fill); };
+        const uint64_t model_key = llama_rn_state_disk_cache::hash_model_key("model");
+        const size_t header = 48;
+        const size_t file_10 = header + 10 * sizeof(llama_token) + 1000;
+
+        llama_rn_state_disk_cache cache;
+        cache.open(dir, 4 * file_10);
+        const auto a = blob(1000, 1), b = blob(1000, 2), c = blob(1000, 3);
+        bool ok = cache.put(model_key, target.data(), 10, a.data(), a.size(), false) &&
+                  cache.put(model_key, target.data(), 5, b.data(), b.size(), true) &&
+                  cache.put(model_key, target.data(), 20, c.data(), c.size(), false);
+
+        // Longest partial within the bound, then full ones past it
+        auto hit = cache.find(model_key, target, 39, 39);
+        ok = ok && hit && hit->n_tokens == 20 && !hit->full && hit->size == c.size() && hit->data[0] == 3;
+        hit = cache.find(model_key, target, 15, 39);
+        ok = ok && hit && hit->n_tokens == 10 && hit->data[0] == 1;
+        hit = cache.find(model_key, target, 0, 39);
+        ok = ok && hit && hit->n_tokens == 5 && hit->full && hit->data[0] == 2;
+        ok = ok && !cache.find(llama_rn_state_disk_cache::hash_model_key("other"), target, 39, 39);
+        std::vector<llama_token> other = target;
+        other[3] = 7;
+        ok = ok && !cache.find(model_key, other, 39, 39);
+        hit.reset();
+
+        // A new index over the same directory finds them again
+        llama_rn_state_disk_cache reopened;
+        reopened.open(dir, 4 * file_10);
+        hit = reopened.find(model_key, target, 15, 39);
+        ok = ok && hit && hit->n_tokens == 10 && reopened.total_bytes == cache.total_bytes;
+        hit.reset();
+
+        // Over budget: the least recently used go first (the 20- and 5-token ones)
+        const auto d = blob(2 * file_10, 4);
+        ok = ok && reopened.put(model_key, target.data(), 30, d.data(), d.size(), false);
+        ok = ok && reopened.total_bytes <= 4 * file_10 &&
+             reopened.contains(model_key, target.data(), 10, false) &&
+             !reopened.contains(model_key, target.data(), 20, false) &&
+             !reopened.contains(model_key, target.data(), 5, true);
+
+        std::filesystem::remove_all(dir);
+        return ok;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Test the encoded media cache: memory LRU by bytes, the disk tier behind it
+bool test_media_embd_cache() {
+    try {
+        const std::string dir = (std::filesystem::temp_directory_path() / "rnllama_media_cache_test").string();
+        std::filesystem::remove_all(dir);
+
+        auto embd = [](size_t n, float fill) { return std::vector<float>(n, fill); };
+        const std::string key_a = "proj|source:1|chunk:1:64:1|64";
+        const std::string key_b = "proj|source:2|chunk:1:64:2|64";
+        const std::string key_c = "proj|source:3|chunk:1:64:3|64";
+        const auto a = embd(1000, 1.0f), b = embd(1000, 2.0f), c = embd(1000, 3.0f);
+        const size_t entry_bytes = 1000 * sizeof(float) + key_a.size();
+
+        // Memory only, room for two: the least recently used goes
+        llama_rn_media_embd_cache mem;
+        mem.configure(2 * entry_bytes, "", 0);
+        mem.put(key_a, a.data(), a.size());
+        mem.put(key_b, b.data(), b.size());
+        auto hit = mem.get(key_a);
+        bool ok = hit && hit->size() == a.size() && (*hit)[0] == 1.0f;
+        mem.put(key_c, c.data(), c.size());
+        ok = ok && mem.get(key_a) && !mem.get(key_b) && mem.get(key_c) && mem.total_bytes <= 2 * entry_bytes;
+        ok = ok && mem.n_hits == 3 && mem.n_misses == 1;
+
+        // Disk tier: a new cache over the directory serves what the first wrote
+        const size_t file_bytes = 32 + entry_bytes;
+        {
+            llama_rn_media_embd_cache disk;
+            disk.configure(entry_bytes, dir, 2 * file_bytes);
+            disk.put(key_a, a.data(), a.size());
+            disk.put(key_b, b.data(), b.size());
+            ok = ok && disk.disk_bytes == 2 * file_bytes;
+        }
+        llama_rn_media_embd_cache reopened;
+        reopened.configure(entry_bytes, dir, 2 * file_bytes);
+        hit = reopened.get(key_a);
+        ok = ok && hit && hit->size() == a.size() && (*hit)[999] == 1.0f && reopened.n_disk_hits == 1;
+        ok = ok && reopened.get(key_a) && reopened.n_hits == 1; // Promoted to memory
+        ok = ok && !reopened.get("proj|source:1|chunk:1:64:1|65");
+
+        // Over the disk budget: b (least recently used) is deleted
+        reopened.put(key_c, c.data(), c.size());
+        reopened.clear();
+        ok = ok && reopened.get(key_a) && !reopened.get(key_b) && reopened.get(key_c) &&
+             reopened.disk_bytes == 2 * file_bytes;
+
+        std::filesystem::remove_all(dir);
+        return ok;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Test the TTS speaker prefix: laid down on first use, restored afterwards,
+// with the same logits as decoding the prompt straight through
+bool test_tts_speaker_prefix() {
+    try {
+        llama_rn_context ctx;
+
+        common_params params;
+        params.model.path = "../tiny-random-llama.gguf";
+        params.n_ctx = 512;
+        params.n_batch = 128;
+        params.cpuparams.n_threads = 1;
+        params.n_gpu_layers = 0; // CPU only for tests
+        params.no_kv_offload = true; // Force CPU-only mode
+
+        if (!ctx.loadModel(params)) {
+            return false;
+        }
+
+        llama_rn_tts_speaker_cache cache;
+        llama_rn_tts_speaker_cache::entry e;
+        e.head_tokens = common_tokenize(ctx.ctx, "<s>the overall package from just two people", false, true);
+        const size_t n_head = e.head_tokens.size();
+        cache.put(std::move(e));
+
+        auto * mem = llama_get_memory(ctx.ctx);
+        const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+        // Decode tokens[n_past, end) and return the last logits
+        auto decode_rest = [&](const std::vector<llama_token> &tokens, llama_pos n_past) {
+            llama_batch batch = llama_batch_init((int) tokens.size(), 0, 1);
+            for (size_t i = n_past; i < tokens.size(); i++) {
+                llama_batch_add(&batch, tokens[i], (llama_pos) i, { 0 }, i + 1 == tokens.size());
+            }
+            std::vector<float> logits;
+            if (llama_decode(ctx.ctx, batch) == 0) {
+                const float * out = llama_get_logits_ith(ctx.ctx, -1);
+                logits.assign(out, out + n_vocab);
+            }
+            llama_batch_free(batch);
+            return logits;
+        };
+        auto max_diff = [](const std::vector<float> &a, const std::vector<float> &b) {
+            float d = a.size() == b.size() && !a.empty() ? 0.0f : INFINITY;
+            for (size_t i = 0; i < std::min(a.size(), b.size()); i++) {
+                d = std::max(d, std::fabs(a[i] - b[i]));
+            }
+            return d;
+        };
+
+        bool ok = true;
+        std::vector<float> reference;
+        for (const char *text : {" is pretty remarkable", " sounds rather different today"}) {
+            std::vector<llama_token> tokens = common_tokenize(ctx.ctx, "<s>the overall package from just two people", false, true);
+            const auto rest = common_tokenize(ctx.ctx, text, false, true);
+            tokens.insert(tokens.end(), rest.begin(), rest.end());
+
+            llama_memory_clear(mem, true);
+            const std::vector<float> expected = decode_rest(tokens, 0);
+
+            // First text lays the prefix down, the second restores it
+            llama_memory_clear(mem, true);
+            llama_pos n_past = 0;
+            ok = ok && cache.load_prefix(ctx.ctx, tokens, n_past) && n_past == (llama_pos) n_head;
+            const std::vector<float> actual = decode_rest(tokens, n_past);
+            ok = ok && max_diff(expected, actual) < 1e-3f;
+        }
+        ok = ok && cache.n_restored == 1;
+
+        // Nothing to do when the live cache already holds the prefix, or the prompt doesn't start with it
+        llama_pos n_past = (llama_pos) n_head;
+        ok = ok && !cache.load_prefix(ctx.ctx, std::vector<llama_token>(n_head + 4, 1), n_past);
+        return ok;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Test delta-encoded state checkpoints: round trips, sizes and base accounting
+bool test_state_delta() {
+    try {
+        // f32 state where a later snapshot rewrote a region and a few scattered cells
+        std::vector<float> a(20000), b(20000);
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = 0.5f + 0.001f * (float) (i % 97);
+            const bool changed = (i >= 2000 && i < 4000) || i % 50 == 0;
+            b[i] = a[i] * (changed ? 1.0001f : 1.0f);
+        }
+        auto bytes = [](const std::vector<float>& v, size_t n) {
+            std::vector<uint8_t> out(n * sizeof(float));
+            memcpy(out.data(), v.data(), out.size());
+            return out;
+        };
+        const auto base = bytes(a, a.size());
+
+        bool ok = true;
+        // Same, shorter and longer than the base (SWA snapshots grow), plus an odd tail
+        for (const size_t size : {base.size(), base.size() / 2 + 3, base.size() + 5}) {
+            std::vector<uint8_t> data = bytes(b, b.size());
+            data.resize(size, 0x5a);
+            std::vector<uint8_t> enc, dec;
+            llama_rn_state_delta::encode(base.data(), base.size(), data.data(), data.size(), enc);
+            ok = ok && llama_rn_state_delta::decode(base.data(), base.size(), enc.data(), enc.size(), size, dec) &&
+                 dec == data && enc.size() < size / 3;
+            enc.pop_back();
+            ok = ok && !llama_rn_state_delta::decode(base.data(), base.size(), enc.data(), enc.size(), size, dec);
+        }
+
+        // The first checkpoint becomes the base, the next is a delta against it,
+        // and unrelated data starts a base of its own
+        std::vector<rn_state_checkpoint> ckpts(3);
+        ckpts[0].data = base;
+        ckpts[1].data = bytes(b, b.size());
+        for (size_t i = 0; i < base.size(); i++) {
+            ckpts[2].data.push_back((uint8_t) (i * 2654435761u >> 13));
+        }
+        const auto raw_2 = ckpts[2].data;
+        std::vector<rn_state_checkpoint> held;
+        for (auto& c : ckpts) {
+            c.compact(held);
+            held.push_back(c);
+        }
+        std::vector<uint8_t> scratch;
+        ok = ok && held[0].raw(scratch) == base && held[1].raw(scratch) == bytes(b, b.size()) &&
+             held[2].raw(scratch) == raw_2;
+        ok = ok && held[1].base == held[0].base && held[2].base != held[0].base;
+        const size_t n = rn_state_checkpoints_bytes(held);
+        ok = ok && n >= 2 * base.size() && n < 2 * base.size() + base.size() / 2;
+        return ok;
+    } catch (const std::exception& e) {
+        std::cout << "Exception: " << e.what() << std::endl;
+        return false;
+    }
+}
+
 int main() {
     std::cout << "Starting rnllama API tests..." << std::endl;
     std::cout << "Using test model: ../tiny-random-llama.gguf" << std::endl;
@@ -349,6 +792,13 @@ int main() {
     results.run_test("Completion Generation Timing", test_completion_generation_timing());
     results.run_test("Graceful Context Init Failure", test_context_init_failure_is_graceful());
     results.run_test("Utility Functions", test_utilities());
+    results.run_test("Stop Word Matcher", test_stop_matcher());
+    results.run_test("Incremental Chat Prompt", test_incremental_chat_prompt());
+    results.run_test("Chat Template Cache", test_chat_template_cache());
+    results.run_test("State Disk Cache", test_state_disk_cache());
+    results.run_test("State Delta Encoding", test_state_delta());
+    results.run_test("Media Embedding Cache", test_media_embd_cache());
+    results.run_test("TTS Speaker Prefix", test_tts_speaker_prefix());
 
     // Print summary
     results.print_summary();